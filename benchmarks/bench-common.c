@@ -0,0 +1,109 @@
+/* bench-common.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <string.h>
+
+#include "bench-common.h"
+
+/*
+ * Helpers shared by the benchmarks.
+ *
+ * Results are printed one per line as "<name> <value> <unit>",
+ * or as a JSON object per line if CM_BENCH_FORMAT is "json",
+ * so that they can be collected and compared between runs.
+ */
+
+guint
+bench_get_env_uint (const char *name,
+                    guint       default_value)
+{
+  g_autoptr(GError) error = NULL;
+  const char *env;
+  guint64 value;
+
+  env = g_getenv (name);
+
+  if (!env || !*env)
+    return default_value;
+
+  if (!g_ascii_string_to_unsigned (env, 10, 0, G_MAXUINT, &value, &error))
+    g_error ("Invalid value for %s: %s", name, error->message);
+
+  return value;
+}
+
+/* Same as bench_get_env_uint(), for values where 0 makes no sense */
+guint
+bench_get_env_uint_nonzero (const char *name,
+                            guint       default_value)
+{
+  guint value;
+
+  g_assert (default_value > 0);
+
+  value = bench_get_env_uint (name, default_value);
+
+  if (!value)
+    g_error ("Invalid value for %s: should be greater than 0", name);
+
+  return value;
+}
+
+double
+bench_get_seconds (gint64 start)
+{
+  return (g_get_monotonic_time () - start) / (double)G_USEC_PER_SEC;
+}
+
+/* Resident memory of the process, 0 if unknown */
+guint
+bench_get_rss_kb (void)
+{
+  g_autofree char *contents = NULL;
+  const char *line;
+
+  if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    return 0;
+
+  line = strstr (contents, "VmRSS:");
+
+  if (!line)
+    return 0;
+
+  return g_ascii_strtoull (line + strlen ("VmRSS:"), NULL, 10);
+}
+
+void
+bench_report (const char *name,
+              double      value,
+              const char *unit)
+{
+  if (g_strcmp0 (g_getenv ("CM_BENCH_FORMAT"), "json") == 0)
+    {
+      char buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+      g_ascii_formatd (buffer, sizeof buffer, "%.3f", value);
+      g_print ("{\"name\": \"%s\", \"value\": %s, \"unit\": \"%s\"}\n",
+               name, buffer, unit);
+    }
+  else
+    {
+      g_print ("%s %.2f %s\n", name, value, unit);
+    }
+}
+
+void
+bench_account_init (MockAccount *account)
+{
+  g_assert (account);
+
+  account->n_rooms = bench_get_env_uint_nonzero ("CM_BENCH_ROOMS", 100);
+  account->n_members = bench_get_env_uint_nonzero ("CM_BENCH_MEMBERS", 20);
+  account->n_events = bench_get_env_uint ("CM_BENCH_EVENTS", 100);
+  account->encrypted_percent = MIN (bench_get_env_uint ("CM_BENCH_ENCRYPTED", 30), 100);
+  account->seed = bench_get_env_uint ("CM_BENCH_SEED", 42);
+}
@@ -0,0 +1,28 @@
+/* bench-common.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "mock-account.h"
+
+G_BEGIN_DECLS
+
+guint       bench_get_env_uint            (const char         *name,
+                                           guint               default_value);
+guint       bench_get_env_uint_nonzero    (const char         *name,
+                                           guint               default_value);
+double      bench_get_seconds             (gint64              start);
+guint       bench_get_rss_kb              (void);
+void        bench_report                  (const char         *name,
+                                           double              value,
+                                           const char         *unit);
+
+void        bench_account_init            (MockAccount        *account);
+
+G_END_DECLS
@@ -0,0 +1,111 @@
+/* canonical-json.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+#include "cm-utils-private.h"
+#include "bench-common.h"
+
+/*
+ * Measures canonical JSON throughput on device keys as
+ * returned by /keys/query, which are verified one by one.
+ * The number of rounds can be changed with CM_BENCH_ROUNDS.
+ */
+
+#define N_DEVICES      200
+#define DEFAULT_ROUNDS 50
+
+static JsonObject *
+create_device_keys (guint index)
+{
+  g_autofree char *device_id = NULL;
+  g_autofree char *label = NULL;
+  JsonObject *object, *child, *sign;
+  JsonArray *array;
+
+  device_id = g_strdup_printf ("DEVICE%04u", index);
+  object = json_object_new ();
+  json_object_set_string_member (object, "user_id", "@alice:example.org");
+  json_object_set_string_member (object, "device_id", device_id);
+
+  array = json_array_new ();
+  json_array_add_string_element (array, "m.olm.v1.curve25519-aes-sha2");
+  json_array_add_string_element (array, "m.megolm.v1.aes-sha2");
+  json_object_set_array_member (object, "algorithms", array);
+
+  child = json_object_new ();
+  label = g_strconcat ("curve25519:", device_id, NULL);
+  json_object_set_string_member (child, label, "3C5BFWi2Y8MaVvjM8M22DBmh24PmgR0nPvJOIArzgyI");
+  g_free (label);
+  label = g_strconcat ("ed25519:", device_id, NULL);
+  json_object_set_string_member (child, label, "lEuiRJBit0IG6nUf5pUzWTUEsRVVe/HJkoKuEww9ULI");
+  json_object_set_object_member (object, "keys", child);
+
+  sign = json_object_new ();
+  json_object_set_string_member (sign, label, "dSO80A01XiigH3uBiDVx/EjzaoycHcjq9lfQX0uWsqxl2giMIiSPR8a4d291W1ihKJL/a+myXS367WT6NAIcBA");
+  child = json_object_new ();
+  json_object_set_object_member (child, "@alice:example.org", sign);
+  json_object_set_object_member (object, "signatures", child);
+
+  child = json_object_new ();
+  json_object_set_string_member (child, "device_display_name", "Alice's \"work\" phone\n");
+  json_object_set_object_member (object, "unsigned", child);
+
+  return object;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GPtrArray) devices = NULL;
+  gint64 start;
+  guint rounds;
+  gsize total = 0;
+
+  rounds = bench_get_env_uint_nonzero ("CM_BENCH_ROUNDS", DEFAULT_ROUNDS);
+
+  devices = g_ptr_array_new_with_free_func ((GDestroyNotify)json_object_unref);
+  for (guint i = 0; i < N_DEVICES; i++)
+    g_ptr_array_add (devices, create_device_keys (i));
+
+  start = g_get_monotonic_time ();
+  for (guint round = 0; round < rounds; round++)
+    for (guint i = 0; i < devices->len; i++)
+      {
+        g_autoptr(GString) str = NULL;
+
+        str = cm_utils_json_get_canonical (devices->pdata[i], NULL);
+        total += str->len;
+      }
+  bench_report ("canonical-json/get-canonical",
+                rounds * devices->len / bench_get_seconds (start), "ops/s");
+
+  start = g_get_monotonic_time ();
+  for (guint round = 0; round < rounds; round++)
+    for (guint i = 0; i < devices->len; i++)
+      {
+        gsize len;
+
+        cm_utils_json_write_canonical (devices->pdata[i], &len);
+        total -= len;
+      }
+  bench_report ("canonical-json/write-canonical",
+                rounds * devices->len / bench_get_seconds (start), "ops/s");
+
+  /* Both should have written the same */
+  g_assert_cmpint (total, ==, 0);
+
+  return 0;
+}
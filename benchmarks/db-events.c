@@ -0,0 +1,239 @@
+/* db-events.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "cm-matrix.h"
+#include "cm-client-private.h"
+#include "cm-db-private.h"
+#include "cm-room-private.h"
+#include "events/cm-room-event-private.h"
+#include "cm-utils-private.h"
+#include "bench-common.h"
+
+/*
+ * Stores the timeline of a synthetic account in a new
+ * database, half of the rooms with cm_db_add_room_events()
+ * and the rest with a single cm_db_add_rooms_events(), and
+ * then measures how long it takes to load the account
+ * (with its rooms) from a cold database.
+ */
+
+#define DB_NAME   "bench.db"
+#define USER_ID   "@bench:example.org"
+#define DEVICE_ID "BENCHDEVICE"
+
+static void
+finish_bool_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  gboolean status;
+
+  g_assert_true (G_IS_TASK (task));
+
+  status = g_task_propagate_boolean (G_TASK (result), &error);
+  g_assert_no_error (error);
+  g_task_return_boolean (task, status);
+}
+
+static void
+wait_for_task (GTask *task)
+{
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static CmDb *
+bench_db_open (const char *dir)
+{
+  g_autoptr(GTask) task = NULL;
+  CmDb *db;
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (dir), DB_NAME, finish_bool_cb, task);
+  wait_for_task (task);
+
+  return db;
+}
+
+static void
+bench_db_close (CmDb *db)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (db, finish_bool_cb, task);
+  wait_for_task (task);
+  g_object_unref (db);
+}
+
+static CmClient *
+bench_client_new (void)
+{
+  CmClient *client;
+
+  client = cm_client_new ();
+  g_object_set_data (G_OBJECT (client), "no-save", GINT_TO_POINTER (TRUE));
+  cm_client_set_user_id (client, USER_ID);
+  cm_client_set_device_id (client, DEVICE_ID);
+
+  return client;
+}
+
+static GPtrArray *
+room_get_events (CmRoom     *room,
+                 JsonObject *room_json)
+{
+  GPtrArray *events;
+  JsonObject *child;
+  JsonArray *array;
+  guint length;
+
+  child = cm_utils_json_object_get_object (room_json, "timeline");
+  array = cm_utils_json_object_get_array (child, "events");
+  length = json_array_get_length (array);
+  events = g_ptr_array_new_full (length, g_object_unref);
+
+  for (guint i = 0; i < length; i++)
+    {
+      CmRoomEvent *event;
+      gboolean encrypted;
+
+      child = json_array_get_object_element (array, i);
+      encrypted = g_strcmp0 (cm_utils_json_object_get_string (child, "type"),
+                             "m.room.encrypted") == 0;
+      event = cm_room_event_new_from_json (room, encrypted ? NULL : child,
+                                           encrypted ? child : NULL);
+      if (event)
+        g_ptr_array_add (events, event);
+    }
+
+  return events;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GPtrArray) rooms = NULL;
+  g_autoptr(GPtrArray) events = NULL;
+  g_autoptr(GPtrArray) batch_rooms = NULL;
+  g_autoptr(GPtrArray) batch_events = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *path = NULL;
+  MockAccount account;
+  JsonObject *join;
+  CmDb *db;
+  gint64 start;
+  guint half, n_events = 0;
+
+  cm_init (TRUE);
+  bench_account_init (&account);
+
+  dir = g_dir_make_tmp ("cm-bench-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  db = bench_db_open (dir);
+  client = bench_client_new ();
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_client_async (db, client, NULL, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  root = mock_account_generate_sync (&account);
+  join = cm_utils_json_object_get_object (cm_utils_json_object_get_object (root, "rooms"), "join");
+  rooms = g_ptr_array_new_full (account.n_rooms, g_object_unref);
+  events = g_ptr_array_new_full (account.n_rooms, (GDestroyNotify)g_ptr_array_unref);
+
+  for (guint i = 0; i < account.n_rooms; i++)
+    {
+      g_autofree char *room_id = NULL;
+      CmRoom *room;
+
+      room_id = mock_account_get_room_id (&account, i);
+      room = cm_room_new (room_id);
+      cm_room_set_client (room, client);
+      g_ptr_array_add (rooms, room);
+      g_ptr_array_add (events, room_get_events (room, cm_utils_json_object_get_object (join, room_id)));
+
+      task = g_task_new (NULL, NULL, NULL, NULL);
+      cm_db_save_room_async (db, client, room, finish_bool_cb, task);
+      wait_for_task (task);
+      g_clear_object (&task);
+    }
+
+  half = account.n_rooms / 2;
+
+  /* One transaction per room, as each room in a sync was stored before */
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < half; i++)
+    {
+      GPtrArray *room_events = events->pdata[i];
+
+      cm_db_add_room_events (db, rooms->pdata[i], room_events, FALSE);
+      n_events += room_events->len;
+    }
+  if (half)
+    bench_report ("db/add-room-events", n_events / bench_get_seconds (start), "events/s");
+
+  batch_rooms = g_ptr_array_new ();
+  batch_events = g_ptr_array_new ();
+  n_events = 0;
+
+  for (guint i = half; i < account.n_rooms; i++)
+    {
+      GPtrArray *room_events = events->pdata[i];
+
+      g_ptr_array_add (batch_rooms, rooms->pdata[i]);
+      g_ptr_array_add (batch_events, room_events);
+      n_events += room_events->len;
+    }
+
+  start = g_get_monotonic_time ();
+  cm_db_add_rooms_events (db, client, batch_rooms, batch_events);
+  bench_report ("db/add-rooms-events", n_events / bench_get_seconds (start), "events/s");
+
+  bench_db_close (db);
+  g_clear_object (&client);
+
+  /* Cold start: a new connection loading the account and its rooms */
+  db = bench_db_open (dir);
+  client = bench_client_new ();
+
+  start = g_get_monotonic_time ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_load_client_async (db, client, DEVICE_ID, finish_bool_cb, task);
+  wait_for_task (task);
+  bench_report ("db/load-client", bench_get_seconds (start) * 1000.0, "ms");
+  g_clear_object (&task);
+
+  bench_db_close (db);
+
+  path = g_build_filename (dir, DB_NAME, NULL);
+  g_remove (path);
+  g_rmdir (dir);
+
+  return 0;
+}
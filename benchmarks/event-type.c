@@ -0,0 +1,87 @@
+/* event-type.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "cm-utils-private.h"
+#include "bench-common.h"
+
+/*
+ * Compares event type lookup with cm_utils_get_event_type()
+ * against a chain of string comparisons, as events were
+ * dispatched before.  The number of lookups can be changed
+ * with CM_BENCH_ROUNDS.
+ */
+
+#define DEFAULT_ROUNDS 2000000
+
+/* Roughly what a sync response has, most are messages */
+static const char *event_types[] = {
+  "m.room.message", "m.room.message", "m.room.message", "m.room.message",
+  "m.room.encrypted", "m.room.encrypted", "m.reaction", "m.room.member",
+  "m.room.member", "m.room.redaction", "m.room.power_levels", "m.room.name",
+  "m.room.topic", "m.key.verification.start", "org.example.custom", "m.room.create",
+};
+
+static const CmEventType chain[] = {
+  CM_M_ROOM_MESSAGE, CM_M_ROOM_MEMBER, CM_M_REACTION, CM_M_ROOM_REDACTION,
+  CM_M_ROOM_TOPIC, CM_M_ROOM_AVATAR, CM_M_CALL_INVITE, CM_M_CALL_CANDIDATES,
+  CM_M_CALL_ANSWER, CM_M_CALL_SELECT_ANSWER, CM_M_CALL_HANGUP,
+  CM_M_ROOM_CANONICAL_ALIAS, CM_M_ROOM_NAME, CM_M_ROOM_CREATE,
+  CM_M_ROOM_POWER_LEVELS, CM_M_ROOM_GUEST_ACCESS, CM_M_ROOM_HISTORY_VISIBILITY,
+  CM_M_ROOM_JOIN_RULES, CM_M_ROOM_SERVER_ACL, CM_M_ROOM_ENCRYPTION,
+  CM_M_ROOM_THIRD_PARTY_INVITE, CM_M_ROOM_RELATED_GROUPS, CM_M_ROOM_TOMBSTONE,
+  CM_M_ROOM_PINNED_EVENTS, CM_M_ROOM_PLUMBING, CM_M_ROOM_BOT_OPTIONS,
+  CM_M_KEY_VERIFICATION_ACCEPT, CM_M_KEY_VERIFICATION_CANCEL,
+  CM_M_KEY_VERIFICATION_DONE, CM_M_KEY_VERIFICATION_KEY,
+  CM_M_KEY_VERIFICATION_MAC, CM_M_KEY_VERIFICATION_READY,
+  CM_M_KEY_VERIFICATION_REQUEST, CM_M_KEY_VERIFICATION_START,
+};
+
+static CmEventType
+strcmp_chain_get_event_type (const char *type)
+{
+  if (g_strcmp0 (type, cm_utils_get_event_type_str (CM_M_ROOM_ENCRYPTED)) == 0)
+    return CM_M_ROOM_ENCRYPTED;
+
+  for (guint i = 0; i < G_N_ELEMENTS (chain); i++)
+    if (g_strcmp0 (type, cm_utils_get_event_type_str (chain[i])) == 0)
+      return chain[i];
+
+  return CM_M_UNKNOWN;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  guint rounds, sum_chain = 0, sum_hash = 0;
+  gint64 start;
+
+  rounds = bench_get_env_uint_nonzero ("CM_BENCH_ROUNDS", DEFAULT_ROUNDS);
+
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < rounds; i++)
+    sum_chain += strcmp_chain_get_event_type (event_types[i % G_N_ELEMENTS (event_types)]);
+  bench_report ("event-type/strcmp-chain", rounds / bench_get_seconds (start) / 1000000.0, "Mops/s");
+
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < rounds; i++)
+    sum_hash += cm_utils_get_event_type (event_types[i % G_N_ELEMENTS (event_types)]);
+  bench_report ("event-type/perfect-hash", rounds / bench_get_seconds (start) / 1000000.0, "Mops/s");
+
+  /* Also keeps the loops from being optimized out */
+  g_assert_cmpint (sum_chain, ==, sum_hash);
+
+  return 0;
+}
@@ -0,0 +1,151 @@
+/* input-stream.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "cm-utils-private.h"
+#include "cm-input-stream-private.h"
+#include "bench-common.h"
+
+/*
+ * Measures encrypt/decrypt throughput through CmInputStream.
+ * The size (in MiB) can be changed with CM_BENCH_SIZE_MB.
+ */
+
+#define DEFAULT_SIZE_MB 128
+
+static void
+fill_random (guchar *data,
+             gsize   len)
+{
+  guint64 x = 0x9E3779B97F4A7C15;
+
+  /* xorshift, g_random_int() is too slow for 100+ MiB */
+  for (gsize i = 0; i + 8 <= len; i += 8)
+    {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      memcpy (data + i, &x, 8);
+    }
+}
+
+static double
+read_all (GInputStream *stream,
+          gsize         block_size,
+          guchar       *out,
+          gsize        *out_len)
+{
+  g_autofree guchar *buffer = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+  gssize n_read;
+  gsize total = 0;
+
+  buffer = g_malloc (block_size);
+  start = g_get_monotonic_time ();
+
+  while ((n_read = g_input_stream_read (stream, buffer, block_size, NULL, &error)) > 0)
+    {
+      if (out)
+        memcpy (out + total, buffer, n_read);
+      total += n_read;
+    }
+
+  g_assert_no_error (error);
+  g_assert_cmpint (n_read, ==, 0);
+
+  if (out_len)
+    *out_len = total;
+
+  return (g_get_monotonic_time () - start) / (double)G_USEC_PER_SEC;
+}
+
+static void
+print_result (const char *name,
+              gsize       block_size,
+              gsize       size,
+              double      seconds)
+{
+  g_autofree char *label = NULL;
+
+  label = g_strdup_printf ("input-stream/%s/%" G_GSIZE_FORMAT, name, block_size);
+  bench_report (label, size / (1024.0 * 1024.0) / seconds, "MB/s");
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autofree guchar *plain = NULL;
+  g_autofree guchar *encrypted = NULL;
+  g_autofree char *path = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  const gsize block_sizes[] = { 8 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+  gsize size, len;
+  int fd;
+
+  size = (gsize)bench_get_env_uint_nonzero ("CM_BENCH_SIZE_MB", DEFAULT_SIZE_MB) * 1024 * 1024;
+
+  plain = g_malloc (size);
+  encrypted = g_malloc (size);
+  fill_random (plain, size);
+
+  fd = g_file_open_tmp ("cm-bench-XXXXXX.bin", &path, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+  g_assert_true (g_file_set_contents (path, (char *)plain, size, &error));
+  g_assert_no_error (error);
+  file = g_file_new_for_path (path);
+
+  for (guint i = 0; i < G_N_ELEMENTS (block_sizes); i++)
+    {
+      g_autoptr(CmInputStream) stream = NULL;
+      g_autoptr(GInputStream) base = NULL;
+      g_autoptr(JsonObject) json = NULL;
+      g_autofree char *sha256 = NULL;
+      CmEncFileInfo file_info = { 0 };
+      double seconds;
+
+      stream = cm_input_stream_new_from_file (file, TRUE, NULL, &error);
+      g_assert_no_error (error);
+      g_object_set_data_full (G_OBJECT (stream), "uri", g_strdup ("mxc://example.org/bench"), g_free);
+      seconds = read_all (G_INPUT_STREAM (stream), block_sizes[i], encrypted, &len);
+      g_assert_cmpint (len, ==, size);
+      print_result ("encrypt", block_sizes[i], size, seconds);
+
+      json = cm_input_stream_get_file_json (stream);
+      g_assert_nonnull (json);
+      file_info.mxc_uri = (char *)"mxc://example.org/bench";
+      file_info.aes_iv_base64 = (char *)cm_utils_json_object_get_string (json, "iv");
+      file_info.aes_key_base64 = (char *)cm_utils_json_object_get_string (cm_utils_json_object_get_object (json, "key"), "k");
+      file_info.sha256_base64 = (char *)cm_utils_json_object_get_string (cm_utils_json_object_get_object (json, "hashes"), "sha256");
+      g_clear_object (&stream);
+
+      base = g_memory_input_stream_new_from_data (encrypted, size, NULL);
+      stream = cm_input_stream_new (base);
+      cm_input_stream_set_file_enc (stream, &file_info);
+      seconds = read_all (G_INPUT_STREAM (stream), block_sizes[i], NULL, &len);
+      g_assert_cmpint (len, ==, size);
+      print_result ("decrypt", block_sizes[i], size, seconds);
+
+      sha256 = cm_input_stream_get_sha256 (stream);
+      g_assert_cmpstr (sha256, ==, file_info.sha256_base64);
+    }
+
+  g_remove (path);
+
+  return 0;
+}
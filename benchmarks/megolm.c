@@ -0,0 +1,77 @@
+/* megolm.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "cm-matrix.h"
+#include "cm-olm-private.h"
+#include "bench-common.h"
+
+/*
+ * Encrypts messages with an outbound megolm session and
+ * decrypts them with the matching inbound session, as done
+ * for every message in an encrypted room.  The number of
+ * messages can be changed with CM_BENCH_ROUNDS.
+ */
+
+#define DEFAULT_ROUNDS 5000
+#define SENDER_KEY     "3C5BFWi2Y8MaVvjM8M22DBmh24PmgR0nPvJOIArzgyI"
+
+static const char *plain_texts[] = {
+  "{\"type\":\"m.room.message\",\"content\":{\"msgtype\":\"m.text\",\"body\":\"Hi\"},"
+  "\"room_id\":\"!room00001:example.org\"}",
+  "{\"type\":\"m.room.message\",\"content\":{\"msgtype\":\"m.text\",\"body\":"
+  "\"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor "
+  "incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud "
+  "exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.\"},"
+  "\"room_id\":\"!room00001:example.org\"}",
+};
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(CmOlm) out_session = NULL;
+  g_autoptr(CmOlm) in_session = NULL;
+  gint64 start;
+  guint rounds;
+
+  cm_init (TRUE);
+  rounds = bench_get_env_uint_nonzero ("CM_BENCH_ROUNDS", DEFAULT_ROUNDS);
+
+  out_session = cm_olm_out_group_new (SENDER_KEY);
+  in_session = cm_olm_in_group_new_from_out (out_session, SENDER_KEY);
+  g_assert_nonnull (out_session);
+  g_assert_nonnull (in_session);
+
+  messages = g_ptr_array_new_full (rounds, g_free);
+
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < rounds; i++)
+    g_ptr_array_add (messages, cm_olm_encrypt (out_session,
+                                               plain_texts[i % G_N_ELEMENTS (plain_texts)]));
+  bench_report ("megolm/encrypt", rounds / bench_get_seconds (start), "msgs/s");
+
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < rounds; i++)
+    {
+      g_autofree char *plain_text = NULL;
+
+      plain_text = cm_olm_decrypt (in_session, 0, messages->pdata[i]);
+      g_assert_cmpstr (plain_text, ==, plain_texts[i % G_N_ELEMENTS (plain_texts)]);
+    }
+  bench_report ("megolm/decrypt", rounds / bench_get_seconds (start), "msgs/s");
+
+  return 0;
+}
@@ -0,0 +1,102 @@
+/* parse-events.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "cm-matrix.h"
+#include "cm-client-private.h"
+#include "cm-room-private.h"
+#include "events/cm-room-event-list-private.h"
+#include "cm-utils-private.h"
+#include "bench-common.h"
+
+/*
+ * Parses the state and timeline events of a synthetic
+ * initial sync with cm_room_event_list_parse_events(),
+ * which is what a sync response spends most of its
+ * time in.  The account size can be changed with
+ * CM_BENCH_ROOMS, CM_BENCH_MEMBERS and CM_BENCH_EVENTS.
+ */
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GPtrArray) rooms = NULL;
+  g_autoptr(GPtrArray) lists = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(JsonObject) root = NULL;
+  MockAccount account;
+  JsonObject *join;
+  gint64 start, state_time = 0, timeline_time = 0;
+  guint n_state = 0, n_timeline = 0;
+
+  cm_init (TRUE);
+  bench_account_init (&account);
+
+  client = cm_client_new ();
+  g_object_set_data (G_OBJECT (client), "no-save", GINT_TO_POINTER (TRUE));
+  cm_client_set_user_id (client, "@bench:example.org");
+  cm_client_set_device_id (client, "BENCHDEVICE");
+
+  root = mock_account_generate_sync (&account);
+  join = cm_utils_json_object_get_object (cm_utils_json_object_get_object (root, "rooms"), "join");
+  rooms = g_ptr_array_new_full (account.n_rooms, g_object_unref);
+  lists = g_ptr_array_new_full (account.n_rooms, g_object_unref);
+
+  for (guint i = 0; i < account.n_rooms; i++)
+    {
+      g_autofree char *room_id = NULL;
+      CmRoomEventList *list;
+      CmRoom *room;
+
+      room_id = mock_account_get_room_id (&account, i);
+      room = cm_room_new (room_id);
+      cm_room_set_client (room, client);
+      list = cm_room_event_list_new (room);
+      cm_room_event_list_set_client (list, client);
+      g_ptr_array_add (rooms, room);
+      g_ptr_array_add (lists, list);
+    }
+
+  for (guint i = 0; i < account.n_rooms; i++)
+    {
+      g_autoptr(GPtrArray) events = NULL;
+      g_autofree char *room_id = NULL;
+      JsonObject *room_json, *state, *timeline;
+
+      room_id = mock_account_get_room_id (&account, i);
+      room_json = cm_utils_json_object_get_object (join, room_id);
+      state = cm_utils_json_object_get_object (room_json, "state");
+      timeline = cm_utils_json_object_get_object (room_json, "timeline");
+      n_state += json_array_get_length (cm_utils_json_object_get_array (state, "events"));
+      n_timeline += json_array_get_length (cm_utils_json_object_get_array (timeline, "events"));
+
+      start = g_get_monotonic_time ();
+      cm_room_event_list_parse_events (lists->pdata[i], state, NULL, FALSE);
+      state_time += g_get_monotonic_time () - start;
+
+      events = g_ptr_array_new_with_free_func (g_object_unref);
+      start = g_get_monotonic_time ();
+      cm_room_event_list_parse_events (lists->pdata[i], timeline, events, FALSE);
+      timeline_time += g_get_monotonic_time () - start;
+      g_assert_cmpint (events->len, <=, account.n_events);
+    }
+
+  bench_report ("parse-events/state",
+                n_state / (state_time / (double)G_USEC_PER_SEC), "events/s");
+  bench_report ("parse-events/timeline",
+                n_timeline / (timeline_time / (double)G_USEC_PER_SEC), "events/s");
+
+  return 0;
+}
@@ -0,0 +1,225 @@
+/* replay.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "cm-matrix.h"
+#include "cm-client-private.h"
+#include "cm-db-private.h"
+#include "cm-net-recorder-private.h"
+#include "cm-utils-private.h"
+#include "bench-common.h"
+#include "mock-server.h"
+
+/*
+ * Replays a trace recorded with CMATRIX_NET_TRACE set:
+ *
+ *   replay-bench trace.gz
+ *
+ * The recorded /sync responses are served in order by the mock
+ * homeserver and other requests get the last recorded response
+ * for the same path, so that the client does the same work each
+ * time.  The network can be made slower with CM_BENCH_LATENCY_MS
+ * and CM_BENCH_BANDWIDTH_KB.
+ */
+
+#define DB_NAME   "replay.db"
+
+typedef struct
+{
+  gint64 first_room_time;
+  guint  n_events;
+} SyncData;
+
+static void
+finish_bool_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  gboolean status;
+
+  g_assert_true (G_IS_TASK (task));
+
+  status = g_task_propagate_boolean (G_TASK (result), &error);
+  g_assert_no_error (error);
+  g_task_return_boolean (task, status);
+}
+
+static void
+wait_for_task (GTask *task)
+{
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static void
+client_sync_cb (CmClient  *client,
+                CmRoom    *room,
+                GPtrArray *events,
+                GError    *error,
+                gpointer   user_data)
+{
+  SyncData *data = user_data;
+
+  if (error)
+    g_debug ("sync error: %s", error->message);
+
+  if (room && !data->first_room_time)
+    data->first_room_time = g_get_monotonic_time ();
+
+  if (events)
+    data->n_events += events->len;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *user_id = NULL;
+  g_autofree char *device_id = NULL;
+  SyncData data = { 0 };
+  const char *trace;
+  CmDb *db;
+  gint64 start;
+  guint n_syncs = 0, rss_start;
+
+  trace = argc > 1 ? argv[1] : g_getenv ("CM_BENCH_TRACE");
+
+  if (!trace)
+    {
+      g_printerr ("Usage: %s TRACE-FILE\n", argv[0]);
+      return 1;
+    }
+
+  cm_init (TRUE);
+
+  entries = cm_net_recorder_load (trace, &error);
+
+  if (!entries)
+    {
+      g_printerr ("Error loading '%s': %s\n", trace, error->message);
+      return 1;
+    }
+
+  server = mock_server_new (NULL);
+  mock_server_set_latency (server, bench_get_env_uint ("CM_BENCH_LATENCY_MS", 0));
+  mock_server_set_bandwidth (server, bench_get_env_uint ("CM_BENCH_BANDWIDTH_KB", 0));
+
+  for (guint i = 0; i < entries->len; i++)
+    {
+      JsonObject *entry = entries->pdata[i], *response;
+      const char *uri_path;
+      guint status;
+
+      uri_path = cm_utils_json_object_get_string (entry, "path");
+      status = cm_utils_json_object_get_int (entry, "status");
+      response = cm_utils_json_object_get_object (entry, "response");
+
+      if (!uri_path || !response || status < 200 || status >= 300)
+        continue;
+
+      if (g_str_has_suffix (uri_path, "/sync"))
+        {
+          mock_server_add_sync (server, json_object_ref (response));
+          n_syncs++;
+          continue;
+        }
+
+      if (g_str_has_suffix (uri_path, "/login"))
+        {
+          g_free (user_id);
+          g_free (device_id);
+          user_id = g_strdup (cm_utils_json_object_get_string (response, "user_id"));
+          device_id = g_strdup (cm_utils_json_object_get_string (response, "device_id"));
+        }
+
+      mock_server_set_response (server, uri_path, json_object_ref (response));
+    }
+
+  if (!n_syncs)
+    {
+      g_printerr ("No /sync responses in '%s'\n", trace);
+      return 1;
+    }
+
+  /* Without a login in the trace, the mock server one is used */
+  if (!user_id || !device_id)
+    {
+      g_free (user_id);
+      g_free (device_id);
+      user_id = g_strdup ("@bench:example.org");
+      device_id = g_strdup ("BENCHDEVICE");
+    }
+
+  dir = g_dir_make_tmp ("cm-replay-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (dir), DB_NAME, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  client = cm_client_new ();
+  g_object_set_data (G_OBJECT (client), "no-save", GINT_TO_POINTER (TRUE));
+  cm_client_set_user_id (client, user_id);
+  cm_client_set_device_id (client, device_id);
+  cm_client_set_homeserver (client, mock_server_get_uri (server));
+  cm_client_set_password (client, "replay-password");
+  cm_client_set_db (client, db);
+  cm_client_set_sync_callback (client, client_sync_cb, &data, NULL);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_client_async (db, client, NULL, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  rss_start = bench_get_rss_kb ();
+  start = g_get_monotonic_time ();
+  cm_client_set_enabled (client, TRUE);
+
+  while (!mock_server_is_drained (server))
+    g_main_context_iteration (NULL, TRUE);
+
+  if (data.first_room_time)
+    bench_report ("replay/first-room", (data.first_room_time - start) / 1000.0, "ms");
+  bench_report ("replay/total", bench_get_seconds (start) * 1000.0, "ms");
+  bench_report ("replay/events", data.n_events / bench_get_seconds (start), "events/s");
+  bench_report ("replay/rss-growth", bench_get_rss_kb () - (double)rss_start, "KiB");
+
+  cm_client_set_enabled (client, FALSE);
+  g_clear_object (&client);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (db, finish_bool_cb, task);
+  wait_for_task (task);
+  g_object_unref (db);
+
+  path = g_build_filename (dir, DB_NAME, NULL);
+  g_remove (path);
+  g_rmdir (dir);
+
+  return 0;
+}
@@ -0,0 +1,190 @@
+/* sync.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "cm-matrix.h"
+#include "cm-client-private.h"
+#include "cm-db-private.h"
+#include "bench-common.h"
+#include "mock-server.h"
+
+/*
+ * Logs a #CmClient in to a mock homeserver and syncs a
+ * synthetic account, followed by CM_BENCH_UPDATES incremental
+ * syncs.  Measured are the time until the first room is
+ * known, the catch-up throughput and the memory used.
+ *
+ * The network can be made slower with CM_BENCH_LATENCY_MS
+ * and CM_BENCH_BANDWIDTH_KB (in KiB/s).
+ */
+
+#define DB_NAME   "bench.db"
+#define USER_ID   "@bench:example.org"
+#define DEVICE_ID "BENCHDEVICE"
+
+typedef struct
+{
+  gint64 first_room_time;
+  guint  n_events;
+  guint  n_errors;
+} SyncData;
+
+static void
+finish_bool_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  gboolean status;
+
+  g_assert_true (G_IS_TASK (task));
+
+  status = g_task_propagate_boolean (G_TASK (result), &error);
+  g_assert_no_error (error);
+  g_task_return_boolean (task, status);
+}
+
+static void
+wait_for_task (GTask *task)
+{
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static void
+client_sync_cb (CmClient  *client,
+                CmRoom    *room,
+                GPtrArray *events,
+                GError    *error,
+                gpointer   user_data)
+{
+  SyncData *data = user_data;
+
+  if (error)
+    {
+      g_warning ("sync error: %s", error->message);
+      data->n_errors++;
+      return;
+    }
+
+  if (room && !data->first_room_time)
+    data->first_room_time = g_get_monotonic_time ();
+
+  if (events)
+    data->n_events += events->len;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *path = NULL;
+  MockAccount account;
+  SyncData data = { 0 };
+  CmDb *db;
+  gint64 start, initial_time = 0;
+  guint n_updates, rss_start, initial_events = 0;
+
+  cm_init (TRUE);
+  bench_account_init (&account);
+  n_updates = bench_get_env_uint ("CM_BENCH_UPDATES", 20);
+
+  dir = g_dir_make_tmp ("cm-bench-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (dir), DB_NAME, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  server = mock_server_new (&account);
+  mock_server_set_latency (server, bench_get_env_uint ("CM_BENCH_LATENCY_MS", 0));
+  mock_server_set_bandwidth (server, bench_get_env_uint ("CM_BENCH_BANDWIDTH_KB", 0));
+  mock_server_add_sync (server, mock_account_generate_sync (&account));
+
+  for (guint i = 1; i <= n_updates; i++)
+    mock_server_add_sync (server, mock_account_generate_update (&account, i, 10, 10));
+
+  client = cm_client_new ();
+  g_object_set_data (G_OBJECT (client), "no-save", GINT_TO_POINTER (TRUE));
+  cm_client_set_user_id (client, USER_ID);
+  cm_client_set_device_id (client, DEVICE_ID);
+  cm_client_set_homeserver (client, mock_server_get_uri (server));
+  cm_client_set_password (client, "bench-password");
+  cm_client_set_db (client, db);
+  cm_client_set_sync_callback (client, client_sync_cb, &data, NULL);
+
+  /* The client isn't saved by itself, but rooms and events are */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_client_async (db, client, NULL, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  rss_start = bench_get_rss_kb ();
+  start = g_get_monotonic_time ();
+  cm_client_set_enabled (client, TRUE);
+
+  while (!mock_server_is_drained (server) && !data.n_errors)
+    {
+      g_main_context_iteration (NULL, TRUE);
+
+      /* The initial sync has been handled once the next is asked for */
+      if (!initial_time && mock_server_get_sync_count (server) > 1)
+        {
+          initial_time = g_get_monotonic_time ();
+          initial_events = data.n_events;
+        }
+    }
+
+  g_assert_cmpint (data.n_errors, ==, 0);
+  g_assert_cmpint (data.first_room_time, >, 0);
+
+  bench_report ("sync/first-room",
+                (data.first_room_time - start) / 1000.0, "ms");
+  bench_report ("sync/initial",
+                (initial_time - start) / 1000.0, "ms");
+  if (n_updates)
+    bench_report ("sync/catch-up",
+                  (data.n_events - initial_events) /
+                  ((g_get_monotonic_time () - initial_time) / (double)G_USEC_PER_SEC),
+                  "events/s");
+  bench_report ("sync/received",
+                mock_server_get_bytes_sent (server) / 1024.0, "KiB");
+  bench_report ("sync/rss-growth",
+                bench_get_rss_kb () - (double)rss_start, "KiB");
+
+  cm_client_set_enabled (client, FALSE);
+  g_clear_object (&client);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (db, finish_bool_cb, task);
+  wait_for_task (task);
+  g_object_unref (db);
+
+  path = g_build_filename (dir, DB_NAME, NULL);
+  g_remove (path);
+  g_rmdir (dir);
+
+  return 0;
+}
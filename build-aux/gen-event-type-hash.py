@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+#
+# Copyright 2022 Purism SPC
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+# Generate the perfect hash table used by cm_utils_get_event_type()
+# in src/cm-utils.c.  Run this each time an event type is added to
+# event_type_names[] and replace the seed and the slots table with
+# the output:
+#
+#   ./build-aux/gen-event-type-hash.py src/cm-enums.h src/cm-utils.c
+
+import re
+import sys
+
+HASH_BITS = 7
+FNV_PRIME = 16777619
+
+
+def fnv1a(data, seed):
+    h = seed
+    for c in data:
+        h = ((h ^ c) * FNV_PRIME) & 0xffffffff
+    return h
+
+
+def parse_enum(path):
+    text = open(path, encoding='utf-8').read()
+    body = text[text.index('CM_M_UNKNOWN,'):text.index('} CmEventType;')]
+    values = {}
+    value = -1
+    for name, explicit in re.findall(r'(CM_M_\w+)(?:\s*=\s*(\d+))?\s*,', body):
+        value = int(explicit) if explicit else value + 1
+        values[name] = value
+    return values
+
+
+def parse_names(path):
+    text = open(path, encoding='utf-8').read()
+    body = text[text.index('event_type_names[] = {'):]
+    body = body[:body.index('};')]
+    return re.findall(r'\[(CM_M_\w+)\]\s*=\s*"([^"]+)"', body)
+
+
+def main():
+    values = parse_enum(sys.argv[1])
+    names = [(values[t], n.encode()) for t, n in parse_names(sys.argv[2])]
+    size = 1 << HASH_BITS
+
+    for seed in range(1, 1 << 24):
+        slots = [0] * size
+        for value, name in names:
+            slot = fnv1a(name, seed) >> (32 - HASH_BITS)
+            if slots[slot]:
+                break
+            slots[slot] = value
+        else:
+            break
+    else:
+        sys.exit('No seed found, increase HASH_BITS')
+
+    print('#define EVENT_TYPE_HASH_SEED 0x%x' % seed)
+    print('#define EVENT_TYPE_HASH_BITS %d' % HASH_BITS)
+    print()
+    print('static const guint8 event_type_slots[1 << EVENT_TYPE_HASH_BITS] = {')
+    for i in range(0, size, 16):
+        print('  ' + ', '.join('%2d' % v for v in slots[i:i + 16]) + ',')
+    print('};')
+
+
+if __name__ == '__main__':
+    main()
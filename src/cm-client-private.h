@@ -12,6 +12,7 @@
 
 #include <glib-object.h>
 #include <gio/gio.h>
+#include <json-glib/json-glib.h>
 
 #include "cm-db-private.h"
 #include "cm-enc-private.h"
@@ -45,7 +46,9 @@ CmEnc      *cm_client_get_enc                     (CmClient            *self);
 void        cm_client_set_db                      (CmClient            *self,
                                                    CmDb                *db);
 const char *cm_client_get_filter_id               (CmClient            *self);
+JsonObject *cm_client_get_homeserver_cache        (CmClient            *self);
 void        cm_client_save                        (CmClient            *self);
+void        cm_client_reconnect                   (CmClient            *self);
 const char *cm_client_get_next_batch              (CmClient            *self);
 CmUserList *cm_client_get_user_list               (CmClient            *self);
 void        cm_client_get_file_async              (CmClient              *self,
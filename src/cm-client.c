@@ -36,6 +36,9 @@
 #include "cm-room-private.h"
 #include "cm-room.h"
 #include "cm-secret-store-private.h"
+#include "cm-stats-private.h"
+#include "cm-trace-private.h"
+#include "cm-matrix-private.h"
 #include "cm-client-private.h"
 #include "cm-client.h"
 
@@ -55,8 +58,12 @@
  */
 
 #define KEY_TIMEOUT         10000 /* milliseconds */
-#define URI_REQUEST_TIMEOUT 30    /* seconds */
 #define SYNC_TIMEOUT        30000 /* milliseconds */
+/* next_batch changes on every sync, save it at most once in this interval */
+#define BATCH_SAVE_TIMEOUT  10    /* seconds */
+/* The homeserver verified in an earlier run is trusted for this
+ * long, without waiting for it to be verified again */
+#define HOMESERVER_CACHE_TTL (7 * 24 * 60 * 60) /* seconds */
 
 struct _CmClient
 {
@@ -64,6 +71,8 @@ struct _CmClient
 
   char           *homeserver;
   GStrv           homeserver_versions;
+  /* Real time in seconds when the homeserver was last verified */
+  gint64          homeserver_checked;
   char           *password;
   char           *device_id;
   char           *device_name;
@@ -72,16 +81,27 @@ struct _CmClient
   CmDb           *cm_db;
   CmNet          *cm_net;
   CmEnc          *cm_enc;
+  /* Decides when to retry, shared with the other clients */
+  CmSyncScheduler *sync_scheduler;
   GSocketAddress *gaddress;
 
   CmCallback      callback;
   gpointer        cb_data;
   GDestroyNotify  cb_destroy;
 
+  /* If set, room changes of a sync response are delivered at once */
+  CmBatchCallback batch_callback;
+  gpointer        batch_cb_data;
+  GDestroyNotify  batch_cb_destroy;
+  /* CmRoomChange items of the sync response being handled */
+  GPtrArray      *room_changes;
+
   GCancellable   *cancellable;
   char           *filter_id;
   char           *next_batch;
   char           *key;
+  /* Signed one-time keys created ahead of demand */
+  char           *one_time_keys;
   char           *pickle_key;
 
   CmUserList     *user_list;
@@ -96,7 +116,19 @@ struct _CmClient
   /* for sending events, incremented for each event */
   int             event_id;
 
-  guint           resync_id;
+  /* The step of matrix_start_sync() being timed, until the
+   * first sync is done, see client_set_startup_phase() */
+  const char     *startup_phase;
+  gint64          startup_phase_start;
+  gint64          startup_start;
+  /* When sync was stopped mid startup, 0 if not */
+  gint64          startup_stopped;
+  gboolean        startup_done;
+
+  guint           save_batch_id;
+  /* Account generation of cm_enc when last saved/being saved */
+  guint           saved_enc_generation;
+  guint           saving_enc_generation;
 
   gboolean        db_migrated;
   gboolean        room_list_loading;
@@ -116,9 +148,15 @@ struct _CmClient
   gboolean        sync_failed;
   gboolean        is_self_change;
   gboolean        save_client_pending;
+  gboolean        save_batch_pending;
   gboolean        save_secret_pending;
   gboolean        is_saving_client;
+  gboolean        is_saving_batch;
   gboolean        is_saving_secret;
+  gboolean        is_creating_keys;
+  /* Upload keys once created, otherwise keep them for later */
+  gboolean        upload_created_keys;
+  gboolean        is_uploading_key;
   gboolean        homeserver_verified;
 };
 
@@ -243,6 +281,37 @@ client_mark_for_save (CmClient *self,
   cm_client_save (self);
 }
 
+static void
+client_save_batch_timeout_cb (gpointer user_data)
+{
+  CmClient *self = user_data;
+
+  g_assert (CM_IS_CLIENT (self));
+
+  self->save_batch_id = 0;
+  cm_client_save (self);
+}
+
+/*
+ * client_mark_batch_for_save:
+ *
+ * next_batch changes on every sync, so instead of saving the
+ * whole client each time, only the batch is updated, and the
+ * writes are coalesced over BATCH_SAVE_TIMEOUT seconds.
+ */
+static void
+client_mark_batch_for_save (CmClient *self)
+{
+  g_assert (CM_IS_CLIENT (self));
+
+  self->save_batch_pending = TRUE;
+
+  if (!self->save_batch_id)
+    self->save_batch_id = g_timeout_add_seconds_once (BATCH_SAVE_TIMEOUT,
+                                                      client_save_batch_timeout_cb,
+                                                      self);
+}
+
 static void
 client_set_login_state (CmClient *self,
                         gboolean  logging_in,
@@ -271,6 +340,7 @@ client_reset_state (CmClient *self)
   self->is_sync = FALSE;
   g_clear_pointer (&self->next_batch, g_free);
   g_clear_pointer (&self->key, g_free);
+  g_clear_pointer (&self->one_time_keys, g_free);
   g_clear_pointer (&self->pickle_key, gcry_free);
   g_clear_pointer (&self->filter_id, g_free);
 
@@ -311,15 +381,13 @@ schedule_resync (gpointer user_data)
   gboolean sync_now;
 
   g_assert (CM_IS_CLIENT (self));
-  self->resync_id = 0;
 
   sync_now = cm_client_can_connect (self);
 
   if (sync_now)
     matrix_start_sync (self, NULL);
   else
-    self->resync_id = g_timeout_add_seconds_once (URI_REQUEST_TIMEOUT,
-                                                  schedule_resync, self);
+    cm_sync_scheduler_retry (self->sync_scheduler, self, schedule_resync, 0);
 }
 
 static gboolean
@@ -341,6 +409,20 @@ handle_matrix_glitches (CmClient *self,
       return TRUE;
     }
 
+  if (g_error_matches (error, CM_ERROR, CM_ERROR_LIMIT_EXCEEDED))
+    {
+      guint delay;
+
+      self->sync_failed = TRUE;
+      g_signal_emit (self, signals[STATUS_CHANGED], 0);
+
+      delay = cm_sync_scheduler_retry (self->sync_scheduler, self, schedule_resync,
+                                       cm_net_get_retry_after (self->cm_net));
+      g_debug ("(%p) Handle glitch, rate limited, retry in %u ms", self, delay);
+
+      return TRUE;
+    }
+
   /*
    * The G_RESOLVER_ERROR may be suggesting that the hostname is wrong, but we don't
    * know if it's network/DNS/Proxy error. So keep retrying.
@@ -359,11 +441,11 @@ handle_matrix_glitches (CmClient *self,
 
       if (cm_client_can_connect (self))
         {
-          CM_TRACE ("(%p) Handle glitch, network error", self);
-          g_clear_handle_id (&self->resync_id, g_source_remove);
+          guint delay;
+
+          delay = cm_sync_scheduler_retry (self->sync_scheduler, self, schedule_resync, 0);
+          CM_TRACE ("(%p) Handle glitch, network error, retry in %u ms", self, delay);
 
-          self->resync_id = g_timeout_add_seconds_once (URI_REQUEST_TIMEOUT,
-                                                        schedule_resync, self);
           return TRUE;
         }
     }
@@ -534,6 +616,11 @@ cm_client_finalize (GObject *object)
   CmClient *self = (CmClient *)object;
 
   cm_client_set_sync_callback (self, NULL, NULL, NULL);
+  cm_client_set_batch_sync_callback (self, NULL, NULL, NULL);
+  g_clear_pointer (&self->room_changes, g_ptr_array_unref);
+  g_clear_handle_id (&self->save_batch_id, g_source_remove);
+  cm_sync_scheduler_remove (self->sync_scheduler, self);
+  g_clear_object (&self->sync_scheduler);
 
   if (self->cancellable)
     g_cancellable_cancel (self->cancellable);
@@ -558,6 +645,8 @@ cm_client_finalize (GObject *object)
   g_free (self->homeserver);
   g_free (self->device_id);
   g_free (self->device_name);
+  g_free (self->key);
+  g_free (self->one_time_keys);
   gcry_free (self->password);
   gcry_free (self->pickle_key);
 
@@ -599,9 +688,14 @@ cm_client_class_init (CmClientClass *klass)
 static void
 cm_client_init (CmClient *self)
 {
+  CmSyncScheduler *scheduler;
+
   self->cm_account = g_object_new (CM_TYPE_ACCOUNT, NULL);
   cm_user_set_client (CM_USER (self->cm_account), self);
 
+  /* Without a CmMatrix (eg: in tests), the client is on its own */
+  scheduler = cm_matrix_get_sync_scheduler ();
+  self->sync_scheduler = scheduler ? g_object_ref (scheduler) : cm_sync_scheduler_new ();
   self->cm_net = cm_net_new ();
   self->user_list = cm_user_list_new (self);
   self->cancellable = g_cancellable_new ();
@@ -897,6 +991,163 @@ cm_client_get_account (CmClient *self)
   return self->cm_account;
 }
 
+/*
+ * Account the time since the last phase of the startup to it,
+ * so that the stats show where the time to the first sync goes.
+ * A %NULL @phase marks the first sync done.
+ */
+static void
+client_set_startup_phase (CmClient   *self,
+                          const char *phase)
+{
+  gint64 now;
+
+  g_assert (CM_IS_CLIENT (self));
+
+  if (self->startup_done || g_strcmp0 (self->startup_phase, phase) == 0)
+    return;
+
+  now = g_get_monotonic_time ();
+
+  if (self->startup_phase)
+    cm_stats_add_time (cm_stats_get_default (), self->startup_phase,
+                       now - self->startup_phase_start);
+  else if (self->startup_stopped)
+    /* Resumed, the phases before the stop are already accounted */
+    self->startup_start += now - self->startup_stopped;
+  else
+    self->startup_start = now;
+
+  self->startup_stopped = 0;
+
+  if (!phase)
+    {
+      g_debug ("(%p) Startup done in %" G_GINT64_FORMAT " ms", self,
+               (now - self->startup_start) / 1000);
+      cm_stats_add_time (cm_stats_get_default (), "startup/total",
+                         now - self->startup_start);
+      self->startup_done = TRUE;
+    }
+
+  self->startup_phase = phase;
+  self->startup_phase_start = now;
+}
+
+static void
+client_revalidate_homeserver_cb (GObject      *obj,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
+  g_autoptr(CmClient) self = user_data;
+  g_autoptr(GError) error = NULL;
+  GStrv versions;
+
+  g_assert (CM_IS_CLIENT (self));
+
+  versions = cm_utils_verify_homeserver_finish (result, &error);
+  g_debug ("(%p) Revalidate home server %s", self, CM_LOG_SUCCESS (!error));
+
+  if (versions && versions[0])
+    {
+      g_clear_pointer (&self->homeserver_versions, g_strfreev);
+      self->homeserver_versions = versions;
+      self->homeserver_checked = g_get_real_time () / G_USEC_PER_SEC;
+
+      g_clear_object (&self->gaddress);
+      self->gaddress = g_object_steal_data (G_OBJECT (result), "address");
+      self->has_tried_connecting = TRUE;
+      client_mark_for_save (self, TRUE, -1);
+    }
+  else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+    {
+      g_autoptr(GString) str = NULL;
+
+      /* The server has changed, let the next (re)sync verify it again */
+      g_clear_pointer (&versions, g_strfreev);
+      str = g_string_new (NULL);
+      g_warning ("(%p) Cached home server of '%s' is no longer supported", self,
+                 cm_utils_anonymize (str, cm_client_get_user_id (self)));
+      self->homeserver_verified = FALSE;
+      self->homeserver_checked = 0;
+      client_mark_for_save (self, TRUE, -1);
+    }
+  else
+    {
+      /* Network errors are handled by the sync, keep the cache */
+      g_clear_pointer (&versions, g_strfreev);
+    }
+}
+
+/*
+ * Use the homeserver discovered and verified in an
+ * earlier run, if recent enough, and verify it again
+ * in the background instead of before the first sync.
+ */
+static void
+client_restore_homeserver_cache (CmClient   *self,
+                                 JsonObject *cache)
+{
+  GStrvBuilder *builder;
+  JsonArray *array;
+  const char *url;
+  gint64 checked, now;
+  guint length;
+
+  g_assert (CM_IS_CLIENT (self));
+
+  if (!cache || self->homeserver_verified)
+    return;
+
+  url = cm_utils_json_object_get_string (cache, "url");
+  array = cm_utils_json_object_get_array (cache, "versions");
+  checked = cm_utils_json_object_get_int (cache, "checked");
+  now = g_get_real_time () / G_USEC_PER_SEC;
+
+  if (!url || !array || !json_array_get_length (array))
+    return;
+
+  /* The clock may have gone backwards too */
+  if (checked > now || now - checked > HOMESERVER_CACHE_TTL)
+    {
+      g_debug ("(%p) Cached home server expired", self);
+      return;
+    }
+
+  /* The discovery result, if not known from the secrets */
+  if (!self->homeserver && !self->is_logging_in && !self->login_success)
+    cm_client_set_homeserver (self, url);
+
+  if (g_strcmp0 (self->homeserver, url) != 0)
+    return;
+
+  builder = g_strv_builder_new ();
+  length = json_array_get_length (array);
+
+  for (guint i = 0; i < length; i++)
+    {
+      const char *version;
+
+      version = json_array_get_string_element (array, i);
+      if (version)
+        g_strv_builder_add (builder, version);
+    }
+
+  g_clear_pointer (&self->homeserver_versions, g_strfreev);
+  self->homeserver_versions = g_strv_builder_end (builder);
+  g_strv_builder_unref (builder);
+  self->homeserver_verified = self->homeserver_versions[0] != NULL;
+  self->homeserver_checked = checked;
+
+  if (!self->homeserver_verified)
+    return;
+
+  g_debug ("(%p) Use cached home server '%s', verified %" G_GINT64_FORMAT " s ago",
+           self, self->homeserver, now - checked);
+  cm_utils_verify_homeserver_async (self->homeserver, 30, self->cancellable,
+                                    client_revalidate_homeserver_cb,
+                                    g_object_ref (self));
+}
+
 static void
 db_load_client_cb (GObject      *obj,
                    GAsyncResult *result,
@@ -962,6 +1213,9 @@ db_load_client_cb (GObject      *obj,
 
       pickle = g_object_get_data (G_OBJECT (result), "pickle");
       self->cm_enc = cm_enc_new (self->cm_db, pickle, self->pickle_key);
+      /* The pickle is already in db */
+      if (self->cm_enc)
+        self->saved_enc_generation = cm_enc_get_account_generation (self->cm_enc);
     }
 
   if (self->cm_enc)
@@ -971,6 +1225,17 @@ db_load_client_cb (GObject      *obj,
   else
     g_clear_pointer (&self->pickle_key, gcry_free);
 
+  if (self->cm_enc && g_object_get_data (G_OBJECT (result), "device-key-hashes"))
+    {
+      GPtrArray *hashes;
+
+      /* Device keys verified in earlier sessions */
+      hashes = g_object_get_data (G_OBJECT (result), "device-key-hashes");
+      for (guint i = 0; i + 2 < hashes->len; i += 3)
+        cm_enc_add_verified_device_keys (self->cm_enc, hashes->pdata[i],
+                                         hashes->pdata[i + 1], hashes->pdata[i + 2]);
+    }
+
   if (g_object_get_data (G_OBJECT (result), "rooms"))
     {
       g_autoptr(GPtrArray) rooms = NULL;
@@ -992,6 +1257,7 @@ db_load_client_cb (GObject      *obj,
   self->next_batch = g_strdup (g_object_get_data (G_OBJECT (result), "batch"));
   g_debug ("(%p) Load db, added %u room(s), db migrated: %s, filter-id: %s",
            self, room_count, CM_LOG_BOOL (self->db_migrated), self->filter_id);
+  client_restore_homeserver_cache (self, g_object_get_data (G_OBJECT (result), "homeserver-cache"));
 
   matrix_start_sync (self, g_steal_pointer (&task));
 }
@@ -1106,6 +1372,42 @@ cm_client_get_filter_id (CmClient *self)
   return NULL;
 }
 
+/*
+ * cm_client_get_homeserver_cache:
+ * @self: A #CmClient
+ *
+ * Get what was learned about the homeserver, to be
+ * saved in the db, so that the next run can skip
+ * discovering and verifying it again.
+ *
+ * Returns: (transfer full) (nullable): The cache as
+ * a #JsonObject, or %NULL if there is nothing to cache
+ */
+JsonObject *
+cm_client_get_homeserver_cache (CmClient *self)
+{
+  JsonObject *cache;
+  JsonArray *versions;
+
+  g_return_val_if_fail (CM_IS_CLIENT (self), NULL);
+
+  if (!self->homeserver_verified || !self->homeserver_checked ||
+      !self->homeserver || !self->homeserver_versions)
+    return NULL;
+
+  cache = json_object_new ();
+  versions = json_array_new ();
+
+  for (guint i = 0; self->homeserver_versions[i]; i++)
+    json_array_add_string_element (versions, self->homeserver_versions[i]);
+
+  json_object_set_string_member (cache, "url", self->homeserver);
+  json_object_set_array_member (cache, "versions", versions);
+  json_object_set_int_member (cache, "checked", self->homeserver_checked);
+
+  return cache;
+}
+
 /**
  * cm_client_set_enabled:
  * @self: A #CmClient
@@ -1155,10 +1457,24 @@ db_save_cb (GObject      *object,
   gboolean status;
 
   status = cm_db_save_client_finish (self->cm_db, result, &error);
-  self->is_saving_client = FALSE;
 
-  if (error || !status)
-    self->save_client_pending = TRUE;
+  if (self->is_saving_batch)
+    {
+      /* Save the complete client if the batch alone couldn't be saved */
+      if (error || !status)
+        self->save_client_pending = TRUE;
+    }
+  else if (error || !status)
+    {
+      self->save_client_pending = TRUE;
+    }
+  else
+    {
+      self->saved_enc_generation = self->saving_enc_generation;
+    }
+
+  self->is_saving_client = FALSE;
+  self->is_saving_batch = FALSE;
 
   if (error)
     g_warning ("Error saving to db: %s", error->message);
@@ -1185,21 +1501,47 @@ cm_client_save (CmClient *self)
       !cm_user_get_id (CM_USER (self->cm_account)))
     return;
 
-  if (self->save_client_pending && !self->is_saving_client &&
-      cm_client_get_device_id (self))
+  /* The Olm account is pickled (and encrypted) only if it has changed */
+  if (self->cm_enc &&
+      cm_enc_get_account_generation (self->cm_enc) != self->saved_enc_generation)
+    self->save_client_pending = TRUE;
+
+  if (self->is_saving_client || !cm_client_get_device_id (self))
+    {
+      /* db_save_cb() shall try again */
+    }
+  else if (self->save_client_pending)
     {
       char *pickle = NULL;
 
       self->is_saving_client = TRUE;
       self->save_client_pending = FALSE;
+      /* The batch is saved along with the client */
+      self->save_batch_pending = FALSE;
+      g_clear_handle_id (&self->save_batch_id, g_source_remove);
 
       if (self->cm_enc)
-        pickle = cm_enc_get_pickle (self->cm_enc);
+        {
+          self->saving_enc_generation = cm_enc_get_account_generation (self->cm_enc);
+
+          if (self->saving_enc_generation != self->saved_enc_generation)
+            pickle = cm_enc_get_pickle (self->cm_enc);
+        }
 
       cm_db_save_client_async (self->cm_db, self, pickle,
                                db_save_cb,
                                g_object_ref (self));
     }
+  else if (self->save_batch_pending && !self->save_batch_id)
+    {
+      self->is_saving_client = TRUE;
+      self->is_saving_batch = TRUE;
+      self->save_batch_pending = FALSE;
+
+      cm_db_save_next_batch_async (self->cm_db, self,
+                                   db_save_cb,
+                                   g_object_ref (self));
+    }
 
   if (self->save_secret_pending && !self->is_saving_secret)
     cm_client_save_secrets_async (self, NULL, NULL, NULL);
@@ -1258,6 +1600,42 @@ cm_client_set_sync_callback (CmClient       *self,
   self->cb_destroy = destroy_data;
 }
 
+/**
+ * cm_client_set_batch_sync_callback:
+ * @self: A #CmClient
+ * @callback:(nullable): A #CmBatchCallback
+ * @user_data:(nullable): The user data passed to @callback
+ * @destroy_data: (nullable): Function to call when the callback is removed
+ *
+ * Set the callback to be executed once per sync response with
+ * the changes of every room in the response.  When set, the
+ * sync callback is no longer invoked for each room, but it's
+ * still used to report errors, and so is required.
+ *
+ * The events of all rooms in a sync response are also saved
+ * to the database in a single task in this mode.
+ *
+ * Passing `NULL` for the callback removes an existing callback.
+ *
+ * Since: 0.0.4
+ */
+void
+cm_client_set_batch_sync_callback (CmClient        *self,
+                                   CmBatchCallback  callback,
+                                   gpointer         user_data,
+                                   GDestroyNotify   destroy_data)
+{
+  g_return_if_fail (CM_IS_CLIENT (self));
+
+  if (self->batch_cb_data &&
+      self->batch_cb_destroy)
+    self->batch_cb_destroy (self->batch_cb_data);
+
+  self->batch_callback = callback;
+  self->batch_cb_data = user_data;
+  self->batch_cb_destroy = destroy_data;
+}
+
 /**
  * cm_client_set_user_id:
  * @self: A #CmClient
@@ -1370,6 +1748,7 @@ cm_client_set_homeserver (CmClient   *self,
 
   g_free (self->homeserver);
   self->homeserver = g_string_free (server, FALSE);
+  self->homeserver_checked = 0;
   cm_net_set_homeserver (self->cm_net, homeserver);
   client_mark_for_save (self, TRUE, TRUE);
 
@@ -1666,6 +2045,26 @@ cm_client_get_ed25519_key (CmClient *self)
   return NULL;
 }
 
+/**
+ * cm_client_get_stats:
+ * @self: A #CmClient
+ *
+ * Get the runtime statistics.  The statistics are
+ * collected for the whole process, and not only
+ * for @self.
+ *
+ * Returns: (transfer none): A #CmStats
+ *
+ * Since: 0.0.4
+ */
+CmStats *
+cm_client_get_stats (CmClient *self)
+{
+  g_return_val_if_fail (CM_IS_CLIENT (self), NULL);
+
+  return cm_stats_get_default ();
+}
+
 static void
 client_join_room_cb (GObject      *obj,
                      GAsyncResult *result,
@@ -1890,9 +2289,16 @@ client_verify_homeserver_cb (GObject      *obj,
   g_assert (CM_IS_CLIENT (self));
 
   client_set_login_state (self, FALSE, FALSE);
+  g_clear_pointer (&self->homeserver_versions, g_strfreev);
   self->homeserver_versions = cm_utils_verify_homeserver_finish (result, &error);
   self->homeserver_verified = self->homeserver_versions && self->homeserver_versions[0];
 
+  if (self->homeserver_verified)
+    {
+      self->homeserver_checked = g_get_real_time () / G_USEC_PER_SEC;
+      client_mark_for_save (self, TRUE, -1);
+    }
+
   g_object_set_data (G_OBJECT (task), "action", "verify-homeserver");
 
   g_debug ("(%p) Verify home server %s", self, CM_LOG_SUCCESS (!error));
@@ -1990,10 +2396,13 @@ client_password_login_cb (GObject      *obj,
   value = cm_utils_json_object_get_string (object, "base_url");
   g_clear_object (&self->cm_enc);
   self->cm_enc = cm_enc_new (self->cm_db, NULL, NULL);
+  /* Not saved yet */
+  self->saved_enc_generation = 0;
   cm_enc_set_details (self->cm_enc,
                       cm_client_get_user_id (self),
                       cm_client_get_device_id (self));
   cm_set_string_value (&self->key, cm_enc_get_device_keys_json (self->cm_enc));
+  g_clear_pointer (&self->one_time_keys, g_free);
   self->is_logging_in = FALSE;
   cm_client_set_homeserver (self, value);
   client_set_login_state (self, FALSE, !!cm_net_get_access_token (self->cm_net));
@@ -2005,18 +2414,12 @@ client_password_login_cb (GObject      *obj,
 
 static gboolean
 room_matches_id (CmRoom     *room,
-                 const char *room_id)
+                 GRefString *room_id)
 {
-  const char *item_room_id;
-
   g_assert (CM_IS_ROOM (room));
 
-  item_room_id = cm_room_get_id (room);
-
-  if (g_strcmp0 (room_id, item_room_id) == 0)
-    return TRUE;
-
-  return FALSE;
+  /* Both are interned */
+  return (gpointer)cm_room_get_id (room) == (gpointer)room_id;
 }
 
 static CmRoom *
@@ -2024,11 +2427,13 @@ client_find_room (CmClient   *self,
                   const char *room_id,
                   GListStore *rooms)
 {
+  g_autoptr(GRefString) id = NULL;
   guint n_items;
 
   g_assert (CM_IS_CLIENT (self));
   g_assert (room_id && *room_id);
 
+  id = cm_utils_intern_id (room_id);
   n_items = g_list_model_get_n_items (G_LIST_MODEL (rooms));
 
   for (guint i = 0; i < n_items; i++)
@@ -2036,7 +2441,7 @@ client_find_room (CmClient   *self,
       g_autoptr(CmRoom) room = NULL;
 
       room = g_list_model_get_item (G_LIST_MODEL (rooms), i);
-      if (room_matches_id (room, room_id))
+      if (room_matches_id (room, id))
         return room;
     }
 
@@ -2054,7 +2459,82 @@ room_loaded_cb (GObject      *obj,
   cm_room_load_finish (room, result, &error);
 }
 
-static gboolean
+static void
+create_one_time_keys_cb (GObject      *obj,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  g_autoptr(CmClient) self = user_data;
+  g_autoptr(GError) error = NULL;
+  char *key;
+
+  g_assert (CM_IS_CLIENT (self));
+  g_assert (G_IS_TASK (result));
+
+  key = cm_enc_create_one_time_keys_finish (CM_ENC (obj), result, &error);
+  self->is_creating_keys = FALSE;
+  g_debug ("(%p) Create onetime keys %s", self, CM_LOG_SUCCESS (!error));
+
+  if (error)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning ("Error creating onetime keys: %s", error->message);
+      return;
+    }
+
+  /* The account was changed while the keys were being created */
+  if ((gpointer)obj != self->cm_enc)
+    {
+      g_free (key);
+      return;
+    }
+
+  /* Keep pre-generated keys until the server runs low */
+  if (!self->upload_created_keys || self->key || self->is_uploading_key)
+    {
+      g_free (self->one_time_keys);
+      self->one_time_keys = key;
+      return;
+    }
+
+  self->key = key;
+
+  if (self->key)
+    matrix_upload_key (self);
+}
+
+static void
+client_create_one_time_keys (CmClient *self,
+                             size_t    count,
+                             gboolean  upload)
+{
+  g_autoptr(JsonObject) keys = NULL;
+
+  g_assert (CM_IS_CLIENT (self));
+  g_assert (!self->is_creating_keys);
+
+  /* Don't stack more keys over unpublished ones, just sign them */
+  keys = cm_enc_get_one_time_keys (self->cm_enc);
+  if (keys)
+    count = 0;
+
+  g_debug ("(%p) Generating %" G_GSIZE_FORMAT " onetime keys in background, upload: %s",
+           self, count, CM_LOG_BOOL (upload));
+
+  self->is_creating_keys = TRUE;
+  self->upload_created_keys = upload;
+  cm_enc_create_one_time_keys_async (self->cm_enc, count, self->cancellable,
+                                     create_one_time_keys_cb,
+                                     g_object_ref (self));
+}
+
+/*
+ * Upload pending device keys or one-time keys if the
+ * server count given in @object is low.  Keys are created
+ * in a worker thread and uploaded without blocking the
+ * sync loop.
+ */
+static void
 handle_one_time_keys (CmClient   *self,
                       JsonObject *object)
 {
@@ -2062,8 +2542,19 @@ handle_one_time_keys (CmClient   *self,
 
   g_assert (CM_IS_CLIENT (self));
 
+  /* The counts are outdated until the current upload is done */
+  if (!self->cm_enc || self->is_creating_keys || self->is_uploading_key)
+    return;
+
+  /* Device keys not yet uploaded */
+  if (self->key)
+    {
+      matrix_upload_key (self);
+      return;
+    }
+
   if (!object)
-    return FALSE;
+    return;
 
   count = cm_utils_json_object_get_int (object, "signed_curve25519");
   limit = cm_enc_max_one_time_keys (self->cm_enc) / 2;
@@ -2071,23 +2562,16 @@ handle_one_time_keys (CmClient   *self,
   /* If we don't have enough onetime keys add some */
   if (count < limit)
     {
-      /* First, get all already created keys */
-      if (!self->key)
-        self->key = cm_enc_get_one_time_keys_json (self->cm_enc);
-
-      /* If we got no keys, create new ones and get them */
-      if (!self->key)
+      if (self->one_time_keys)
         {
-          g_debug ("(%p) Generating %" G_GSIZE_FORMAT " onetime keys", self, limit - count);
-          cm_enc_create_one_time_keys (self->cm_enc, limit - count);
-          self->key = cm_enc_get_one_time_keys_json (self->cm_enc);
+          self->key = g_steal_pointer (&self->one_time_keys);
+          matrix_upload_key (self);
+        }
+      else
+        {
+          client_create_one_time_keys (self, limit - count, TRUE);
         }
-      matrix_upload_key (self);
-
-      return TRUE;
     }
-
-  return FALSE;
 }
 
 static void
@@ -2104,19 +2588,30 @@ upload_key_cb (GObject      *obj,
   g_assert (G_IS_TASK (result));
 
   root = g_task_propagate_pointer (G_TASK (result), &error);
+  self->is_uploading_key = FALSE;
   g_debug ("(%p) Upload key %s", self, CM_LOG_SUCCESS (!error));
 
-  if (!error) {
-    cm_enc_publish_one_time_keys (self->cm_enc);
-  } else {
-    self->sync_failed = TRUE;
-    handle_matrix_glitches (self, error);
-    g_warning ("Error uploading key: %s", error->message);
-  }
+  if (error)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      self->sync_failed = TRUE;
+      handle_matrix_glitches (self, error);
+      g_warning ("Error uploading key: %s", error->message);
+      return;
+    }
+
+  cm_enc_publish_one_time_keys (self->cm_enc);
+  cm_client_save (self);
 
   object = cm_utils_json_object_get_object (root, "one_time_key_counts");
-  if (!handle_one_time_keys (self, object))
-    matrix_start_sync (self, NULL);
+  handle_one_time_keys (self, object);
+
+  /* Nothing more to upload now, create the next set of keys ahead */
+  if (!self->is_creating_keys && !self->is_uploading_key &&
+      !self->one_time_keys && self->cm_enc)
+    client_create_one_time_keys (self, cm_enc_max_one_time_keys (self->cm_enc) / 4, FALSE);
 }
 
 static void
@@ -2126,8 +2621,10 @@ matrix_upload_key (CmClient *self)
 
   g_assert (CM_IS_CLIENT (self));
   g_assert (self->key);
+  g_assert (!self->is_uploading_key);
 
   key = g_steal_pointer (&self->key);
+  self->is_uploading_key = TRUE;
 
   g_debug ("(%p) Upload key", self);
   cm_net_send_data_async (self->cm_net, 2, key, strlen (key),
@@ -2347,6 +2844,129 @@ handle_to_device (CmClient   *self,
     }
 }
 
+static void
+room_change_free (gpointer data)
+{
+  CmRoomChange *change = data;
+
+  g_clear_object (&change->room);
+  g_clear_pointer (&change->events, g_ptr_array_unref);
+  g_free (change);
+}
+
+static gboolean
+client_room_data_has_state (JsonObject *room_data,
+                            GPtrArray  *events)
+{
+  const char *names[] = { "state", "invite_state" };
+
+  for (guint i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      JsonObject *child;
+      JsonArray *array;
+
+      child = cm_utils_json_object_get_object (room_data, names[i]);
+      array = cm_utils_json_object_get_array (child, "events");
+
+      if (array && json_array_get_length (array))
+        return TRUE;
+    }
+
+  for (guint i = 0; events && i < events->len; i++)
+    if (cm_event_has_state_key (events->pdata[i]))
+      return TRUE;
+
+  return FALSE;
+}
+
+/*
+ * Deliver the changes of @room.  If the batched callback
+ * is set, the changes are queued to be delivered with the
+ * rest of the sync response in client_flush_room_changes().
+ */
+static void
+client_handle_room_change (CmClient   *self,
+                           CmRoom     *room,
+                           JsonObject *room_data,
+                           GPtrArray  *events,
+                           gint64      old_unread,
+                           CmStatus    old_status)
+{
+  CmRoomChange *change;
+
+  g_assert (CM_IS_CLIENT (self));
+  g_assert (CM_IS_ROOM (room));
+
+  if (!self->batch_callback)
+    {
+      if (events && events->len)
+        cm_db_add_room_events (self->cm_db, room, events, FALSE);
+
+      if (self->callback)
+        self->callback (self, room, events, NULL, self->cb_data);
+
+      return;
+    }
+
+  change = g_new0 (CmRoomChange, 1);
+  change->room = g_object_ref (room);
+
+  if (events && events->len)
+    {
+      change->events = g_ptr_array_ref (events);
+      change->flags |= CM_ROOM_CHANGE_EVENTS;
+    }
+
+  if (client_room_data_has_state (room_data, events))
+    change->flags |= CM_ROOM_CHANGE_STATE;
+
+  if (old_unread != cm_room_get_unread_notification_counts (room))
+    change->flags |= CM_ROOM_CHANGE_UNREAD;
+
+  if (old_status != cm_room_get_status (room))
+    change->flags |= CM_ROOM_CHANGE_STATUS;
+
+  if (!self->room_changes)
+    self->room_changes = g_ptr_array_new_with_free_func (room_change_free);
+  g_ptr_array_add (self->room_changes, change);
+}
+
+static void
+client_flush_room_changes (CmClient *self)
+{
+  g_autoptr(GPtrArray) changes = NULL;
+  g_autoptr(GPtrArray) events = NULL;
+  g_autoptr(GPtrArray) rooms = NULL;
+
+  g_assert (CM_IS_CLIENT (self));
+
+  changes = g_steal_pointer (&self->room_changes);
+
+  if (!changes || !changes->len)
+    return;
+
+  rooms = g_ptr_array_new ();
+  events = g_ptr_array_new ();
+
+  for (guint i = 0; i < changes->len; i++)
+    {
+      CmRoomChange *change = changes->pdata[i];
+
+      if (!change->events)
+        continue;
+
+      g_ptr_array_add (rooms, change->room);
+      g_ptr_array_add (events, change->events);
+    }
+
+  CM_TRACE ("(%p) Flushing changes of %u rooms, %u with events",
+            self, changes->len, rooms->len);
+  cm_db_add_rooms_events (self->cm_db, self, rooms, events);
+
+  if (self->batch_callback)
+    self->batch_callback (self, changes, self->batch_cb_data);
+}
+
 static void
 handle_room_join (CmClient   *self,
                   JsonObject *root)
@@ -2365,11 +2985,18 @@ handle_room_join (CmClient   *self,
       g_autoptr(GPtrArray) events = NULL;
       CmRoom *room;
       JsonObject *room_data;
+      CmStatus old_status = CM_STATUS_UNKNOWN;
+      gint64 old_unread = 0;
 
       room = client_find_room (self, room_id->data, self->joined_rooms);
       room_data = cm_utils_json_object_get_object (root, room_id->data);
 
-      if (!room)
+      if (room)
+        {
+          old_status = cm_room_get_status (room);
+          old_unread = cm_room_get_unread_notification_counts (room);
+        }
+      else
         {
           room = g_hash_table_lookup (self->direct_rooms, room_id->data);
 
@@ -2390,10 +3017,7 @@ handle_room_join (CmClient   *self,
 
       cm_room_set_status (room, CM_STATUS_JOIN);
       events = cm_room_set_data (room, room_data);
-      cm_db_add_room_events (self->cm_db, room, events, FALSE);
-
-      if (self->callback)
-        self->callback (self, room, events, NULL, self->cb_data);
+      client_handle_room_change (self, room, room_data, events, old_unread, old_status);
 
       cm_utils_remove_list_item (self->invited_rooms, room);
 
@@ -2420,6 +3044,8 @@ handle_room_leave (CmClient   *self,
       g_autoptr(GPtrArray) events = NULL;
       CmRoom *room;
       JsonObject *room_data;
+      CmStatus old_status;
+      gint64 old_unread;
 
       room = client_find_room (self, room_id->data, self->joined_rooms);
       room_data = cm_utils_json_object_get_object (root, room_id->data);
@@ -2427,12 +3053,11 @@ handle_room_leave (CmClient   *self,
       if (!room)
         continue;
 
+      old_status = cm_room_get_status (room);
+      old_unread = cm_room_get_unread_notification_counts (room);
       events = cm_room_set_data (room, room_data);
       cm_room_set_status (room, CM_STATUS_LEAVE);
-      cm_db_add_room_events (self->cm_db, room, events, FALSE);
-
-      if (self->callback)
-        self->callback (self, room, events, NULL, self->cb_data);
+      client_handle_room_change (self, room, room_data, events, old_unread, old_status);
 
       cm_utils_remove_list_item (self->joined_rooms, room);
     }
@@ -2456,11 +3081,18 @@ handle_room_invite (CmClient   *self,
       g_autoptr(GPtrArray) events = NULL;
       CmRoom *room;
       JsonObject *room_data;
+      CmStatus old_status = CM_STATUS_UNKNOWN;
+      gint64 old_unread = 0;
 
       room = client_find_room (self, room_id->data, self->invited_rooms);
       room_data = cm_utils_json_object_get_object (root, room_id->data);
 
-      if (!room)
+      if (room)
+        {
+          old_status = cm_room_get_status (room);
+          old_unread = cm_room_get_unread_notification_counts (room);
+        }
+      else
         {
           room = cm_room_new (room_id->data);
           cm_room_set_status (room, CM_STATUS_INVITE);
@@ -2470,12 +3102,7 @@ handle_room_invite (CmClient   *self,
         }
 
       events = cm_room_set_data (room, room_data);
-
-      if (events && events->len)
-        cm_db_add_room_events (self->cm_db, room, events, FALSE);
-
-      if (self->callback)
-        self->callback (self, room, events, NULL, self->cb_data);
+      client_handle_room_change (self, room, room_data, events, old_unread, old_status);
     }
 }
 
@@ -2509,22 +3136,37 @@ handle_red_pill (CmClient   *self,
                  JsonObject *root)
 {
   JsonObject *object;
+  gint64 trace_begin;
 
   g_assert (CM_IS_CLIENT (self));
 
   if (!root)
     return;
 
+  trace_begin = CM_TRACE_BEGIN ();
   handle_account_data (self, cm_utils_json_object_get_object (root, "account_data"));
   handle_device_list (self, cm_utils_json_object_get_object (root, "device_lists"));
+  CM_TRACE_SPAN (trace_begin, "sync stage", "account data and device lists");
+
   /* to_device should be handled first as it might contain keys to be used
    * to decrypt following events */
+  trace_begin = CM_TRACE_BEGIN ();
   handle_to_device (self, cm_utils_json_object_get_object (root, "to_device"));
+  CM_TRACE_SPAN (trace_begin, "sync stage", "to-device");
 
   object = cm_utils_json_object_get_object (root, "rooms");
+  trace_begin = CM_TRACE_BEGIN ();
   handle_room_join (self, cm_utils_json_object_get_object (object, "join"));
+  CM_TRACE_SPAN (trace_begin, "sync stage", "joined rooms");
+
+  trace_begin = CM_TRACE_BEGIN ();
   handle_room_leave (self, cm_utils_json_object_get_object (object, "leave"));
   handle_room_invite (self, cm_utils_json_object_get_object (object, "invite"));
+  CM_TRACE_SPAN (trace_begin, "sync stage", "left and invited rooms");
+
+  trace_begin = CM_TRACE_BEGIN ();
+  client_flush_room_changes (self);
+  CM_TRACE_SPAN (trace_begin, "sync stage", "flush room changes");
 }
 
 static void
@@ -2542,6 +3184,10 @@ matrix_take_red_pill_cb (GObject      *obj,
 
   root = g_task_propagate_pointer (G_TASK (result), &error);
 
+  /* Cancelled on stop, which already gave the slot back */
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    cm_sync_scheduler_release_slot (self->sync_scheduler, self);
+
   if (error)
     {
       self->sync_failed = TRUE;
@@ -2554,30 +3200,36 @@ matrix_take_red_pill_cb (GObject      *obj,
     }
 
   client_set_login_state (self, FALSE, TRUE);
+  cm_sync_scheduler_reset (self->sync_scheduler, self);
 
   g_free (self->next_batch);
   self->next_batch = g_strdup (cm_utils_json_object_get_string (root, "next_batch"));
-  client_mark_for_save (self, TRUE, -1);
-  cm_client_save (self);
+  client_mark_batch_for_save (self);
 
   {
     g_autofree char *json_str = NULL;
+    gint64 start_time;
 
     json_str = cm_utils_json_object_to_string (root, FALSE);
+    start_time = g_get_monotonic_time ();
     handle_red_pill (self, root);
+    cm_stats_add_time (cm_stats_get_default (), "sync/processing",
+                       g_get_monotonic_time () - start_time);
+    CM_TRACE_SPAN (start_time, "sync", "%s", self->next_batch);
 
     /* update variables only after the result is locally parsed  */
     if (self->sync_failed || !self->is_sync)
       {
+        client_set_startup_phase (self, NULL);
         self->sync_failed = FALSE;
         self->is_sync = TRUE;
         g_signal_emit (self, signals[STATUS_CHANGED], 0);
       }
   }
 
+  /* Keys are uploaded alongside the next sync */
   object = cm_utils_json_object_get_object (root, "device_one_time_keys_count");
-  if (handle_one_time_keys (self, object))
-    return;
+  handle_one_time_keys (self, object);
 
   /* Repeat */
   matrix_start_sync (self, NULL);
@@ -2833,11 +3485,16 @@ matrix_start_sync (CmClient *self,
   if (!self->db_loaded)
     {
       self->db_loading = TRUE;
+      client_set_startup_phase (self, "startup/db-load");
       g_debug ("(%p) Load db", self);
       cm_db_load_client_async (self->cm_db, self,
                                cm_client_get_device_id (self),
                                db_load_client_cb,
                                g_steal_pointer (&task));
+
+      /* Have the connection ready by the time the db is loaded */
+      if (self->homeserver)
+        cm_net_preconnect (self->cm_net);
     }
   else if (!self->homeserver)
     {
@@ -2859,6 +3516,7 @@ matrix_start_sync (CmClient *self,
         }
 
       client_set_login_state (self, TRUE, FALSE);
+      client_set_startup_phase (self, "startup/discovery");
       g_debug ("(%p) Getting homeserver", self);
       cm_utils_get_homeserver_async (user_id, 30, cancellable,
                                      client_get_homeserver_cb,
@@ -2867,6 +3525,7 @@ matrix_start_sync (CmClient *self,
   else if (!self->homeserver_verified)
     {
       client_set_login_state (self, TRUE, FALSE);
+      client_set_startup_phase (self, "startup/verify");
       g_debug ("(%p) Verify homeserver '%s'", self, self->homeserver);
       cm_utils_verify_homeserver_async (self->homeserver, 30, cancellable,
                                         client_verify_homeserver_cb,
@@ -2890,48 +3549,71 @@ matrix_start_sync (CmClient *self,
       g_assert (self->cm_db);
       cm_net_set_access_token (self->cm_net, NULL);
       client_set_login_state (self, TRUE, FALSE);
+      client_set_startup_phase (self, "startup/login");
       g_debug ("(%p) Login with password", self);
       client_login_with_password_async (self, cancellable,
                                         client_password_login_cb,
                                         g_steal_pointer (&task));
     }
-  else if (self->db_migrated && !self->direct_room_list_loaded)
+  else if (self->db_migrated &&
+           (!self->direct_room_list_loaded || !self->room_list_loaded))
     {
-      g_autofree char *uri = NULL;
+      client_set_startup_phase (self, "startup/room-lists");
 
-      self->direct_room_list_loading = TRUE;
+      /* The lists don't depend on each other (parse_direct_rooms() handles
+       * rooms already joined), fetch them at once. The last one to finish
+       * continues from here */
+      if (!self->direct_room_list_loaded)
+        {
+          g_autofree char *uri = NULL;
 
-      uri = g_strconcat ("/_matrix/client/r0/user/",
-                         cm_user_get_id (CM_USER (self->cm_account)),
-                         "/account_data/m.direct", NULL);
-      g_debug ("(%p) Get direct rooms", self);
-      cm_net_send_json_async (self->cm_net, 0, NULL, uri, SOUP_METHOD_GET,
-                              NULL, NULL, get_direct_rooms_cb,
-                              g_object_ref (self));
-    }
-  else if (self->db_migrated && !self->room_list_loaded)
-    {
-      self->room_list_loading = TRUE;
-      g_debug ("(%p) Get joined rooms", self);
-      cm_net_send_json_async (self->cm_net, 0, NULL,
-                              "/_matrix/client/r0/joined_rooms", SOUP_METHOD_GET,
-                              NULL, NULL, get_joined_rooms_cb,
-                              g_object_ref (self));
+          self->direct_room_list_loading = TRUE;
+
+          uri = g_strconcat ("/_matrix/client/r0/user/",
+                             cm_user_get_id (CM_USER (self->cm_account)),
+                             "/account_data/m.direct", NULL);
+          g_debug ("(%p) Get direct rooms", self);
+          cm_net_send_json_async (self->cm_net, 0, NULL, uri, SOUP_METHOD_GET,
+                                  NULL, NULL, get_direct_rooms_cb,
+                                  g_object_ref (self));
+        }
 
+      if (!self->room_list_loaded)
+        {
+          self->room_list_loading = TRUE;
+          g_debug ("(%p) Get joined rooms", self);
+          cm_net_send_json_async (self->cm_net, 0, NULL,
+                                  "/_matrix/client/r0/joined_rooms", SOUP_METHOD_GET,
+                                  NULL, NULL, get_joined_rooms_cb,
+                                  g_object_ref (self));
+        }
     }
   else if (!self->filter_id)
     {
       g_assert (self->cm_enc);
       g_assert (self->callback);
       client_set_login_state (self, TRUE, FALSE);
+      client_set_startup_phase (self, "startup/filter");
       matrix_upload_filter (self, g_steal_pointer (&task));
     }
   else
     {
       g_assert (self->cm_db);
       g_assert (self->callback);
+
+      /* The first sync is the heaviest, don't let every
+       * client run it at once (eg: after a network change) */
+      if (!self->is_sync &&
+          !cm_sync_scheduler_acquire_slot (self->sync_scheduler, self, schedule_resync))
+        {
+          client_set_startup_phase (self, "startup/sync-wait");
+          g_debug ("(%p) Waiting to start initial sync", self);
+          return;
+        }
+
       if (!self->is_sync) {
         client_set_login_state (self, TRUE, FALSE);
+        client_set_startup_phase (self, "startup/initial-sync");
       }
       matrix_take_red_pill (self, g_steal_pointer (&task));
     }
@@ -2997,10 +3679,39 @@ cm_client_start_sync (CmClient *self)
     return;
 
   g_debug ("(%p) Start sync", self);
-  g_clear_handle_id (&self->resync_id, g_source_remove);
+  cm_sync_scheduler_cancel (self->sync_scheduler, self);
   matrix_start_sync (self, NULL);
 }
 
+static void
+client_reconnect_cb (gpointer user_data)
+{
+  CmClient *self = user_data;
+
+  g_assert (CM_IS_CLIENT (self));
+
+  if (cm_client_can_connect (self) && self->callback)
+    cm_client_start_sync (self);
+}
+
+/*
+ * cm_client_reconnect:
+ * @self: A #CmClient
+ *
+ * Start sync after a short random delay, as done when the
+ * network changed, so that clients don't reconnect all at once.
+ */
+void
+cm_client_reconnect (CmClient *self)
+{
+  guint delay;
+
+  g_return_if_fail (CM_IS_CLIENT (self));
+
+  delay = cm_sync_scheduler_reconnect (self->sync_scheduler, self, client_reconnect_cb);
+  g_debug ("(%p) Reconnect in %u ms", self, delay);
+}
+
 /**
  * cm_client_is_sync:
  * @self: A #CmClient
@@ -3040,11 +3751,30 @@ cm_client_stop_sync (CmClient *self)
   self->is_logging_in = FALSE;
   self->login_success = FALSE;
 
-  g_clear_handle_id (&self->resync_id, g_source_remove);
+  /* Time spent stopped isn't startup time, keep what was
+   * spent so far so that the total still covers every phase */
+  if (!self->startup_done && self->startup_phase)
+    {
+      gint64 now = g_get_monotonic_time ();
+
+      cm_stats_add_time (cm_stats_get_default (), self->startup_phase,
+                         now - self->startup_phase_start);
+      self->startup_phase = NULL;
+      self->startup_stopped = now;
+    }
+
+  cm_sync_scheduler_cancel (self->sync_scheduler, self);
   g_clear_object (&self->cancellable);
   self->cancellable = g_cancellable_new ();
   g_debug ("(%p) Stop sync", self);
 
+  /* Don't wait for the timeout to save the last batch */
+  if (self->save_batch_id)
+    {
+      g_clear_handle_id (&self->save_batch_id, g_source_remove);
+      cm_client_save (self);
+    }
+
   g_signal_emit (self, signals[STATUS_CHANGED], 0);
 }
 
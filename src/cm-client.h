@@ -17,6 +17,7 @@ G_BEGIN_DECLS
 
 #include "cm-enums.h"
 #include "cm-pusher.h"
+#include "cm-stats.h"
 #include "cm-types.h"
 #include "users/cm-account.h"
 
@@ -49,6 +50,40 @@ typedef void   (*CmCallback)                        (CmClient           *self,
                                                      GError             *err,
                                                      gpointer            user_data);
 
+/**
+ * CmRoomChange:
+ * @room: The room that changed
+ * @events:(element-type CmEvent) (nullable): The new timeline events
+ * @flags: What changed in @room
+ *
+ * The changes of a single room in a sync response, as passed
+ * to [callback@BatchCallback].
+ *
+ * Since: 0.0.4
+ */
+typedef struct {
+  CmRoom            *room;
+  GPtrArray         *events;
+  CmRoomChangeFlags  flags;
+} CmRoomChange;
+
+/**
+ * CmBatchCallback:
+ * @self: the client that received the events
+ * @changes:(element-type CmRoomChange): The changed rooms
+ * @user_data: The user data passed in [method@Client.set_batch_sync_callback]
+ *
+ * Type definition for the function that will be called once
+ * per sync response with the summary of every room changed.
+ * @changes and its items are owned by @self and are valid only
+ * during the callback.
+ *
+ * Since: 0.0.4
+ */
+typedef void   (*CmBatchCallback)                   (CmClient           *self,
+                                                     GPtrArray          *changes,
+                                                     gpointer            user_data);
+
 CmClient     *cm_client_new                           (void);
 CmAccount    *cm_client_get_account                   (CmClient            *self);
 void          cm_client_set_enabled                   (CmClient            *self,
@@ -58,6 +93,10 @@ void          cm_client_set_sync_callback             (CmClient            *self
                                                        CmCallback           callback,
                                                        gpointer             user_data,
                                                        GDestroyNotify       destroy_data);
+void          cm_client_set_batch_sync_callback       (CmClient            *self,
+                                                       CmBatchCallback      callback,
+                                                       gpointer             user_data,
+                                                       GDestroyNotify       destroy_data);
 gboolean      cm_client_set_user_id                   (CmClient            *self,
                                                        const char          *matrix_user_id);
 GRefString   *cm_client_get_user_id                   (CmClient            *self);
@@ -82,6 +121,7 @@ void          cm_client_set_pickle_key                (CmClient            *self
                                                        const char          *pickle_key);
 const char   *cm_client_get_pickle_key                (CmClient            *self);
 const char   *cm_client_get_ed25519_key               (CmClient            *self);
+CmStats      *cm_client_get_stats                     (CmClient            *self);
 
 void          cm_client_join_room_async               (CmClient            *self,
                                                        const char          *id_or_alias,
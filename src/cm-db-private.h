@@ -16,6 +16,7 @@
 #include "cm-client.h"
 #include "cm-device.h"
 #include "cm-room.h"
+#include "events/cm-room-relations-private.h"
 
 G_BEGIN_DECLS
 
@@ -56,6 +57,10 @@ void           cm_db_save_client_async             (CmDb                *db,
                                                     char                *pickle,
                                                     GAsyncReadyCallback  callback,
                                                     gpointer             user_data);
+void           cm_db_save_next_batch_async         (CmDb                *self,
+                                                    CmClient            *client,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
 gboolean       cm_db_save_client_finish            (CmDb                *self,
                                                     GAsyncResult        *result,
                                                     GError             **error);
@@ -96,6 +101,32 @@ void           cm_db_find_file_enc_async           (CmDb                *self,
 CmEncFileInfo *cm_db_find_file_enc_finish          (CmDb                *self,
                                                     GAsyncResult        *result,
                                                     GError             **error);
+void           cm_db_lookup_media_async            (CmDb                *self,
+                                                    const char          *uri,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
+char          *cm_db_lookup_media_finish           (CmDb                *self,
+                                                    GAsyncResult        *result,
+                                                    GError             **error);
+void           cm_db_add_media_async               (CmDb                *self,
+                                                    const char          *uri,
+                                                    const char          *file_path,
+                                                    goffset              file_size,
+                                                    const char          *sha256,
+                                                    gboolean             encrypted,
+                                                    goffset              max_size,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
+gboolean       cm_db_add_media_finish              (CmDb                *self,
+                                                    GAsyncResult        *result,
+                                                    GError             **error);
+void           cm_db_add_media_part_async          (CmDb                *self,
+                                                    const char          *uri,
+                                                    const char          *part_path,
+                                                    goffset              file_size,
+                                                    goffset              max_size,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
 gboolean       cm_db_add_session                   (CmDb                *self,
                                                     gpointer             session,
                                                     char                *pickle);
@@ -114,6 +145,10 @@ void           cm_db_add_room_events               (CmDb                *self,
                                                     CmRoom              *room,
                                                     GPtrArray           *events,
                                                     gboolean             prepend);
+void           cm_db_add_rooms_events              (CmDb                *self,
+                                                    CmClient            *client,
+                                                    GPtrArray           *rooms,
+                                                    GPtrArray           *events);
 void           cm_db_get_past_events_async         (CmDb                *self,
                                                     CmRoom              *room,
                                                     CmEvent             *from,
@@ -122,6 +157,13 @@ void           cm_db_get_past_events_async         (CmDb                *self,
 GPtrArray     *cm_db_get_past_events_finish        (CmDb                *self,
                                                     GAsyncResult        *result,
                                                     GError             **error);
+void           cm_db_get_room_relations_async      (CmDb                *self,
+                                                    CmRoom              *room,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
+CmRoomRelations *cm_db_get_room_relations_finish   (CmDb                *self,
+                                                    GAsyncResult        *result,
+                                                    GError             **error);
 gpointer       cm_db_lookup_olm_session            (CmDb                *self,
                                                     const char          *account_id,
                                                     const char          *account_device,
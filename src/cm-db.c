@@ -13,12 +13,14 @@
 #include "cm-config.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <fcntl.h>
 #include <sqlite3.h>
 
 #include "events/cm-event-private.h"
 #include "events/cm-room-event-private.h"
 #include "events/cm-room-message-event-private.h"
+#include "events/cm-room-relations-private.h"
 #include "users/cm-user-private.h"
 #include "cm-device-private.h"
 #include "cm-enc-private.h"
@@ -26,6 +28,8 @@
 #include "cm-olm-private.h"
 #include "cm-client-private.h"
 #include "cm-room-private.h"
+#include "cm-stats-private.h"
+#include "cm-trace-private.h"
 #include "cm-utils-private.h"
 #include "cm-db-private.h"
 
@@ -33,7 +37,7 @@
 #define STRING_VALUE(arg) #arg
 
 /* increment when DB changes */
-#define DB_VERSION 2
+#define DB_VERSION 4
 
 struct _CmDb
 {
@@ -58,6 +62,11 @@ struct _CmDb
 /* We got m.room.encrypted, but with empty content */
 #define EVENT_MAY_BE_DECRYPTED    3
 
+/* Marks media_cache entries of partially downloaded files */
+#define MEDIA_PART_JSON           "{\"partial\":true}"
+/* Partial files not resumed within a week are removed, in seconds */
+#define MEDIA_PART_MAX_AGE        (7 * 24 * 60 * 60)
+
 /*
  * CmDb->db should never be accessed nor modified in main thread
  * except for checking if it’s %NULL.  Any operation should be done only
@@ -71,6 +80,14 @@ struct _CmDb
 typedef void (*CmDbCallback) (CmDb  *self,
                               GTask *task);
 
+/* The task is named after @worker, so that time spent
+ * in the worker thread can be accounted per task type */
+#define db_task_set_worker(task, worker)                \
+  G_STMT_START {                                        \
+    g_task_set_task_data (task, worker, NULL);          \
+    g_task_set_name (task, #worker);                    \
+  } G_STMT_END
+
 G_DEFINE_TYPE (CmDb, cm_db, G_TYPE_OBJECT)
 
 static void
@@ -187,6 +204,65 @@ db_event_get_decryption_value (CmEvent *event)
   return EVENT_NOT_ENCRYPTED;
 }
 
+static void
+db_update_room_relation (CmDb    *self,
+                         int      room_id,
+                         CmEvent *event)
+{
+  const char *relates_to_id, *key;
+  CmRelationType type;
+  sqlite3_stmt *stmt;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (CM_IS_EVENT (event));
+
+  if (cm_event_get_m_type (event) == CM_M_ROOM_REDACTION)
+    {
+      if (!cm_event_get_replaces_id (event))
+        return;
+
+      sqlite3_prepare_v2 (self->db,
+                          "DELETE FROM room_relations WHERE room_id=? AND event_uid=?;",
+                          -1, &stmt, NULL);
+      matrix_bind_int (stmt, 1, room_id, "binding when deleting relation");
+      matrix_bind_text (stmt, 2, cm_event_get_replaces_id (event), "binding when deleting relation");
+      sqlite3_step (stmt);
+      sqlite3_finalize (stmt);
+
+      return;
+    }
+
+  if (!cm_event_has_relation (event))
+    return;
+
+  type = cm_event_get_relation (event, &relates_to_id, &key);
+
+  /* Only the relations aggregated by CmRoomRelations are stored */
+  if (type != CM_RELATION_REPLACE &&
+      type != CM_RELATION_ANNOTATION &&
+      type != CM_RELATION_REPLY)
+    return;
+
+  if (!cm_event_get_id (event) || !relates_to_id)
+    return;
+
+  sqlite3_prepare_v2 (self->db,
+                      "INSERT INTO room_relations(room_id,event_uid,relates_to_uid,"
+                      "relation_type,key,sender,origin_server_ts) "
+                      "VALUES(?1,?2,?3,?4,?5,?6,?7) "
+                      "ON CONFLICT (room_relations.room_id, room_relations.event_uid) DO NOTHING;",
+                      -1, &stmt, NULL);
+  matrix_bind_int (stmt, 1, room_id, "binding when adding relation");
+  matrix_bind_text (stmt, 2, cm_event_get_id (event), "binding when adding relation");
+  matrix_bind_text (stmt, 3, relates_to_id, "binding when adding relation");
+  matrix_bind_int (stmt, 4, type, "binding when adding relation");
+  matrix_bind_text (stmt, 5, key, "binding when adding relation");
+  matrix_bind_text (stmt, 6, cm_event_get_sender_id (event), "binding when adding relation");
+  matrix_bind_int (stmt, 7, cm_event_get_time_stamp (event), "binding when adding relation");
+  sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+}
+
 static GPtrArray *
 db_get_past_room_events (CmDb   *self,
                          CmRoom *cm_room,
@@ -256,8 +332,10 @@ db_get_past_room_events (CmDb   *self,
 
 /**
    user_devices.json_data
+   - (the device keys, as received from the server)
    - local
    -  device_display_name
+   -  key_hash = string (hash of the verified device keys)
    users.json_data
    - local
    -  name
@@ -452,6 +530,41 @@ cm_db_create_schema (CmDb  *self,
     "json_data TEXT, "
     "UNIQUE (account_id, sender_key, session_id));"
 
+    /* v3 */
+    "CREATE TABLE IF NOT EXISTS media_cache ("
+    "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+    /* mxc:// uri the file was downloaded from */
+    "file_url TEXT NOT NULL, "
+    "file_path TEXT NOT NULL, "
+    "file_size INTEGER NOT NULL DEFAULT 0, "
+    /* Set only for encrypted files, the sha256 of the encrypted content */
+    "file_sha256 TEXT, "
+    /* Unused, the content of an mxc:// uri never changes */
+    "etag TEXT, "
+    "encrypted INTEGER NOT NULL DEFAULT 0, "
+    /* unix time in seconds, used for LRU eviction */
+    "last_access INTEGER NOT NULL DEFAULT 0, "
+    "json_data TEXT, "
+    "UNIQUE (file_url));"
+
+    /* v4 */
+    "CREATE TABLE IF NOT EXISTS room_relations ("
+    "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+    "room_id INTEGER NOT NULL REFERENCES rooms(id) ON DELETE CASCADE, "
+    /* The event that has the relation */
+    "event_uid TEXT NOT NULL, "
+    /* The event it relates to, which may not be in db */
+    "relates_to_uid TEXT NOT NULL, "
+    /* CmRelationType */
+    "relation_type INTEGER NOT NULL, "
+    /* Set for annotations */
+    "key TEXT, "
+    /* The sender of event_uid */
+    "sender TEXT, "
+    "origin_server_ts INTEGER NOT NULL, "
+    "json_data TEXT, "
+    "UNIQUE (room_id, event_uid));"
+
     /* v2 */
     "CREATE UNIQUE INDEX IF NOT EXISTS room_event_idx ON room_events (room_id, event_uid);"
     "CREATE UNIQUE INDEX IF NOT EXISTS room_event_txn_idx ON room_events (room_id, txnid);"
@@ -461,6 +574,10 @@ cm_db_create_schema (CmDb  *self,
     "CREATE UNIQUE INDEX IF NOT EXISTS encryption_key_idx ON encryption_keys (account_id, file_url);"
     "CREATE INDEX IF NOT EXISTS session_sender_idx ON sessions (account_id, sender_key);"
     "CREATE INDEX IF NOT EXISTS user_idx ON users (username);"
+    /* v3 */
+    "CREATE INDEX IF NOT EXISTS media_cache_access_idx ON media_cache (last_access);"
+    /* v4 */
+    "CREATE INDEX IF NOT EXISTS room_relation_idx ON room_relations (room_id, relates_to_uid);"
 
     /* v2 */
     "CREATE TRIGGER IF NOT EXISTS insert_replaced_with_id AFTER INSERT "
@@ -850,6 +967,153 @@ cm_db_migrate_to_v2 (CmDb  *self,
   return FALSE;
 }
 
+static gboolean
+cm_db_migrate_to_v3 (CmDb  *self,
+                     GTask *task)
+{
+  char *error = NULL;
+  int status;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  cm_db_backup (self);
+
+  status = sqlite3_exec (self->db,
+                         "CREATE TABLE IF NOT EXISTS media_cache ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "file_url TEXT NOT NULL, "
+                         "file_path TEXT NOT NULL, "
+                         "file_size INTEGER NOT NULL DEFAULT 0, "
+                         "file_sha256 TEXT, "
+                         "etag TEXT, "
+                         "encrypted INTEGER NOT NULL DEFAULT 0, "
+                         "last_access INTEGER NOT NULL DEFAULT 0, "
+                         "json_data TEXT, "
+                         "UNIQUE (file_url));"
+
+                         "CREATE INDEX IF NOT EXISTS media_cache_access_idx ON media_cache (last_access);"
+
+                         "PRAGMA user_version = 3;",
+                         NULL, NULL, &error);
+
+  g_debug ("Migrating db to version 3, success: %d", !error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE)
+    return TRUE;
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't migrate to new db. errno: %d. %s",
+                           status, error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
+/*
+ * Add the relations of the events already in db, in
+ * the order they were received, so that redactions
+ * remove the relations added before them.
+ */
+static void
+db_backfill_room_relations (CmDb *self)
+{
+  sqlite3_stmt *stmt;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  /* Skip parsing the events that can't have relations */
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT room_id,json_data FROM room_events "
+                      "WHERE json_data IS NOT NULL "
+                      "AND (event_type=? OR json_data LIKE '%\"m.relates_to\"%') "
+                      "ORDER BY id",
+                      -1, &stmt, NULL);
+  matrix_bind_int (stmt, 1, CM_M_ROOM_REDACTION, "binding when adding relations");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      g_autoptr(JsonObject) json = NULL;
+      g_autoptr(CmEvent) event = NULL;
+      JsonObject *root, *encrypted;
+
+      json = cm_utils_string_to_json_object ((char *)sqlite3_column_text (stmt, 1));
+      root = cm_utils_json_object_get_object (json, "json");
+      encrypted = cm_utils_json_object_get_object (json, "encrypted");
+
+      if (!root && !encrypted)
+        continue;
+
+      event = cm_event_new_from_json (root, encrypted);
+      db_update_room_relation (self, sqlite3_column_int (stmt, 0), event);
+    }
+
+  sqlite3_finalize (stmt);
+}
+
+static gboolean
+cm_db_migrate_to_v4 (CmDb  *self,
+                     GTask *task)
+{
+  char *error = NULL;
+  int status;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  cm_db_backup (self);
+
+  status = sqlite3_exec (self->db,
+                         "BEGIN TRANSACTION;"
+
+                         "CREATE TABLE IF NOT EXISTS room_relations ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "room_id INTEGER NOT NULL REFERENCES rooms(id) ON DELETE CASCADE, "
+                         "event_uid TEXT NOT NULL, "
+                         "relates_to_uid TEXT NOT NULL, "
+                         "relation_type INTEGER NOT NULL, "
+                         "key TEXT, "
+                         "sender TEXT, "
+                         "origin_server_ts INTEGER NOT NULL, "
+                         "json_data TEXT, "
+                         "UNIQUE (room_id, event_uid));"
+
+                         "CREATE INDEX IF NOT EXISTS room_relation_idx ON room_relations (room_id, relates_to_uid);",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE)
+    {
+      db_backfill_room_relations (self);
+      status = sqlite3_exec (self->db,
+                             "PRAGMA user_version = 4;"
+                             "END TRANSACTION;",
+                             NULL, NULL, &error);
+    }
+  else
+    {
+      sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+    }
+
+  g_debug ("Migrating db to version 4, success: %d", !error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE)
+    return TRUE;
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't migrate to new db. errno: %d. %s",
+                           status, error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
 static gboolean
 cm_db_migrate (CmDb  *self,
                GTask *task)
@@ -878,6 +1142,16 @@ cm_db_migrate (CmDb  *self,
   case 1:
     if (!cm_db_migrate_to_v2 (self, task))
       return FALSE;
+    /* fallthrough */
+
+  case 2:
+    if (!cm_db_migrate_to_v3 (self, task))
+      return FALSE;
+    /* fallthrough */
+
+  case 3:
+    if (!cm_db_migrate_to_v4 (self, task))
+      return FALSE;
     break;
 
   default:
@@ -1323,6 +1597,76 @@ cm_db_update_user (CmDb   *self,
   sqlite3_finalize (stmt);
 }
 
+/*
+ * Get the json_data of the device to save.  The device keys
+ * from @keys, if any, replace the ones in db, the local data
+ * in db is kept, and @key_hash, if any, is added to it.
+ */
+static char *
+db_user_device_json_data (CmDb       *self,
+                          int         user_id,
+                          const char *device,
+                          JsonObject *keys,
+                          const char *key_hash)
+{
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(JsonObject) old = NULL;
+  JsonObject *local;
+  sqlite3_stmt *stmt;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT json_data FROM user_devices "
+                      "WHERE user_id=?1 AND device=?2",
+                      -1, &stmt, NULL);
+  matrix_bind_int (stmt, 1, user_id, "binding when getting user device");
+  matrix_bind_text (stmt, 2, device, "binding when getting user device");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    old = cm_utils_string_to_json_object ((char *)sqlite3_column_text (stmt, 0));
+  sqlite3_finalize (stmt);
+
+  if (keys)
+    {
+      g_autofree char *keys_str = NULL;
+
+      /* Copy, so that the device json isn't changed */
+      keys_str = cm_utils_json_object_to_string (keys, FALSE);
+      root = cm_utils_string_to_json_object (keys_str);
+    }
+  else if (old)
+    {
+      root = json_object_ref (old);
+    }
+
+  if (!root)
+    root = json_object_new ();
+
+  local = cm_utils_json_object_get_object (old, "local");
+  if (local && root != old)
+    json_object_set_object_member (root, "local", json_object_ref (local));
+
+  if (key_hash)
+    {
+      local = cm_utils_json_object_get_object (root, "local");
+
+      if (!local)
+        {
+          local = json_object_new ();
+          json_object_set_object_member (root, "local", local);
+        }
+
+      json_object_set_string_member (local, "key_hash", key_hash);
+    }
+
+  if (!json_object_get_size (root))
+    return NULL;
+
+  return cm_utils_json_object_to_string (root, FALSE);
+}
+
 static void
 cm_db_update_user_device (CmDb     *self,
                           int       user_id,
@@ -1331,7 +1675,6 @@ cm_db_update_user_device (CmDb     *self,
   const char *curve25519_key, *ed25519_key;
   g_autofree char *json_str = NULL;
   sqlite3_stmt *stmt;
-  JsonObject *json;
 
   g_assert (CM_IS_DB (self));
   g_assert (CM_IS_DEVICE (device));
@@ -1341,9 +1684,8 @@ cm_db_update_user_device (CmDb     *self,
 
   curve25519_key = cm_device_get_curve_key (device);
   ed25519_key = cm_device_get_ed_key (device);
-  json = cm_device_get_json (device);
-  if (json)
-    json_str = cm_utils_json_object_to_string (json, FALSE);
+  json_str = db_user_device_json_data (self, user_id, cm_device_get_id (device),
+                                       cm_device_get_json (device), NULL);
 
   sqlite3_prepare_v2 (self->db,
                       "INSERT INTO user_devices(user_id,device,"
@@ -1365,6 +1707,63 @@ cm_db_update_user_device (CmDb     *self,
   sqlite3_finalize (stmt);
 }
 
+/*
+ * Remove the partial files that no download has resumed
+ * for MEDIA_PART_MAX_AGE, and those removed behind our back.
+ */
+static void
+db_remove_stale_media_parts (CmDb *self)
+{
+  g_autoptr(GArray) ids = NULL;
+  sqlite3_stmt *stmt;
+  gint64 now;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  ids = g_array_new (FALSE, FALSE, sizeof (int));
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT id,file_path,last_access FROM media_cache "
+                      "WHERE json_data=?1",
+                      -1, &stmt, NULL);
+  matrix_bind_text (stmt, 1, MEDIA_PART_JSON, "binding when removing media parts");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      const char *file_path;
+      int id;
+
+      id = sqlite3_column_int (stmt, 0);
+      file_path = (const char *)sqlite3_column_text (stmt, 1);
+
+      if (file_path && g_file_test (file_path, G_FILE_TEST_EXISTS) &&
+          now - sqlite3_column_int64 (stmt, 2) < MEDIA_PART_MAX_AGE)
+        continue;
+
+      if (file_path)
+        g_unlink (file_path);
+      g_array_append_val (ids, id);
+    }
+  sqlite3_finalize (stmt);
+
+  if (!ids->len)
+    return;
+
+  g_debug ("Removing %u stale partial media files", ids->len);
+
+  sqlite3_prepare_v2 (self->db, "DELETE FROM media_cache WHERE id=?1",
+                      -1, &stmt, NULL);
+
+  for (guint i = 0; i < ids->len; i++)
+    {
+      matrix_bind_int (stmt, 1, g_array_index (ids, int, i), "binding when removing media parts");
+      sqlite3_step (stmt);
+      sqlite3_reset (stmt);
+    }
+  sqlite3_finalize (stmt);
+}
+
 static void
 matrix_open_db (CmDb  *self,
                 GTask *task)
@@ -1401,6 +1800,8 @@ matrix_open_db (CmDb  *self,
           sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
           return;
         }
+
+      db_remove_stale_media_parts (self);
     } else {
       if (!cm_db_create_schema (self, task))
         {
@@ -1467,7 +1868,7 @@ cm_db_save_client (CmDb  *self,
 {
   const char *device, *pickle, *username, *batch, *filter;
   g_autofree char *json_str = NULL;
-  JsonObject *root, *obj;
+  JsonObject *root, *obj, *cache;
   sqlite3_stmt *stmt;
   int status, user_device_id = 0, account_id = 0;
   gboolean enabled;
@@ -1483,6 +1884,7 @@ cm_db_save_client (CmDb  *self,
   enabled = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "enabled"));
   username = g_object_get_data (G_OBJECT (task), "username");
   filter = g_object_get_data (G_OBJECT (task), "filter-id");
+  cache = g_object_get_data (G_OBJECT (task), "homeserver-cache");
 
   sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
   account_id = matrix_db_get_account_id (self, username, device, &user_device_id, TRUE);
@@ -1495,7 +1897,7 @@ cm_db_save_client (CmDb  *self,
       return;
     }
 
-  if (filter && *filter)
+  if ((filter && *filter) || cache)
     {
       root = json_object_new ();
       obj = json_object_new ();
@@ -1504,7 +1906,11 @@ cm_db_save_client (CmDb  *self,
       if (filter && *filter)
         json_object_set_string_member (obj, "filter-id", filter);
 
+      if (cache)
+        json_object_set_object_member (obj, "homeserver", json_object_ref (cache));
+
       json_str = cm_utils_json_object_to_string (root, FALSE);
+      json_object_unref (root);
     }
 
   sqlite3_prepare_v2 (self->db,
@@ -1512,7 +1918,9 @@ cm_db_save_client (CmDb  *self,
                       "next_batch,enabled,json_data) "
                       "VALUES(?1,?2,?3,?4,?5) "
                       "ON CONFLICT(user_device_id) "
-                      "DO UPDATE SET pickle=?2, next_batch=?3, enabled=?4, json_data=?5",
+                      /* Keep the old pickle if unchanged (ie, not provided) */
+                      "DO UPDATE SET pickle=coalesce(?2,pickle), next_batch=?3, "
+                      "enabled=?4, json_data=?5",
                       -1, &stmt, NULL);
 
   matrix_bind_int (stmt, 1, user_device_id, "binding when updating account");
@@ -1536,31 +1944,76 @@ cm_db_save_client (CmDb  *self,
                              status, sqlite3_errmsg (self->db));
 }
 
-static int
-cm_db_get_room_id (CmDb       *self,
-                   GTask      *task,
-                   const char *room,
-                   int         account_id)
+static void
+cm_db_save_next_batch (CmDb  *self,
+                       GTask *task)
 {
+  const char *device, *username, *batch;
   sqlite3_stmt *stmt;
-  const char *error;
-  int status;
+  int status, account_id;
 
-  g_assert (room && *room);
-  g_assert (account_id);
+  g_assert (CM_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT rooms.id FROM rooms "
-                      "WHERE room_name=? and account_id=?",
-                      -1, &stmt, NULL);
-  matrix_bind_text (stmt, 1, room, "binding when getting room id");
-  matrix_bind_int (stmt, 2, account_id, "binding when getting room id");
+  batch = g_object_get_data (G_OBJECT (task), "batch");
+  device = g_object_get_data (G_OBJECT (task), "device");
+  username = g_object_get_data (G_OBJECT (task), "username");
 
-  status = sqlite3_step (stmt);
-  if (status == SQLITE_ROW)
-    return sqlite3_column_int (stmt, 0);
+  account_id = matrix_db_get_account_id (self, username, device, NULL, FALSE);
 
-  if (status == SQLITE_DONE)
+  /* Let the caller save the complete account */
+  if (!account_id)
+    {
+      g_task_return_boolean (task, FALSE);
+      return;
+    }
+
+  sqlite3_prepare_v2 (self->db,
+                      "UPDATE accounts SET next_batch=?1 WHERE id=?2",
+                      -1, &stmt, NULL);
+  matrix_bind_text (stmt, 1, batch, "binding when updating next batch");
+  matrix_bind_int (stmt, 2, account_id, "binding when updating next batch");
+
+  status = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  if (status == SQLITE_DONE)
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Error saving next batch. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+}
+
+static int
+cm_db_get_room_id (CmDb       *self,
+                   GTask      *task,
+                   const char *room,
+                   int         account_id)
+{
+  sqlite3_stmt *stmt;
+  const char *error;
+  int status;
+
+  g_assert (room && *room);
+  g_assert (account_id);
+
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT rooms.id FROM rooms "
+                      "WHERE room_name=? and account_id=?",
+                      -1, &stmt, NULL);
+  matrix_bind_text (stmt, 1, room, "binding when getting room id");
+  matrix_bind_int (stmt, 2, account_id, "binding when getting room id");
+
+  status = sqlite3_step (stmt);
+  if (status == SQLITE_ROW)
+    return sqlite3_column_int (stmt, 0);
+
+  if (status == SQLITE_DONE)
     error = "Room not found in db";
   else
     error = sqlite3_errmsg (self->db);
@@ -1636,6 +2089,55 @@ cm_db_get_rooms (CmDb       *self,
   return g_steal_pointer (&rooms);
 }
 
+/*
+ * Get the hashes of verified device keys of all users
+ * known to @account_id as a flat array of user id,
+ * device id and hash triplets.
+ */
+static GPtrArray *
+cm_db_get_device_key_hashes (CmDb *self,
+                             int   account_id)
+{
+  GPtrArray *hashes;
+  sqlite3_stmt *stmt;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  hashes = g_ptr_array_new_full (128, g_free);
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT users.username,user_devices.device,user_devices.json_data "
+                      "FROM user_devices "
+                      "INNER JOIN users ON users.id=user_devices.user_id "
+                      "WHERE users.account_id=? AND user_devices.json_data IS NOT NULL",
+                      -1, &stmt, NULL);
+  matrix_bind_int (stmt, 1, account_id, "binding when loading device keys");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      g_autoptr(JsonObject) json = NULL;
+      const char *username, *device, *hash;
+      JsonObject *child;
+
+      username = (const char *)sqlite3_column_text (stmt, 0);
+      device = (const char *)sqlite3_column_text (stmt, 1);
+      json = cm_utils_string_to_json_object ((char *)sqlite3_column_text (stmt, 2));
+      child = cm_utils_json_object_get_object (json, "local");
+      hash = cm_utils_json_object_get_string (child, "key_hash");
+
+      if (!username || !device || !hash)
+        continue;
+
+      g_ptr_array_add (hashes, g_strdup (username));
+      g_ptr_array_add (hashes, g_strdup (device));
+      g_ptr_array_add (hashes, g_strdup (hash));
+    }
+
+  sqlite3_finalize (stmt);
+
+  return hashes;
+}
+
 static void
 cm_db_load_client (CmDb  *self,
                    GTask *task)
@@ -1674,7 +2176,7 @@ cm_db_load_client (CmDb  *self,
       const char *filter;
       GObject *object = G_OBJECT (task);
       g_autoptr(JsonObject) json = NULL;
-      JsonObject *child;
+      JsonObject *child, *cache;
       GPtrArray *rooms;
 
       g_object_set_data_full (object, "pickle", g_strdup ((char *)sqlite3_column_text (stmt, 0)), g_free);
@@ -1691,8 +2193,17 @@ cm_db_load_client (CmDb  *self,
       if (filter && *filter)
         g_object_set_data_full (object, "filter-id", g_strdup (filter), g_free);
 
+      cache = cm_utils_json_object_get_object (child, "homeserver");
+      if (cache)
+        g_object_set_data_full (object, "homeserver-cache", json_object_ref (cache),
+                                (GDestroyNotify)json_object_unref);
+
       rooms = cm_db_get_rooms (self, account_id, (char *)sqlite3_column_text (stmt, 1));
       g_object_set_data_full (object, "rooms", rooms, (GDestroyNotify)g_ptr_array_unref);
+
+      g_object_set_data_full (object, "device-key-hashes",
+                              cm_db_get_device_key_hashes (self, account_id),
+                              (GDestroyNotify)g_ptr_array_unref);
     }
 
   sqlite3_finalize (stmt);
@@ -1997,6 +2508,204 @@ cm_db_find_file_enc (CmDb  *self,
   g_task_return_pointer (task, file, cm_enc_file_info_free);
 }
 
+static void
+db_lookup_media (CmDb  *self,
+                 GTask *task)
+{
+  g_autofree char *file_path = NULL;
+  sqlite3_stmt *stmt;
+  const char *uri;
+  GStatBuf st;
+  gint64 file_size = 0;
+  int id = 0;
+  gboolean valid, partial = FALSE;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
+
+  uri = g_object_get_data (G_OBJECT (task), "uri");
+  g_assert (uri && *uri);
+
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT id,file_path,file_size,json_data=?2 "
+                      "FROM media_cache WHERE file_url=?1",
+                      -1, &stmt, NULL);
+  matrix_bind_text (stmt, 1, uri, "binding when looking up media");
+  matrix_bind_text (stmt, 2, MEDIA_PART_JSON, "binding when looking up media");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      id = sqlite3_column_int (stmt, 0);
+      file_path = g_strdup ((char *)sqlite3_column_text (stmt, 1));
+      file_size = sqlite3_column_int64 (stmt, 2);
+      partial = sqlite3_column_int (stmt, 3);
+    }
+
+  sqlite3_finalize (stmt);
+
+  /* Partial files are kept to be resumed, and are never used as such */
+  if (!id || partial)
+    {
+      g_task_return_pointer (task, NULL, NULL);
+      return;
+    }
+
+  /* The file may have been removed or truncated behind our back */
+  valid = file_path && g_stat (file_path, &st) == 0 && st.st_size == file_size;
+
+  if (valid)
+    sqlite3_prepare_v2 (self->db,
+                        "UPDATE media_cache SET last_access=?2 WHERE id=?1",
+                        -1, &stmt, NULL);
+  else
+    sqlite3_prepare_v2 (self->db,
+                        "DELETE FROM media_cache WHERE id=?1",
+                        -1, &stmt, NULL);
+
+  matrix_bind_int (stmt, 1, id, "binding when updating media");
+  if (valid)
+    matrix_bind_int (stmt, 2, g_get_real_time () / G_USEC_PER_SEC, "binding when updating media");
+
+  sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  if (!valid)
+    {
+      g_debug ("Media cache entry for '%s' invalid, removed", uri);
+
+      if (file_path)
+        g_unlink (file_path);
+      g_clear_pointer (&file_path, g_free);
+    }
+
+  g_task_return_pointer (task, g_steal_pointer (&file_path), g_free);
+}
+
+/*
+ * Remove the least recently used files until the total
+ * size of the cache is within @max_size.  @keep_uri is
+ * never evicted.
+ */
+static void
+db_evict_media (CmDb       *self,
+                const char *keep_uri,
+                gint64      max_size)
+{
+  g_autoptr(GArray) ids = NULL;
+  sqlite3_stmt *stmt;
+  gint64 total = 0;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  db_remove_stale_media_parts (self);
+
+  if (max_size <= 0)
+    return;
+
+  /* Partial files are counted too, and evicted like any other file */
+  sqlite3_prepare_v2 (self->db, "SELECT SUM(file_size) FROM media_cache",
+                      -1, &stmt, NULL);
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    total = sqlite3_column_int64 (stmt, 0);
+  sqlite3_finalize (stmt);
+
+  if (total <= max_size)
+    return;
+
+  ids = g_array_new (FALSE, FALSE, sizeof (int));
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT id,file_path,file_size FROM media_cache "
+                      "WHERE file_url!=?1 "
+                      "ORDER BY last_access ASC, id ASC",
+                      -1, &stmt, NULL);
+  matrix_bind_text (stmt, 1, keep_uri, "binding when evicting media");
+
+  while (total > max_size && sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      const char *file_path;
+      int id;
+
+      id = sqlite3_column_int (stmt, 0);
+      file_path = (const char *)sqlite3_column_text (stmt, 1);
+      total -= sqlite3_column_int64 (stmt, 2);
+
+      if (file_path)
+        g_unlink (file_path);
+      g_array_append_val (ids, id);
+    }
+  sqlite3_finalize (stmt);
+
+  g_debug ("Evicting %u media cache entries", ids->len);
+
+  sqlite3_prepare_v2 (self->db, "DELETE FROM media_cache WHERE id=?1",
+                      -1, &stmt, NULL);
+
+  for (guint i = 0; i < ids->len; i++)
+    {
+      matrix_bind_int (stmt, 1, g_array_index (ids, int, i), "binding when evicting media");
+      sqlite3_step (stmt);
+      sqlite3_reset (stmt);
+    }
+  sqlite3_finalize (stmt);
+}
+
+static void
+db_add_media (CmDb  *self,
+              GTask *task)
+{
+  const char *uri, *file_path, *sha256;
+  gint64 *file_size, *max_size;
+  sqlite3_stmt *stmt;
+  gboolean encrypted, partial;
+  int status;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
+
+  uri = g_object_get_data (G_OBJECT (task), "uri");
+  file_path = g_object_get_data (G_OBJECT (task), "file-path");
+  file_size = g_object_get_data (G_OBJECT (task), "file-size");
+  max_size = g_object_get_data (G_OBJECT (task), "max-size");
+  sha256 = g_object_get_data (G_OBJECT (task), "sha256");
+  encrypted = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "encrypted"));
+  partial = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "partial"));
+  g_assert (uri && file_path);
+  g_assert (file_size && max_size);
+
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+
+  sqlite3_prepare_v2 (self->db,
+                      "INSERT INTO media_cache(file_url,file_path,file_size,"
+                      "file_sha256,encrypted,last_access,json_data) "
+                      "VALUES(?1,?2,?3,?4,?5,?6,?7) "
+                      "ON CONFLICT(file_url) DO UPDATE SET file_path=?2,"
+                      "file_size=?3,file_sha256=?4,encrypted=?5,last_access=?6,"
+                      "json_data=?7",
+                      -1, &stmt, NULL);
+  matrix_bind_text (stmt, 1, uri, "binding when adding media");
+  matrix_bind_text (stmt, 2, file_path, "binding when adding media");
+  matrix_bind_int (stmt, 3, *file_size, "binding when adding media");
+  matrix_bind_text (stmt, 4, sha256, "binding when adding media");
+  matrix_bind_int (stmt, 5, encrypted, "binding when adding media");
+  matrix_bind_int (stmt, 6, g_get_real_time () / G_USEC_PER_SEC, "binding when adding media");
+  matrix_bind_text (stmt, 7, partial ? MEDIA_PART_JSON : NULL, "binding when adding media");
+
+  status = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  if (status == SQLITE_DONE)
+    db_evict_media (self, uri, *max_size);
+
+  sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+
+  g_task_return_boolean (task, status == SQLITE_DONE);
+}
+
 static void
 db_lookup_session (CmDb  *self,
                    GTask *task)
@@ -2258,16 +2967,19 @@ db_update_user_devices (CmDb  *self,
 
   for (guint i = 0; added &&  i < added->len; i++)
     {
+      g_autofree char *json_str = NULL;
       sqlite3_stmt *stmt;
       CmDevice *device;
       gboolean verified;
 
       device = added->pdata[i];
       verified = cm_device_is_verified (device);
+      json_str = db_user_device_json_data (self, user_id, cm_device_get_id (device),
+                                           NULL, cm_device_get_key_hash (device));
       sqlite3_prepare_v2 (self->db,
-                          "INSERT INTO user_devices(user_id,device,curve25519_key,ed25519_key,verification) "
-                          "VALUES(?1,?2,?3,?4,?5) ON CONFLICT(user_id,device) DO UPDATE SET "
-                          "verification=?5",
+                          "INSERT INTO user_devices(user_id,device,curve25519_key,ed25519_key,verification,json_data) "
+                          "VALUES(?1,?2,?3,?4,?5,?6) ON CONFLICT(user_id,device) DO UPDATE SET "
+                          "verification=?5,json_data=?6",
                           -1, &stmt, NULL);
 
       matrix_bind_int (stmt, 1, user_id, "binding add user device");
@@ -2276,6 +2988,7 @@ db_update_user_devices (CmDb  *self,
       matrix_bind_text (stmt, 4, cm_device_get_ed_key (device), "binding add user device");
       if (verified)
         matrix_bind_int (stmt, 5, VERIFICATION_VERIFIED, "binding add user device");
+      matrix_bind_text (stmt, 6, json_str, "binding add user device");
 
       sqlite3_step (stmt);
       sqlite3_finalize (stmt);
@@ -2448,32 +3161,30 @@ db_add_room_members (CmDb  *self,
   g_task_return_boolean (task, TRUE);
 }
 
-static void
-db_add_room_events (CmDb  *self,
-                    GTask *task)
+/*
+ * Should be run inside a transaction.
+ *
+ * Returns: %FALSE if @room isn't in db
+ */
+static gboolean
+db_add_room_events_real (CmDb       *self,
+                         int         account_id,
+                         const char *room,
+                         GPtrArray  *events,
+                         gboolean    prepend)
 {
-  const char *username, *device, *room;
   sqlite3_stmt *stmt;
-  GPtrArray *events;
-  int room_id, account_id, sorted_event_id = 0, match_id = 0;
-  gboolean prepend;
+  int room_id, sorted_event_id = 0, match_id = 0;
 
   g_assert (CM_IS_DB (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
-  g_assert (self->db);
+  g_assert (events);
 
-  username = g_object_get_data (G_OBJECT (task), "username");
-  device = g_object_get_data (G_OBJECT (task), "device");
-  room = g_object_get_data (G_OBJECT (task), "room");
-  events = g_object_get_data (G_OBJECT (task), "events");
-  prepend = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "prepend"));
-  g_assert (events && events->len);
-
-  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-  account_id = matrix_db_get_account_id (self, username, device, NULL, FALSE);
   room_id = matrix_db_get_room_id (self, account_id, room, FALSE);
 
+  if (!room_id)
+    return FALSE;
+
   if (prepend)
     match_id = db_get_first_room_event_id (self, room_id, &sorted_event_id);
   else
@@ -2482,14 +3193,6 @@ db_add_room_events (CmDb  *self,
   if (match_id)
     prepend ? (--sorted_event_id) : (++sorted_event_id);
 
-  if (!room_id)
-    {
-      sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
-      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-                               "Account or Room not found in db");
-      return;
-    }
-
   for (guint i = 0; i < events->len; i++)
     {
       g_autoptr(JsonObject) encrypted = NULL;
@@ -2603,8 +3306,75 @@ db_add_room_events (CmDb  *self,
                      status == SQLITE_ERROR ? sqlite3_errmsg (self->db) : "Unknown error");
         }
 
+      db_update_room_relation (self, room_id, event);
       prepend ? (--sorted_event_id) : (++sorted_event_id);
     }
+
+  return TRUE;
+}
+
+static void
+db_add_room_events (CmDb  *self,
+                    GTask *task)
+{
+  const char *username, *device, *room;
+  GPtrArray *events;
+  int account_id;
+  gboolean prepend, added;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
+
+  username = g_object_get_data (G_OBJECT (task), "username");
+  device = g_object_get_data (G_OBJECT (task), "device");
+  room = g_object_get_data (G_OBJECT (task), "room");
+  events = g_object_get_data (G_OBJECT (task), "events");
+  prepend = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "prepend"));
+  g_assert (events && events->len);
+
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  account_id = matrix_db_get_account_id (self, username, device, NULL, FALSE);
+  added = db_add_room_events_real (self, account_id, room, events, prepend);
+  sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
+
+  if (!added)
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                             "Account or Room not found in db");
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+db_add_rooms_events (CmDb  *self,
+                     GTask *task)
+{
+  const char *username, *device;
+  GPtrArray *rooms, *events;
+  int account_id;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
+
+  username = g_object_get_data (G_OBJECT (task), "username");
+  device = g_object_get_data (G_OBJECT (task), "device");
+  rooms = g_object_get_data (G_OBJECT (task), "rooms");
+  events = g_object_get_data (G_OBJECT (task), "events");
+  g_assert (rooms && events);
+  g_assert (rooms->len == events->len);
+
+  /* A single transaction for all rooms of the sync response */
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  account_id = matrix_db_get_account_id (self, username, device, NULL, FALSE);
+
+  for (guint i = 0; i < rooms->len; i++)
+    if (!db_add_room_events_real (self, account_id, rooms->pdata[i],
+                                  events->pdata[i], FALSE))
+      g_debug ("(%p) Room '%s' not found in db", self, (char *)rooms->pdata[i]);
+
   sqlite3_exec (self->db, "END TRANSACTION;", NULL, NULL, NULL);
 
   g_task_return_boolean (task, TRUE);
@@ -2651,21 +3421,81 @@ db_get_past_events (CmDb  *self,
   g_task_return_pointer (task, events, (GDestroyNotify)g_ptr_array_unref);
 }
 
+static void
+db_get_room_relations (CmDb  *self,
+                       GTask *task)
+{
+  g_autoptr(CmRoomRelations) relations = NULL;
+  const char *username, *device, *room;
+  sqlite3_stmt *stmt;
+  int room_id, account_id;
+
+  g_assert (CM_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
+
+  room = g_object_get_data (G_OBJECT (task), "room");
+  device = g_object_get_data (G_OBJECT (task), "device");
+  username = g_object_get_data (G_OBJECT (task), "username");
+
+  account_id = matrix_db_get_account_id (self, username, device, NULL, FALSE);
+  room_id = matrix_db_get_room_id (self, account_id, room, FALSE);
+
+  if (!room_id)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                               "Account or Room not found in db");
+      return;
+    }
+
+  /* The object isn't shared until returned, so it's safe to build here */
+  relations = cm_room_relations_new ();
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT event_uid,relates_to_uid,sender,relation_type,key,origin_server_ts "
+                      "FROM room_relations WHERE room_id=?;",
+                      -1, &stmt, NULL);
+  matrix_bind_int (stmt, 1, room_id, "binding when getting relations");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    cm_room_relations_add (relations,
+                           (const char *)sqlite3_column_text (stmt, 0),
+                           (const char *)sqlite3_column_text (stmt, 1),
+                           (const char *)sqlite3_column_text (stmt, 2),
+                           sqlite3_column_int (stmt, 3),
+                           (const char *)sqlite3_column_text (stmt, 4),
+                           sqlite3_column_int64 (stmt, 5));
+  sqlite3_finalize (stmt);
+
+  g_task_return_pointer (task, g_steal_pointer (&relations), g_object_unref);
+}
+
 static gpointer
 cm_db_worker (gpointer user_data)
 {
   CmDb *self = user_data;
+  CmStats *stats;
   GTask *task;
 
   g_assert (CM_IS_DB (self));
 
+  stats = cm_stats_get_default ();
+
   while ((task = g_async_queue_pop (self->queue)))
     {
+      g_autofree char *name = NULL;
       CmDbCallback callback;
+      gint64 start_time;
 
       g_assert (task);
+      cm_stats_set_gauge (stats, "db/queue-depth", g_async_queue_length (self->queue));
+      name = g_strconcat ("db/task/", g_task_get_name (task), NULL);
       callback = g_task_get_task_data (task);
+
+      start_time = g_get_monotonic_time ();
       callback (self, task);
+      cm_stats_add_time (stats, name, g_get_monotonic_time () - start_time);
+      CM_TRACE_SPAN (start_time, "db", "%s", g_task_get_name (task));
       g_object_unref (task);
 
       if (callback == matrix_close_db)
@@ -2811,7 +3641,7 @@ cm_db_open_async (CmDb                *self,
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, cm_db_open_async);
-  g_task_set_task_data (task, matrix_open_db, NULL);
+  db_task_set_worker (task, matrix_open_db);
   g_object_set_data_full (G_OBJECT (task), "dir", dir, g_free);
   g_object_set_data_full (G_OBJECT (task), "file-name", g_strdup (file_name), g_free);
 
@@ -2880,7 +3710,7 @@ cm_db_close_async (CmDb                *self,
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, cm_db_close_async);
-  g_task_set_task_data (task, matrix_close_db, NULL);
+  db_task_set_worker (task, matrix_close_db);
 
   g_async_queue_push (self->queue, task);
 }
@@ -2912,6 +3742,19 @@ cm_db_close_finish (CmDb          *self,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
+/**
+ * cm_db_save_client_async:
+ * @self: A #CmDb
+ * @client: A #CmClient
+ * @pickle: (nullable) (transfer full): The Olm account pickle
+ * @callback: A #GAsyncReadyCallback
+ * @user_data: user data for @callback
+ *
+ * Save the account details of @client.  If @pickle is %NULL,
+ * the pickle already stored (if any) is kept as such.
+ *
+ * Finish with cm_db_save_client_finish().
+ */
 void
 cm_db_save_client_async (CmDb                *self,
                          CmClient            *client,
@@ -2928,7 +3771,7 @@ cm_db_save_client_async (CmDb                *self,
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, cm_db_save_client_async);
-  g_task_set_task_data (task, cm_db_save_client, NULL);
+  db_task_set_worker (task, cm_db_save_client);
 
   object = G_OBJECT (task);
   username = cm_client_get_user_id (client);
@@ -2952,6 +3795,61 @@ cm_db_save_client_async (CmDb                *self,
   g_object_set_data_full (object, "account", g_object_ref (client), g_object_unref);
   g_object_set_data_full (object, "filter-id",
                           g_strdup (cm_client_get_filter_id (client)), g_free);
+  g_object_set_data_full (object, "homeserver-cache",
+                          cm_client_get_homeserver_cache (client),
+                          (GDestroyNotify)json_object_unref);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * cm_db_save_next_batch_async:
+ * @self: A #CmDb
+ * @client: A #CmClient
+ * @callback: A #GAsyncReadyCallback
+ * @user_data: user data for @callback
+ *
+ * Save only the next batch of @client, which is way cheaper
+ * than cm_db_save_client_async() and is what changes after
+ * every sync.  This fails (returns %FALSE) if @client was
+ * never saved before.
+ *
+ * Finish with cm_db_save_client_finish().
+ */
+void
+cm_db_save_next_batch_async (CmDb                *self,
+                             CmClient            *client,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  GObject *object;
+  GTask *task;
+  const char *username;
+
+  g_return_if_fail (CM_IS_DB (self));
+  g_return_if_fail (CM_IS_CLIENT (client));
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, cm_db_save_next_batch_async);
+  db_task_set_worker (task, cm_db_save_next_batch);
+
+  object = G_OBJECT (task);
+  username = cm_client_get_user_id (client);
+
+  if (g_application_get_default ())
+    g_application_hold (g_application_get_default ());
+
+  if (!username || !*username || !cm_client_get_device_id (client))
+    {
+      g_task_return_boolean (task, FALSE);
+      return;
+    }
+
+  g_object_set_data_full (object, "device",
+                          g_strdup (cm_client_get_device_id (client)), g_free);
+  g_object_set_data_full (object, "batch",
+                          g_strdup (cm_client_get_next_batch (client)), g_free);
+  g_object_set_data_full (object, "username", g_strdup (username), g_free);
 
   g_async_queue_push (self->queue, task);
 }
@@ -2986,7 +3884,7 @@ cm_db_load_client_async (CmDb                *self,
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, cm_db_load_client_async);
-  g_task_set_task_data (task, cm_db_load_client, NULL);
+  db_task_set_worker (task, cm_db_load_client);
 
   username = cm_client_get_user_id (client);
 
@@ -3031,7 +3929,7 @@ cm_db_save_room_async (CmDb                *self,
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, cm_db_save_room_async);
-  g_task_set_task_data (task, cm_db_save_room, NULL);
+  db_task_set_worker (task, cm_db_save_room);
 
   username = cm_client_get_user_id (client);
   device_id = cm_client_get_device_id (client);
@@ -3076,7 +3974,7 @@ cm_db_delete_client_async (CmDb                *self,
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, cm_db_delete_client_async);
-  g_task_set_task_data (task, cm_db_delete_client, NULL);
+  db_task_set_worker (task, cm_db_delete_client);
 
   username = cm_client_get_user_id (client);
   device_id = cm_client_get_device_id (client);
@@ -3116,7 +4014,7 @@ cm_db_add_session (CmDb     *self,
   task = g_task_new (self, NULL, NULL, NULL);
   g_object_ref (task);
   g_task_set_source_tag (task, cm_db_add_session);
-  g_task_set_task_data (task, db_add_session, NULL);
+  db_task_set_worker (task, db_add_session);
   object = G_OBJECT (task);
 
   g_object_set_data_full (object, "session", g_object_ref (session), g_object_unref);
@@ -3151,7 +4049,7 @@ cm_db_save_file_enc_async (CmDb                *self,
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, cm_db_save_file_enc_async);
-  g_task_set_task_data (task, cm_db_save_file_enc, NULL);
+  db_task_set_worker (task, cm_db_save_file_enc);
   g_object_set_data (G_OBJECT (task), "file", file);
 
   g_async_queue_push (self->queue, task);
@@ -3182,7 +4080,7 @@ cm_db_find_file_enc_async (CmDb                *self,
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, cm_db_find_file_enc_async);
-  g_task_set_task_data (task, cm_db_find_file_enc, NULL);
+  db_task_set_worker (task, cm_db_find_file_enc);
 
   g_object_set_data_full (G_OBJECT (task), "uri", g_strdup (uri), g_free);
 
@@ -3201,6 +4099,163 @@ cm_db_find_file_enc_finish (CmDb          *self,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+void
+cm_db_lookup_media_async (CmDb                *self,
+                          const char          *uri,
+                          GAsyncReadyCallback  callback,
+                          gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CM_IS_DB (self));
+  g_return_if_fail (uri && *uri);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, cm_db_lookup_media_async);
+  db_task_set_worker (task, db_lookup_media);
+
+  g_object_set_data_full (G_OBJECT (task), "uri", g_strdup (uri), g_free);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * cm_db_lookup_media_finish:
+ * @self: A #CmDb
+ * @result: A #GAsyncResult
+ * @error: A #GError
+ *
+ * Finish call to cm_db_lookup_media_async().
+ *
+ * Returns: (transfer full) (nullable): The path of the cached file
+ * if it's still valid, or %NULL.
+ */
+char *
+cm_db_lookup_media_finish (CmDb          *self,
+                           GAsyncResult  *result,
+                           GError       **error)
+{
+  g_return_val_if_fail (CM_IS_DB (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * cm_db_add_media_async:
+ * @self: A #CmDb
+ * @uri: The mxc uri of the file
+ * @file_path: The path the file is stored at
+ * @file_size: The size of the file in bytes
+ * @sha256: (nullable): The sha256 of encrypted content
+ * @encrypted: Whether the file was encrypted on the wire
+ * @max_size: The size budget of the cache in bytes, or 0 for unlimited
+ * @callback: (nullable): a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
+ *
+ * Add @uri to the media cache.  Least recently used
+ * files shall be removed (both from db and the file system)
+ * if the total size exceeds @max_size.
+ */
+void
+cm_db_add_media_async (CmDb                *self,
+                       const char          *uri,
+                       const char          *file_path,
+                       goffset              file_size,
+                       const char          *sha256,
+                       gboolean             encrypted,
+                       goffset              max_size,
+                       GAsyncReadyCallback  callback,
+                       gpointer             user_data)
+{
+  GObject *object;
+  gint64 size;
+  GTask *task;
+
+  g_return_if_fail (CM_IS_DB (self));
+  g_return_if_fail (uri && *uri);
+  g_return_if_fail (file_path && *file_path);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, cm_db_add_media_async);
+  db_task_set_worker (task, db_add_media);
+  object = G_OBJECT (task);
+
+  g_object_set_data_full (object, "uri", g_strdup (uri), g_free);
+  g_object_set_data_full (object, "file-path", g_strdup (file_path), g_free);
+  g_object_set_data_full (object, "sha256", g_strdup (sha256), g_free);
+  g_object_set_data (object, "encrypted", GINT_TO_POINTER (!!encrypted));
+  size = file_size;
+  g_object_set_data_full (object, "file-size", g_memdup2 (&size, sizeof (size)), g_free);
+  size = max_size;
+  g_object_set_data_full (object, "max-size", g_memdup2 (&size, sizeof (size)), g_free);
+
+  g_async_queue_push (self->queue, task);
+}
+
+gboolean
+cm_db_add_media_finish (CmDb          *self,
+                        GAsyncResult  *result,
+                        GError       **error)
+{
+  g_return_val_if_fail (CM_IS_DB (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * cm_db_add_media_part_async:
+ * @self: A #CmDb
+ * @uri: The mxc uri of the file
+ * @part_path: The path the partial file is stored at
+ * @file_size: The size of the partial file in bytes
+ * @max_size: The size budget of the cache in bytes, or 0 for unlimited
+ * @callback: (nullable): a #GAsyncReadyCallback
+ * @user_data: closure data for @callback
+ *
+ * Same as cm_db_add_media_async(), but for a partially
+ * downloaded file kept to be resumed.  The file counts
+ * towards @max_size, but isn't returned on lookup, and
+ * is removed if not resumed in a week.  Adding the
+ * complete file for @uri replaces the partial one.
+ * Finish with cm_db_add_media_finish().
+ */
+void
+cm_db_add_media_part_async (CmDb                *self,
+                            const char          *uri,
+                            const char          *part_path,
+                            goffset              file_size,
+                            goffset              max_size,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+  GObject *object;
+  gint64 size;
+  GTask *task;
+
+  g_return_if_fail (CM_IS_DB (self));
+  g_return_if_fail (uri && *uri);
+  g_return_if_fail (part_path && *part_path);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, cm_db_add_media_async);
+  db_task_set_worker (task, db_add_media);
+  object = G_OBJECT (task);
+
+  g_object_set_data_full (object, "uri", g_strdup (uri), g_free);
+  g_object_set_data_full (object, "file-path", g_strdup (part_path), g_free);
+  g_object_set_data (object, "partial", GINT_TO_POINTER (TRUE));
+  size = file_size;
+  g_object_set_data_full (object, "file-size", g_memdup2 (&size, sizeof (size)), g_free);
+  size = max_size;
+  g_object_set_data_full (object, "max-size", g_memdup2 (&size, sizeof (size)), g_free);
+
+  g_async_queue_push (self->queue, task);
+}
+
 gpointer
 cm_db_lookup_session (CmDb          *self,
                       const char    *account_id,
@@ -3225,7 +4280,7 @@ cm_db_lookup_session (CmDb          *self,
   g_object_ref (task);
 
   g_task_set_source_tag (task, cm_db_lookup_session);
-  g_task_set_task_data (task, db_lookup_session, NULL);
+  db_task_set_worker (task, db_lookup_session);
   object = G_OBJECT (task);
 
   g_object_set_data_full (object, "account-id", g_strdup (account_id), g_free);
@@ -3277,7 +4332,7 @@ cm_db_lookup_olm_session (CmDb           *self,
   g_object_ref (task);
 
   g_task_set_source_tag (task, cm_db_lookup_olm_session);
-  g_task_set_task_data (task, db_lookup_olm_session, NULL);
+  db_task_set_worker (task, db_lookup_olm_session);
   object = G_OBJECT (task);
 
   g_object_set_data_full (object, "account-id", g_strdup (account_id), g_free);
@@ -3324,7 +4379,7 @@ cm_db_mark_user_device_change (CmDb      *self,
   g_object_ref (task);
 
   g_task_set_source_tag (task, cm_db_mark_user_device_change);
-  g_task_set_task_data (task, db_mark_user_device_change, NULL);
+  db_task_set_worker (task, db_mark_user_device_change);
   account_id = cm_client_get_user_id (client);
   device = cm_client_get_device_id (client);
   object = G_OBJECT (task);
@@ -3371,7 +4426,7 @@ cm_db_update_user_devices (CmDb       *self,
   g_object_ref (task);
 
   g_task_set_source_tag (task, cm_db_update_user_devices);
-  g_task_set_task_data (task, db_update_user_devices, NULL);
+  db_task_set_worker (task, db_update_user_devices);
   account_id = cm_client_get_user_id (client);
   device = cm_client_get_device_id (client);
   object = G_OBJECT (task);
@@ -3435,7 +4490,7 @@ cm_db_update_device (CmDb     *self,
   g_object_ref (task);
 
   g_task_set_source_tag (task, cm_db_update_user_device);
-  g_task_set_task_data (task, db_update_user_device, NULL);
+  db_task_set_worker (task, db_update_user_device);
   account_id = cm_client_get_user_id (client);
   device_id = cm_client_get_device_id (client);
   object = G_OBJECT (task);
@@ -3495,7 +4550,7 @@ cm_db_add_room_members (CmDb      *self,
   g_object_ref (task);
   g_object_ref (cm_room);
   g_ptr_array_ref (members);
-  g_task_set_task_data (task, db_add_room_members, NULL);
+  db_task_set_worker (task, db_add_room_members);
   g_object_set_data_full (G_OBJECT (task), "members", members, (GDestroyNotify)g_ptr_array_unref);
   g_object_set_data_full (G_OBJECT (task), "cm-room", cm_room, g_object_unref);
   g_object_set_data_full (G_OBJECT (task), "room", g_strdup (room), g_free);
@@ -3551,7 +4606,7 @@ cm_db_add_room_events (CmDb      *self,
   g_object_ref (task);
   g_object_ref (cm_room);
   g_ptr_array_ref (events);
-  g_task_set_task_data (task, db_add_room_events, NULL);
+  db_task_set_worker (task, db_add_room_events);
   g_object_set_data_full (G_OBJECT (task), "events", events, (GDestroyNotify)g_ptr_array_unref);
   g_object_set_data_full (G_OBJECT (task), "cm-room", cm_room, g_object_unref);
   g_object_set_data_full (G_OBJECT (task), "room", g_strdup (room), g_free);
@@ -3572,6 +4627,69 @@ cm_db_add_room_events (CmDb      *self,
     g_debug ("Error getting session: %s", error->message);
 }
 
+/*
+ * cm_db_add_rooms_events:
+ * @client: The client of @rooms
+ * @rooms: (element-type CmRoom): The rooms
+ * @events: (element-type GPtrArray): The events of
+ * each item in @rooms, in the same order
+ *
+ * Same as cm_db_add_room_events() with @prepend
+ * %FALSE for each room, but all rooms are saved
+ * in a single db task.
+ */
+void
+cm_db_add_rooms_events (CmDb      *self,
+                        CmClient  *client,
+                        GPtrArray *rooms,
+                        GPtrArray *events)
+{
+  g_autoptr(GPtrArray) room_ids = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_return_if_fail (CM_IS_DB (self));
+  g_return_if_fail (CM_IS_CLIENT (client));
+  g_return_if_fail (rooms && events);
+  g_return_if_fail (rooms->len == events->len);
+
+  if (!rooms->len)
+    return;
+
+  if (g_application_get_default ())
+    g_application_hold (g_application_get_default ());
+
+  room_ids = g_ptr_array_new_full (rooms->len, g_free);
+  for (guint i = 0; i < rooms->len; i++)
+    g_ptr_array_add (room_ids, g_strdup (cm_room_get_id (rooms->pdata[i])));
+
+  task = g_task_new (self, NULL, NULL, NULL);
+  g_object_ref (task);
+  db_task_set_worker (task, db_add_rooms_events);
+  g_object_set_data_full (G_OBJECT (task), "events", g_ptr_array_ref (events),
+                          (GDestroyNotify)g_ptr_array_unref);
+  g_object_set_data_full (G_OBJECT (task), "cm-rooms", g_ptr_array_ref (rooms),
+                          (GDestroyNotify)g_ptr_array_unref);
+  g_object_set_data_full (G_OBJECT (task), "rooms", g_steal_pointer (&room_ids),
+                          (GDestroyNotify)g_ptr_array_unref);
+  g_object_set_data_full (G_OBJECT (task), "username",
+                          g_strdup (cm_client_get_user_id (client)), g_free);
+  g_object_set_data_full (G_OBJECT (task), "device",
+                          g_strdup (cm_client_get_device_id (client)), g_free);
+
+  g_async_queue_push (self->queue, task);
+
+  cm_db_wait_for_completion (task);
+
+  if (g_application_get_default ())
+    g_application_release (g_application_get_default ());
+
+  g_task_propagate_boolean (task, &error);
+
+  if (error)
+    g_debug ("Error adding rooms events: %s", error->message);
+}
+
 void
 cm_db_get_past_events_async (CmDb                *self,
                              CmRoom              *room,
@@ -3608,7 +4726,7 @@ cm_db_get_past_events_async (CmDb                *self,
   g_object_set_data_full (G_OBJECT (task), "username", g_strdup (username), g_free);
   g_object_set_data_full (G_OBJECT (task), "device", g_strdup (device), g_free);
   g_task_set_source_tag (task, cm_db_get_past_events_async);
-  g_task_set_task_data (task, db_get_past_events, NULL);
+  db_task_set_worker (task, db_get_past_events);
 
   g_async_queue_push (self->queue, task);
 }
@@ -3624,3 +4742,42 @@ cm_db_get_past_events_finish (CmDb          *self,
 
   return g_task_propagate_pointer (G_TASK (result), error);
 }
+
+void
+cm_db_get_room_relations_async (CmDb                *self,
+                                CmRoom              *room,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+  const char *username, *device;
+  CmClient *client;
+  GTask *task;
+
+  g_return_if_fail (CM_IS_DB (self));
+  g_return_if_fail (CM_IS_ROOM (room));
+
+  client = cm_room_get_client (room);
+  username = cm_client_get_user_id (client);
+  device = cm_client_get_device_id (client);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_object_set_data_full (G_OBJECT (task), "room", g_strdup (cm_room_get_id (room)), g_free);
+  g_object_set_data_full (G_OBJECT (task), "username", g_strdup (username), g_free);
+  g_object_set_data_full (G_OBJECT (task), "device", g_strdup (device), g_free);
+  g_task_set_source_tag (task, cm_db_get_room_relations_async);
+  db_task_set_worker (task, db_get_room_relations);
+
+  g_async_queue_push (self->queue, task);
+}
+
+CmRoomRelations *
+cm_db_get_room_relations_finish (CmDb          *self,
+                                 GAsyncResult  *result,
+                                 GError       **error)
+{
+  g_return_val_if_fail (CM_IS_DB (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -27,5 +27,6 @@ void        cm_device_set_verified     (CmDevice   *self,
 gboolean    cm_device_is_verified      (CmDevice   *self);
 CmUser     *cm_device_get_user         (CmDevice   *self);
 JsonObject *cm_device_get_json         (CmDevice   *self);
+const char *cm_device_get_key_hash     (CmDevice   *self);
 
 G_END_DECLS
@@ -26,6 +26,8 @@ struct _CmDevice
   char     *device_name;
   char     *ed_key;
   char     *curve_key;
+  /* Hash of the signed keys, set if signature is valid */
+  char     *key_hash;
 
   gboolean meagolm_v1;
   gboolean olm_v1;
@@ -45,6 +47,7 @@ cm_device_finalize (GObject *object)
   g_free (self->device_name);
   g_free (self->ed_key);
   g_free (self->curve_key);
+  g_free (self->key_hash);
   g_clear_pointer (&self->json, json_object_unref);
   g_clear_weak_pointer (&self->user);
 
@@ -102,9 +105,10 @@ cm_device_new (CmUser     *user,
   self->ed_key = g_strdup (text);
   g_free (key_name);
 
-  if (!cm_enc_verify (cm_client_get_enc (self->client), root,
-                      cm_user_get_id (user),
-                      self->device_id, self->ed_key))
+  if (!cm_enc_verify_device_keys (cm_client_get_enc (self->client), root,
+                                  cm_user_get_id (user),
+                                  self->device_id, self->ed_key,
+                                  &self->key_hash))
     {
       /* DEBUG */
       g_warning ("Signature failed");
@@ -188,3 +192,11 @@ cm_device_get_curve_key (CmDevice *self)
 
   return self->curve_key;
 }
+
+const char *
+cm_device_get_key_hash (CmDevice *self)
+{
+  g_return_val_if_fail (CM_IS_DEVICE (self), NULL);
+
+  return self->key_hash;
+}
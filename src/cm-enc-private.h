@@ -56,6 +56,7 @@ void           cm_enc_set_details                (CmEnc               *self,
                                                   GRefString          *user_id,
                                                   const char          *device_id);
 char          *cm_enc_get_pickle                 (CmEnc               *self);
+guint          cm_enc_get_account_generation     (CmEnc               *self);
 char          *cm_enc_get_pickle_key             (CmEnc               *self);
 char          *cm_enc_sign_string                (CmEnc               *self,
                                                   const char          *str,
@@ -65,9 +66,27 @@ gboolean       cm_enc_verify                     (CmEnc               *self,
                                                   const char          *matrix_id,
                                                   const char          *device_id,
                                                   const char          *ed_key);
+gboolean       cm_enc_verify_device_keys         (CmEnc               *self,
+                                                  JsonObject          *object,
+                                                  const char          *matrix_id,
+                                                  const char          *device_id,
+                                                  const char          *ed_key,
+                                                  char               **out_hash);
+void           cm_enc_add_verified_device_keys   (CmEnc               *self,
+                                                  const char          *matrix_id,
+                                                  const char          *device_id,
+                                                  const char          *hash);
 size_t         cm_enc_max_one_time_keys          (CmEnc               *self);
 size_t         cm_enc_create_one_time_keys       (CmEnc               *self,
                                                   size_t               count);
+void           cm_enc_create_one_time_keys_async (CmEnc               *self,
+                                                  size_t               count,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data);
+char          *cm_enc_create_one_time_keys_finish (CmEnc              *self,
+                                                   GAsyncResult       *result,
+                                                   GError            **error);
 void           cm_enc_publish_one_time_keys      (CmEnc               *self);
 JsonObject    *cm_enc_get_one_time_keys          (CmEnc               *self);
 char          *cm_enc_get_one_time_keys_json     (CmEnc               *self);
@@ -26,6 +26,8 @@
 #include "cm-db-private.h"
 #include "cm-olm-private.h"
 #include "cm-olm-sas-private.h"
+#include "cm-stats-private.h"
+#include "cm-trace-private.h"
 #include "cm-enc-private.h"
 
 #define KEY_LABEL_SIZE    6
@@ -49,6 +51,9 @@ struct _CmEnc
 
   CmDb       *cm_db;
 
+  /* Guards @account, which may be used from a worker thread
+   * when creating one-time keys in the background */
+  GMutex      account_lock;
   OlmAccount *account;
   OlmUtility *utility;
   char       *pickle_key;
@@ -63,12 +68,17 @@ struct _CmEnc
   GHashTable *in_group_sessions;
   GHashTable *out_group_sessions;
   GHashTable *out_group_room_session;
+  /* "user_id\ndevice_id" => hash of verified device keys */
+  GHashTable *verified_device_keys;
 
   GRefString *user_id;
   char *device_id;
 
   char *curve_key; /* Public part of Curve25519 identity key */
   char *ed_key;    /* Public part of Ed25519 fingerprint key */
+
+  /* Incremented each time the account (and so the pickle) changes */
+  guint account_generation;
 };
 
 G_DEFINE_TYPE (CmEnc, cm_enc, G_TYPE_OBJECT)
@@ -117,7 +127,9 @@ ma_create_olm_out_session (CmEnc      *self,
 
   g_assert (CM_ENC (self));
 
+  g_mutex_lock (&self->account_lock);
   session = cm_olm_outbound_new (self->account, curve_key, one_time_key, room_id);
+  g_mutex_unlock (&self->account_lock);
 
   if (!session)
     return NULL;
@@ -137,6 +149,7 @@ ma_create_olm_out_session (CmEnc      *self,
  *
  * Load the public part of Ed25519 fingerprint
  * key pair and Curve25519 identity key pair.
+ * Shall be called with account_lock held.
  */
 static gboolean
 cm_enc_load_identity_keys (CmEnc *self)
@@ -180,6 +193,7 @@ cm_enc_load_identity_keys (CmEnc *self)
   return TRUE;
 }
 
+/* Shall be called with account_lock held */
 static void
 create_new_details (CmEnc *self)
 {
@@ -195,6 +209,7 @@ create_new_details (CmEnc *self)
 
   self->account = g_malloc (olm_account_size ());
   olm_account (self->account);
+  g_atomic_int_inc (&self->account_generation);
 
   gcry_free (self->pickle_key);
   buffer = gcry_random_bytes_secure (64, GCRY_STRONG_RANDOM);
@@ -217,27 +232,31 @@ create_new_details (CmEnc *self)
 
 static void
 cm_enc_sign_json_object (CmEnc      *self,
-                         JsonObject *object)
+                         JsonObject *object,
+                         const char *user_id,
+                         const char *device_id)
 {
-  g_autoptr(GString) str = NULL;
   g_autofree char *signature = NULL;
   g_autofree char *label = NULL;
   JsonObject *sign, *child;
+  const char *str;
+  gsize len;
 
   g_assert (CM_IS_ENC (self));
   g_assert (object);
+  g_assert (user_id && device_id);
 
   /* The JSON is in canonical form.  Required for signing */
   /* https://matrix.org/docs/spec/appendices#signing-json */
-  str = cm_utils_json_get_canonical (object, NULL);
-  signature = cm_enc_sign_string (self, str->str, str->len);
+  str = cm_utils_json_write_canonical (object, &len);
+  signature = cm_enc_sign_string (self, str, len);
 
   sign = json_object_new ();
-  label = g_strconcat ("ed25519:", self->device_id, NULL);
+  label = g_strconcat ("ed25519:", device_id, NULL);
   json_object_set_string_member (sign, label, signature);
 
   child = json_object_new ();
-  json_object_set_object_member (child, self->user_id, sign);
+  json_object_set_object_member (child, user_id, sign);
   json_object_set_object_member (object, "signatures", child);
 }
 
@@ -248,6 +267,7 @@ cm_enc_finalize (GObject *object)
 
   olm_clear_account (self->account);
   g_free (self->account);
+  g_mutex_clear (&self->account_lock);
 
   olm_clear_utility (self->utility);
   g_free (self->utility);
@@ -258,6 +278,7 @@ cm_enc_finalize (GObject *object)
   g_hash_table_unref (self->in_group_sessions);
   g_hash_table_unref (self->out_group_sessions);
   g_hash_table_unref (self->out_group_room_session);
+  g_hash_table_unref (self->verified_device_keys);
 
   g_clear_pointer (&self->user_id, g_ref_string_release);
   g_free (self->device_id);
@@ -282,6 +303,7 @@ cm_enc_class_init (CmEncClass *klass)
 static void
 cm_enc_init (CmEnc *self)
 {
+  g_mutex_init (&self->account_lock);
   self->utility = g_malloc (olm_utility_size ());
   olm_utility (self->utility);
 
@@ -301,6 +323,8 @@ cm_enc_init (CmEnc *self)
                                                     g_free, g_object_unref);
   self->out_group_room_session = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                         g_object_unref, g_free);
+  self->verified_device_keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free, g_free);
 }
 
 /**
@@ -327,6 +351,7 @@ cm_enc_new (gpointer    matrix_db,
             const char *key)
 {
   g_autoptr(CmEnc) self = NULL;
+  gboolean loaded;
 
   g_return_val_if_fail (!pickle || (*pickle && key && *key), NULL);
 
@@ -342,6 +367,8 @@ cm_enc_new (gpointer    matrix_db,
       g_debug ("(%p) Create from pickle", self);
       self->pickle_key = gcry_malloc_secure (strlen (pickle) + 1);
       strcpy (self->pickle_key, key);
+
+      g_mutex_lock (&self->account_lock);
       self->account = g_malloc (olm_account_size ());
       olm_account (self->account);
 
@@ -352,15 +379,20 @@ cm_enc_new (gpointer    matrix_db,
       if (err == olm_error ())
         {
           g_warning ("Error account unpickle: %s", olm_account_last_error (self->account));
+          g_mutex_unlock (&self->account_lock);
           return NULL;
         }
     }
   else
     {
+      g_mutex_lock (&self->account_lock);
       create_new_details (self);
     }
 
-  if (!cm_enc_load_identity_keys (self))
+  loaded = cm_enc_load_identity_keys (self);
+  g_mutex_unlock (&self->account_lock);
+
+  if (!loaded)
     return NULL;
 
   return g_steal_pointer (&self);
@@ -418,8 +450,10 @@ cm_enc_set_details (CmEnc      *self,
   if (self->user_id && old_device &&
       g_strcmp0 (device_id, old_device) == 0)
     {
+      g_mutex_lock (&self->account_lock);
       create_new_details (self);
       cm_enc_load_identity_keys (self);
+      g_mutex_unlock (&self->account_lock);
     }
 }
 
@@ -427,19 +461,24 @@ char *
 cm_enc_get_pickle (CmEnc *self)
 {
   g_autofree char *pickle = NULL;
+  g_autofree char *error_str = NULL;
   size_t length, err;
 
   g_return_val_if_fail (CM_IS_ENC (self), NULL);
 
+  g_mutex_lock (&self->account_lock);
   length = olm_pickle_account_length (self->account);
   pickle = malloc (length + 1);
   err = olm_pickle_account (self->account, self->pickle_key,
                             strlen (self->pickle_key), pickle, length);
   pickle[length] = '\0';
+  if (err == olm_error ())
+    error_str = g_strdup (olm_account_last_error (self->account));
+  g_mutex_unlock (&self->account_lock);
 
   if (err == olm_error ())
     {
-      g_warning ("Error getting account pickle: %s", olm_account_last_error (self->account));
+      g_warning ("Error getting account pickle: %s", error_str);
 
       return NULL;
     }
@@ -447,6 +486,26 @@ cm_enc_get_pickle (CmEnc *self)
   return g_steal_pointer (&pickle);
 }
 
+/**
+ * cm_enc_get_account_generation:
+ * @self: A #CmEnc
+ *
+ * Get a counter that changes each time the Olm account
+ * is modified (new identity, one-time keys generated,
+ * published or used).  This can be compared with the value
+ * at the time of the last cm_enc_get_pickle() to avoid
+ * pickling and storing the same account again.
+ *
+ * Returns: The account generation
+ */
+guint
+cm_enc_get_account_generation (CmEnc *self)
+{
+  g_return_val_if_fail (CM_IS_ENC (self), 0);
+
+  return g_atomic_int_get (&self->account_generation);
+}
+
 char *
 cm_enc_get_pickle_key (CmEnc *self)
 {
@@ -472,6 +531,7 @@ cm_enc_sign_string (CmEnc  *self,
                     const char *str,
                     size_t      len)
 {
+  g_autofree char *error_str = NULL;
   char *signature;
   size_t length, err;
 
@@ -482,14 +542,19 @@ cm_enc_sign_string (CmEnc  *self,
   if (len == (size_t) -1)
     len = strlen (str);
 
+  g_mutex_lock (&self->account_lock);
   length = olm_account_signature_length (self->account);
   signature = malloc (length + 1);
   err = olm_account_sign (self->account, str, len, signature, length);
   signature[length] = '\0';
+  if (err == olm_error ())
+    error_str = g_strdup (olm_account_last_error (self->account));
+  g_mutex_unlock (&self->account_lock);
 
   if (err == olm_error ())
     {
-      g_warning ("Error signing data: %s", olm_account_last_error (self->account));
+      g_warning ("Error signing data: %s", error_str);
+      free (signature);
 
       return NULL;
     }
@@ -508,8 +573,7 @@ cm_enc_sign_string (CmEnc  *self,
  * Verify if the content in @object is signed by
  * the user @matrix_id with device @device_id.
  *
- * This function may modify @object by removing
- * "signatures" and "unsigned" members.
+ * @object is not modified.
  *
  * Returns; %TRUE if verification succeeded.  Or
  * %FALSE otherwise.
@@ -521,12 +585,12 @@ cm_enc_verify (CmEnc      *self,
                const char *device_id,
                const char *ed_key)
 {
-  JsonNode *signatures, *non_signed;
-  g_autoptr(GString) json_str = NULL;
   g_autofree char *signature = NULL;
   g_autofree char *key_name = NULL;
   JsonObject *child;
+  const char *json_str;
   size_t error;
+  gsize len;
 
   if (!object)
     return FALSE;
@@ -545,23 +609,12 @@ cm_enc_verify (CmEnc      *self,
   if (!signature)
     return FALSE;
 
-  signatures = json_object_dup_member (object, "signatures");
-  non_signed = json_object_dup_member (object, "signatures");
-  /* Remove the non signed members before verification */
-  json_object_remove_member (object, "signatures");
-  json_object_remove_member (object, "unsigned");
-
-  json_str = cm_utils_json_get_canonical (object, NULL);
-
-  /* Revert the changes we made to the JSON object */
-  if (signatures)
-    json_object_set_member (object, "signatures", signatures);
-  if (non_signed)
-    json_object_set_member (object, "unsigned", non_signed);
+  /* The non signed members are skipped in canonical form */
+  json_str = cm_utils_json_write_canonical (object, &len);
 
   error = olm_ed25519_verify (self->utility,
                               ed_key, strlen (ed_key),
-                              json_str->str, json_str->len,
+                              json_str, len,
                               signature, strlen (signature));
 
   if (error == olm_error ())
@@ -573,6 +626,112 @@ cm_enc_verify (CmEnc      *self,
   return TRUE;
 }
 
+static char *
+enc_device_keys_label (const char *matrix_id,
+                       const char *device_id)
+{
+  /* Neither can have a new line */
+  return g_strconcat (matrix_id, "\n", device_id, NULL);
+}
+
+/**
+ * cm_enc_verify_device_keys:
+ * @self: A #CmEnc
+ * @object: A #JsonObject
+ * @matrix_id: A Fully qualified Matrix ID
+ * @device_id: The device id string.
+ * @ed_key: The ED25519 key of @matrix_id
+ * @out_hash: (out) (optional): Return location for the hash
+ *
+ * Same as cm_enc_verify(), but the result is cached
+ * with the hash of the signed content of @object, so
+ * that the same device keys are not verified again.
+ * The hash can be stored and added back later with
+ * cm_enc_add_verified_device_keys().
+ *
+ * Returns; %TRUE if verification succeeded.  Or
+ * %FALSE otherwise.
+ */
+gboolean
+cm_enc_verify_device_keys (CmEnc       *self,
+                           JsonObject  *object,
+                           const char  *matrix_id,
+                           const char  *device_id,
+                           const char  *ed_key,
+                           char       **out_hash)
+{
+  g_autoptr(GChecksum) checksum = NULL;
+  g_autofree char *label = NULL;
+  g_autofree char *key_name = NULL;
+  const char *json_str, *signature, *hash;
+  JsonObject *child;
+  gsize len;
+
+  g_return_val_if_fail (CM_IS_ENC (self), FALSE);
+
+  if (!object || !matrix_id || !device_id || !ed_key)
+    return FALSE;
+
+  key_name = g_strconcat ("ed25519:", device_id, NULL);
+  child = cm_utils_json_object_get_object (object, "signatures");
+  child = cm_utils_json_object_get_object (child, matrix_id);
+  signature = cm_utils_json_object_get_string (child, key_name);
+
+  if (!signature)
+    return FALSE;
+
+  /* Hash everything the verification depends on */
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  json_str = cm_utils_json_write_canonical (object, &len);
+  g_checksum_update (checksum, (const guchar *)json_str, len);
+  g_checksum_update (checksum, (const guchar *)"\n", 1);
+  g_checksum_update (checksum, (const guchar *)ed_key, -1);
+  g_checksum_update (checksum, (const guchar *)"\n", 1);
+  g_checksum_update (checksum, (const guchar *)signature, -1);
+  hash = g_checksum_get_string (checksum);
+
+  label = enc_device_keys_label (matrix_id, device_id);
+
+  if (g_strcmp0 (g_hash_table_lookup (self->verified_device_keys, label), hash) != 0)
+    {
+      if (!cm_enc_verify (self, object, matrix_id, device_id, ed_key))
+        return FALSE;
+
+      g_hash_table_insert (self->verified_device_keys,
+                           g_steal_pointer (&label), g_strdup (hash));
+    }
+
+  if (out_hash)
+    *out_hash = g_strdup (hash);
+
+  return TRUE;
+}
+
+/**
+ * cm_enc_add_verified_device_keys:
+ * @self: A #CmEnc
+ * @matrix_id: A Fully qualified Matrix ID
+ * @device_id: The device id string.
+ * @hash: The hash from cm_enc_verify_device_keys()
+ *
+ * Mark the device keys with @hash as already verified.
+ */
+void
+cm_enc_add_verified_device_keys (CmEnc      *self,
+                                 const char *matrix_id,
+                                 const char *device_id,
+                                 const char *hash)
+{
+  g_return_if_fail (CM_IS_ENC (self));
+  g_return_if_fail (matrix_id && *matrix_id == '@');
+  g_return_if_fail (device_id && *device_id);
+  g_return_if_fail (hash && *hash);
+
+  g_hash_table_insert (self->verified_device_keys,
+                       enc_device_keys_label (matrix_id, device_id),
+                       g_strdup (hash));
+}
+
 /**
  * cm_enc_max_one_time_keys:
  * @self: A #CmEnc
@@ -585,9 +744,15 @@ cm_enc_verify (CmEnc      *self,
 size_t
 cm_enc_max_one_time_keys (CmEnc *self)
 {
+  size_t count;
+
   g_return_val_if_fail (CM_IS_ENC (self), 0);
 
-  return olm_account_max_number_of_one_time_keys (self->account);
+  g_mutex_lock (&self->account_lock);
+  count = olm_account_max_number_of_one_time_keys (self->account);
+  g_mutex_unlock (&self->account_lock);
+
+  return count;
 }
 
 /**
@@ -606,6 +771,7 @@ size_t
 cm_enc_create_one_time_keys (CmEnc  *self,
                              size_t  count)
 {
+  g_autofree char *error_str = NULL;
   cm_gcry_t buffer = NULL;
   size_t length, err;
 
@@ -615,19 +781,28 @@ cm_enc_create_one_time_keys (CmEnc  *self,
   /* doc: The maximum number of active keys supported by libolm
      is returned by olm_account_max_number_of_one_time_keys.
      The client should try to maintain about half this number on the homeserver. */
+  g_mutex_lock (&self->account_lock);
   count = MIN (count, olm_account_max_number_of_one_time_keys (self->account) / 2);
-
   length = olm_account_generate_one_time_keys_random_length (self->account, count);
+  g_mutex_unlock (&self->account_lock);
+
+  /* Gathering strong random bytes can block, don't hold the lock for it */
   if (length)
     buffer = gcry_random_bytes (length, GCRY_STRONG_RANDOM);
+
+  g_mutex_lock (&self->account_lock);
   err = olm_account_generate_one_time_keys (self->account, count, buffer, length);
+  if (err == olm_error ())
+    error_str = g_strdup (olm_account_last_error (self->account));
+  g_mutex_unlock (&self->account_lock);
+  g_atomic_int_inc (&self->account_generation);
 
   if (buffer)
     gcry_free (buffer);
 
   if (err == olm_error ())
     {
-      g_warning ("Error creating one time keys: %s", olm_account_last_error (self->account));
+      g_warning ("Error creating one time keys: %s", error_str);
 
       return 0;
     }
@@ -635,6 +810,151 @@ cm_enc_create_one_time_keys (CmEnc  *self,
   return count;
 }
 
+static char *
+enc_get_one_time_keys_json (CmEnc      *self,
+                            const char *user_id,
+                            const char *device_id)
+{
+  g_autoptr(JsonObject) object = NULL;
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(GList) members = NULL;
+  JsonObject *keys, *child, *obj;
+
+  g_assert (CM_IS_ENC (self));
+
+  object = cm_enc_get_one_time_keys (self);
+
+  if (!object)
+    return NULL;
+
+  keys = json_object_new ();
+  obj = json_object_get_object_member (object, "curve25519");
+  members = json_object_get_members (obj);
+
+  for (GList *item = members; item; item = item->next)
+    {
+      g_autofree char *label = NULL;
+      const char *value;
+
+      child = json_object_new ();
+      value = json_object_get_string_member (obj, item->data);
+      json_object_set_string_member (child, "key", value);
+      cm_enc_sign_json_object (self, child, user_id, device_id);
+
+      label = g_strconcat ("signed_curve25519:", item->data, NULL);
+      json_object_set_object_member (keys, label, child);
+    }
+
+  root = json_object_new ();
+  json_object_set_object_member (root, "one_time_keys", keys);
+
+  return cm_utils_json_object_to_string (root, FALSE);
+}
+
+/* The ids are copied, as they may change while the keys are created */
+typedef struct
+{
+  char   *user_id;
+  char   *device_id;
+  size_t  count;
+} OneTimeKeysData;
+
+static void
+one_time_keys_data_free (gpointer data)
+{
+  OneTimeKeysData *keys_data = data;
+
+  g_free (keys_data->user_id);
+  g_free (keys_data->device_id);
+  g_free (keys_data);
+}
+
+static void
+enc_create_one_time_keys_thread (GTask        *task,
+                                 gpointer      source_object,
+                                 gpointer      task_data,
+                                 GCancellable *cancellable)
+{
+  CmEnc *self = source_object;
+  OneTimeKeysData *keys_data = task_data;
+
+  g_assert (CM_IS_ENC (self));
+
+  if (!g_task_return_error_if_cancelled (task))
+    {
+      if (keys_data->count)
+        cm_enc_create_one_time_keys (self, keys_data->count);
+      g_task_return_pointer (task,
+                             enc_get_one_time_keys_json (self, keys_data->user_id,
+                                                         keys_data->device_id),
+                             g_free);
+    }
+}
+
+/**
+ * cm_enc_create_one_time_keys_async:
+ * @self: A #CmEnc
+ * @count: The number of keys to create, may be 0
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: A #GAsyncReadyCallback
+ * @user_data: The data for @callback
+ *
+ * Same as cm_enc_create_one_time_keys(), but the keys are
+ * generated and signed in a worker thread so that the caller
+ * is not blocked on gathering random bytes.  The signed JSON
+ * of all unpublished keys is returned on finish, see
+ * cm_enc_get_one_time_keys_json().
+ *
+ * If @count is 0, only the JSON of the existing unpublished
+ * keys is created.
+ */
+void
+cm_enc_create_one_time_keys_async (CmEnc               *self,
+                                   size_t               count,
+                                   GCancellable        *cancellable,
+                                   GAsyncReadyCallback  callback,
+                                   gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  OneTimeKeysData *keys_data;
+
+  g_return_if_fail (CM_IS_ENC (self));
+  g_return_if_fail (self->user_id && self->device_id);
+
+  keys_data = g_new0 (OneTimeKeysData, 1);
+  keys_data->user_id = g_strdup (self->user_id);
+  keys_data->device_id = g_strdup (self->device_id);
+  keys_data->count = count;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, cm_enc_create_one_time_keys_async);
+  g_task_set_task_data (task, keys_data, one_time_keys_data_free);
+  g_task_run_in_thread (task, enc_create_one_time_keys_thread);
+}
+
+/**
+ * cm_enc_create_one_time_keys_finish:
+ * @self: A #CmEnc
+ * @result: A #GAsyncResult
+ * @error: (nullable): A #GError
+ *
+ * Finish call to cm_enc_create_one_time_keys_async().
+ *
+ * Returns: (nullable) (transfer full): The signed one-time
+ * keys JSON or %NULL if there are no unpublished keys or
+ * on error.  Free with g_free()
+ */
+char *
+cm_enc_create_one_time_keys_finish (CmEnc         *self,
+                                    GAsyncResult  *result,
+                                    GError       **error)
+{
+  g_return_val_if_fail (CM_IS_ENC (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 /**
  * cm_enc_publish_one_time_keys:
  * @self: A #CmEnc
@@ -648,7 +968,10 @@ cm_enc_publish_one_time_keys (CmEnc *self)
 {
   g_return_if_fail (CM_IS_ENC (self));
 
+  g_mutex_lock (&self->account_lock);
   olm_account_mark_keys_as_published (self->account);
+  g_mutex_unlock (&self->account_lock);
+  g_atomic_int_inc (&self->account_generation);
 }
 
 /**
@@ -677,18 +1000,23 @@ cm_enc_get_one_time_keys (CmEnc *self)
   g_autoptr(JsonParser) parser = NULL;
   g_autoptr(GError) error = NULL;
   g_autofree char *buffer = NULL;
+  g_autofree char *error_str = NULL;
   size_t length, err;
 
   g_return_val_if_fail (CM_IS_ENC (self), NULL);
 
+  g_mutex_lock (&self->account_lock);
   length = olm_account_one_time_keys_length (self->account);
   buffer = g_malloc (length + 1);
   err = olm_account_one_time_keys (self->account, buffer, length);
   buffer[length] = '\0';
+  if (err == olm_error ())
+    error_str = g_strdup (olm_account_last_error (self->account));
+  g_mutex_unlock (&self->account_lock);
 
   if (err == olm_error ())
     {
-      g_warning ("Error getting one time keys: %s", olm_account_last_error (self->account));
+      g_warning ("Error getting one time keys: %s", error_str);
 
       return NULL;
     }
@@ -741,40 +1069,10 @@ cm_enc_get_one_time_keys (CmEnc *self)
 char *
 cm_enc_get_one_time_keys_json (CmEnc *self)
 {
-  g_autoptr(JsonObject) object = NULL;
-  g_autoptr(JsonObject) root = NULL;
-  g_autoptr(GList) members = NULL;
-  JsonObject *keys, *child, *obj;
-
   g_return_val_if_fail (CM_IS_ENC (self), NULL);
+  g_return_val_if_fail (self->user_id && self->device_id, NULL);
 
-  object = cm_enc_get_one_time_keys (self);
-
-  if (!object)
-    return NULL;
-
-  keys = json_object_new ();
-  obj = json_object_get_object_member (object, "curve25519");
-  members = json_object_get_members (obj);
-
-  for (GList *item = members; item; item = item->next)
-    {
-      g_autofree char *label = NULL;
-      const char *value;
-
-      child = json_object_new ();
-      value = json_object_get_string_member (obj, item->data);
-      json_object_set_string_member (child, "key", value);
-      cm_enc_sign_json_object (self, child);
-
-      label = g_strconcat ("signed_curve25519:", item->data, NULL);
-      json_object_set_object_member (keys, label, child);
-    }
-
-  root = json_object_new ();
-  json_object_set_object_member (root, "one_time_keys", keys);
-
-  return cm_utils_json_object_to_string (root, FALSE);
+  return enc_get_one_time_keys_json (self, self->user_id, self->device_id);
 }
 
 /**
@@ -837,7 +1135,7 @@ cm_enc_get_device_keys_json (CmEnc *self)
   g_free (label);
 
   json_object_set_object_member (device_keys, "keys", keys);
-  cm_enc_sign_json_object (self, device_keys);
+  cm_enc_sign_json_object (self, device_keys, self->user_id, self->device_id);
 
   root = json_object_new ();
   json_object_set_object_member (root, "device_keys", device_keys);
@@ -953,8 +1251,13 @@ cm_enc_handle_room_encrypted (CmEnc      *self,
 
       if (!session)
         {
+          g_mutex_lock (&self->account_lock);
           session = cm_olm_inbound_new (self->account, sender_key, body);
+          g_mutex_unlock (&self->account_lock);
           g_debug ("(%p) New inbound session created %p", self, session);
+          /* The one-time key used is removed from the account */
+          if (session)
+            g_atomic_int_inc (&self->account_generation);
           cm_olm_set_db (session, self->cm_db);
           cm_olm_set_key (session, self->pickle_key);
 
@@ -965,10 +1268,26 @@ cm_enc_handle_room_encrypted (CmEnc      *self,
   g_debug ("(%p) Handle decrypted, session: %p", self, session);
 
   if (!session)
-    return;
+    {
+      cm_stats_add_count (cm_stats_get_default (), "enc/olm-no-session", 1);
+      return;
+    }
 
   if (!plaintext)
-    plaintext = cm_olm_decrypt (session, type, body);
+    {
+      gint64 trace_begin = CM_TRACE_BEGIN ();
+
+      plaintext = cm_olm_decrypt (session, type, body);
+      CM_TRACE_SPAN (trace_begin, "decrypt", "olm");
+    }
+
+  if (!plaintext)
+    {
+      cm_stats_add_count (cm_stats_get_default (), "enc/olm-failed", 1);
+      return;
+    }
+
+  cm_stats_add_count (cm_stats_get_default (), "enc/olm-decrypted", 1);
 
   {
     g_autoptr(JsonObject) content = NULL;
@@ -1097,6 +1416,7 @@ cm_enc_handle_join_room_encrypted (CmEnc      *self,
   const char *sender_key;
   const char *ciphertext, *session_id;
   g_autofree char *plaintext = NULL;
+  gint64 trace_begin;
 
   g_return_val_if_fail (CM_IS_ENC (self), NULL);
   g_return_val_if_fail (object, NULL);
@@ -1131,12 +1451,22 @@ cm_enc_handle_join_room_encrypted (CmEnc      *self,
 
   /* TODO bubble up invalid session error */
   if (!session)
-    return NULL;
+    {
+      cm_stats_add_count (cm_stats_get_default (), "enc/megolm-no-session", 1);
+      return NULL;
+    }
 
+  trace_begin = CM_TRACE_BEGIN ();
   plaintext = cm_olm_decrypt (session, 0, ciphertext);
+  CM_TRACE_SPAN (trace_begin, "decrypt", "megolm");
   /* TODO bubble up decryption error */
   if (!plaintext)
-    return NULL;
+    {
+      cm_stats_add_count (cm_stats_get_default (), "enc/megolm-failed", 1);
+      return NULL;
+    }
+
+  cm_stats_add_count (cm_stats_get_default (), "enc/megolm-decrypted", 1);
 
   if (strstr (plaintext, "\"key_ops\""))
     cm_enc_save_file_enc (self, plaintext);
@@ -1153,6 +1483,7 @@ cm_enc_encrypt_for_chat (CmEnc      *self,
   g_autofree char *encrypted = NULL;
   const char *session_id;
   JsonObject *root;
+  gint64 trace_begin;
 
   g_return_val_if_fail (CM_IS_ENC (self), NULL);
   g_return_val_if_fail (CM_IS_ROOM (room), NULL);
@@ -1161,7 +1492,9 @@ cm_enc_encrypt_for_chat (CmEnc      *self,
   session = ma_enc_lookup_out_group_session (self, room, NULL);
   g_return_val_if_fail (session, NULL);
 
+  trace_begin = CM_TRACE_BEGIN ();
   encrypted = cm_olm_encrypt (session, message);
+  CM_TRACE_SPAN (trace_begin, "encrypt", "megolm");
   g_debug ("(%p) Enrypt for room %p, session: %p, chain-index: %zu",
            self, room, session,
            cm_olm_get_message_index (session));
@@ -1191,6 +1524,7 @@ cm_enc_create_out_group_keys (CmEnc      *self,
   CmOlm *session = NULL;
   const char *session_key, *session_id;
   JsonObject *root, *child;
+  gint64 trace_begin;
 
   g_return_val_if_fail (CM_IS_ENC (self), FALSE);
   g_return_val_if_fail (CM_IS_ROOM (room), FALSE);
@@ -1220,6 +1554,7 @@ cm_enc_create_out_group_keys (CmEnc      *self,
   session_key = cm_olm_get_session_key (session);
   *out_session = session;
 
+  trace_begin = CM_TRACE_BEGIN ();
   root = json_object_new ();
 
   /* https://matrix.org/docs/spec/client_server/r0.6.1#m-room-key */
@@ -1312,6 +1647,8 @@ cm_enc_create_out_group_keys (CmEnc      *self,
         }
     }
 
+  CM_TRACE_SPAN (trace_begin, "encrypt", "room keys for %u users", one_time_keys->len);
+
   return root;
 }
 
@@ -101,6 +101,20 @@ typedef enum {
   CM_CONTENT_TYPE_SERVER_NOTICE,
 } CmContentType;
 
+/**
+ * CmThumbnailMethod:
+ * @CM_THUMBNAIL_METHOD_SCALE: Scale to fit within the size, keeping the aspect ratio
+ * @CM_THUMBNAIL_METHOD_CROP: Crop to fill the exact size
+ *
+ * How the server should generate a thumbnail.
+ *
+ * Since: 0.0.4
+ */
+typedef enum {
+  CM_THUMBNAIL_METHOD_SCALE,
+  CM_THUMBNAIL_METHOD_CROP,
+} CmThumbnailMethod;
+
 /**
  * CmEventType:
  * @CM_M_UNKNOWN: The event type is unknown
@@ -200,3 +214,24 @@ typedef enum
   CM_EVENT_STATE_SENT,
   CM_EVENT_STATE_RECEIVED,
 } CmEventState;
+
+/**
+ * CmRoomChangeFlags:
+ * @CM_ROOM_CHANGE_NONE: Nothing changed
+ * @CM_ROOM_CHANGE_EVENTS: New timeline events were received
+ * @CM_ROOM_CHANGE_STATE: Room state changed
+ * @CM_ROOM_CHANGE_UNREAD: Unread notification count changed
+ * @CM_ROOM_CHANGE_STATUS: Room membership status changed
+ *
+ * The changes of a room in a sync response.
+ *
+ * Since: 0.0.4
+ */
+typedef enum
+{
+  CM_ROOM_CHANGE_NONE   = 0,
+  CM_ROOM_CHANGE_EVENTS = 1 << 0,
+  CM_ROOM_CHANGE_STATE  = 1 << 1,
+  CM_ROOM_CHANGE_UNREAD = 1 << 2,
+  CM_ROOM_CHANGE_STATUS = 1 << 3,
+} CmRoomChangeFlags;
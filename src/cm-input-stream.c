@@ -26,20 +26,43 @@ struct _CmInputStream
 
   char              *aes_key_base64;
   char              *aes_iv_base64;
+  /* The initial counter block, used to seek */
+  guchar             aes_iv[16];
 
   /* For files that will be used to upload */
   GFile             *file;
   GFileInfo         *file_info;
   GChecksum         *checksum;
   gboolean           checksum_complete;
+  /* Set when reading starts at some offset */
+  gboolean           no_checksum;
   gboolean           encrypt;
 
-  char              *buffer;
-  int                buffer_len;
+  /* Large chunks are hashed in a separate thread,
+   * so that hashing overlaps with decryption and I/O */
+  GThread           *hash_thread;
+  GAsyncQueue       *hash_queue;
+  GAsyncQueue       *free_chunks;
+  guint              n_chunks;
 
   gcry_error_t       gcr_error;
 };
 
+typedef struct {
+  guchar *data;
+  gsize   len;
+  gsize   alloc_len;
+} HashChunk;
+
+#define DATA_BLOCK_SIZE   (256 * 1024)
+/* Reads smaller than this are hashed inline, as long as no thread is running */
+#define HASH_THREAD_MIN   (16 * 1024)
+/* Chunks in flight, limits the memory used when hashing is slower than reading */
+#define MAX_HASH_CHUNKS   4
+
+/* Pushed to the hash queue to stop the thread */
+static HashChunk hash_end;
+
 G_DEFINE_TYPE (CmInputStream, cm_input_stream, G_TYPE_FILTER_INPUT_STREAM)
 
 static char *
@@ -92,6 +115,95 @@ parse_base64_value (const char  *unpadded_base64,
   *out = g_base64_decode (base64, out_len);
 }
 
+static gpointer
+input_stream_hash_thread (gpointer user_data)
+{
+  CmInputStream *self = user_data;
+  HashChunk *chunk;
+
+  while ((chunk = g_async_queue_pop (self->hash_queue)) != &hash_end)
+    {
+      g_checksum_update (self->checksum, chunk->data, chunk->len);
+      g_async_queue_push (self->free_chunks, chunk);
+    }
+
+  return NULL;
+}
+
+static void
+hash_chunk_free (gpointer data)
+{
+  HashChunk *chunk = data;
+
+  g_free (chunk->data);
+  g_free (chunk);
+}
+
+/* Wait for the queued chunks to be hashed and stop the thread */
+static void
+input_stream_hash_finish (CmInputStream *self)
+{
+  if (!self->hash_thread)
+    return;
+
+  g_async_queue_push (self->hash_queue, &hash_end);
+  g_thread_join (self->hash_thread);
+  self->hash_thread = NULL;
+}
+
+static void
+input_stream_hash (CmInputStream *self,
+                   const guchar  *data,
+                   gsize          len)
+{
+  HashChunk *chunk;
+
+  if (!self->hash_thread && len < HASH_THREAD_MIN)
+    {
+      g_checksum_update (self->checksum, data, len);
+      return;
+    }
+
+  if (!self->hash_thread)
+    {
+      if (!self->hash_queue)
+        {
+          self->hash_queue = g_async_queue_new ();
+          self->free_chunks = g_async_queue_new_full (hash_chunk_free);
+        }
+
+      self->hash_thread = g_thread_new ("cm-input-stream-hash",
+                                        input_stream_hash_thread, self);
+    }
+
+  /* Reuse the chunks already hashed, and block if there are
+   * too many pending as hashing is slower than reading */
+  chunk = g_async_queue_try_pop (self->free_chunks);
+
+  if (!chunk && self->n_chunks < MAX_HASH_CHUNKS)
+    {
+      chunk = g_new0 (HashChunk, 1);
+      self->n_chunks++;
+    }
+  else if (!chunk)
+    {
+      chunk = g_async_queue_pop (self->free_chunks);
+    }
+
+  if (chunk->alloc_len < len)
+    {
+      chunk->alloc_len = MAX (len, DATA_BLOCK_SIZE);
+      g_free (chunk->data);
+      chunk->data = g_malloc (chunk->alloc_len);
+    }
+
+  /* The caller owns the buffer, so we need a copy for the thread.
+   * It's still way cheaper than the sha256 which happens in parallel */
+  memcpy (chunk->data, data, len);
+  chunk->len = len;
+  g_async_queue_push (self->hash_queue, chunk);
+}
+
 static gssize
 cm_input_stream_read_fn (GInputStream  *stream,
                          void          *buffer,
@@ -108,44 +220,35 @@ cm_input_stream_read_fn (GInputStream  *stream,
   n_read = G_INPUT_STREAM_CLASS (cm_input_stream_parent_class)->read_fn (stream, buffer, count,
                                                                          cancellable, error);
 
-  if (self->cipher_hd && n_read > 0)
-    {
-      /* We need sha256 checksums only for encrypted/to be encrypted files */
-      if (!self->checksum)
-        self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
-
-      if (G_UNLIKELY (self->buffer_len < n_read))
-        {
-          self->buffer_len = MAX (n_read, 1024 * 8);
-          self->buffer = g_realloc (self->buffer, self->buffer_len);
-        }
-    }
+  /* We need sha256 checksums only for encrypted/to be encrypted files */
+  if (self->cipher_hd && n_read > 0 && !self->checksum && !self->no_checksum)
+    self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
 
-  /* Since it's CTR mode, the encrypted and decrypted always have the same size */
+  /* Since it's CTR mode, the encrypted and decrypted always have the
+   * same size, so the content is transformed in place */
   if (self->cipher_hd && n_read > 0)
     {
       if (self->encrypt)
         {
-          self->gcr_error = gcry_cipher_encrypt (self->cipher_hd, self->buffer,
-                                                 n_read, buffer, n_read);
+          self->gcr_error = gcry_cipher_encrypt (self->cipher_hd, buffer, n_read, NULL, 0);
           /* we are encrypting, calculate the checksum after encryption */
-          if (!self->gcr_error)
-            g_checksum_update (self->checksum, (gpointer)self->buffer, n_read);
+          if (!self->gcr_error && self->checksum)
+            input_stream_hash (self, buffer, n_read);
         }
       else
         {
           /* we are decrypting, calculate the checksum before decryption */
-          g_checksum_update (self->checksum, buffer, n_read);
-          self->gcr_error = gcry_cipher_decrypt (self->cipher_hd, self->buffer,
-                                                 n_read, buffer, n_read);
+          if (self->checksum)
+            input_stream_hash (self, buffer, n_read);
+          self->gcr_error = gcry_cipher_decrypt (self->cipher_hd, buffer, n_read, NULL, 0);
         }
-
-      if (!self->gcr_error)
-        memcpy (buffer, self->buffer, n_read);
     }
 
   if (!self->gcr_error && self->cipher_hd && n_read == 0)
-    self->checksum_complete = TRUE;
+    {
+      input_stream_hash_finish (self);
+      self->checksum_complete = TRUE;
+    }
 
  end:
   if (self->gcr_error)
@@ -163,10 +266,14 @@ cm_input_stream_finalize (GObject *object)
 {
   CmInputStream *self = (CmInputStream *)object;
 
+  input_stream_hash_finish (self);
+  g_clear_pointer (&self->hash_queue, g_async_queue_unref);
+  g_clear_pointer (&self->free_chunks, g_async_queue_unref);
+
   g_clear_pointer (&self->cipher_hd, gcry_cipher_close);
   g_clear_pointer (&self->checksum, g_checksum_free);
 
-  g_clear_pointer (&self->buffer, g_free);
+  cm_utils_clear ((char *)self->aes_iv, sizeof (self->aes_iv));
   g_clear_pointer (&self->aes_iv_base64, g_free);
   g_clear_pointer (&self->aes_key_base64, g_free);
 
@@ -283,6 +390,8 @@ cm_input_stream_set_file_enc (CmInputStream *self,
       /* uses unpadded base64 */
       parse_base64_value (iv_base64, &iv, &len);
       self->gcr_error = gcry_cipher_setctr (cipher_hd, iv, len);
+      if (len == sizeof (self->aes_iv))
+        memcpy (self->aes_iv, iv, len);
 
       cm_utils_clear ((char *)iv, len);
       cm_utils_clear (iv_base64, -1);
@@ -327,6 +436,134 @@ cm_input_stream_set_encrypt (CmInputStream *self)
     }
 }
 
+/**
+ * cm_input_stream_set_offset:
+ * @self: A #CmInputStream
+ * @offset: The offset in bytes
+ *
+ * Set the offset of the data in the base stream from the
+ * start of the file, eg: when the base stream is the
+ * response to an HTTP Range request.  The AES-CTR counter
+ * is moved to the block containing @offset so that the
+ * content is decrypted correctly.
+ *
+ * As the content before @offset is never seen, sha256
+ * of the content shall not be available.  See
+ * cm_input_stream_resume_with_prefix() if required.
+ *
+ * This should be called before reading any data.
+ */
+void
+cm_input_stream_set_offset (CmInputStream *self,
+                            goffset        offset)
+{
+  guchar ctr[16], *skip;
+  guint64 blocks;
+  guint carry;
+  gsize remain;
+
+  g_return_if_fail (CM_IS_INPUT_STREAM (self));
+  g_return_if_fail (offset >= 0);
+  g_return_if_fail (!self->checksum);
+
+  if (!self->cipher_hd || self->gcr_error || offset == 0)
+    return;
+
+  g_return_if_fail (!self->encrypt);
+
+  /* The counter is a 128 bit big endian integer, with each block of 16 bytes
+   * incrementing it by one, which is also what libgcrypt does */
+  memcpy (ctr, self->aes_iv, sizeof (ctr));
+  blocks = offset / 16;
+  carry = 0;
+
+  for (int i = 15; i >= 0; i--)
+    {
+      guint sum;
+
+      sum = ctr[i] + (guint)(blocks & 0xff) + carry;
+      ctr[i] = sum & 0xff;
+      carry = sum >> 8;
+      blocks >>= 8;
+    }
+
+  self->gcr_error = gcry_cipher_setctr (self->cipher_hd, ctr, sizeof (ctr));
+
+  /* Discard the key stream for the bytes before offset in the same block */
+  remain = offset % 16;
+  if (!self->gcr_error && remain)
+    {
+      skip = g_alloca (remain);
+      memset (skip, 0, remain);
+      self->gcr_error = gcry_cipher_decrypt (self->cipher_hd, skip, remain, NULL, 0);
+    }
+
+  /* Don't calculate checksum, as it would be wrong */
+  self->checksum_complete = FALSE;
+  self->no_checksum = TRUE;
+}
+
+/**
+ * cm_input_stream_resume_with_prefix:
+ * @self: A #CmInputStream
+ * @prefix: The decrypted content before the current offset
+ * @cancellable: (nullable): A #GCancellable
+ * @error: A #GError
+ *
+ * Same as cm_input_stream_set_offset(), but the already
+ * decrypted content before the offset is read from @prefix
+ * so that the sha256 of the encrypted content can be
+ * continued.  As CTR mode is symmetric, the content is
+ * encrypted again to get the original data.
+ *
+ * This does blocking I/O on @prefix.
+ *
+ * Returns: The number of bytes read from @prefix, or -1 on error.
+ */
+goffset
+cm_input_stream_resume_with_prefix (CmInputStream  *self,
+                                    GInputStream   *prefix,
+                                    GCancellable   *cancellable,
+                                    GError        **error)
+{
+  g_autofree guchar *buffer = NULL;
+  goffset offset = 0;
+  gssize n_read;
+
+  g_return_val_if_fail (CM_IS_INPUT_STREAM (self), -1);
+  g_return_val_if_fail (G_IS_INPUT_STREAM (prefix), -1);
+  g_return_val_if_fail (!self->checksum, -1);
+
+  if (self->cipher_hd)
+    self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  buffer = g_malloc (DATA_BLOCK_SIZE);
+
+  while ((n_read = g_input_stream_read (prefix, buffer, DATA_BLOCK_SIZE,
+                                        cancellable, error)) > 0)
+    {
+      offset += n_read;
+
+      if (!self->cipher_hd)
+        continue;
+
+      self->gcr_error = gcry_cipher_encrypt (self->cipher_hd, buffer, n_read, NULL, 0);
+      if (self->gcr_error)
+        break;
+
+      g_checksum_update (self->checksum, buffer, n_read);
+    }
+
+  if (self->gcr_error)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed encrypting buffer: %s", gcry_strerror (self->gcr_error));
+
+  if (n_read < 0 || self->gcr_error)
+    return -1;
+
+  return offset;
+}
+
 char *
 cm_input_stream_get_sha256 (CmInputStream *self)
 {
@@ -335,7 +572,7 @@ cm_input_stream_get_sha256 (CmInputStream *self)
 
   g_return_val_if_fail (CM_IS_INPUT_STREAM (self), NULL);
 
-  if (!self->checksum || !self->checksum_complete)
+  if (!self->checksum || !self->checksum_complete || self->no_checksum)
     return NULL;
 
   digest_len = g_checksum_type_get_length (G_CHECKSUM_SHA256);
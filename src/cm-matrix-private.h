@@ -9,6 +9,9 @@
 #include <gio/gio.h>
 #include "cm-matrix.h"
 #include "cm-db-private.h"
+#include "cm-media-cache-private.h"
+#include "cm-net-pool-private.h"
+#include "cm-sync-scheduler-private.h"
 
 #if !defined(_CMATRIX_TAKEN) && !defined(CMATRIX_COMPILATION)
 # error "Only <cmatrix.h> can be included directly."
@@ -18,6 +21,9 @@ G_BEGIN_DECLS
 
 const char  *cm_matrix_get_data_dir   (void);
 const char  *cm_matrix_get_app_id     (void);
+CmMediaCache *cm_matrix_get_media_cache (void);
+CmNetPool   *cm_matrix_get_net_pool   (void);
+CmSyncScheduler *cm_matrix_get_sync_scheduler (void);
 
 /* To be used only for tests */
 CmDb *cm_matrix_get_db (CmMatrix *self);
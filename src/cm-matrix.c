@@ -18,8 +18,10 @@
 #include <sys/stat.h>
 
 #include "cm-db-private.h"
+#include "cm-media-cache-private.h"
 #include "cm-utils-private.h"
 #include "cm-secret-store-private.h"
+#include "cm-stats-private.h"
 #include "cm-client.h"
 #include "cm-client-private.h"
 #include "cm-matrix.h"
@@ -46,6 +48,10 @@ struct _CmMatrix
   char *cache_dir;
 
   CmDb *cm_db;
+  CmMediaCache *media_cache;
+  goffset       media_cache_size;
+  CmNetPool    *net_pool;
+  CmSyncScheduler *sync_scheduler;
 
   GListStore *clients_list;
   GHashTable *clients_to_save;
@@ -69,6 +75,9 @@ typedef struct
 #define RECONNECT_TIMEOUT    500 /* milliseconds */
 
 static char *cmatrix_data_dir, *cmatrix_app_id;
+static CmMediaCache *cmatrix_media_cache;
+static CmNetPool *cmatrix_net_pool;
+static CmSyncScheduler *cmatrix_sync_scheduler;
 
 G_DEFINE_TYPE (CmMatrix, cm_matrix, G_TYPE_OBJECT)
 
@@ -150,9 +159,11 @@ matrix_reconnect (gpointer user_data)
 
     client = g_list_model_get_item (model, i);
 
+    /* Spread over a few seconds, so that accounts on the
+     * same server don't hit it all at once */
     if (cm_client_can_connect (client) &&
         cm_client_get_enabled (client))
-      cm_client_start_sync (client);
+      cm_client_reconnect (client);
     else
       cm_client_stop_sync (client);
   }
@@ -226,6 +237,19 @@ cm_matrix_finalize (GObject *object)
   g_clear_object (&self->clients_list);
   g_hash_table_unref (self->clients_to_save);
 
+  if (cmatrix_media_cache == self->media_cache)
+    cmatrix_media_cache = NULL;
+  g_clear_object (&self->media_cache);
+
+  /* Clients still alive keep a reference of their own */
+  if (cmatrix_net_pool == self->net_pool)
+    cmatrix_net_pool = NULL;
+  g_clear_object (&self->net_pool);
+
+  if (cmatrix_sync_scheduler == self->sync_scheduler)
+    cmatrix_sync_scheduler = NULL;
+  g_clear_object (&self->sync_scheduler);
+
   g_free (self->db_path);
   g_free (self->db_name);
 
@@ -268,6 +292,17 @@ cm_matrix_init (CmMatrix *self)
   self->clients_list = g_list_store_new (CM_TYPE_CLIENT);
   self->clients_to_save = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                  g_free, g_object_unref);
+  /* Unset, use the default of CmMediaCache */
+  self->media_cache_size = -1;
+
+  /* The pool of the first CmMatrix is shared by all clients */
+  self->net_pool = cm_net_pool_new ();
+  if (!cmatrix_net_pool)
+    cmatrix_net_pool = self->net_pool;
+
+  self->sync_scheduler = cm_sync_scheduler_new ();
+  if (!cmatrix_sync_scheduler)
+    cmatrix_sync_scheduler = self->sync_scheduler;
 
   g_signal_connect_object (g_network_monitor_get_default (),
                            "network-changed",
@@ -408,40 +443,100 @@ load_accounts_from_secrets (CmMatrix  *self,
     }
 }
 
+/* The secrets and the db are loaded at once, the
+ * accounts are loaded once both are done */
+typedef struct
+{
+  GPtrArray *accounts;
+  GError    *error;
+  gint64     start_time;
+  guint      n_pending;
+} MatrixOpenData;
+
+static void
+matrix_open_data_free (gpointer data)
+{
+  MatrixOpenData *open_data = data;
+
+  g_clear_pointer (&open_data->accounts, g_ptr_array_unref);
+  g_clear_error (&open_data->error);
+  g_free (open_data);
+}
+
+static void
+matrix_open_done (GTask *task)
+{
+  MatrixOpenData *open_data;
+  CmMatrix *self;
+
+  g_assert (G_IS_TASK (task));
+
+  self = g_task_get_source_object (task);
+  open_data = g_task_get_task_data (task);
+  g_assert (CM_IS_MATRIX (self));
+  g_assert (open_data->n_pending > 0);
+
+  if (--open_data->n_pending)
+    return;
+
+  self->is_opening = FALSE;
+  cm_stats_add_time (cm_stats_get_default (), "startup/open",
+                     g_get_monotonic_time () - open_data->start_time);
+
+  if (open_data->error)
+    {
+      g_task_return_error (task, g_steal_pointer (&open_data->error));
+      return;
+    }
+
+  load_accounts_from_secrets (self, open_data->accounts);
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_READY]);
+  g_task_return_boolean (task, self->db_loaded && self->secrets_loaded);
+}
+
 static void
 db_open_cb (GObject      *obj,
             GAsyncResult *result,
             gpointer      user_data)
 {
   g_autoptr(GTask) task = user_data;
+  MatrixOpenData *open_data;
   GError *error = NULL;
   CmMatrix *self;
 
   g_assert (G_IS_TASK (task));
 
   self = g_task_get_source_object (task);
+  open_data = g_task_get_task_data (task);
   g_assert (CM_IS_MATRIX (self));
 
   self->db_loaded = cm_db_open_finish (self->cm_db, result, &error);
-  self->is_opening = FALSE;
   g_debug ("(%p) Open DB %s", self, CM_LOG_SUCCESS (self->db_loaded));
+  cm_stats_add_time (cm_stats_get_default (), "startup/db-open",
+                     g_get_monotonic_time () - open_data->start_time);
 
   if (!self->db_loaded)
     {
       g_clear_object (&self->cm_db);
       g_warning ("(%p) Open DB error: %s", self, error ? error->message : "");
-      g_task_return_error (task, error);
-      return;
+      if (!error)
+        error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open DB");
+
+      if (open_data->error)
+        g_clear_error (&error);
+      else
+        open_data->error = error;
     }
   else
     {
-      GPtrArray *accounts;
-
-      accounts = g_task_get_task_data (task);
-      load_accounts_from_secrets (self, accounts);
-      g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_READY]);
-      g_task_return_boolean (task,  self->db_loaded && self->secrets_loaded);
+      g_clear_object (&self->media_cache);
+      self->media_cache = cm_media_cache_new (self->cm_db);
+      if (self->media_cache_size >= 0)
+        cm_media_cache_set_max_size (self->media_cache, self->media_cache_size);
+      cmatrix_media_cache = self->media_cache;
     }
+
+  matrix_open_done (task);
 }
 
 static void
@@ -451,48 +546,34 @@ matrix_store_load_cb (GObject      *object,
 {
   CmMatrix *self;
   g_autoptr(GTask) task = user_data;
-  g_autoptr(GPtrArray) accounts = NULL;
+  MatrixOpenData *open_data;
   GError *error = NULL;
 
   g_assert (G_IS_TASK (task));
 
   self = g_task_get_source_object (task);
+  open_data = g_task_get_task_data (task);
   g_assert (CM_IS_MATRIX (self));
 
-  accounts = cm_secret_store_load_finish (self->secret_store, result, &error);
-  self->is_opening = FALSE;
+  open_data->accounts = cm_secret_store_load_finish (self->secret_store, result, &error);
   if (!error)
     self->secrets_loaded = TRUE;
 
   g_debug ("(%p) Load secrets %s", self, CM_LOG_SUCCESS (!error));
+  cm_stats_add_time (cm_stats_get_default (), "startup/secrets",
+                     g_get_monotonic_time () - open_data->start_time);
 
   if (error)
     {
       g_warning ("(%p) Load secrets error: %s", self, error->message);
-      g_task_return_error (task, error);
-      return;
-    }
 
-  if (self->db_loaded)
-    {
-      load_accounts_from_secrets (self, accounts);
-      g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_READY]);
-      g_task_return_boolean (task, TRUE);
+      if (open_data->error)
+        g_clear_error (&error);
+      else
+        open_data->error = error;
     }
-  else
-    {
-      self->is_opening = TRUE;
-      if (accounts)
-        g_task_set_task_data (task, g_steal_pointer (&accounts),
-                              (GDestroyNotify)g_ptr_array_unref);
 
-      self->cm_db = cm_db_new ();
-
-      g_debug ("(%p) Open DB", self);
-      cm_db_open_async (self->cm_db,
-                        g_strdup (self->db_path), self->db_name,
-                        db_open_cb, g_steal_pointer (&task));
-    }
+  matrix_open_done (task);
 }
 
 /**
@@ -516,6 +597,7 @@ cm_matrix_open_async (CmMatrix            *self,
                       gpointer             user_data)
 {
   g_autoptr(GTask) task = NULL;
+  MatrixOpenData *open_data;
 
   g_return_if_fail (CM_IS_MATRIX (self));
   g_return_if_fail (db_path && *db_path);
@@ -552,25 +634,32 @@ cm_matrix_open_async (CmMatrix            *self,
   if (g_test_initialized ())
     self->secrets_loaded = TRUE;
 
+  g_assert (!self->secrets_loaded || !self->db_loaded);
+
+  open_data = g_new0 (MatrixOpenData, 1);
+  open_data->start_time = g_get_monotonic_time ();
+  open_data->n_pending = !self->secrets_loaded + !self->db_loaded;
+  g_task_set_task_data (task, open_data, matrix_open_data_free);
+
+  /* Independent of each other, load them at once */
   if (!self->secrets_loaded)
     {
       g_debug ("(%p) Load secrets", self);
       cm_secret_store_load_async (self->secret_store,
                                   cancellable,
                                   matrix_store_load_cb,
-                                  g_steal_pointer (&task));
+                                  g_object_ref (task));
     }
-  else if (!self->db_loaded)
+
+  if (!self->db_loaded)
     {
       self->cm_db = cm_db_new ();
 
       g_debug ("(%p) Open DB", self);
       cm_db_open_async (self->cm_db, g_strdup (db_path), db_name,
                         db_open_cb,
-                        g_steal_pointer (&task));
+                        g_object_ref (task));
     }
-  else
-    g_assert_not_reached ();
 }
 
 gboolean
@@ -933,6 +1022,67 @@ cm_matrix_get_app_id (void)
   return cmatrix_app_id;
 }
 
+CmMediaCache *
+cm_matrix_get_media_cache (void)
+{
+  return cmatrix_media_cache;
+}
+
+CmNetPool *
+cm_matrix_get_net_pool (void)
+{
+  return cmatrix_net_pool;
+}
+
+CmSyncScheduler *
+cm_matrix_get_sync_scheduler (void)
+{
+  return cmatrix_sync_scheduler;
+}
+
+/**
+ * cm_matrix_set_media_cache_size:
+ * @self: A #CmMatrix
+ * @max_size: The size in bytes, or 0 for no limit
+ *
+ * Set the maximum total size of downloaded files (avatars,
+ * attachments, etc.) to be kept on disk.  The least recently
+ * used files are removed when the limit is exceeded.
+ *
+ * Since: 0.0.4
+ */
+void
+cm_matrix_set_media_cache_size (CmMatrix *self,
+                                goffset   max_size)
+{
+  g_return_if_fail (CM_IS_MATRIX (self));
+  g_return_if_fail (max_size >= 0);
+
+  self->media_cache_size = max_size;
+
+  if (self->media_cache)
+    cm_media_cache_set_max_size (self->media_cache, max_size);
+}
+
+/**
+ * cm_matrix_get_stats:
+ * @self: A #CmMatrix
+ *
+ * Get the runtime statistics of libcmatrix, like
+ * request latencies and database times.  See #CmStats.
+ *
+ * Returns: (transfer none): A #CmStats
+ *
+ * Since: 0.0.4
+ */
+CmStats *
+cm_matrix_get_stats (CmMatrix *self)
+{
+  g_return_val_if_fail (CM_IS_MATRIX (self), NULL);
+
+  return cm_stats_get_default ();
+}
+
 static void
 matrix_save_client (GObject      *object,
                     GAsyncResult *result,
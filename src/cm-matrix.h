@@ -64,5 +64,8 @@ void        cm_matrix_add_clients_async    (CmMatrix            *self,
 gboolean    cm_matrix_add_clients_finish   (CmMatrix            *self,
                                             GAsyncResult        *result,
                                             GError             **error);
+void        cm_matrix_set_media_cache_size (CmMatrix            *self,
+                                            goffset              max_size);
+CmStats    *cm_matrix_get_stats            (CmMatrix            *self);
 
 G_END_DECLS
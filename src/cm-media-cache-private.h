@@ -0,0 +1,51 @@
+/* cm-media-cache-private.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "cm-enums.h"
+#include "cm-types.h"
+#include "cm-net-private.h"
+
+G_BEGIN_DECLS
+
+#define CM_TYPE_MEDIA_CACHE (cm_media_cache_get_type ())
+
+G_DECLARE_FINAL_TYPE (CmMediaCache, cm_media_cache, CM, MEDIA_CACHE, GObject)
+
+CmMediaCache  *cm_media_cache_new                  (CmDb                  *db);
+void           cm_media_cache_set_max_size         (CmMediaCache          *self,
+                                                    goffset                max_size);
+goffset        cm_media_cache_get_max_size         (CmMediaCache          *self);
+void           cm_media_cache_get_file_async       (CmMediaCache          *self,
+                                                    CmClient              *client,
+                                                    const char            *uri,
+                                                    char                  *file_path,
+                                                    CmTransferPriority     priority,
+                                                    GCancellable          *cancellable,
+                                                    GFileProgressCallback  progress_callback,
+                                                    gpointer               progress_user_data,
+                                                    GAsyncReadyCallback    callback,
+                                                    gpointer               user_data);
+void           cm_media_cache_get_thumbnail_async  (CmMediaCache          *self,
+                                                    CmClient              *client,
+                                                    const char            *uri,
+                                                    int                    width,
+                                                    int                    height,
+                                                    CmThumbnailMethod      method,
+                                                    char                  *file_path,
+                                                    CmTransferPriority     priority,
+                                                    GCancellable          *cancellable,
+                                                    GAsyncReadyCallback    callback,
+                                                    gpointer               user_data);
+GFile         *cm_media_cache_get_file_finish      (CmMediaCache          *self,
+                                                    GAsyncResult          *result,
+                                                    GError               **error);
+
+G_END_DECLS
@@ -0,0 +1,1025 @@
+/* cm-media-cache.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "cm-media-cache"
+
+#include "cm-config.h"
+
+#include <glib/gstdio.h>
+
+#include "cm-db-private.h"
+#include "cm-enc-private.h"
+#include "cm-net-private.h"
+#include "cm-client-private.h"
+#include "cm-input-stream-private.h"
+#include "cm-utils-private.h"
+#include "cm-media-cache-private.h"
+
+/* 512 MiB */
+#define DEFAULT_MAX_SIZE (512 * 1024 * 1024)
+#define MAX_RETRIES      3
+/* Larger than what g_output_stream_splice() uses, so that
+ * decrypting and hashing are done on bigger blocks */
+#define COPY_BLOCK_SIZE  (256 * 1024)
+
+/*
+ * CmMediaCache:
+ *
+ * Files downloaded from the server (avatars, attachments, etc.)
+ * are indexed in the database by their mxc uri so that they
+ * survive restarts and are shared among all clients.  The
+ * least recently used files are removed when the total size
+ * exceeds the budget.  Partial files kept to resume failed
+ * downloads are indexed too, so that they count towards the
+ * budget and are removed if never resumed.
+ *
+ * Concurrent requests for the same uri are coalesced into a
+ * single download, which is cancelled once every request
+ * waiting for it is cancelled.  A request that comes in while
+ * the download is being cancelled starts a new one.
+ */
+struct _CmMediaCache
+{
+  GObject     parent_instance;
+
+  CmDb       *cm_db;
+
+  /* mxc uri -> MediaFetch */
+  GHashTable *pending;
+  goffset     max_size;
+  guint       sweep_id;
+};
+
+typedef struct {
+  /* GTask waiting for the file */
+  GPtrArray    *waiters;
+  GCancellable *cancellable;
+  /* The fetch to start once this one, which is cancelled, is done */
+  GTask        *next_task;
+} MediaFetch;
+
+G_DEFINE_TYPE (CmMediaCache, cm_media_cache, G_TYPE_OBJECT)
+
+static void
+media_fetch_free (gpointer data)
+{
+  MediaFetch *fetch = data;
+
+  g_ptr_array_unref (fetch->waiters);
+  g_object_unref (fetch->cancellable);
+  g_clear_object (&fetch->next_task);
+  g_free (fetch);
+}
+
+static gboolean
+media_cache_sweep_cancelled (gpointer user_data)
+{
+  CmMediaCache *self = user_data;
+  GHashTableIter iter;
+  MediaFetch *fetch;
+  const char *uri;
+
+  g_assert (CM_IS_MEDIA_CACHE (self));
+
+  self->sweep_id = 0;
+
+  /* Cancel the downloads nobody is waiting for anymore */
+  g_hash_table_iter_init (&iter, self->pending);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&uri, (gpointer *)&fetch))
+    {
+      gboolean stale = TRUE;
+
+      if (g_cancellable_is_cancelled (fetch->cancellable))
+        continue;
+
+      for (guint i = 0; i < fetch->waiters->len && stale; i++)
+        stale = g_cancellable_is_cancelled (g_task_get_cancellable (fetch->waiters->pdata[i]));
+
+      if (stale)
+        {
+          g_debug ("(%p) Cancelling stale download of '%s'", self, uri);
+          g_cancellable_cancel (fetch->cancellable);
+        }
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+media_cache_waiter_cancelled_cb (GCancellable *cancellable,
+                                 CmMediaCache *self)
+{
+  /* May be run synchronously from g_cancellable_connect(), so defer */
+  if (!self->sweep_id)
+    self->sweep_id = g_idle_add (media_cache_sweep_cancelled, self);
+}
+
+static void
+media_cache_add_waiter (CmMediaCache *self,
+                        MediaFetch   *fetch,
+                        GTask        *task)
+{
+  GCancellable *cancellable;
+  gulong handler = 0;
+
+  cancellable = g_task_get_cancellable (task);
+  if (cancellable)
+    handler = g_cancellable_connect (cancellable,
+                                     G_CALLBACK (media_cache_waiter_cancelled_cb),
+                                     self, NULL);
+
+  g_object_set_data (G_OBJECT (task), "cancel-id", GSIZE_TO_POINTER (handler));
+  g_ptr_array_add (fetch->waiters, task);
+}
+
+static void media_cache_lookup_cb (GObject      *object,
+                                   GAsyncResult *result,
+                                   gpointer      user_data);
+
+static void
+media_cache_fetch_done_cb (GObject      *object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  CmMediaCache *self = (CmMediaCache *)object;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree char *key = NULL;
+  MediaFetch *fetch;
+  const char *uri;
+
+  g_assert (CM_IS_MEDIA_CACHE (self));
+  g_assert (G_IS_TASK (result));
+
+  file = g_task_propagate_pointer (G_TASK (result), &error);
+  fetch = g_object_get_data (G_OBJECT (result), "fetch");
+  uri = g_object_get_data (G_OBJECT (result), "uri");
+  g_assert (fetch);
+
+  /* Stale fetches are removed from pending once replaced */
+  if (g_hash_table_lookup (self->pending, uri) == fetch)
+    g_hash_table_steal_extended (self->pending, uri, (gpointer *)&key, NULL);
+
+  g_debug ("(%p) Fetching '%s' %s, waiters: %u", self, uri,
+           CM_LOG_SUCCESS (!error), fetch->waiters->len);
+
+  for (guint i = 0; i < fetch->waiters->len; i++)
+    {
+      GTask *task = fetch->waiters->pdata[i];
+      gulong handler;
+
+      handler = GPOINTER_TO_SIZE (g_object_get_data (G_OBJECT (task), "cancel-id"));
+      g_cancellable_disconnect (g_task_get_cancellable (task), handler);
+
+      if (error)
+        g_task_return_error (task, g_error_copy (error));
+      else
+        g_task_return_pointer (task, g_object_ref (file), g_object_unref);
+    }
+
+  /* Now that the part file is no longer written to, start over */
+  if (fetch->next_task)
+    {
+      GTask *next_task = g_steal_pointer (&fetch->next_task);
+
+      cm_db_lookup_media_async (self->cm_db,
+                                g_object_get_data (G_OBJECT (next_task), "uri"),
+                                media_cache_lookup_cb, next_task);
+    }
+
+  media_fetch_free (fetch);
+}
+
+static void media_cache_download (CmMediaCache *self,
+                                  GTask        *task);
+
+static goffset
+media_cache_get_part_size (GTask *task)
+{
+  GStatBuf st;
+
+  if (g_stat (g_object_get_data (G_OBJECT (task), "part-path"), &st) == 0)
+    return st.st_size;
+
+  return 0;
+}
+
+static void
+media_cache_add_part (CmMediaCache *self,
+                      GTask        *task)
+{
+  cm_db_add_media_part_async (self->cm_db,
+                              g_object_get_data (G_OBJECT (task), "uri"),
+                              g_object_get_data (G_OBJECT (task), "part-path"),
+                              media_cache_get_part_size (task),
+                              self->max_size, NULL, NULL);
+}
+
+/*
+ * Retry the download on network errors, but only if some progress was
+ * made in the last attempt, so that we don't retry on a dead network.
+ * Returns %TRUE if download was restarted.
+ */
+static gboolean
+media_cache_maybe_retry (CmMediaCache *self,
+                         GTask        *task,
+                         const GError *error)
+{
+  goffset *offset;
+  guint attempt;
+
+  g_assert (CM_IS_MEDIA_CACHE (self));
+  g_assert (G_IS_TASK (task));
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return FALSE;
+
+  attempt = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "attempt"));
+  offset = g_object_get_data (G_OBJECT (task), "offset");
+
+  if (attempt >= MAX_RETRIES || !offset ||
+      media_cache_get_part_size (task) <= *offset)
+    return FALSE;
+
+  g_debug ("(%p) Download of '%s' interrupted, resuming: %s", self,
+           (char *)g_object_get_data (G_OBJECT (task), "uri"), error->message);
+  g_object_set_data (G_OBJECT (task), "attempt", GUINT_TO_POINTER (attempt + 1));
+  media_cache_download (self, g_object_ref (task));
+
+  return TRUE;
+}
+
+static void
+media_cache_splice_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  CmMediaCache *self;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFile) part_file = NULL;
+  g_autofree char *sha256 = NULL;
+  CmEncFileInfo *file_info;
+  GInputStream *stream;
+  GError *error = NULL;
+  const char *file_path;
+  gint64 *content_length;
+  goffset *offset;
+  gssize size;
+
+  g_assert (G_IS_TASK (task));
+
+  self = g_task_get_source_object (task);
+  g_assert (CM_IS_MEDIA_CACHE (self));
+
+  size = g_task_propagate_int (G_TASK (result), &error);
+  stream = g_object_get_data (G_OBJECT (task), "stream");
+  file_info = g_object_get_data (G_OBJECT (task), "file-enc");
+  file_path = g_object_get_data (G_OBJECT (task), "path");
+  offset = g_object_get_data (G_OBJECT (task), "offset");
+  content_length = g_object_get_data (G_OBJECT (stream), "content-length");
+  part_file = g_file_new_for_path (g_object_get_data (G_OBJECT (task), "part-path"));
+
+  /* With content encoding, the length is of the encoded data.
+   * Less data means the connection was closed early, which can
+   * be resumed. */
+  if (!error && content_length && *content_length >= 0 &&
+      !g_object_get_data (G_OBJECT (stream), "content-encoding") &&
+      *content_length != size)
+    g_set_error (&error, G_IO_ERROR,
+                 size < *content_length ? G_IO_ERROR_PARTIAL_INPUT : G_IO_ERROR_INVALID_DATA,
+                 "Expected %" G_GINT64_FORMAT " bytes, got %" G_GSSIZE_FORMAT,
+                 *content_length, size);
+
+  if (error && media_cache_maybe_retry (self, task, error))
+    {
+      g_clear_error (&error);
+      return;
+    }
+
+  if (!error && file_info && file_info->sha256_base64)
+    {
+      sha256 = cm_input_stream_get_sha256 (CM_INPUT_STREAM (stream));
+
+      if (g_strcmp0 (sha256, file_info->sha256_base64) != 0)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "sha256 mismatch for downloaded file");
+    }
+
+  if (!error)
+    {
+      file = g_file_new_for_path (file_path);
+      g_file_move (part_file, file, G_FILE_COPY_OVERWRITE,
+                   NULL, NULL, NULL, &error);
+    }
+
+  if (error)
+    {
+      g_debug ("(%p) Error downloading '%s': %s", self,
+               (char *)g_object_get_data (G_OBJECT (task), "uri"),
+               error->message);
+
+      /* Keep partial content to be resumed later, unless it's invalid.
+       * Thumbnails are never resumed. */
+      if (g_object_get_data (G_OBJECT (task), "thumbnail") ||
+          g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA))
+        g_file_delete (part_file, NULL, NULL);
+      else
+        media_cache_add_part (self, task);
+
+      g_task_return_error (task, error);
+      return;
+    }
+
+  cm_db_add_media_async (self->cm_db,
+                         g_object_get_data (G_OBJECT (task), "uri"),
+                         file_path, *offset + size, sha256,
+                         !!file_info, self->max_size,
+                         NULL, NULL);
+  g_task_return_pointer (task, g_steal_pointer (&file), g_object_unref);
+}
+
+/*
+ * Report @size bytes written to the part file in this attempt
+ * to every waiter of the download @task that asked for progress.
+ */
+static void
+media_cache_report_progress (GTask   *task,
+                             goffset  size)
+{
+  GInputStream *stream;
+  MediaFetch *fetch;
+  gint64 *content_length;
+  goffset *offset, total = 0;
+
+  g_assert (G_IS_TASK (task));
+
+  fetch = g_object_get_data (G_OBJECT (task), "fetch");
+  offset = g_object_get_data (G_OBJECT (task), "offset");
+  stream = g_object_get_data (G_OBJECT (task), "stream");
+  content_length = g_object_get_data (G_OBJECT (stream), "content-length");
+
+  /* The length is of the encoded data with content encoding */
+  if (content_length && *content_length >= 0 &&
+      !g_object_get_data (G_OBJECT (stream), "content-encoding"))
+    total = *offset + *content_length;
+
+  for (guint i = 0; i < fetch->waiters->len; i++)
+    {
+      GTask *waiter = fetch->waiters->pdata[i];
+      GFileProgressCallback progress_cb;
+
+      progress_cb = g_object_get_data (G_OBJECT (waiter), "progress-cb");
+
+      if (progress_cb && !g_cancellable_is_cancelled (g_task_get_cancellable (waiter)))
+        progress_cb (*offset + size, total,
+                     g_object_get_data (G_OBJECT (waiter), "progress-cb-data"));
+    }
+}
+
+static void media_cache_copy_read (GTask *copy_task);
+
+static void
+media_cache_copy_close_cb (GObject      *object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  g_autoptr(GTask) copy_task = user_data;
+  GError *error = NULL;
+  gssize *size;
+
+  g_assert (G_IS_TASK (copy_task));
+
+  size = g_object_get_data (G_OBJECT (copy_task), "size");
+
+  if (g_output_stream_close_finish (G_OUTPUT_STREAM (object), result, &error))
+    g_task_return_int (copy_task, *size);
+  else
+    g_task_return_error (copy_task, error);
+}
+
+/* Takes ownership of @copy_task and @error */
+static void
+media_cache_copy_done (GTask  *copy_task,
+                       GError *error)
+{
+  GOutputStream *out_stream;
+  GInputStream *istream;
+
+  out_stream = g_task_get_source_object (copy_task);
+  istream = g_object_get_data (G_OBJECT (copy_task), "stream");
+
+  g_input_stream_close (istream, NULL, NULL);
+
+  if (error)
+    {
+      g_output_stream_close (out_stream, NULL, NULL);
+      g_task_return_error (copy_task, error);
+      g_object_unref (copy_task);
+      return;
+    }
+
+  g_output_stream_close_async (out_stream, G_PRIORITY_DEFAULT,
+                               g_task_get_cancellable (copy_task),
+                               media_cache_copy_close_cb, copy_task);
+}
+
+static void
+media_cache_copy_write_cb (GObject      *object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  GTask *copy_task = user_data;
+  GError *error = NULL;
+  gsize written = 0;
+  gssize *size;
+
+  g_assert (G_IS_TASK (copy_task));
+
+  if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (object), result, &written, &error))
+    {
+      media_cache_copy_done (copy_task, error);
+      return;
+    }
+
+  size = g_object_get_data (G_OBJECT (copy_task), "size");
+  *size += written;
+  media_cache_report_progress (g_object_get_data (G_OBJECT (copy_task), "task"), *size);
+  media_cache_copy_read (copy_task);
+}
+
+static void
+media_cache_copy_read_cb (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  GTask *copy_task = user_data;
+  GError *error = NULL;
+  gssize n_read;
+
+  g_assert (G_IS_TASK (copy_task));
+
+  n_read = g_input_stream_read_finish (G_INPUT_STREAM (object), result, &error);
+
+  if (n_read <= 0)
+    {
+      media_cache_copy_done (copy_task, error);
+      return;
+    }
+
+  g_output_stream_write_all_async (g_task_get_source_object (copy_task),
+                                   g_object_get_data (G_OBJECT (copy_task), "buffer"),
+                                   n_read, G_PRIORITY_DEFAULT,
+                                   g_task_get_cancellable (copy_task),
+                                   media_cache_copy_write_cb, copy_task);
+}
+
+static void
+media_cache_copy_read (GTask *copy_task)
+{
+  g_input_stream_read_async (g_object_get_data (G_OBJECT (copy_task), "stream"),
+                             g_object_get_data (G_OBJECT (copy_task), "buffer"),
+                             COPY_BLOCK_SIZE, G_PRIORITY_DEFAULT,
+                             g_task_get_cancellable (copy_task),
+                             media_cache_copy_read_cb, copy_task);
+}
+
+static void
+media_cache_splice (GTask *task)
+{
+  g_autoptr(GFileOutputStream) out_stream = NULL;
+  g_autoptr(GFile) part_file = NULL;
+  GInputStream *istream;
+  GTask *copy_task;
+  GError *error = NULL;
+  goffset *offset;
+
+  g_assert (G_IS_TASK (task));
+
+  istream = g_object_get_data (G_OBJECT (task), "stream");
+  offset = g_object_get_data (G_OBJECT (task), "offset");
+  part_file = g_file_new_for_path (g_object_get_data (G_OBJECT (task), "part-path"));
+
+  /* Download to a temporary file so that a partial file is never used */
+  if (*offset)
+    out_stream = g_file_append_to (part_file, G_FILE_CREATE_PRIVATE, NULL, &error);
+  else
+    out_stream = g_file_replace (part_file, NULL, FALSE, G_FILE_CREATE_PRIVATE,
+                                 NULL, &error);
+
+  if (!out_stream)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  /* Index the part file before writing to it, so that it's
+   * removed later even if we never get to update it */
+  if (!g_object_get_data (G_OBJECT (task), "thumbnail"))
+    media_cache_add_part (g_task_get_source_object (task), task);
+
+  /* Same as g_output_stream_splice_async() with both streams
+   * closed at the end, but with a larger buffer */
+  copy_task = g_task_new (out_stream, g_task_get_cancellable (task),
+                          media_cache_splice_cb, task);
+  g_object_set_data_full (G_OBJECT (copy_task), "stream",
+                          g_object_ref (istream), g_object_unref);
+  g_object_set_data_full (G_OBJECT (copy_task), "buffer",
+                          g_malloc (COPY_BLOCK_SIZE), g_free);
+  g_object_set_data_full (G_OBJECT (copy_task), "size",
+                          g_new0 (gssize, 1), g_free);
+  /* Owned by the callback of copy_task */
+  g_object_set_data (G_OBJECT (copy_task), "task", task);
+  media_cache_copy_read (copy_task);
+}
+
+static void
+media_cache_resume_thread (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
+{
+  g_autoptr(GFileInputStream) prefix = NULL;
+  g_autoptr(GFile) part_file = NULL;
+  GTask *download_task = task_data;
+  GError *error = NULL;
+  goffset *offset, size;
+
+  part_file = g_file_new_for_path (g_object_get_data (G_OBJECT (download_task), "part-path"));
+  offset = g_object_get_data (G_OBJECT (download_task), "offset");
+  prefix = g_file_read (part_file, cancellable, &error);
+
+  if (prefix)
+    {
+      size = cm_input_stream_resume_with_prefix (g_object_get_data (G_OBJECT (download_task), "stream"),
+                                                 G_INPUT_STREAM (prefix), cancellable, &error);
+      if (!error && size != *offset)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                     "Partial file size changed");
+    }
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+media_cache_resume_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GError *error = NULL;
+
+  g_assert (G_IS_TASK (task));
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error))
+    {
+      g_autoptr(GFile) part_file = NULL;
+
+      part_file = g_file_new_for_path (g_object_get_data (G_OBJECT (task), "part-path"));
+      g_file_delete (part_file, NULL, NULL);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  media_cache_splice (g_steal_pointer (&task));
+}
+
+static void
+media_cache_get_file_cb (GObject      *object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GInputStream) istream = NULL;
+  CmEncFileInfo *file_info;
+  CmMediaCache *self;
+  GError *error = NULL;
+  goffset *offset, *range_start;
+
+  g_assert (G_IS_TASK (task));
+
+  self = g_task_get_source_object (task);
+  g_assert (CM_IS_MEDIA_CACHE (self));
+
+  istream = cm_net_get_file_finish (CM_NET (object), result, &error);
+  offset = g_object_get_data (G_OBJECT (task), "offset");
+
+  /* We may have the complete file, or the part file is invalid */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT) && *offset)
+    {
+      g_autoptr(GFile) part_file = NULL;
+      guint attempt;
+
+      attempt = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "attempt"));
+      part_file = g_file_new_for_path (g_object_get_data (G_OBJECT (task), "part-path"));
+      g_file_delete (part_file, NULL, NULL);
+
+      if (attempt < MAX_RETRIES)
+        {
+          g_clear_error (&error);
+          g_object_set_data (G_OBJECT (task), "attempt", GUINT_TO_POINTER (attempt + 1));
+          media_cache_download (self, g_steal_pointer (&task));
+          return;
+        }
+    }
+
+  if (error)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_object_set_data_full (G_OBJECT (task), "stream", g_object_ref (istream), g_object_unref);
+  range_start = g_object_get_data (G_OBJECT (istream), "range-start");
+
+  /* Server sent the whole file, start over */
+  if (!range_start || *range_start != *offset)
+    *offset = 0;
+
+  file_info = g_object_get_data (G_OBJECT (task), "file-enc");
+
+  if (*offset && file_info)
+    {
+      g_debug ("(%p) Resuming download of '%s' from %" G_GOFFSET_FORMAT, self,
+               (char *)g_object_get_data (G_OBJECT (task), "uri"), *offset);
+
+      /* We need the whole content to verify the checksum */
+      if (file_info->sha256_base64)
+        {
+          g_autoptr(GTask) resume_task = NULL;
+
+          resume_task = g_task_new (self, NULL, media_cache_resume_cb, task);
+          g_task_set_task_data (resume_task, g_steal_pointer (&task), NULL);
+          g_task_run_in_thread (resume_task, media_cache_resume_thread);
+          return;
+        }
+
+      cm_input_stream_set_offset (CM_INPUT_STREAM (istream), *offset);
+    }
+
+  media_cache_splice (g_steal_pointer (&task));
+}
+
+/* Takes ownership of @task */
+static void
+media_cache_download (CmMediaCache *self,
+                      GTask        *task)
+{
+  CmClient *client;
+  goffset offset = 0;
+
+  g_assert (CM_IS_MEDIA_CACHE (self));
+  g_assert (G_IS_TASK (task));
+
+  client = g_object_get_data (G_OBJECT (task), "client");
+  g_assert (CM_IS_CLIENT (client));
+
+  if (g_object_get_data (G_OBJECT (task), "thumbnail"))
+    {
+      g_object_set_data_full (G_OBJECT (task), "offset",
+                              g_memdup2 (&offset, sizeof (offset)), g_free);
+      cm_net_get_thumbnail_async (cm_client_get_net (client),
+                                  g_object_get_data (G_OBJECT (task), "mxc-uri"),
+                                  GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "width")),
+                                  GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "height")),
+                                  GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "method")),
+                                  cm_client_get_homeserver_versions (client),
+                                  GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "priority")),
+                                  g_task_get_cancellable (task),
+                                  media_cache_get_file_cb, task);
+      return;
+    }
+
+  /* Resume from where we stopped the last time */
+  offset = media_cache_get_part_size (task);
+  g_object_set_data_full (G_OBJECT (task), "offset",
+                          g_memdup2 (&offset, sizeof (offset)), g_free);
+
+  cm_net_get_file_range_async (cm_client_get_net (client),
+                               g_object_get_data (G_OBJECT (task), "mxc-uri"),
+                               g_object_get_data (G_OBJECT (task), "file-enc"),
+                               cm_client_get_homeserver_versions (client),
+                               offset,
+                               GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "priority")),
+                               g_task_get_cancellable (task),
+                               media_cache_get_file_cb, task);
+}
+
+static void
+media_cache_find_file_enc_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  GTask *task = user_data;
+  CmEncFileInfo *file_info;
+
+  g_assert (G_IS_TASK (task));
+
+  file_info = cm_enc_find_file_enc_finish (CM_ENC (object), result, NULL);
+  /* file_info is owned by CmEnc */
+  g_object_set_data (G_OBJECT (task), "file-enc", file_info);
+
+  media_cache_download (g_task_get_source_object (task), task);
+}
+
+static void
+media_cache_lookup_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autofree char *file_path = NULL;
+  g_autofree char *dir = NULL;
+  CmClient *client;
+  const char *path;
+
+  g_assert (G_IS_TASK (task));
+
+  file_path = cm_db_lookup_media_finish (CM_DB (object), result, NULL);
+
+  if (file_path)
+    {
+      g_task_return_pointer (task, g_file_new_for_path (file_path), g_object_unref);
+      return;
+    }
+
+  path = g_object_get_data (G_OBJECT (task), "path");
+  dir = g_path_get_dirname (path);
+  g_mkdir_with_parents (dir, 0700);
+  g_object_set_data_full (G_OBJECT (task), "part-path",
+                          g_strconcat (path, ".part", NULL), g_free);
+
+  client = g_object_get_data (G_OBJECT (task), "client");
+  g_assert (CM_IS_CLIENT (client));
+
+  if (g_object_get_data (G_OBJECT (task), "thumbnail"))
+    media_cache_download (g_task_get_source_object (task), g_steal_pointer (&task));
+  else
+    cm_enc_find_file_enc_async (cm_client_get_enc (client),
+                                g_object_get_data (G_OBJECT (task), "mxc-uri"),
+                                media_cache_find_file_enc_cb,
+                                g_steal_pointer (&task));
+}
+
+static void
+cm_media_cache_finalize (GObject *object)
+{
+  CmMediaCache *self = (CmMediaCache *)object;
+
+  g_clear_handle_id (&self->sweep_id, g_source_remove);
+  g_clear_object (&self->cm_db);
+  g_hash_table_unref (self->pending);
+
+  G_OBJECT_CLASS (cm_media_cache_parent_class)->finalize (object);
+}
+
+static void
+cm_media_cache_class_init (CmMediaCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = cm_media_cache_finalize;
+}
+
+static void
+cm_media_cache_init (CmMediaCache *self)
+{
+  self->max_size = DEFAULT_MAX_SIZE;
+  self->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, media_fetch_free);
+}
+
+CmMediaCache *
+cm_media_cache_new (CmDb *db)
+{
+  CmMediaCache *self;
+
+  g_return_val_if_fail (CM_IS_DB (db), NULL);
+
+  self = g_object_new (CM_TYPE_MEDIA_CACHE, NULL);
+  self->cm_db = g_object_ref (db);
+
+  return self;
+}
+
+/**
+ * cm_media_cache_set_max_size:
+ * @self: A #CmMediaCache
+ * @max_size: The size in bytes, or 0 for no limit
+ *
+ * Set the total size of files that shall be kept
+ * in cache.  The limit is enforced when new files
+ * are added.
+ */
+void
+cm_media_cache_set_max_size (CmMediaCache *self,
+                             goffset       max_size)
+{
+  g_return_if_fail (CM_IS_MEDIA_CACHE (self));
+  g_return_if_fail (max_size >= 0);
+
+  self->max_size = max_size;
+}
+
+goffset
+cm_media_cache_get_max_size (CmMediaCache *self)
+{
+  g_return_val_if_fail (CM_IS_MEDIA_CACHE (self), 0);
+
+  return self->max_size;
+}
+
+static void
+media_cache_get_async (CmMediaCache          *self,
+                       CmClient              *client,
+                       const char            *uri,
+                       gboolean               thumbnail,
+                       int                    width,
+                       int                    height,
+                       CmThumbnailMethod      method,
+                       char                  *file_path,
+                       CmTransferPriority     priority,
+                       GCancellable          *cancellable,
+                       GFileProgressCallback  progress_callback,
+                       gpointer               progress_user_data,
+                       GAsyncReadyCallback    callback,
+                       gpointer               user_data)
+{
+  g_autoptr(GTask) fetch_task = NULL;
+  g_autofree char *key = NULL;
+  MediaFetch *fetch, *stale_fetch = NULL;
+  GTask *task;
+
+  g_assert (CM_IS_MEDIA_CACHE (self));
+
+  /* Each thumbnail size is a different file, so cache them separately */
+  if (thumbnail)
+    key = g_strdup_printf ("%s?width=%d&height=%d&method=%s", uri, width, height,
+                           method == CM_THUMBNAIL_METHOD_CROP ? "crop" : "scale");
+  else
+    key = g_strdup (uri);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, cm_media_cache_get_file_async);
+  g_object_set_data (G_OBJECT (task), "progress-cb", progress_callback);
+  g_object_set_data (G_OBJECT (task), "progress-cb-data", progress_user_data);
+
+  fetch = g_hash_table_lookup (self->pending, key);
+
+  /* The download keeps the priority it was queued with */
+  if (fetch && !g_cancellable_is_cancelled (fetch->cancellable))
+    {
+      g_debug ("(%p) Download of '%s' in progress, waiting", self, key);
+      media_cache_add_waiter (self, fetch, task);
+      g_free (file_path);
+      return;
+    }
+
+  /* A stale download is being cancelled, which shouldn't fail the new
+   * waiter.  Start a new one, which resumes from the part file once the
+   * stale download is done */
+  if (fetch)
+    {
+      g_autofree char *stale_key = NULL;
+
+      g_debug ("(%p) Download of '%s' is being cancelled, starting over", self, key);
+      g_hash_table_steal_extended (self->pending, key, (gpointer *)&stale_key, NULL);
+      stale_fetch = fetch;
+    }
+
+  fetch = g_new0 (MediaFetch, 1);
+  fetch->waiters = g_ptr_array_new_with_free_func (g_object_unref);
+  fetch->cancellable = g_cancellable_new ();
+  media_cache_add_waiter (self, fetch, task);
+  g_hash_table_insert (self->pending, g_strdup (key), fetch);
+
+  /* The download is shared, so it's cancelled only when all waiters are */
+  fetch_task = g_task_new (self, fetch->cancellable, media_cache_fetch_done_cb, NULL);
+  g_object_set_data_full (G_OBJECT (fetch_task), "uri", g_strdup (key), g_free);
+  g_object_set_data_full (G_OBJECT (fetch_task), "mxc-uri", g_strdup (uri), g_free);
+  g_object_set_data_full (G_OBJECT (fetch_task), "path", file_path, g_free);
+  g_object_set_data_full (G_OBJECT (fetch_task), "client",
+                          g_object_ref (client), g_object_unref);
+  g_object_set_data (G_OBJECT (fetch_task), "thumbnail", GINT_TO_POINTER (thumbnail));
+  g_object_set_data (G_OBJECT (fetch_task), "width", GINT_TO_POINTER (width));
+  g_object_set_data (G_OBJECT (fetch_task), "height", GINT_TO_POINTER (height));
+  g_object_set_data (G_OBJECT (fetch_task), "method", GINT_TO_POINTER (method));
+  g_object_set_data (G_OBJECT (fetch_task), "priority", GINT_TO_POINTER (priority));
+  g_object_set_data (G_OBJECT (fetch_task), "fetch", fetch);
+
+  if (stale_fetch)
+    stale_fetch->next_task = g_steal_pointer (&fetch_task);
+  else
+    cm_db_lookup_media_async (self->cm_db, key,
+                              media_cache_lookup_cb,
+                              g_steal_pointer (&fetch_task));
+}
+
+/**
+ * cm_media_cache_get_file_async:
+ * @self: A #CmMediaCache
+ * @client: The #CmClient to download the file with
+ * @uri: The mxc uri of the file
+ * @file_path: (transfer full): The path to save the file to
+ * @priority: The #CmTransferPriority of the download
+ * @cancellable: (nullable): A #GCancellable
+ * @progress_callback: (nullable): A #GFileProgressCallback
+ * @progress_user_data: user data for @progress_callback
+ * @callback: A #GAsyncReadyCallback
+ * @user_data: user data for @callback
+ *
+ * Get the local file for @uri, downloading it to @file_path
+ * if it's not already in cache.  If there is already a
+ * download in progress for @uri, the same shall be reused.
+ *
+ * @progress_callback is run as the download progresses,
+ * including when joining a download already in progress,
+ * with the total size 0 if not known.
+ *
+ * Cancelling @cancellable cancels the download only if no
+ * other request is waiting for it.
+ */
+void
+cm_media_cache_get_file_async (CmMediaCache          *self,
+                               CmClient              *client,
+                               const char            *uri,
+                               char                  *file_path,
+                               CmTransferPriority     priority,
+                               GCancellable          *cancellable,
+                               GFileProgressCallback  progress_callback,
+                               gpointer               progress_user_data,
+                               GAsyncReadyCallback    callback,
+                               gpointer               user_data)
+{
+  g_return_if_fail (CM_IS_MEDIA_CACHE (self));
+  g_return_if_fail (CM_IS_CLIENT (client));
+  g_return_if_fail (uri && *uri);
+  g_return_if_fail (file_path && *file_path == '/');
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  media_cache_get_async (self, client, uri, FALSE, 0, 0, 0, file_path, priority,
+                         cancellable, progress_callback, progress_user_data,
+                         callback, user_data);
+}
+
+/**
+ * cm_media_cache_get_thumbnail_async:
+ * @self: A #CmMediaCache
+ * @client: The #CmClient to download the file with
+ * @uri: The mxc uri of the file
+ * @width: The desired width
+ * @height: The desired height
+ * @method: A #CmThumbnailMethod
+ * @file_path: (transfer full): The path to save the thumbnail to
+ * @priority: The #CmTransferPriority of the download
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: A #GAsyncReadyCallback
+ * @user_data: user data for @callback
+ *
+ * Same as cm_media_cache_get_file_async(), but for a server
+ * generated thumbnail of @uri.  Finish with
+ * cm_media_cache_get_file_finish().
+ */
+void
+cm_media_cache_get_thumbnail_async (CmMediaCache        *self,
+                                    CmClient            *client,
+                                    const char          *uri,
+                                    int                  width,
+                                    int                  height,
+                                    CmThumbnailMethod    method,
+                                    char                *file_path,
+                                    CmTransferPriority   priority,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  g_return_if_fail (CM_IS_MEDIA_CACHE (self));
+  g_return_if_fail (CM_IS_CLIENT (client));
+  g_return_if_fail (uri && g_str_has_prefix (uri, "mxc://"));
+  g_return_if_fail (width > 0 && height > 0);
+  g_return_if_fail (file_path && *file_path == '/');
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  media_cache_get_async (self, client, uri, TRUE, width, height, method, file_path,
+                         priority, cancellable, NULL, NULL, callback, user_data);
+}
+
+GFile *
+cm_media_cache_get_file_finish (CmMediaCache  *self,
+                                GAsyncResult  *result,
+                                GError       **error)
+{
+  g_return_val_if_fail (CM_IS_MEDIA_CACHE (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
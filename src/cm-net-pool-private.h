@@ -0,0 +1,42 @@
+/* cm-net-pool-private.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+#define CM_TYPE_NET_POOL (cm_net_pool_get_type ())
+
+G_DECLARE_FINAL_TYPE (CmNetPool, cm_net_pool, CM, NET_POOL, GObject)
+
+CmNetPool     *cm_net_pool_new                  (void);
+char          *cm_net_pool_get_origin           (const char     *homeserver);
+SoupSession   *cm_net_pool_acquire_session      (CmNetPool      *self,
+                                                 const char     *homeserver);
+void           cm_net_pool_release_session      (CmNetPool      *self,
+                                                 SoupSession    *session);
+guint          cm_net_pool_get_n_sessions       (CmNetPool      *self);
+SoupSession   *cm_net_pool_get_file_session     (CmNetPool      *self);
+gboolean       cm_net_pool_can_transfer         (CmNetPool      *self,
+                                                 const char     *host);
+void           cm_net_pool_add_transfer         (CmNetPool      *self,
+                                                 const char     *host);
+void           cm_net_pool_remove_transfer      (CmNetPool      *self,
+                                                 const char     *host);
+gboolean       cm_net_pool_take_token           (CmNetPool      *self,
+                                                 const char     *origin,
+                                                 guint          *wait_ms);
+void           cm_net_pool_set_retry_after      (CmNetPool      *self,
+                                                 const char     *origin,
+                                                 guint           retry_after_ms);
+guint          cm_net_pool_get_retry_after      (CmNetPool      *self,
+                                                 const char     *origin);
+
+G_END_DECLS
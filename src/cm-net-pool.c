@@ -0,0 +1,477 @@
+/* cm-net-pool.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "cm-net-pool"
+
+#include "cm-config.h"
+
+#include "cm-net-pool-private.h"
+
+/**
+ * CmNetPool:
+ *
+ * The HTTP sessions shared by every #CmNet, so that the
+ * connections (and TLS handshakes) to a homeserver are
+ * reused by all the accounts on it, and the number of
+ * sockets grows with the number of servers rather than
+ * the number of accounts.
+ *
+ * Requests carry their own Authorization header, so
+ * sharing a session doesn't share any credentials.  Cookies
+ * are not used by matrix, and no cookie jar is ever added.
+ *
+ * Media is fetched with a single session for all servers,
+ * and the transfers are limited globally and per host so
+ * that a few accounts fetching thumbnails at once can't
+ * open an unbounded number of connections.
+ *
+ * Other requests are rate limited per homeserver with a
+ * token bucket shared by all the accounts on it, and held
+ * back altogether when the server asked to retry later.
+ */
+
+#define MAX_CONNECTIONS        4
+/* Every client keeps a /sync long poll open, so each one
+ * sharing a session gets a connection on top of the rest */
+#define CLIENTS_PER_SESSION    4
+#define MAX_TRANSFERS          16
+#define MAX_TRANSFERS_PER_HOST 4
+/* Requests allowed in a burst, and refilled per second */
+#define BUCKET_SIZE            50
+#define BUCKET_RATE            20
+
+typedef struct {
+  double       tokens;
+  gint64       last_fill;
+  /* Monotonic time until which the server doesn't want requests */
+  gint64       retry_after;
+} RateLimit;
+
+typedef struct {
+  SoupSession *session;
+  char        *origin;
+  guint        n_users;
+} PoolSession;
+
+struct _CmNetPool
+{
+  GObject      parent_instance;
+
+  /* PoolSession, there are only a handful of servers */
+  GPtrArray   *sessions;
+  SoupSession *file_session;
+
+  /* host -> number of running transfers */
+  GHashTable  *transfers;
+  guint        n_transfers;
+
+  /* origin -> RateLimit */
+  GHashTable  *limits;
+};
+
+G_DEFINE_TYPE (CmNetPool, cm_net_pool, G_TYPE_OBJECT)
+
+enum {
+  TRANSFER_RELEASED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS];
+
+static void
+pool_session_free (gpointer data)
+{
+  PoolSession *entry = data;
+
+  /* Not aborted, requests in flight keep the session alive */
+  g_object_unref (entry->session);
+  g_free (entry->origin);
+  g_free (entry);
+}
+
+static RateLimit *
+net_pool_get_limit (CmNetPool  *self,
+                    const char *origin)
+{
+  RateLimit *limit;
+
+  limit = g_hash_table_lookup (self->limits, origin);
+
+  if (!limit)
+    {
+      limit = g_new0 (RateLimit, 1);
+      limit->tokens = BUCKET_SIZE;
+      limit->last_fill = g_get_monotonic_time ();
+      g_hash_table_insert (self->limits, g_strdup (origin), limit);
+    }
+
+  return limit;
+}
+
+/**
+ * cm_net_pool_get_origin:
+ * @homeserver: The homeserver url
+ *
+ * Get the origin of @homeserver, ie, "scheme://host:port",
+ * which the sessions and rate limits are shared by.
+ *
+ * Returns: (transfer full): The origin of @homeserver
+ */
+char *
+cm_net_pool_get_origin (const char *homeserver)
+{
+  g_autoptr(GUri) uri = NULL;
+  int port;
+
+  uri = g_uri_parse (homeserver, SOUP_HTTP_URI_FLAGS, NULL);
+
+  if (!uri || !g_uri_get_host (uri))
+    return g_strdup (homeserver);
+
+  port = g_uri_get_port (uri);
+  if (port == -1)
+    port = g_str_equal (g_uri_get_scheme (uri), "https") ? 443 : 80;
+
+  return g_strdup_printf ("%s://%s:%d", g_uri_get_scheme (uri),
+                          g_uri_get_host (uri), port);
+}
+
+static void
+cm_net_pool_finalize (GObject *object)
+{
+  CmNetPool *self = (CmNetPool *)object;
+
+  if (self->sessions->len)
+    g_warning ("%u sessions still in use", self->sessions->len);
+
+  g_clear_pointer (&self->sessions, g_ptr_array_unref);
+  soup_session_abort (self->file_session);
+  g_clear_object (&self->file_session);
+  g_clear_pointer (&self->transfers, g_hash_table_unref);
+  g_clear_pointer (&self->limits, g_hash_table_unref);
+
+  G_OBJECT_CLASS (cm_net_pool_parent_class)->finalize (object);
+}
+
+static void
+cm_net_pool_class_init (CmNetPoolClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = cm_net_pool_finalize;
+
+  /**
+   * CmNetPool::transfer-released:
+   * @self: A #CmNetPool
+   *
+   * Emitted when a media transfer has finished, so that
+   * the transfers waiting for a slot can be started.
+   */
+  signals[TRANSFER_RELEASED] =
+    g_signal_new ("transfer-released",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 0);
+}
+
+static void
+cm_net_pool_init (CmNetPool *self)
+{
+  self->sessions = g_ptr_array_new_with_free_func (pool_session_free);
+  self->file_session = g_object_new (SOUP_TYPE_SESSION,
+                                     "max-conns", MAX_TRANSFERS,
+                                     "max-conns-per-host", MAX_TRANSFERS_PER_HOST,
+                                     NULL);
+  self->transfers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->limits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+CmNetPool *
+cm_net_pool_new (void)
+{
+  return g_object_new (CM_TYPE_NET_POOL, NULL);
+}
+
+/**
+ * cm_net_pool_acquire_session:
+ * @self: A #CmNetPool
+ * @homeserver: The homeserver url
+ *
+ * Get a session for @homeserver, shared with the other
+ * users of the same origin.  Once the limit of users per
+ * session is reached, a new session is created.
+ *
+ * Release the session with cm_net_pool_release_session()
+ * when done.
+ *
+ * Returns: (transfer full): A #SoupSession
+ */
+SoupSession *
+cm_net_pool_acquire_session (CmNetPool  *self,
+                             const char *homeserver)
+{
+  g_autofree char *origin = NULL;
+  PoolSession *entry;
+
+  g_return_val_if_fail (CM_IS_NET_POOL (self), NULL);
+  g_return_val_if_fail (homeserver && *homeserver, NULL);
+
+  origin = cm_net_pool_get_origin (homeserver);
+
+  for (guint i = 0; i < self->sessions->len; i++)
+    {
+      entry = g_ptr_array_index (self->sessions, i);
+
+      if (entry->n_users < CLIENTS_PER_SESSION &&
+          g_str_equal (entry->origin, origin))
+        {
+          entry->n_users++;
+
+          return g_object_ref (entry->session);
+        }
+    }
+
+  entry = g_new0 (PoolSession, 1);
+  entry->origin = g_steal_pointer (&origin);
+  entry->n_users = 1;
+  entry->session = g_object_new (SOUP_TYPE_SESSION,
+                                 "max-conns", MAX_CONNECTIONS + CLIENTS_PER_SESSION,
+                                 "max-conns-per-host", MAX_CONNECTIONS + CLIENTS_PER_SESSION,
+                                 NULL);
+  g_ptr_array_add (self->sessions, entry);
+  g_debug ("New session for %s, %u in total", entry->origin, self->sessions->len);
+
+  return g_object_ref (entry->session);
+}
+
+/**
+ * cm_net_pool_release_session:
+ * @self: A #CmNetPool
+ * @session: (transfer full): A #SoupSession
+ *
+ * Release @session got with cm_net_pool_acquire_session().
+ * The session is closed when it has no users left.
+ */
+void
+cm_net_pool_release_session (CmNetPool   *self,
+                             SoupSession *session)
+{
+  g_return_if_fail (CM_IS_NET_POOL (self));
+  g_return_if_fail (SOUP_IS_SESSION (session));
+
+  for (guint i = 0; i < self->sessions->len; i++)
+    {
+      PoolSession *entry = g_ptr_array_index (self->sessions, i);
+
+      if (entry->session != session)
+        continue;
+
+      g_assert (entry->n_users > 0);
+      entry->n_users--;
+      g_object_unref (session);
+
+      if (!entry->n_users)
+        g_ptr_array_remove_index_fast (self->sessions, i);
+
+      return;
+    }
+
+  g_warn_if_reached ();
+  g_object_unref (session);
+}
+
+guint
+cm_net_pool_get_n_sessions (CmNetPool *self)
+{
+  g_return_val_if_fail (CM_IS_NET_POOL (self), 0);
+
+  return self->sessions->len;
+}
+
+/**
+ * cm_net_pool_get_file_session:
+ * @self: A #CmNetPool
+ *
+ * Get the session used for media transfers of all servers.
+ *
+ * Returns: (transfer none): A #SoupSession
+ */
+SoupSession *
+cm_net_pool_get_file_session (CmNetPool *self)
+{
+  g_return_val_if_fail (CM_IS_NET_POOL (self), NULL);
+
+  return self->file_session;
+}
+
+/**
+ * cm_net_pool_can_transfer:
+ * @self: A #CmNetPool
+ * @host: The host of the transfer
+ *
+ * Get if a new transfer from @host can be started
+ * without exceeding the limits.
+ *
+ * Returns: %TRUE if a transfer can be started
+ */
+gboolean
+cm_net_pool_can_transfer (CmNetPool  *self,
+                          const char *host)
+{
+  guint count;
+
+  g_return_val_if_fail (CM_IS_NET_POOL (self), FALSE);
+  g_return_val_if_fail (host, FALSE);
+
+  if (self->n_transfers >= MAX_TRANSFERS)
+    return FALSE;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (self->transfers, host));
+
+  return count < MAX_TRANSFERS_PER_HOST;
+}
+
+void
+cm_net_pool_add_transfer (CmNetPool  *self,
+                          const char *host)
+{
+  guint count;
+
+  g_return_if_fail (CM_IS_NET_POOL (self));
+  g_return_if_fail (host);
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (self->transfers, host));
+  g_hash_table_insert (self->transfers, g_strdup (host), GUINT_TO_POINTER (count + 1));
+  self->n_transfers++;
+}
+
+void
+cm_net_pool_remove_transfer (CmNetPool  *self,
+                             const char *host)
+{
+  guint count;
+
+  g_return_if_fail (CM_IS_NET_POOL (self));
+  g_return_if_fail (host);
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (self->transfers, host));
+  g_return_if_fail (count > 0);
+  g_assert (self->n_transfers > 0);
+  self->n_transfers--;
+
+  if (count > 1)
+    g_hash_table_insert (self->transfers, g_strdup (host), GUINT_TO_POINTER (count - 1));
+  else
+    g_hash_table_remove (self->transfers, host);
+
+  g_signal_emit (self, signals[TRANSFER_RELEASED], 0);
+}
+
+/**
+ * cm_net_pool_take_token:
+ * @self: A #CmNetPool
+ * @origin: The origin of the homeserver
+ * @wait_ms: (out): The time to wait before trying again
+ *
+ * Take a token to send a request to @origin, if it's not
+ * rate limited.  Otherwise, @wait_ms is set to the time
+ * until the next one is available.
+ *
+ * Returns: %TRUE if the request can be sent now
+ */
+gboolean
+cm_net_pool_take_token (CmNetPool  *self,
+                        const char *origin,
+                        guint      *wait_ms)
+{
+  RateLimit *limit;
+  gint64 now;
+
+  g_return_val_if_fail (CM_IS_NET_POOL (self), FALSE);
+  g_return_val_if_fail (origin, FALSE);
+  g_return_val_if_fail (wait_ms, FALSE);
+
+  limit = net_pool_get_limit (self, origin);
+  now = g_get_monotonic_time ();
+  *wait_ms = 0;
+
+  if (limit->retry_after > now)
+    {
+      *wait_ms = (limit->retry_after - now) / 1000 + 1;
+      return FALSE;
+    }
+
+  limit->tokens += (double)(now - limit->last_fill) * BUCKET_RATE / G_USEC_PER_SEC;
+  limit->tokens = MIN (limit->tokens, BUCKET_SIZE);
+  limit->last_fill = now;
+
+  if (limit->tokens >= 1.0)
+    {
+      limit->tokens -= 1.0;
+      return TRUE;
+    }
+
+  *wait_ms = (1.0 - limit->tokens) * 1000 / BUCKET_RATE + 1;
+
+  return FALSE;
+}
+
+/**
+ * cm_net_pool_set_retry_after:
+ * @self: A #CmNetPool
+ * @origin: The origin of the homeserver
+ * @retry_after_ms: The time the server asked to wait
+ *
+ * Hold back the requests to @origin for @retry_after_ms,
+ * as the server rate limited one of them.
+ */
+void
+cm_net_pool_set_retry_after (CmNetPool  *self,
+                             const char *origin,
+                             guint       retry_after_ms)
+{
+  RateLimit *limit;
+  gint64 retry_after;
+
+  g_return_if_fail (CM_IS_NET_POOL (self));
+  g_return_if_fail (origin);
+
+  limit = net_pool_get_limit (self, origin);
+  retry_after = g_get_monotonic_time () + (gint64)retry_after_ms * 1000;
+  limit->retry_after = MAX (limit->retry_after, retry_after);
+
+  /* Don't let the requests held back go in a burst afterwards */
+  limit->tokens = MIN (limit->tokens, 1.0);
+}
+
+/**
+ * cm_net_pool_get_retry_after:
+ * @self: A #CmNetPool
+ * @origin: The origin of the homeserver
+ *
+ * Returns: The time left in milliseconds until @origin
+ * accepts requests again, or 0
+ */
+guint
+cm_net_pool_get_retry_after (CmNetPool  *self,
+                             const char *origin)
+{
+  RateLimit *limit;
+  gint64 now;
+
+  g_return_val_if_fail (CM_IS_NET_POOL (self), 0);
+  g_return_val_if_fail (origin, 0);
+
+  limit = g_hash_table_lookup (self->limits, origin);
+  now = g_get_monotonic_time ();
+
+  if (!limit || limit->retry_after <= now)
+    return 0;
+
+  return (limit->retry_after - now) / 1000 + 1;
+}
@@ -14,11 +14,28 @@
 #include <json-glib/json-glib.h>
 
 #include "cm-enc-private.h"
+#include "cm-net-recorder-private.h"
+#include "cm-enums.h"
 
 G_BEGIN_DECLS
 
 #define CM_TYPE_NET (cm_net_get_type ())
 
+/*
+ * CmTransferPriority:
+ *
+ * Priority classes of media transfers, in order of
+ * importance.  Transfers of higher priority are started
+ * first when more transfers are queued than allowed to run.
+ */
+typedef enum {
+  CM_TRANSFER_PRIORITY_AVATAR,     /* Avatars that are visible */
+  CM_TRANSFER_PRIORITY_THUMBNAIL,  /* Image previews */
+  CM_TRANSFER_PRIORITY_DOWNLOAD,   /* Initiated by the user, also uploads */
+  CM_TRANSFER_PRIORITY_PREFETCH,   /* Speculative, can be dropped */
+  CM_TRANSFER_PRIORITY_N
+} CmTransferPriority;
+
 G_DECLARE_FINAL_TYPE (CmNet, cm_net, CM, NET, GObject)
 
 CmNet         *cm_net_new                 (void);
@@ -27,6 +44,10 @@ void           cm_net_set_homeserver      (CmNet                 *self,
 void           cm_net_set_access_token    (CmNet                 *self,
                                            const char            *access_token);
 const char    *cm_net_get_access_token    (CmNet                 *self);
+guint          cm_net_get_retry_after     (CmNet                 *self);
+void           cm_net_preconnect          (CmNet                 *self);
+void           cm_net_set_recorder        (CmNet                 *self,
+                                           CmNetRecorder         *recorder);
 void           cm_net_send_data_async     (CmNet                 *self,
                                            int                    priority,
                                            char                  *data,
@@ -53,6 +74,25 @@ void           cm_net_get_file_async      (CmNet                 *self,
                                            GCancellable          *cancellable,
                                            GAsyncReadyCallback    callback,
                                            gpointer               user_data);
+void           cm_net_get_file_range_async (CmNet                *self,
+                                            const char           *uri,
+                                            CmEncFileInfo        *file_info,
+                                            const char * const   *versions,
+                                            goffset               offset,
+                                            CmTransferPriority    priority,
+                                            GCancellable         *cancellable,
+                                            GAsyncReadyCallback   callback,
+                                            gpointer              user_data);
+void           cm_net_get_thumbnail_async (CmNet                 *self,
+                                           const char            *uri,
+                                           int                    width,
+                                           int                    height,
+                                           CmThumbnailMethod      method,
+                                           const char * const    *versions,
+                                           CmTransferPriority     priority,
+                                           GCancellable          *cancellable,
+                                           GAsyncReadyCallback    callback,
+                                           gpointer               user_data);
 GInputStream  *cm_net_get_file_finish     (CmNet                 *self,
                                            GAsyncResult          *result,
                                            GError               **error);
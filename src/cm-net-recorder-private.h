@@ -0,0 +1,40 @@
+/* cm-net-recorder-private.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+#define CM_TYPE_NET_RECORDER (cm_net_recorder_get_type ())
+
+G_DECLARE_FINAL_TYPE (CmNetRecorder, cm_net_recorder, CM, NET_RECORDER, GObject)
+
+CmNetRecorder *cm_net_recorder_new              (const char     *file_name,
+                                                 GError        **error);
+CmNetRecorder *cm_net_recorder_get_default      (void);
+void           cm_net_recorder_add              (CmNetRecorder  *self,
+                                                 const char     *method,
+                                                 const char     *uri_path,
+                                                 const char     *query,
+                                                 const char     *request,
+                                                 gsize           request_size,
+                                                 guint           status,
+                                                 const char     *response,
+                                                 gsize           response_size,
+                                                 gint64          start_time,
+                                                 const char     *error_message);
+char          *cm_net_recorder_anonymize_path   (CmNetRecorder  *self,
+                                                 const char     *uri_path);
+JsonNode      *cm_net_recorder_anonymize_json   (CmNetRecorder  *self,
+                                                 JsonNode       *node);
+GPtrArray     *cm_net_recorder_load             (const char     *file_name,
+                                                 GError        **error);
+
+G_END_DECLS
@@ -0,0 +1,762 @@
+/* cm-net-recorder.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "cm-net-recorder"
+
+#include "cm-config.h"
+
+#include <string.h>
+#define GCRYPT_NO_DEPRECATED
+#include <gcrypt.h>
+
+#include "cm-utils-private.h"
+#include "cm-net-recorder-private.h"
+
+/**
+ * CmNetRecorder:
+ *
+ * Records the requests made with #CmNet and their responses,
+ * so that a slow sync can be replayed offline.  The trace is
+ * a gzip compressed file with a json object per line, the
+ * first one being a header.
+ *
+ * Everything is anonymized before written: matrix ids and
+ * media urls are replaced with keyed hashes (so that they
+ * still match each other within a trace, but can't be
+ * guessed back), secrets are removed, and other strings are
+ * masked with cm_utils_anonymize().  Only the values that
+ * the protocol depends on (event types, sync tokens, etc.)
+ * are kept as such.
+ *
+ * Recording is enabled for every #CmNet by setting the
+ * CMATRIX_NET_TRACE environment variable to the trace path.
+ *
+ * Entries are anonymized and written in a worker thread, in
+ * the order they are added, so that recording doesn't block
+ * the main loop.
+ */
+
+#define TRACE_VERSION 1
+#define HASH_LENGTH   16
+
+struct _CmNetRecorder
+{
+  GObject        parent_instance;
+
+  GOutputStream *stream;
+  /* Writes the entries, one at a time */
+  GThreadPool   *writer;
+  gint64         start_time;
+  guchar         salt[32];
+  /* Set from the writer thread */
+  int            failed;
+};
+
+typedef struct
+{
+  char   *method;
+  char   *uri_path;
+  char   *query;
+  char   *request;
+  gsize   request_size;
+  guint   status;
+  char   *response;
+  gsize   response_size;
+  gint64  time;
+  gint64  duration;
+  char   *error_message;
+} RecorderEntry;
+
+G_DEFINE_TYPE (CmNetRecorder, cm_net_recorder, G_TYPE_OBJECT)
+
+/* Values of these are needed to replay, and are not personal */
+static const char *kept_keys[] = {
+  "type", "msgtype", "membership", "algorithm", "rel_type", "format",
+  "join_rule", "history_visibility", "guest_access", "presence", "errcode",
+  "next_batch", "prev_batch", "since", "start", "end", "from", "to", "dir",
+  "filter", "filter_id", "room_version", "timeout", "limit", "full_state",
+  "set_presence", "versions", "unstable_features",
+};
+
+static const char *secret_keys[] = {
+  "access_token", "refresh_token", "password", "token", "session_key",
+  "pickle", "passphrase",
+};
+
+static gboolean
+recorder_key_in (const char  *key,
+                 const char **keys,
+                 guint        n_keys)
+{
+  if (!key)
+    return FALSE;
+
+  for (guint i = 0; i < n_keys; i++)
+    if (g_str_equal (key, keys[i]))
+      return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+recorder_is_id (const char *value)
+{
+  if (!value || !*value || !value[1] || !strchr ("@!$#+", *value))
+    return FALSE;
+
+  if (strchr (value, ' '))
+    return FALSE;
+
+  /* Event ids from room version 3 don't have a server name */
+  return *value == '$' || strchr (value, ':');
+}
+
+static char *
+recorder_hash (CmNetRecorder *self,
+               const char    *value,
+               gssize         length)
+{
+  char *hash;
+
+  if (length < 0)
+    length = strlen (value);
+
+  hash = g_compute_hmac_for_data (G_CHECKSUM_SHA256, self->salt, sizeof self->salt,
+                                  (const guchar *)value, length);
+  hash[HASH_LENGTH] = '\0';
+
+  return hash;
+}
+
+static char *
+recorder_hash_server (CmNetRecorder *self,
+                      const char    *server)
+{
+  g_autofree char *hash = NULL;
+
+  hash = recorder_hash (self, server, -1);
+
+  return g_strdup_printf ("%.8s.invalid", hash);
+}
+
+/* Keeps the sigil and the shape, so that the id is still valid */
+static char *
+recorder_pseudonymize (CmNetRecorder *self,
+                       const char    *id)
+{
+  g_autofree char *hash = NULL;
+  g_autofree char *server = NULL;
+  const char *colon;
+
+  hash = recorder_hash (self, id, -1);
+  colon = strchr (id, ':');
+
+  if (!colon)
+    return g_strdup_printf ("%c%s", *id, hash);
+
+  server = recorder_hash_server (self, colon + 1);
+
+  return g_strdup_printf ("%c%s:%s", *id, hash, server);
+}
+
+static char *
+recorder_anonymize_string (CmNetRecorder *self,
+                           const char    *key,
+                           const char    *value)
+{
+  g_autoptr(GString) str = NULL;
+
+  if (!value || !*value)
+    return g_strdup (value);
+
+  if (recorder_key_in (key, secret_keys, G_N_ELEMENTS (secret_keys)))
+    return g_strdup ("******");
+
+  if (recorder_is_id (value))
+    return recorder_pseudonymize (self, value);
+
+  if (g_str_has_prefix (value, "mxc://"))
+    {
+      g_autofree char *server = NULL;
+      g_autofree char *hash = NULL;
+      g_auto(GStrv) parts = NULL;
+
+      parts = g_strsplit (value + strlen ("mxc://"), "/", 2);
+      server = recorder_hash_server (self, parts[0] ?: "");
+      /* Hashed as in media download paths */
+      hash = recorder_hash (self, parts[0] && parts[1] ? parts[1] : "", -1);
+
+      return g_strdup_printf ("mxc://%s/%s", server, hash);
+    }
+
+  if (recorder_key_in (key, kept_keys, G_N_ELEMENTS (kept_keys)))
+    return g_strdup (value);
+
+  str = g_string_new (NULL);
+  cm_utils_anonymize (str, value);
+
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
+
+static JsonNode *
+recorder_anonymize_node (CmNetRecorder *self,
+                         const char    *key,
+                         JsonNode      *node)
+{
+  JsonNode *copy;
+
+  if (!node)
+    return NULL;
+
+  if (JSON_NODE_HOLDS_OBJECT (node))
+    {
+      g_autoptr(GList) members = NULL;
+      JsonObject *object, *new_object;
+
+      object = json_node_get_object (node);
+      new_object = json_object_new ();
+      members = json_object_get_members (object);
+
+      for (GList *item = members; item; item = item->next)
+        {
+          g_autofree char *name = NULL;
+          JsonNode *child;
+
+          /* Maps keyed by ids, like the rooms in /sync */
+          if (recorder_is_id (item->data))
+            name = recorder_pseudonymize (self, item->data);
+          else
+            name = g_strdup (item->data);
+
+          child = json_object_get_member (object, item->data);
+          json_object_set_member (new_object, name,
+                                  recorder_anonymize_node (self, item->data, child));
+        }
+
+      copy = json_node_init_object (json_node_alloc (), new_object);
+      json_object_unref (new_object);
+    }
+  else if (JSON_NODE_HOLDS_ARRAY (node))
+    {
+      JsonArray *array, *new_array;
+      guint length;
+
+      array = json_node_get_array (node);
+      length = json_array_get_length (array);
+      new_array = json_array_sized_new (length);
+
+      /* Array elements are anonymized as the member holding the array */
+      for (guint i = 0; i < length; i++)
+        json_array_add_element (new_array,
+                                recorder_anonymize_node (self, key,
+                                                         json_array_get_element (array, i)));
+
+      copy = json_node_init_array (json_node_alloc (), new_array);
+      json_array_unref (new_array);
+    }
+  else if (JSON_NODE_HOLDS_VALUE (node) &&
+           json_node_get_value_type (node) == G_TYPE_STRING)
+    {
+      g_autofree char *value = NULL;
+
+      value = recorder_anonymize_string (self, key, json_node_get_string (node));
+      copy = json_node_init_string (json_node_alloc (), value);
+    }
+  else
+    {
+      copy = json_node_copy (node);
+    }
+
+  return copy;
+}
+
+static JsonNode *
+recorder_anonymize_data (CmNetRecorder *self,
+                         const char    *data,
+                         gsize          size)
+{
+  g_autoptr(JsonNode) node = NULL;
+  g_autofree char *copy = NULL;
+
+  if (!data || !size)
+    return NULL;
+
+  copy = g_strndup (data, size);
+  node = json_from_string (copy, NULL);
+
+  return recorder_anonymize_node (self, NULL, node);
+}
+
+static JsonObject *
+recorder_anonymize_query (CmNetRecorder *self,
+                          const char    *query)
+{
+  g_autoptr(GHashTable) params = NULL;
+  JsonObject *object;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (!query || !*query)
+    return NULL;
+
+  params = g_uri_parse_params (query, -1, "&", G_URI_PARAMS_NONE, NULL);
+
+  if (!params)
+    return NULL;
+
+  object = json_object_new ();
+  g_hash_table_iter_init (&iter, params);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_autofree char *anonymized = NULL;
+
+      anonymized = recorder_anonymize_string (self, key, value);
+      json_object_set_string_member (object, key, anonymized);
+    }
+
+  return object;
+}
+
+static void
+recorder_entry_free (gpointer data)
+{
+  RecorderEntry *entry = data;
+
+  g_free (entry->method);
+  g_free (entry->uri_path);
+  g_free (entry->query);
+  g_free (entry->request);
+  g_free (entry->response);
+  g_free (entry->error_message);
+  g_free (entry);
+}
+
+static void
+recorder_write (CmNetRecorder *self,
+                JsonObject    *object)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *line = NULL;
+  char *json;
+
+  if (g_atomic_int_get (&self->failed))
+    return;
+
+  json = cm_utils_json_object_to_string (object, FALSE);
+  line = g_strconcat (json, "\n", NULL);
+  g_free (json);
+
+  /* Flushed for each entry, so that the trace is usable even
+   * if the process ends before the recorder is finalized */
+  if (g_output_stream_write_all (self->stream, line, strlen (line), NULL, NULL, &error))
+    g_output_stream_flush (self->stream, NULL, &error);
+
+  if (error)
+    {
+      g_warning ("Error writing net trace: %s", error->message);
+      g_atomic_int_set (&self->failed, TRUE);
+    }
+}
+
+/* Run in the writer thread */
+static void
+recorder_write_entry (gpointer data,
+                      gpointer user_data)
+{
+  CmNetRecorder *self = user_data;
+  RecorderEntry *entry = data;
+  g_autoptr(JsonObject) object = NULL;
+  g_autofree char *path = NULL;
+  JsonObject *params;
+  JsonNode *node;
+
+  if (g_atomic_int_get (&self->failed))
+    {
+      recorder_entry_free (entry);
+      return;
+    }
+
+  path = cm_net_recorder_anonymize_path (self, entry->uri_path);
+
+  object = json_object_new ();
+  json_object_set_int_member (object, "time", entry->time);
+  json_object_set_int_member (object, "duration", entry->duration);
+  json_object_set_string_member (object, "method", entry->method);
+  json_object_set_string_member (object, "path", path);
+
+  params = recorder_anonymize_query (self, entry->query);
+  if (params)
+    json_object_set_object_member (object, "query", params);
+
+  node = recorder_anonymize_data (self, entry->request, entry->request_size);
+  if (node)
+    json_object_set_member (object, "request", node);
+  else if (entry->request_size)
+    json_object_set_int_member (object, "request_size", entry->request_size);
+
+  json_object_set_int_member (object, "status", entry->status);
+
+  node = recorder_anonymize_data (self, entry->response, entry->response_size);
+  if (node)
+    json_object_set_member (object, "response", node);
+  else if (entry->response_size)
+    json_object_set_int_member (object, "response_size", entry->response_size);
+
+  if (entry->error_message)
+    {
+      g_autoptr(GString) str = NULL;
+
+      str = g_string_new (NULL);
+      json_object_set_string_member (object, "error", cm_utils_anonymize (str, entry->error_message));
+    }
+
+  recorder_write (self, object);
+  recorder_entry_free (entry);
+}
+
+static void
+cm_net_recorder_finalize (GObject *object)
+{
+  CmNetRecorder *self = (CmNetRecorder *)object;
+
+  /* Write what's queued before closing */
+  if (self->writer)
+    g_thread_pool_free (self->writer, FALSE, TRUE);
+
+  if (self->stream)
+    g_output_stream_close (self->stream, NULL, NULL);
+
+  g_clear_object (&self->stream);
+
+  G_OBJECT_CLASS (cm_net_recorder_parent_class)->finalize (object);
+}
+
+static void
+cm_net_recorder_class_init (CmNetRecorderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = cm_net_recorder_finalize;
+}
+
+static void
+cm_net_recorder_init (CmNetRecorder *self)
+{
+  gcry_create_nonce (self->salt, sizeof self->salt);
+  self->start_time = g_get_monotonic_time ();
+  self->writer = g_thread_pool_new (recorder_write_entry, self, 1, FALSE, NULL);
+}
+
+/**
+ * cm_net_recorder_new:
+ * @file_name: The trace file path
+ * @error: A #GError
+ *
+ * Create a new recorder writing to @file_name.  Any
+ * existing file is replaced.
+ *
+ * Returns: (transfer full): A #CmNetRecorder, or %NULL
+ * if @file_name can't be written.
+ */
+CmNetRecorder *
+cm_net_recorder_new (const char  *file_name,
+                     GError     **error)
+{
+  g_autoptr(CmNetRecorder) self = NULL;
+  g_autoptr(GZlibCompressor) compressor = NULL;
+  g_autoptr(GFileOutputStream) stream = NULL;
+  g_autoptr(JsonObject) header = NULL;
+  g_autoptr(GFile) file = NULL;
+
+  g_return_val_if_fail (file_name && *file_name, NULL);
+
+  file = g_file_new_for_path (file_name);
+  stream = g_file_replace (file, NULL, FALSE,
+                           G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
+                           NULL, error);
+  if (!stream)
+    return NULL;
+
+  self = g_object_new (CM_TYPE_NET_RECORDER, NULL);
+  compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  self->stream = g_converter_output_stream_new (G_OUTPUT_STREAM (stream),
+                                                G_CONVERTER (compressor));
+
+  header = json_object_new ();
+  json_object_set_int_member (header, "version", TRACE_VERSION);
+  json_object_set_int_member (header, "created", g_get_real_time () / 1000);
+  recorder_write (self, header);
+
+  if (g_atomic_int_get (&self->failed))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to write to '%s'", file_name);
+      return NULL;
+    }
+
+  return g_steal_pointer (&self);
+}
+
+/**
+ * cm_net_recorder_get_default:
+ *
+ * Get the recorder enabled with the CMATRIX_NET_TRACE
+ * environment variable.
+ *
+ * Returns: (transfer full) (nullable): A #CmNetRecorder
+ */
+CmNetRecorder *
+cm_net_recorder_get_default (void)
+{
+  static CmNetRecorder *recorder;
+  static gsize initialized;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *file_name;
+
+      file_name = g_getenv ("CMATRIX_NET_TRACE");
+
+      if (file_name && *file_name)
+        {
+          g_autoptr(GError) error = NULL;
+
+          recorder = cm_net_recorder_new (file_name, &error);
+
+          if (error)
+            g_warning ("Error creating net trace: %s", error->message);
+          else
+            g_debug ("Recording network requests to '%s'", file_name);
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return recorder ? g_object_ref (recorder) : NULL;
+}
+
+/**
+ * cm_net_recorder_add:
+ * @self: A #CmNetRecorder
+ * @method: The request method
+ * @uri_path: The request path
+ * @query: (nullable): The request query string
+ * @request: (nullable): The request body
+ * @request_size: The size of @request
+ * @status: The response status code
+ * @response: (nullable): The response body
+ * @response_size: The size of @response
+ * @start_time: The monotonic time the request was made
+ * @error_message: (nullable): The error, if the request failed
+ *
+ * Add the request and its response to the trace.  The
+ * entry is written in the background.
+ */
+void
+cm_net_recorder_add (CmNetRecorder *self,
+                     const char    *method,
+                     const char    *uri_path,
+                     const char    *query,
+                     const char    *request,
+                     gsize          request_size,
+                     guint          status,
+                     const char    *response,
+                     gsize          response_size,
+                     gint64         start_time,
+                     const char    *error_message)
+{
+  RecorderEntry *entry;
+
+  g_return_if_fail (CM_IS_NET_RECORDER (self));
+  g_return_if_fail (method && uri_path);
+
+  if (g_atomic_int_get (&self->failed))
+    return;
+
+  /* Copied, the data may be gone before the entry is written */
+  entry = g_new0 (RecorderEntry, 1);
+  entry->method = g_strdup (method);
+  entry->uri_path = g_strdup (uri_path);
+  entry->query = g_strdup (query);
+  entry->request = request ? g_strndup (request, request_size) : NULL;
+  entry->request_size = request_size;
+  entry->status = status;
+  entry->response = response ? g_strndup (response, response_size) : NULL;
+  entry->response_size = response_size;
+  entry->time = (start_time - self->start_time) / 1000;
+  entry->duration = (g_get_monotonic_time () - start_time) / 1000;
+  entry->error_message = g_strdup (error_message);
+
+  g_thread_pool_push (self->writer, entry, NULL);
+}
+
+/**
+ * cm_net_recorder_anonymize_path:
+ * @self: A #CmNetRecorder
+ * @uri_path: A request path
+ *
+ * Anonymize @uri_path the same way ids in json are
+ * anonymized, so that paths built from anonymized
+ * responses match the recorded paths.
+ *
+ * Returns: (transfer full): The anonymized path
+ */
+char *
+cm_net_recorder_anonymize_path (CmNetRecorder *self,
+                                const char    *uri_path)
+{
+  g_auto(GStrv) segments = NULL;
+  GString *str;
+  guint media_segment = 0;
+
+  g_return_val_if_fail (CM_IS_NET_RECORDER (self), NULL);
+  g_return_val_if_fail (uri_path, NULL);
+
+  segments = g_strsplit (uri_path, "/", -1);
+  str = g_string_new (NULL);
+
+  for (guint i = 0; segments[i]; i++)
+    {
+      g_autofree char *segment = NULL;
+      g_autofree char *anonymized = NULL;
+
+      if (i)
+        g_string_append_c (str, '/');
+
+      segment = g_uri_unescape_string (segments[i], NULL);
+
+      if (!segment)
+        segment = g_strdup (segments[i]);
+
+      /* .../download/{serverName}/{mediaId} */
+      if (media_segment == 1)
+        anonymized = recorder_hash_server (self, segment);
+      else if (media_segment == 2)
+        anonymized = recorder_hash (self, segment, -1);
+      else if (recorder_is_id (segment))
+        anonymized = recorder_pseudonymize (self, segment);
+
+      if (media_segment)
+        media_segment = (media_segment + 1) % 3;
+
+      if (g_str_equal (segment, "download") ||
+          g_str_equal (segment, "thumbnail"))
+        media_segment = 1;
+
+      g_string_append (str, anonymized ?: segments[i]);
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+/**
+ * cm_net_recorder_anonymize_json:
+ * @self: A #CmNetRecorder
+ * @node: A #JsonNode
+ *
+ * Returns: (transfer full): An anonymized copy of @node
+ */
+JsonNode *
+cm_net_recorder_anonymize_json (CmNetRecorder *self,
+                                JsonNode      *node)
+{
+  g_return_val_if_fail (CM_IS_NET_RECORDER (self), NULL);
+
+  return recorder_anonymize_node (self, NULL, node);
+}
+
+/**
+ * cm_net_recorder_load:
+ * @file_name: A trace file path
+ * @error: A #GError
+ *
+ * Load the entries of a trace written with #CmNetRecorder,
+ * in the order the requests completed.
+ *
+ * Returns: (transfer full): An array of #JsonObject
+ */
+GPtrArray *
+cm_net_recorder_load (const char  *file_name,
+                      GError     **error)
+{
+  g_autoptr(GZlibDecompressor) decompressor = NULL;
+  g_autoptr(GDataInputStream) data_stream = NULL;
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GFileInputStream) file_stream = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autoptr(GFile) file = NULL;
+  gboolean has_header = FALSE;
+
+  g_return_val_if_fail (file_name && *file_name, NULL);
+
+  file = g_file_new_for_path (file_name);
+  file_stream = g_file_read (file, NULL, error);
+
+  if (!file_stream)
+    return NULL;
+
+  decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  stream = g_converter_input_stream_new (G_INPUT_STREAM (file_stream),
+                                         G_CONVERTER (decompressor));
+  data_stream = g_data_input_stream_new (stream);
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify)json_object_unref);
+
+  while (TRUE)
+    {
+      g_autoptr(GError) local_error = NULL;
+      g_autofree char *line = NULL;
+      JsonObject *object;
+
+      line = g_data_input_stream_read_line_utf8 (data_stream, NULL, NULL, &local_error);
+
+      /* The recorder didn't get to finish the trace */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT))
+        break;
+
+      if (local_error)
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return NULL;
+        }
+
+      if (!line)
+        break;
+
+      if (!*line)
+        continue;
+
+      object = cm_utils_string_to_json_object (line);
+
+      if (!object)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Invalid entry in '%s'", file_name);
+          return NULL;
+        }
+
+      if (!has_header)
+        {
+          has_header = TRUE;
+
+          if (cm_utils_json_object_get_int (object, "version") != TRACE_VERSION)
+            {
+              json_object_unref (object);
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "'%s' is not a supported trace", file_name);
+              return NULL;
+            }
+
+          json_object_unref (object);
+          continue;
+        }
+
+      g_ptr_array_add (entries, object);
+    }
+
+  return g_steal_pointer (&entries);
+}
@@ -18,6 +18,11 @@
 #include "cm-enums.h"
 #include "cm-enc-private.h"
 #include "cm-input-stream-private.h"
+#include "cm-net-recorder-private.h"
+#include "cm-net-pool-private.h"
+#include "cm-matrix-private.h"
+#include "cm-stats-private.h"
+#include "cm-trace-private.h"
 #include "cm-net-private.h"
 
 /**
@@ -26,24 +31,214 @@
  * Matrix Network related methods
  */
 
-#define MAX_CONNECTIONS     4
 #define DATA_BLOCK_SIZE     8192
+/* The priorities of requests, from -2 to 2 */
+#define REQUEST_PRIORITY_N  5
+/* Beyond this, or when rate limited, low priority requests are dropped */
+#define MAX_QUEUED_REQUESTS 64
+#define MAX_REQUEUES        3
+/* If the server didn't say how long to wait */
+#define DEFAULT_RETRY_AFTER 5000 /* milliseconds */
 
 struct _CmNet
 {
   GObject         parent_instance;
 
+  /* The sessions are shared with other CmNet, see CmNetPool */
+  CmNetPool      *pool;
   SoupSession    *soup_session;
   SoupSession    *file_session;
   GCancellable   *cancellable;
   char           *homeserver;
   char           *access_token;
+  /* Set only when requests are recorded */
+  CmNetRecorder  *recorder;
+
+  /* Requests are rate limited per origin, shared in the pool */
+  char           *origin;
+  /* Requests waiting for the rate limit, the highest priority first */
+  GQueue          request_queue[REQUEST_PRIORITY_N];
+  guint           request_dispatch_id;
+
+  /* Media transfers waiting for a free slot, one per CmTransferPriority.
+   * The slots are limited by the pool, and so shared with other CmNet */
+  GQueue          transfer_queue[CM_TRANSFER_PRIORITY_N];
+  guint           n_active_transfers;
+  guint           dispatch_id;
 };
 
+typedef void (*NetTransferStart) (CmNet *self,
+                                  GTask *task);
+
+typedef struct {
+  CmNet        *net;
+  GMainContext *context;
+  char         *host;
+  gint64        trace_begin;
+} TransferSlot;
+
 
 G_DEFINE_TYPE (CmNet, cm_net, G_TYPE_OBJECT)
 
 
+static void net_transfer_dispatch_later (CmNet *self);
+
+static gboolean
+transfer_slot_release (gpointer data)
+{
+  TransferSlot *slot = data;
+  CmNet *self = slot->net;
+
+  g_assert (CM_IS_NET (self));
+  g_assert (self->n_active_transfers > 0);
+  self->n_active_transfers--;
+
+  CM_TRACE_SPAN (slot->trace_begin, "transfer", "%s", slot->host);
+  /* Also dispatches the queue of every CmNet sharing the pool */
+  cm_net_pool_remove_transfer (self->pool, slot->host);
+
+  g_main_context_unref (slot->context);
+  g_object_unref (slot->net);
+  g_free (slot->host);
+  g_free (slot);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The stream holding the slot may be finalized in a worker thread,
+ * so always do the book keeping in the context the transfer was started */
+static void
+transfer_slot_free (gpointer data)
+{
+  TransferSlot *slot = data;
+
+  g_main_context_invoke (slot->context, transfer_slot_release, slot);
+}
+
+/* Returns %TRUE if @task was removed from the queue */
+static gboolean
+net_transfer_try_start (CmNet *self,
+                        GTask *task)
+{
+  NetTransferStart start;
+  GCancellable *cancellable;
+  TransferSlot *slot;
+  const char *host;
+  gulong handler;
+
+  cancellable = g_task_get_cancellable (task);
+  host = g_object_get_data (G_OBJECT (task), "transfer-host");
+
+  if (!g_cancellable_is_cancelled (cancellable) &&
+      !cm_net_pool_can_transfer (self->pool, host))
+    return FALSE;
+
+  handler = GPOINTER_TO_SIZE (g_object_get_data (G_OBJECT (task), "transfer-cancel-id"));
+  g_cancellable_disconnect (cancellable, handler);
+
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return TRUE;
+    }
+
+  slot = g_new0 (TransferSlot, 1);
+  slot->net = g_object_ref (self);
+  slot->context = g_main_context_ref_thread_default ();
+  slot->host = g_strdup (host);
+  slot->trace_begin = CM_TRACE_BEGIN ();
+  cm_net_pool_add_transfer (self->pool, host);
+  self->n_active_transfers++;
+
+  /* The slot is released when the task is finalized, unless moved
+   * somewhere else (eg: the stream the file is being read from) */
+  g_object_set_data_full (G_OBJECT (task), "transfer-slot", slot, transfer_slot_free);
+
+  start = g_object_get_data (G_OBJECT (task), "transfer-start");
+  start (self, task);
+
+  return TRUE;
+}
+
+static gboolean
+net_transfer_dispatch (gpointer user_data)
+{
+  CmNet *self = user_data;
+
+  g_assert (CM_IS_NET (self));
+
+  self->dispatch_id = 0;
+
+  /* Start as many as possible in the order of priority, but don't let
+   * a busy host block transfers from others */
+  for (guint i = 0; i < CM_TRANSFER_PRIORITY_N; i++)
+    {
+      GList *node = self->transfer_queue[i].head;
+
+      while (node)
+        {
+          GList *next = node->next;
+
+          if (net_transfer_try_start (self, node->data))
+            g_queue_delete_link (&self->transfer_queue[i], node);
+
+          node = next;
+        }
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+net_transfer_dispatch_later (CmNet *self)
+{
+  if (!self->dispatch_id)
+    self->dispatch_id = g_idle_add (net_transfer_dispatch, self);
+}
+
+static void
+net_transfer_cancelled_cb (GCancellable *cancellable,
+                           CmNet        *self)
+{
+  /* The queue is swept on dispatch, which can't be done from here
+   * as the handler can't be disconnected within the callback */
+  net_transfer_dispatch_later (self);
+}
+
+/*
+ * Queue @task to be run with @start when a slot is free.
+ * Takes ownership of @task.
+ */
+static void
+net_transfer_queue (CmNet              *self,
+                    GTask              *task,
+                    SoupMessage        *msg,
+                    CmTransferPriority  priority,
+                    NetTransferStart    start)
+{
+  GCancellable *cancellable;
+  const char *host;
+  gulong handler = 0;
+
+  g_assert (CM_IS_NET (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (SOUP_IS_MESSAGE (msg));
+  g_assert (priority < CM_TRANSFER_PRIORITY_N);
+
+  host = g_uri_get_host (soup_message_get_uri (msg));
+  g_object_set_data_full (G_OBJECT (task), "transfer-host", g_strdup (host ?: ""), g_free);
+  g_object_set_data (G_OBJECT (task), "transfer-start", start);
+
+  cancellable = g_task_get_cancellable (task);
+  if (cancellable)
+    handler = g_cancellable_connect (cancellable, G_CALLBACK (net_transfer_cancelled_cb),
+                                     self, NULL);
+  g_object_set_data (G_OBJECT (task), "transfer-cancel-id", GSIZE_TO_POINTER (handler));
+
+  g_queue_push_tail (&self->transfer_queue[priority], task);
+  net_transfer_dispatch_later (self);
+}
+
 static void
 net_get_file_stream_cb (GObject      *obj,
                         GAsyncResult *result,
@@ -52,6 +247,7 @@ net_get_file_stream_cb (GObject      *obj,
   CmNet *self;
   g_autoptr(GTask) task = user_data;
   GInputStream *stream;
+  SoupMessage *msg;
   GError *error = NULL;
 
   g_assert (G_IS_TASK (task));
@@ -61,20 +257,62 @@ net_get_file_stream_cb (GObject      *obj,
 
   stream = soup_session_send_finish (SOUP_SESSION (obj), result, &error);
 
+  msg = g_object_get_data (user_data, "msg");
+
+  if (!error && soup_message_get_status (msg) == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE)
+    {
+      g_clear_object (&stream);
+      error = g_error_new (G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                           "Requested range not satisfiable");
+    }
+  else if (!error && !SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (msg)))
+    {
+      g_clear_object (&stream);
+      error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Failed to get file: %u %s",
+                           soup_message_get_status (msg),
+                           soup_message_get_reason_phrase (msg));
+    }
+
   if (error)
     {
       g_task_return_error (task, error);
     }
   else
     {
+      SoupMessageHeaders *headers;
       CmInputStream *cm_stream;
       CmEncFileInfo *enc_file;
+      gint64 content_length;
+      goffset start = 0, end, total;
 
       cm_stream = cm_input_stream_new (stream);
+      g_object_unref (stream);
 
       enc_file = g_object_get_data (user_data, "file");
       cm_input_stream_set_file_enc (cm_stream, enc_file);
 
+      /* Used to validate the downloaded file */
+      headers = soup_message_get_response_headers (msg);
+      content_length = soup_message_headers_get_content_length (headers);
+      g_object_set_data_full (G_OBJECT (cm_stream), "content-length",
+                              g_memdup2 (&content_length, sizeof (content_length)), g_free);
+      g_object_set_data_full (G_OBJECT (cm_stream), "content-encoding",
+                              g_strdup (soup_message_headers_get_one (headers, "Content-Encoding")),
+                              g_free);
+
+      /* The server may ignore the Range header and send the whole file */
+      if (soup_message_get_status (msg) != SOUP_STATUS_PARTIAL_CONTENT ||
+          !soup_message_headers_get_content_range (headers, &start, &end, &total))
+        start = 0;
+      g_object_set_data_full (G_OBJECT (cm_stream), "range-start",
+                              g_memdup2 (&start, sizeof (start)), g_free);
+
+      /* Keep the transfer slot until the content is read */
+      g_object_set_data_full (G_OBJECT (cm_stream), "transfer-slot",
+                              g_object_steal_data (user_data, "transfer-slot"),
+                              transfer_slot_free);
+
       g_task_return_pointer (task, cm_stream, g_object_unref);
     }
 }
@@ -89,10 +327,14 @@ parse_from_data (GTask        *task,
   JsonNode *root = NULL;
   GError *error = NULL;
   GByteArray *content;
+  gint64 trace_begin;
 
+  trace_begin = CM_TRACE_BEGIN ();
   content = g_object_get_data (G_OBJECT (task), "content");
   parser = json_parser_new ();
   json_parser_load_from_data (parser, (char *)content->data, -1, &error);
+  CM_TRACE_SPAN (trace_begin, "parse", "%" G_GSIZE_FORMAT " bytes",
+                 GPOINTER_TO_SIZE (g_object_get_data (G_OBJECT (task), "pos")));
 
   if (!error)
     {
@@ -129,6 +371,155 @@ parse_from_data (GTask        *task,
                              "Received invalid data");
 }
 
+static SoupMessage *
+net_task_get_message (GTask *task)
+{
+  gpointer data = g_task_get_task_data (task);
+
+  /* File uploads keep the message in the task they are run for */
+  if (G_IS_TASK (data))
+    return g_object_get_data (data, "msg");
+
+  return data;
+}
+
+static void
+net_record (CmNet      *self,
+            GTask      *task,
+            const char *response,
+            gsize       size,
+            GError     *error)
+{
+  SoupMessage *msg;
+  GBytes *request;
+  GUri *uri;
+  gint64 *start_time;
+
+  g_assert (CM_IS_NET (self));
+  g_assert (self->recorder);
+
+  msg = net_task_get_message (task);
+  uri = soup_message_get_uri (msg);
+  request = g_object_get_data (G_OBJECT (task), "request-body");
+  start_time = g_object_get_data (G_OBJECT (task), "start-time");
+
+  cm_net_recorder_add (self->recorder,
+                       soup_message_get_method (msg),
+                       g_uri_get_path (uri),
+                       g_uri_get_query (uri),
+                       request ? g_bytes_get_data (request, NULL) : NULL,
+                       request ? g_bytes_get_size (request) : 0,
+                       soup_message_get_status (msg),
+                       response, size,
+                       start_time ? *start_time : g_get_monotonic_time (),
+                       error ? error->message : NULL);
+}
+
+static void
+net_add_stats (GTask    *task,
+               gsize     received,
+               gboolean  failed)
+{
+  SoupMessage *msg;
+  gint64 *start_time;
+  goffset sent;
+
+  msg = net_task_get_message (task);
+  start_time = g_object_get_data (G_OBJECT (task), "start-time");
+  sent = soup_message_headers_get_content_length (soup_message_get_request_headers (msg));
+
+  cm_stats_add_request (cm_stats_get_default (),
+                        soup_message_get_method (msg),
+                        g_uri_get_path (soup_message_get_uri (msg)),
+                        sent, received,
+                        g_get_monotonic_time () - *start_time,
+                        failed);
+  CM_TRACE_SPAN (*start_time, "http", "%s %s: %u",
+                 soup_message_get_method (msg),
+                 g_uri_get_path (soup_message_get_uri (msg)),
+                 soup_message_get_status (msg));
+}
+
+static void net_request_queue    (CmNet *self,
+                                  GTask *task);
+static void net_request_dispatch (CmNet *self);
+
+static void
+net_copy_header (const char *name,
+                 const char *value,
+                 gpointer    user_data)
+{
+  soup_message_headers_append (user_data, name, value);
+}
+
+/*
+ * Set the retry time of the server from the response of
+ * @task, which was rate limited, and get if @task should
+ * be queued again, in which case it's made ready for that.
+ */
+static gboolean
+net_request_limited (CmNet      *self,
+                     GTask      *task,
+                     const char *response)
+{
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(SoupMessage) message = NULL;
+  SoupMessage *msg;
+  GBytes *body;
+  const char *header;
+  guint retry_after = 0;
+  guint n_retries;
+  int priority;
+
+  msg = net_task_get_message (task);
+  root = cm_utils_string_to_json_object (response);
+
+  if (root)
+    retry_after = cm_utils_json_object_get_int (root, "retry_after_ms");
+
+  header = soup_message_headers_get_one (soup_message_get_response_headers (msg), "Retry-After");
+  if (!retry_after && header)
+    retry_after = g_ascii_strtoull (header, NULL, 10) * 1000;
+
+  if (!retry_after)
+    retry_after = DEFAULT_RETRY_AFTER;
+
+  g_debug ("Rate limited on %s, retry after %u ms",
+           g_uri_get_path (soup_message_get_uri (msg)), retry_after);
+  cm_net_pool_set_retry_after (self->pool, self->origin, retry_after);
+  cm_stats_add_count (cm_stats_get_default (), "net/rate-limited", 1);
+
+  /* Low priority requests are given up first, the caller can try later */
+  priority = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "priority"));
+  n_retries = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "retries"));
+
+  /* File uploads are not queued as requests */
+  if (!SOUP_IS_MESSAGE (g_task_get_task_data (task)) ||
+      priority < 0 || n_retries >= MAX_REQUEUES)
+    return FALSE;
+
+  g_object_set_data (G_OBJECT (task), "retries", GUINT_TO_POINTER (n_retries + 1));
+  g_object_set_data (G_OBJECT (task), "pos", NULL);
+  g_object_set_data (G_OBJECT (task), "stream", NULL);
+  g_object_set_data (G_OBJECT (task), "content", NULL);
+
+  /* Send a copy, the message has its response set */
+  message = soup_message_new_from_uri (soup_message_get_method (msg),
+                                       soup_message_get_uri (msg));
+  soup_message_headers_foreach (soup_message_get_request_headers (msg), net_copy_header,
+                                soup_message_get_request_headers (message));
+  soup_message_set_priority (message, soup_message_get_priority (msg));
+
+  body = g_object_get_data (G_OBJECT (task), "request-body");
+  if (body)
+    soup_message_set_request_body_from_bytes (message, "application/json", body);
+
+  g_task_set_task_data (task, g_steal_pointer (&message), g_object_unref);
+  cm_stats_add_count (cm_stats_get_default (), "net/requeued", 1);
+
+  return TRUE;
+}
+
 static void
 read_from_stream (GObject      *object,
                   GAsyncResult *result,
@@ -153,6 +544,8 @@ read_from_stream (GObject      *object,
 
   if (n_bytes < 0)
     {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        net_add_stats (task, pos, TRUE);
       g_task_return_error (task, error);
     }
   else if (n_bytes > 0)
@@ -174,7 +567,23 @@ read_from_stream (GObject      *object,
     }
   else
     {
+      CmNet *self;
+      SoupMessage *msg;
+
       content->data[pos] = 0;
+      self = g_task_get_source_object (task);
+      msg = net_task_get_message (task);
+      net_add_stats (task, pos, !SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (msg)));
+
+      if (self->recorder)
+        net_record (self, task, (char *)content->data, pos, NULL);
+
+      if (soup_message_get_status (msg) == SOUP_STATUS_TOO_MANY_REQUESTS &&
+          net_request_limited (self, task, (char *)content->data))
+        {
+          net_request_queue (self, g_steal_pointer (&task));
+          return;
+        }
 
       if (*(content->data) != '{' &&
           content->len < 1024 &&
@@ -201,8 +610,16 @@ session_send_cb (GObject      *object,
   stream = soup_session_send_finish (SOUP_SESSION (object), result, &error);
 
   if (error) {
+    CmNet *self = g_task_get_source_object (task);
+
     if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-      g_debug ("Error session send: %s", error->message);
+      {
+        g_debug ("Error session send: %s", error->message);
+        net_add_stats (task, 0, TRUE);
+
+        if (self->recorder)
+          net_record (self, task, NULL, 0, error);
+      }
     g_task_return_error (task, error);
     return;
   }
@@ -222,6 +639,195 @@ session_send_cb (GObject      *object,
                              g_steal_pointer (&task));
 }
 
+/* From the highest priority to the lowest */
+static guint
+net_request_get_index (int priority)
+{
+  return 2 - CLAMP (priority, -2, 2);
+}
+
+static void
+net_request_send (CmNet *self,
+                  GTask *task)
+{
+  SoupMessage *msg;
+  gint64 start_time, *queue_time;
+
+  g_assert (CM_IS_NET (self));
+  g_assert (G_IS_TASK (task));
+
+  msg = g_task_get_task_data (task);
+  start_time = g_get_monotonic_time ();
+  queue_time = g_object_get_data (G_OBJECT (task), "queue-time");
+  cm_stats_add_time (cm_stats_get_default (), "net/queue-wait", start_time - *queue_time);
+  g_object_set_data_full (G_OBJECT (task), "start-time",
+                          g_memdup2 (&start_time, sizeof (start_time)), g_free);
+
+  soup_session_send_async (self->soup_session, msg, soup_message_get_priority (msg),
+                           g_task_get_cancellable (task),
+                           session_send_cb, task);
+}
+
+static void
+net_request_dispatch_cb (gpointer user_data)
+{
+  CmNet *self = user_data;
+
+  g_assert (CM_IS_NET (self));
+
+  self->request_dispatch_id = 0;
+  net_request_dispatch (self);
+}
+
+static void
+net_request_dispatch_later (CmNet *self,
+                            guint  delay)
+{
+  g_clear_handle_id (&self->request_dispatch_id, g_source_remove);
+  self->request_dispatch_id = g_timeout_add_once (delay, net_request_dispatch_cb, self);
+}
+
+static void
+net_request_cancelled_cb (GCancellable *cancellable,
+                          CmNet        *self)
+{
+  /* Swept on dispatch, see net_transfer_cancelled_cb() */
+  net_request_dispatch_later (self, 0);
+}
+
+static void
+net_request_take (CmNet *self,
+                  GTask *task)
+{
+  gulong handler;
+
+  handler = GPOINTER_TO_SIZE (g_object_get_data (G_OBJECT (task), "request-cancel-id"));
+  g_cancellable_disconnect (g_task_get_cancellable (task), handler);
+  g_object_set_data (G_OBJECT (task), "request-cancel-id", NULL);
+}
+
+static gboolean
+net_request_under_pressure (CmNet *self)
+{
+  guint n_queued = 0;
+
+  if (cm_net_pool_get_retry_after (self->pool, self->origin))
+    return TRUE;
+
+  for (guint i = 0; i < REQUEST_PRIORITY_N; i++)
+    n_queued += self->request_queue[i].length;
+
+  return n_queued >= MAX_QUEUED_REQUESTS;
+}
+
+static void
+net_request_dispatch (CmNet *self)
+{
+  g_autoptr(GPtrArray) cancelled = NULL;
+  g_autoptr(GPtrArray) dropped = NULL;
+  GTask *task;
+  guint wait_ms;
+
+  g_assert (CM_IS_NET (self));
+
+  g_clear_handle_id (&self->request_dispatch_id, g_source_remove);
+  cancelled = g_ptr_array_new_with_free_func (g_object_unref);
+  dropped = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < REQUEST_PRIORITY_N; i++)
+    {
+      GList *node = self->request_queue[i].head;
+
+      while (node)
+        {
+          GList *next = node->next;
+
+          if (g_cancellable_is_cancelled (g_task_get_cancellable (node->data)))
+            {
+              g_ptr_array_add (cancelled, node->data);
+              g_queue_delete_link (&self->request_queue[i], node);
+            }
+
+          node = next;
+        }
+    }
+
+  /* Leave the room to what matters when the server can't keep up */
+  if (net_request_under_pressure (self))
+    for (guint i = net_request_get_index (-1); i < REQUEST_PRIORITY_N; i++)
+      while ((task = g_queue_pop_head (&self->request_queue[i])))
+        g_ptr_array_add (dropped, task);
+
+  for (guint i = 0; i < REQUEST_PRIORITY_N; i++)
+    {
+      while ((task = g_queue_peek_head (&self->request_queue[i])))
+        {
+          if (!cm_net_pool_take_token (self->pool, self->origin, &wait_ms))
+            {
+              net_request_dispatch_later (self, wait_ms);
+              goto end;
+            }
+
+          g_queue_pop_head (&self->request_queue[i]);
+          net_request_take (self, task);
+          net_request_send (self, task);
+        }
+    }
+
+ end:
+  /* The callbacks may queue more, so run them once done with the queues */
+  for (guint i = 0; i < cancelled->len; i++)
+    {
+      task = cancelled->pdata[i];
+      net_request_take (self, task);
+      g_task_return_error_if_cancelled (task);
+    }
+
+  for (guint i = 0; i < dropped->len; i++)
+    {
+      task = dropped->pdata[i];
+      net_request_take (self, task);
+      g_debug ("Dropped request, too many requests");
+      cm_stats_add_count (cm_stats_get_default (), "net/dropped", 1);
+      g_object_set_data (G_OBJECT (task), "retry-after",
+                         GUINT_TO_POINTER (cm_net_pool_get_retry_after (self->pool, self->origin)));
+      g_task_return_new_error (task, CM_ERROR, CM_ERROR_LIMIT_EXCEEDED,
+                               "Too many requests");
+    }
+}
+
+/*
+ * Queue @task to be sent in the order of priority
+ * once the rate limit allows.  Takes ownership of @task.
+ */
+static void
+net_request_queue (CmNet *self,
+                   GTask *task)
+{
+  GCancellable *cancellable;
+  gint64 queue_time;
+  gulong handler = 0;
+  int priority;
+
+  g_assert (CM_IS_NET (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (SOUP_IS_MESSAGE (g_task_get_task_data (task)));
+
+  queue_time = g_get_monotonic_time ();
+  g_object_set_data_full (G_OBJECT (task), "queue-time",
+                          g_memdup2 (&queue_time, sizeof (queue_time)), g_free);
+
+  cancellable = g_task_get_cancellable (task);
+  if (cancellable)
+    handler = g_cancellable_connect (cancellable, G_CALLBACK (net_request_cancelled_cb),
+                                     self, NULL);
+  g_object_set_data (G_OBJECT (task), "request-cancel-id", GSIZE_TO_POINTER (handler));
+
+  priority = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "priority"));
+  g_queue_push_tail (&self->request_queue[net_request_get_index (priority)], task);
+  net_request_dispatch (self);
+}
+
 /*
  * queue_data:
  * @data: (transfer full)
@@ -240,7 +846,6 @@ queue_data (CmNet      *self,
   g_autoptr(SoupMessage) message = NULL;
   g_autoptr(GUri) uri = NULL;
   GUri *old_uri;
-  GCancellable *cancellable;
   SoupMessagePriority msg_priority;
   int priority = 0;
 
@@ -292,13 +897,14 @@ queue_data (CmNet      *self,
     g_autoptr(GBytes) content_data = g_bytes_new_take (data, size);
 
     soup_message_set_request_body_from_bytes (message, "application/json", content_data);
-  }
 
-  cancellable = g_task_get_cancellable (task);
-  g_task_set_task_data (task, g_object_ref (message), g_object_unref);
+    /* Kept to record, or to resend when rate limited */
+    g_object_set_data_full (G_OBJECT (task), "request-body",
+                            g_bytes_ref (content_data), (GDestroyNotify)g_bytes_unref);
+  }
 
-  soup_session_send_async (self->soup_session, message, msg_priority, cancellable,
-                           session_send_cb, task);
+  g_task_set_task_data (task, g_steal_pointer (&message), g_object_unref);
+  net_request_queue (self, task);
 }
 
 static void
@@ -309,14 +915,23 @@ cm_net_finalize (GObject *object)
   if (self->cancellable)
     g_cancellable_cancel (self->cancellable);
 
-  soup_session_abort (self->soup_session);
-  soup_session_abort (self->file_session);
+  /* Queued transfers and running ones (via their slots) hold
+   * a reference, so the queues are empty at this point */
+  g_clear_handle_id (&self->dispatch_id, g_source_remove);
+  g_clear_handle_id (&self->request_dispatch_id, g_source_remove);
+
+  /* Every request holds a reference, so there is nothing left
+   * to abort, and the sessions may still be used by others */
+  if (self->soup_session)
+    cm_net_pool_release_session (self->pool, g_steal_pointer (&self->soup_session));
 
   g_clear_object (&self->cancellable);
-  g_clear_object (&self->soup_session);
   g_clear_object (&self->file_session);
+  g_clear_object (&self->recorder);
+  g_clear_object (&self->pool);
 
   g_free (self->homeserver);
+  g_free (self->origin);
   g_clear_pointer (&self->access_token, gcry_free);
 
   G_OBJECT_CLASS (cm_net_parent_class)->finalize (object);
@@ -333,13 +948,23 @@ cm_net_class_init (CmNetClass *klass)
 static void
 cm_net_init (CmNet *self)
 {
-  self->soup_session = g_object_new (SOUP_TYPE_SESSION,
-                                     "max-conns-per-host", MAX_CONNECTIONS,
-                                     NULL);
-  self->file_session = g_object_new (SOUP_TYPE_SESSION,
-                                     "max-conns-per-host", MAX_CONNECTIONS,
-                                     NULL);
+  CmNetPool *pool;
+
+  /* Without a CmMatrix (eg: in tests), nothing is shared */
+  pool = cm_matrix_get_net_pool ();
+  self->pool = pool ? g_object_ref (pool) : cm_net_pool_new ();
+  self->file_session = g_object_ref (cm_net_pool_get_file_session (self->pool));
+  g_signal_connect_object (self->pool, "transfer-released",
+                           G_CALLBACK (net_transfer_dispatch_later), self,
+                           G_CONNECT_SWAPPED);
   self->cancellable = g_cancellable_new ();
+  self->recorder = cm_net_recorder_get_default ();
+
+  for (guint i = 0; i < CM_TRANSFER_PRIORITY_N; i++)
+    g_queue_init (&self->transfer_queue[i]);
+
+  for (guint i = 0; i < REQUEST_PRIORITY_N; i++)
+    g_queue_init (&self->request_queue[i]);
 }
 
 CmNet *
@@ -355,8 +980,18 @@ cm_net_set_homeserver (CmNet      *self,
   g_return_if_fail (CM_IS_NET (self));
   g_return_if_fail (homeserver && *homeserver);
 
+  if (g_strcmp0 (self->homeserver, homeserver) == 0)
+    return;
+
   g_free (self->homeserver);
   self->homeserver = g_strdup (homeserver);
+  g_free (self->origin);
+  self->origin = cm_net_pool_get_origin (homeserver);
+
+  /* Requests already sent keep a reference to the old session */
+  if (self->soup_session)
+    cm_net_pool_release_session (self->pool, g_steal_pointer (&self->soup_session));
+  self->soup_session = cm_net_pool_acquire_session (self->pool, homeserver);
 }
 
 void
@@ -374,6 +1009,76 @@ cm_net_set_access_token (CmNet      *self,
     }
 }
 
+/**
+ * cm_net_get_retry_after:
+ * @self: A #CmNet
+ *
+ * Get the time the server asked to wait before
+ * making requests again, the last time it rate
+ * limited any of the clients on it.
+ *
+ * Returns: The time left in milliseconds, or 0
+ */
+guint
+cm_net_get_retry_after (CmNet *self)
+{
+  g_return_val_if_fail (CM_IS_NET (self), 0);
+
+  if (!self->origin)
+    return 0;
+
+  return cm_net_pool_get_retry_after (self->pool, self->origin);
+}
+
+static void
+net_preconnect_cb (GObject      *object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  g_autofree gint64 *start_time = user_data;
+  g_autoptr(GError) error = NULL;
+
+  if (soup_session_preconnect_finish (SOUP_SESSION (object), result, &error))
+    cm_stats_add_time (cm_stats_get_default (), "net/preconnect",
+                       g_get_monotonic_time () - *start_time);
+  else if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_debug ("Preconnect failed: %s", error->message);
+}
+
+/**
+ * cm_net_preconnect:
+ * @self: A #CmNet
+ *
+ * Open a connection to the homeserver (and do the TLS
+ * handshake) ahead of the first request, so that it
+ * doesn't have to wait for it.  Eg: while the client
+ * is loaded from the db.  The connection is idle in the
+ * session until a request uses it.
+ */
+void
+cm_net_preconnect (CmNet *self)
+{
+  g_autoptr(SoupMessage) message = NULL;
+  g_autofree char *uri = NULL;
+  gint64 *start_time;
+
+  g_return_if_fail (CM_IS_NET (self));
+
+  if (!self->soup_session || !self->homeserver)
+    return;
+
+  uri = g_strconcat (self->homeserver, "/_matrix/client/versions", NULL);
+  message = soup_message_new (SOUP_METHOD_GET, uri);
+
+  if (!message)
+    return;
+
+  start_time = g_new (gint64, 1);
+  *start_time = g_get_monotonic_time ();
+  soup_session_preconnect_async (self->soup_session, message, G_PRIORITY_DEFAULT,
+                                 self->cancellable, net_preconnect_cb, start_time);
+}
+
 const char *
 cm_net_get_access_token (CmNet *self)
 {
@@ -382,6 +1087,25 @@ cm_net_get_access_token (CmNet *self)
   return self->access_token;
 }
 
+/**
+ * cm_net_set_recorder:
+ * @self: A #CmNet
+ * @recorder: (nullable): A #CmNetRecorder
+ *
+ * Record the requests sent with @self and their responses
+ * with @recorder.  Media transfers are not recorded.  Set
+ * %NULL to stop recording.
+ */
+void
+cm_net_set_recorder (CmNet         *self,
+                     CmNetRecorder *recorder)
+{
+  g_return_if_fail (CM_IS_NET (self));
+  g_return_if_fail (!recorder || CM_IS_NET_RECORDER (recorder));
+
+  g_set_object (&self->recorder, recorder);
+}
+
 /**
  * cm_net_send_data_async:
  * @self: A #CmNet
@@ -492,6 +1216,16 @@ cm_net_send_json_async (CmNet               *self,
   queue_data (self, data, size, uri_path, method, query, task);
 }
 
+static void
+net_get_media_start (CmNet *self,
+                     GTask *task)
+{
+  soup_session_send_async (self->file_session,
+                           g_object_get_data (G_OBJECT (task), "msg"),
+                           0, g_task_get_cancellable (task),
+                           net_get_file_stream_cb, task);
+}
+
 /**
  * cm_net_get_file_async:
  * @self: A #CmNet
@@ -507,22 +1241,27 @@ cm_net_send_json_async (CmNet               *self,
  * and has keys to decrypt the file, the file shall be
  * stored decrypted.
  */
-void
-cm_net_get_file_async (CmNet                 *self,
-                       const char            *uri,
-                       CmEncFileInfo         *enc_file,
-                       const char * const    *versions,
-                       GCancellable          *cancellable,
-                       GAsyncReadyCallback    callback,
-                       gpointer               user_data)
+static void
+net_get_media_async (CmNet               *self,
+                     const char          *uri,
+                     const char          *query,
+                     CmTransferPriority   priority,
+                     goffset              offset,
+                     CmEncFileInfo       *enc_file,
+                     const char * const  *versions,
+                     const char          *endpoint,
+                     GCancellable        *cancellable,
+                     GAsyncReadyCallback  callback,
+                     gpointer             user_data)
 {
   g_autofree char *url = NULL;
   SoupMessage *msg;
   GTask *task;
   gboolean needs_auth = FALSE;
 
-  g_return_if_fail (CM_IS_NET (self));
-  g_return_if_fail (uri && *uri);
+  g_assert (CM_IS_NET (self));
+  g_assert (uri && *uri);
+  g_assert (endpoint && *endpoint);
 
   if (!cancellable)
     cancellable = self->cancellable;
@@ -535,11 +1274,13 @@ cm_net_get_file_async (CmNet                 *self,
       /* Endpoints for authenticated media
        * https://matrix.org/blog/2024/06/20/matrix-v1.11-release/ */
       url = g_strconcat (self->homeserver,
-                         "/_matrix/client/v1/media/download/", file_url, NULL);
+                         "/_matrix/client/v1/media/", endpoint, "/", file_url,
+                         query ? "?" : "", query, NULL);
       needs_auth = TRUE;
     } else {
       url = g_strconcat (self->homeserver,
-                         "/_matrix/media/r0/download/", file_url, NULL);
+                         "/_matrix/media/r0/", endpoint, "/", file_url,
+                         query ? "?" : "", query, NULL);
     }
   }
 
@@ -560,8 +1301,137 @@ cm_net_get_file_async (CmNet                 *self,
     soup_message_headers_replace (headers, "Authorization", auth);
   }
 
-  soup_session_send_async (self->file_session, msg, 0, cancellable,
-                           net_get_file_stream_cb, task);
+  if (offset > 0)
+    soup_message_headers_set_range (soup_message_get_request_headers (msg), offset, -1);
+
+  net_transfer_queue (self, task, msg, priority, net_get_media_start);
+}
+
+/**
+ * cm_net_get_file_async:
+ * @self: A #CmNet
+ * @uri: The mxc uri (or http url) of the file
+ * @enc_file: (nullable): The #CmEncFileInfo if the file is encrypted
+ * @versions: (nullable): The versions supported by the homeserver
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when completed
+ * @user_data: user data for @callback
+ *
+ * Download the file @uri.  If @enc_file is set, the
+ * stream returned shall decrypt the content.
+ *
+ * The download is queued as %CM_TRANSFER_PRIORITY_DOWNLOAD
+ * and is started when a slot is free for the host.  The slot
+ * is held until the returned stream is finalized.
+ */
+void
+cm_net_get_file_async (CmNet                 *self,
+                       const char            *uri,
+                       CmEncFileInfo         *enc_file,
+                       const char * const    *versions,
+                       GCancellable          *cancellable,
+                       GAsyncReadyCallback    callback,
+                       gpointer               user_data)
+{
+  g_return_if_fail (CM_IS_NET (self));
+  g_return_if_fail (uri && *uri);
+
+  net_get_media_async (self, uri, NULL, CM_TRANSFER_PRIORITY_DOWNLOAD, 0,
+                       enc_file, versions, "download",
+                       cancellable, callback, user_data);
+}
+
+/**
+ * cm_net_get_file_range_async:
+ * @self: A #CmNet
+ * @uri: The mxc uri (or http url) of the file
+ * @enc_file: (nullable): The #CmEncFileInfo if the file is encrypted
+ * @versions: (nullable): The versions supported by the homeserver
+ * @offset: The offset to start downloading from
+ * @priority: The #CmTransferPriority of the download
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when completed
+ * @user_data: user data for @callback
+ *
+ * Same as cm_net_get_file_async(), but request the content
+ * starting from @offset, eg: to resume an interrupted download.
+ * Content referred by mxc uris are immutable, so there is no
+ * need to verify if the file changed in between.
+ *
+ * The server may choose to send the complete file.  The
+ * real offset is set as "range-start" (a #goffset pointer)
+ * data on the returned stream.  If it's not 0 and @enc_file
+ * is set, the caller should then use cm_input_stream_set_offset()
+ * or cm_input_stream_resume_with_prefix() before reading.
+ *
+ * Finish with cm_net_get_file_finish().
+ */
+void
+cm_net_get_file_range_async (CmNet                 *self,
+                             const char            *uri,
+                             CmEncFileInfo         *enc_file,
+                             const char * const    *versions,
+                             goffset                offset,
+                             CmTransferPriority     priority,
+                             GCancellable          *cancellable,
+                             GAsyncReadyCallback    callback,
+                             gpointer               user_data)
+{
+  g_return_if_fail (CM_IS_NET (self));
+  g_return_if_fail (uri && *uri);
+  g_return_if_fail (offset >= 0);
+  g_return_if_fail (priority < CM_TRANSFER_PRIORITY_N);
+
+  net_get_media_async (self, uri, NULL, priority, offset,
+                       enc_file, versions, "download",
+                       cancellable, callback, user_data);
+}
+
+/**
+ * cm_net_get_thumbnail_async:
+ * @self: A #CmNet
+ * @uri: The mxc uri of the file
+ * @width: The desired width
+ * @height: The desired height
+ * @method: A #CmThumbnailMethod
+ * @versions: (nullable): The versions supported by the homeserver
+ * @priority: The #CmTransferPriority of the download
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when completed
+ * @user_data: user data for @callback
+ *
+ * Download a thumbnail of @uri generated by the server.
+ * The server may return a larger image than requested,
+ * see the spec for details.
+ *
+ * Thumbnails are not available for encrypted files.
+ *
+ * Finish with cm_net_get_file_finish().
+ */
+void
+cm_net_get_thumbnail_async (CmNet                 *self,
+                            const char            *uri,
+                            int                    width,
+                            int                    height,
+                            CmThumbnailMethod      method,
+                            const char * const    *versions,
+                            CmTransferPriority     priority,
+                            GCancellable          *cancellable,
+                            GAsyncReadyCallback    callback,
+                            gpointer               user_data)
+{
+  g_autofree char *query = NULL;
+
+  g_return_if_fail (CM_IS_NET (self));
+  g_return_if_fail (uri && g_str_has_prefix (uri, "mxc://"));
+  g_return_if_fail (width > 0 && height > 0);
+  g_return_if_fail (priority < CM_TRANSFER_PRIORITY_N);
+
+  query = g_strdup_printf ("width=%d&height=%d&method=%s", width, height,
+                           method == CM_THUMBNAIL_METHOD_CROP ? "crop" : "scale");
+  net_get_media_async (self, uri, query, priority, 0,
+                       NULL, versions, "thumbnail",
+                       cancellable, callback, user_data);
 }
 
 GInputStream *
@@ -596,7 +1466,6 @@ put_file_async_cb (GObject      *obj,
   g_assert (CM_IS_NET (self));
 
   root = g_task_propagate_pointer (G_TASK (result), &error);
-  g_assert_no_error (error);
 
   if (root)
     {
@@ -629,6 +1498,23 @@ wrote_body_data_cb (GTask       *task,
   progress_cb (0, 0, progress_user_data);
 }
 
+static void
+net_put_file_start (CmNet *self,
+                    GTask *local_task)
+{
+  GTask *task = g_task_get_task_data (local_task);
+  gint64 start_time;
+
+  start_time = g_get_monotonic_time ();
+  g_object_set_data_full (G_OBJECT (local_task), "start-time",
+                          g_memdup2 (&start_time, sizeof (start_time)), g_free);
+
+  soup_session_send_async (self->file_session,
+                           g_object_get_data (G_OBJECT (task), "msg"),
+                           0, g_task_get_cancellable (local_task),
+                           session_send_cb, local_task);
+}
+
 void
 cm_net_put_file_async (CmNet                 *self,
                        GFile                 *file,
@@ -686,8 +1572,8 @@ cm_net_put_file_async (CmNet                 *self,
     g_signal_connect_object (msg, "wrote-body-data",
                              G_CALLBACK (wrote_body_data_cb), task, G_CONNECT_SWAPPED);
 
-  soup_session_send_async (self->file_session, msg, 0, cancellable,
-                           session_send_cb, local_task);
+  net_transfer_queue (self, local_task, msg, CM_TRANSFER_PRIORITY_DOWNLOAD,
+                      net_put_file_start);
 }
 
 char *
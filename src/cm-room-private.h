@@ -36,6 +36,8 @@ JsonObject   *cm_room_decrypt                      (CmRoom              *self,
 void          cm_room_add_events                   (CmRoom              *self,
                                                     GPtrArray           *events,
                                                     gboolean             append);
+void          cm_room_emit_relations_changed       (CmRoom              *self,
+                                                    const char          *event_id);
 void          cm_room_user_changed                 (CmRoom              *self,
                                                     GPtrArray           *changed_users);
 const char   *cm_room_get_prev_batch               (CmRoom              *self);
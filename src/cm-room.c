@@ -16,6 +16,7 @@
 #include "cm-common.h"
 #include "events/cm-event-private.h"
 #include "events/cm-room-event-list-private.h"
+#include "events/cm-room-relations-private.h"
 #include "events/cm-room-message-event-private.h"
 #include "users/cm-room-member-private.h"
 #include "users/cm-room-member.h"
@@ -23,11 +24,25 @@
 #include "users/cm-user-private.h"
 #include "users/cm-user-list-private.h"
 #include "cm-matrix-private.h"
+#include "cm-stats-private.h"
 #include "cm-room-private.h"
 #include "cm-room.h"
 
 #define KEY_TIMEOUT         10000 /* milliseconds */
-#define TYPING_TIMEOUT      4     /* seconds */
+/* How long the server keeps the typing notice */
+#define TYPING_TIMEOUT      30000 /* milliseconds */
+/* Resend typing notice this long after the last one if still typing */
+#define TYPING_REFRESH      25000 /* milliseconds */
+/* Minimum interval between two typing notices */
+#define TYPING_DEBOUNCE     1000  /* milliseconds */
+/* Resend a typing notice this long after it failed */
+#define TYPING_RETRY        5000  /* milliseconds */
+
+typedef struct
+{
+  GRefString *event_id;
+  gint64      time_stamp;
+} RoomReceipt;
 
 /**
  * CmRoom:
@@ -59,7 +74,7 @@ struct _CmRoom
   char       *name;
   char       *generated_name;
   char       *past_name;
-  char       *room_id;
+  GRefString *room_id;
   char       *replacement_room;
   char       *encryption;
   char       *prev_batch;
@@ -76,11 +91,25 @@ struct _CmRoom
   gboolean    has_prev_batch;
   gboolean    is_direct;
 
+  /* GRefString user ids of the members typing, except self */
+  GPtrArray  *typing_users;
+  /* key: GRefString (user_id), value: RoomReceipt */
+  GHashTable *read_receipts;
+  guint       ephemeral_changed_id;
+
   /* Use g_get_monotonic_time(), we only need the interval */
   gint64     typing_set_time;
+  /* When the typing state was last requested */
+  gint64     typing_wanted_time;
   /* set doesn't mean the user has typing state set,
    * also compare with typing_set_time and TYPING_TIMEOUT */
   gboolean   typing;
+  /* The last notice failed, the server may have either state */
+  gboolean   typing_unknown;
+  /* The state last requested, sent when the debounce timer fires */
+  gboolean   typing_wanted;
+  gboolean   typing_sending;
+  guint      typing_timeout_id;
 
   gboolean    loading_initial_sync;
   gboolean    loading_past_events;
@@ -97,6 +126,8 @@ struct _CmRoom
   gboolean    keys_claimed;
   gboolean    uploading_keys;
   gboolean    initial_sync_done;
+  gboolean    relations_loading;
+  gboolean    relations_loaded;
 
   gboolean    is_accepting_invite;
   gboolean    is_rejecting_invite;
@@ -116,6 +147,14 @@ enum {
 
 static GParamSpec *properties[N_PROPS];
 
+enum {
+  RELATIONS_CHANGED,
+  EPHEMERAL_CHANGED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS];
+
 typedef struct
 {
   GAsyncResult *res;
@@ -441,11 +480,25 @@ cm_room_get_property (GObject    *object,
     }
 }
 
+static void
+room_receipt_free (gpointer data)
+{
+  RoomReceipt *receipt = data;
+
+  g_clear_pointer (&receipt->event_id, g_ref_string_release);
+  g_free (receipt);
+}
+
 static void
 cm_room_finalize (GObject *object)
 {
   CmRoom *self = (CmRoom *)object;
 
+  g_clear_handle_id (&self->typing_timeout_id, g_source_remove);
+  g_clear_handle_id (&self->ephemeral_changed_id, g_source_remove);
+  g_clear_pointer (&self->typing_users, g_ptr_array_unref);
+  g_clear_pointer (&self->read_receipts, g_hash_table_unref);
+
   if (self->enc_cancellable)
     g_cancellable_cancel (self->enc_cancellable);
   g_clear_object (&self->enc_cancellable);
@@ -463,12 +516,13 @@ cm_room_finalize (GObject *object)
 
   g_clear_object (&self->client);
   g_clear_object (&self->room_event);
-  g_free (self->room_id);
+  g_clear_pointer (&self->room_id, g_ref_string_release);
 
   g_free (self->name);
   g_free (self->generated_name);
 
   g_queue_free_full (self->message_queue, g_object_unref);
+  cm_stats_object_free (CM_STATS_OBJECT_ROOM);
 
   G_OBJECT_CLASS (cm_room_parent_class)->finalize (object);
 }
@@ -507,11 +561,42 @@ cm_room_class_init (CmRoomClass *klass)
                        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
 
   g_object_class_install_properties (object_class, N_PROPS, properties);
+
+  /**
+   * CmRoom::relations-changed:
+   * @self: The room
+   * @event_id: The event id
+   *
+   * Emitted when the edits, reactions or replies of
+   * the event @event_id changed.
+   */
+  signals [RELATIONS_CHANGED] =
+    g_signal_new ("relations-changed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 1, G_TYPE_STRING);
+
+  /**
+   * CmRoom::ephemeral-changed:
+   * @self: The room
+   *
+   * Emitted when the typing users or read receipts
+   * changed.  Changes are coalesced, so this is emitted
+   * at most once per main loop iteration.
+   */
+  signals [EPHEMERAL_CHANGED] =
+    g_signal_new ("ephemeral-changed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 0);
 }
 
 static void
 cm_room_init (CmRoom *self)
 {
+  cm_stats_object_new (CM_STATS_OBJECT_ROOM);
   self->room_event = cm_room_event_list_new (self);
   self->one_time_keys = g_ptr_array_new_full (32, g_free);
   self->changed_users = g_ptr_array_new_full (32, g_object_unref);
@@ -530,6 +615,10 @@ cm_room_init (CmRoom *self)
                                                        (GDestroyNotify)g_ref_string_release,
                                                        g_object_unref);
   self->message_queue = g_queue_new ();
+  self->typing_users = g_ptr_array_new_with_free_func ((GDestroyNotify)g_ref_string_release);
+  self->read_receipts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               (GDestroyNotify)g_ref_string_release,
+                                               room_receipt_free);
 }
 
 CmRoom *
@@ -540,7 +629,7 @@ cm_room_new (const char *room_id)
   g_return_val_if_fail (room_id && *room_id, NULL);
 
   self = g_object_new (CM_TYPE_ROOM, NULL);
-  self->room_id = g_strdup (room_id);
+  self->room_id = cm_utils_intern_id (room_id);
 
   return self;
 }
@@ -769,7 +858,8 @@ cm_room_has_state_sync (CmRoom *self)
  * cm_room_get_id:
  * @self: A #CmRoom
  *
- * Get the matrix room id.
+ * Get the matrix room id.  The id is interned, so
+ * rooms can be matched by comparing the pointers.
  *
  * Returns: The room id
  */
@@ -911,6 +1001,168 @@ cm_room_get_events_list (CmRoom *self)
   return cm_room_event_list_get_events (self->room_event);
 }
 
+/**
+ * cm_room_get_edit_id:
+ * @self: The room
+ * @event: A #CmEvent
+ *
+ * Get the id of the latest event that replaces
+ * (edits) @event.  Only the events known to
+ * @self and sent by the sender of @event are
+ * considered.
+ *
+ * Returns: (nullable): The id of the latest edit
+ *
+ * Since: 0.0.4
+ */
+const char *
+cm_room_get_edit_id (CmRoom  *self,
+                     CmEvent *event)
+{
+  CmRoomRelations *relations;
+
+  g_return_val_if_fail (CM_IS_ROOM (self), NULL);
+  g_return_val_if_fail (CM_IS_EVENT (event), NULL);
+
+  relations = cm_room_event_list_get_relations (self->room_event);
+
+  return cm_room_relations_get_edit_id (relations, cm_event_get_id (event),
+                                        cm_event_get_sender_id (event));
+}
+
+/**
+ * cm_room_get_reaction_count:
+ * @self: The room
+ * @event_id: An event id
+ * @key: The reaction key, eg: an emoji
+ *
+ * Get the number of reactions with @key to @event_id
+ *
+ * Returns: The reaction count
+ *
+ * Since: 0.0.4
+ */
+guint
+cm_room_get_reaction_count (CmRoom     *self,
+                            const char *event_id,
+                            const char *key)
+{
+  CmRoomRelations *relations;
+
+  g_return_val_if_fail (CM_IS_ROOM (self), 0);
+
+  relations = cm_room_event_list_get_relations (self->room_event);
+
+  return cm_room_relations_get_annotation_count (relations, event_id, key);
+}
+
+/**
+ * cm_room_get_reaction_keys:
+ * @self: The room
+ * @event_id: An event id
+ *
+ * Get the sorted list of reaction keys of @event_id.
+ *
+ * Returns: (transfer full) (nullable): The keys.
+ * Free with g_strfreev()
+ *
+ * Since: 0.0.4
+ */
+GStrv
+cm_room_get_reaction_keys (CmRoom     *self,
+                           const char *event_id)
+{
+  CmRoomRelations *relations;
+
+  g_return_val_if_fail (CM_IS_ROOM (self), NULL);
+
+  relations = cm_room_event_list_get_relations (self->room_event);
+
+  return cm_room_relations_get_annotation_keys (relations, event_id);
+}
+
+/**
+ * cm_room_get_reply_ids:
+ * @self: The room
+ * @event_id: An event id
+ *
+ * Get the ids of the events that are replies to @event_id.
+ *
+ * Returns: (transfer full) (nullable): The ids.
+ * Free with g_strfreev()
+ *
+ * Since: 0.0.4
+ */
+GStrv
+cm_room_get_reply_ids (CmRoom     *self,
+                       const char *event_id)
+{
+  CmRoomRelations *relations;
+
+  g_return_val_if_fail (CM_IS_ROOM (self), NULL);
+
+  relations = cm_room_event_list_get_relations (self->room_event);
+
+  return cm_room_relations_get_reply_ids (relations, event_id);
+}
+
+void
+cm_room_emit_relations_changed (CmRoom     *self,
+                                const char *event_id)
+{
+  g_return_if_fail (CM_IS_ROOM (self));
+  g_return_if_fail (event_id && *event_id);
+
+  g_signal_emit (self, signals[RELATIONS_CHANGED], 0, event_id);
+}
+
+/**
+ * cm_room_get_typing_user_ids:
+ * @self: The room
+ *
+ * Get the ids of the users currently typing in @self,
+ * as last received from the server.  The own user is
+ * never included.
+ *
+ * Returns: (transfer none) (element-type utf8): The user ids
+ */
+GPtrArray *
+cm_room_get_typing_user_ids (CmRoom *self)
+{
+  g_return_val_if_fail (CM_IS_ROOM (self), NULL);
+
+  return self->typing_users;
+}
+
+/**
+ * cm_room_get_read_receipt:
+ * @self: The room
+ * @user_id: A matrix user id
+ * @time_stamp: (out) (optional): The receipt time stamp
+ *
+ * Get the id of the latest event @user_id has read,
+ * if known.
+ *
+ * Returns: (nullable): The event id
+ */
+const char *
+cm_room_get_read_receipt (CmRoom     *self,
+                          const char *user_id,
+                          gint64     *time_stamp)
+{
+  RoomReceipt *receipt = NULL;
+
+  g_return_val_if_fail (CM_IS_ROOM (self), NULL);
+
+  if (user_id)
+    receipt = g_hash_table_lookup (self->read_receipts, user_id);
+
+  if (time_stamp)
+    *time_stamp = receipt ? receipt->time_stamp : 0;
+
+  return receipt ? receipt->event_id : NULL;
+}
+
 gint64
 cm_room_get_unread_notification_counts (CmRoom *self)
 {
@@ -1051,7 +1303,8 @@ cm_room_get_avatar_async (CmRoom              *self,
 
       self->avatar_loading = TRUE;
       cm_utils_save_url_to_path_async (self->client, avatar_url,
-                                       file_path, cancellable,
+                                       file_path, CM_TRANSFER_PRIORITY_AVATAR,
+                                       cancellable,
                                        NULL, NULL,
                                        room_get_avatar_cb,
                                        g_steal_pointer (&task));
@@ -1082,6 +1335,110 @@ cm_room_get_avatar_finish (CmRoom        *self,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+static void
+room_get_avatar_thumbnail_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GInputStream *istream;
+  GError *error = NULL;
+
+  g_assert (G_IS_TASK (task));
+
+  istream = cm_utils_read_thumbnail_finish (result, &error);
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, istream, g_object_unref);
+}
+
+/**
+ * cm_room_get_avatar_thumbnail_async:
+ * @self: The room
+ * @width: The desired width in pixels
+ * @height: The desired height in pixels
+ * @method: A #CmThumbnailMethod
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: A #GAsyncReadyCallback
+ * @user_data: The user data for @callback.
+ *
+ * Get a thumbnail of the room avatar generated by the server.
+ * This is much cheaper than [method@Room.get_avatar_async]
+ * when the avatar is shown small, eg: in a room list.
+ *
+ * The returned image may be larger than requested.
+ *
+ * Since: 0.0.4
+ */
+void
+cm_room_get_avatar_thumbnail_async (CmRoom              *self,
+                                    int                  width,
+                                    int                  height,
+                                    CmThumbnailMethod    method,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  g_autoptr(JsonObject) json = NULL;
+  g_autoptr(GTask) task = NULL;
+  const char *avatar_url = NULL;
+  JsonObject *child;
+  CmEvent *event;
+
+  g_return_if_fail (CM_IS_ROOM (self));
+  g_return_if_fail (width > 0 && height > 0);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, cm_room_get_avatar_thumbnail_async);
+
+  event = cm_room_event_list_get_event (self->room_event, CM_M_ROOM_AVATAR);
+
+  if (event)
+    {
+      json = cm_event_get_json (event);
+      child = cm_utils_json_object_get_object (json, "content");
+      avatar_url = cm_utils_json_object_get_string (child, "url");
+    }
+
+  g_debug ("(%p) Get avatar thumbnail %dx%d", self, width, height);
+
+  cm_utils_read_thumbnail_async (self->client, avatar_url,
+                                 width, height, method,
+                                 CM_M_ROOM_AVATAR, CM_TRANSFER_PRIORITY_AVATAR,
+                                 cancellable,
+                                 room_get_avatar_thumbnail_cb,
+                                 g_steal_pointer (&task));
+}
+
+/**
+ * cm_room_get_avatar_thumbnail_finish:
+ * @self: The room
+ * @result: `GAsyncResult`
+ * @error: The return location for a recoverable error.
+ *
+ * Finishes an asynchronous operation started with
+ * [method@Room.get_avatar_thumbnail_async].
+ *
+ * Returns: (transfer full) (nullable): The input stream, or
+ * %NULL if the room has no avatar
+ *
+ * Since: 0.0.4
+ */
+GInputStream *
+cm_room_get_avatar_thumbnail_finish (CmRoom        *self,
+                                     GAsyncResult  *result,
+                                     GError       **error)
+{
+  g_return_val_if_fail (CM_IS_ROOM (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 CmStatus
 cm_room_get_status (CmRoom *self)
 {
@@ -1142,6 +1499,160 @@ cm_room_add_events (CmRoom    *self,
   cm_room_event_list_add_events (self->room_event, events, append);
 }
 
+static gboolean
+room_parse_typing (CmRoom     *self,
+                   JsonObject *content)
+{
+  g_autoptr(GPtrArray) users = NULL;
+  const char *own_id = NULL;
+  JsonArray *array;
+  guint length = 0;
+
+  array = cm_utils_json_object_get_array (content, "user_ids");
+
+  if (array)
+    length = json_array_get_length (array);
+
+  if (self->client)
+    own_id = cm_client_get_user_id (self->client);
+
+  users = g_ptr_array_new_full (length, (GDestroyNotify)g_ref_string_release);
+
+  for (guint i = 0; i < length; i++)
+    {
+      const char *user_id;
+
+      user_id = json_array_get_string_element (array, i);
+
+      if (!user_id || g_strcmp0 (user_id, own_id) == 0)
+        continue;
+
+      g_ptr_array_add (users, cm_utils_intern_id (user_id));
+    }
+
+  /* m.typing always has the complete list.  As ids are
+   * interned, they can be compared by pointer */
+  if (users->len == self->typing_users->len)
+    {
+      guint i;
+
+      for (i = 0; i < users->len; i++)
+        if (!g_ptr_array_find (self->typing_users, users->pdata[i], NULL))
+          break;
+
+      if (i == users->len)
+        return FALSE;
+    }
+
+  g_ptr_array_unref (self->typing_users);
+  self->typing_users = g_steal_pointer (&users);
+
+  return TRUE;
+}
+
+static gboolean
+room_parse_receipts (CmRoom     *self,
+                     JsonObject *content)
+{
+  g_autoptr(GList) event_ids = NULL;
+  gboolean changed = FALSE;
+
+  if (!content)
+    return FALSE;
+
+  event_ids = json_object_get_members (content);
+
+  for (GList *event_id = event_ids; event_id; event_id = event_id->next)
+    {
+      g_autoptr(GList) user_ids = NULL;
+      JsonObject *child;
+
+      child = cm_utils_json_object_get_object (content, event_id->data);
+      child = cm_utils_json_object_get_object (child, "m.read");
+
+      if (!child)
+        continue;
+
+      user_ids = json_object_get_members (child);
+
+      for (GList *user_id = user_ids; user_id; user_id = user_id->next)
+        {
+          RoomReceipt *receipt;
+          gint64 time_stamp;
+
+          time_stamp = cm_utils_json_object_get_int (cm_utils_json_object_get_object (child, user_id->data), "ts");
+          receipt = g_hash_table_lookup (self->read_receipts, user_id->data);
+
+          /* Receipts may come out of order, keep the latest */
+          if (receipt &&
+              (receipt->time_stamp > time_stamp ||
+               g_strcmp0 (receipt->event_id, event_id->data) == 0))
+            continue;
+
+          if (!receipt)
+            {
+              receipt = g_new0 (RoomReceipt, 1);
+              g_hash_table_insert (self->read_receipts,
+                                   cm_utils_intern_id (user_id->data), receipt);
+            }
+
+          g_clear_pointer (&receipt->event_id, g_ref_string_release);
+          receipt->event_id = cm_utils_intern_id (event_id->data);
+          receipt->time_stamp = time_stamp;
+          changed = TRUE;
+        }
+    }
+
+  return changed;
+}
+
+/*
+ * Returns: %TRUE if typing users or read receipts changed
+ */
+static gboolean
+room_parse_ephemeral (CmRoom     *self,
+                      JsonObject *object)
+{
+  JsonArray *array;
+  gboolean changed = FALSE;
+  guint length = 0;
+
+  array = cm_utils_json_object_get_array (object, "events");
+
+  if (array)
+    length = json_array_get_length (array);
+
+  for (guint i = 0; i < length; i++)
+    {
+      JsonObject *event, *content;
+      CmEventType type;
+
+      event = json_array_get_object_element (array, i);
+      type = cm_utils_get_event_type (cm_utils_json_object_get_string (event, "type"));
+      content = cm_utils_json_object_get_object (event, "content");
+
+      if (type == CM_M_TYPING)
+        changed |= room_parse_typing (self, content);
+      else if (type == CM_M_RECEIPT)
+        changed |= room_parse_receipts (self, content);
+    }
+
+  return changed;
+}
+
+static gboolean
+room_emit_ephemeral_changed (gpointer user_data)
+{
+  CmRoom *self = user_data;
+
+  g_assert (CM_IS_ROOM (self));
+
+  self->ephemeral_changed_id = 0;
+  g_signal_emit (self, signals[EPHEMERAL_CHANGED], 0);
+
+  return G_SOURCE_REMOVE;
+}
+
 GPtrArray *
 cm_room_set_data (CmRoom     *self,
                   JsonObject *object)
@@ -1215,6 +1726,12 @@ cm_room_set_data (CmRoom     *self,
         }
     }
 
+  /* Several sync responses may be handled before the main loop
+   * gets to run again, so notify only once for them all */
+  child = cm_utils_json_object_get_object (object, "ephemeral");
+  if (room_parse_ephemeral (self, child) && !self->ephemeral_changed_id)
+    self->ephemeral_changed_id = g_idle_add (room_emit_ephemeral_changed, self);
+
   self->initial_sync_done = TRUE;
   cm_room_save (self);
 
@@ -1901,30 +2418,128 @@ cm_room_send_file_finish (CmRoom        *self,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+static void room_flush_typing (CmRoom *self);
+
+static gboolean
+room_typing_timeout_cb (gpointer user_data)
+{
+  CmRoom *self = user_data;
+
+  g_assert (CM_IS_ROOM (self));
+
+  self->typing_timeout_id = 0;
+  room_flush_typing (self);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 send_typing_cb (GObject      *obj,
                 GAsyncResult *result,
                 gpointer      user_data)
 {
-  CmRoom *self;
-  g_autoptr(GTask) task = user_data;
+  g_autoptr(CmRoom) self = user_data;
   g_autoptr(JsonObject) object = NULL;
   g_autoptr(GError) error = NULL;
 
-  g_assert (G_IS_TASK (task));
-  self = g_task_get_source_object (task);
+  g_assert (CM_IS_ROOM (self));
 
   object = g_task_propagate_pointer (G_TASK (result), &error);
+  self->typing_sending = FALSE;
 
   CM_TRACE ("(%p) Set typing to '%s' %s", self,
             CM_LOG_BOOL (self->typing), CM_LOG_SUCCESS (!error));
 
+  /* We don't know what the server has, so resend it later */
+  self->typing_unknown = !!error;
+
   if (error)
+    g_debug ("(%p) Set typing error: %s", self, error->message);
+
+  /* Send the changes requested meanwhile, if any */
+  room_flush_typing (self);
+}
+
+/*
+ * Send the latest requested typing state, if the server
+ * doesn't already have it.  Notices are sent at most once
+ * per TYPING_DEBOUNCE, the changes in between are coalesced.
+ * A typing notice is refreshed only if typing was set again
+ * after it was sent, so that the server times it out if the
+ * app stops setting it.
+ */
+static void
+room_flush_typing (CmRoom *self)
+{
+  g_autofree char *uri = NULL;
+  JsonObject *object;
+  gint64 now, elapsed, delay;
+
+  g_assert (CM_IS_ROOM (self));
+
+  if (self->typing_sending || self->typing_timeout_id)
+    return;
+
+  now = g_get_monotonic_time ();
+  elapsed = (now - self->typing_set_time) / 1000;
+
+  /* Whatever was sent last, the server has timed it out by now */
+  if (elapsed >= TYPING_TIMEOUT)
+    {
+      self->typing = FALSE;
+      self->typing_unknown = FALSE;
+    }
+
+  if (self->typing_unknown)
+    {
+      /* Give up if the state hasn't been requested for long */
+      if ((now - self->typing_wanted_time) / 1000 >= TYPING_TIMEOUT)
+        return;
+
+      delay = TYPING_RETRY;
+    }
+  else if (self->typing_wanted != self->typing)
+    {
+      delay = TYPING_DEBOUNCE;
+    }
+  else if (self->typing && self->typing_wanted_time > self->typing_set_time)
+    {
+      /* Still typing, refresh before the server times it out */
+      delay = TYPING_REFRESH;
+    }
+  else
+    {
+      return;
+    }
+
+  if (elapsed < delay)
     {
-      self->typing = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "was-typing"));
-      self->typing_set_time = GPOINTER_TO_SIZE (g_object_get_data (G_OBJECT (task), "was-typing-time"));
-      g_debug ("(%p) Set typing error: %s", self, error->message);
+      self->typing_timeout_id = g_timeout_add (delay - elapsed,
+                                               room_typing_timeout_cb, self);
+      return;
     }
+
+  if (!self->client)
+    return;
+
+  CM_TRACE ("(%p) Set typing to '%s'", self, CM_LOG_BOOL (self->typing_wanted));
+  self->typing_set_time = g_get_monotonic_time ();
+  self->typing = self->typing_wanted;
+  self->typing_sending = TRUE;
+
+  /* https://matrix.org/docs/spec/client_server/r0.6.1#put-matrix-client-r0-rooms-roomid-typing-userid */
+  object = json_object_new ();
+  json_object_set_boolean_member (object, "typing", self->typing);
+  if (self->typing)
+    json_object_set_int_member (object, "timeout", TYPING_TIMEOUT);
+
+  uri = g_strconcat ("/_matrix/client/r0/rooms/", self->room_id,
+                     "/typing/", cm_client_get_user_id (self->client), NULL);
+
+  cm_net_send_json_async (cm_client_get_net (self->client), 0, object,
+                          uri, SOUP_METHOD_PUT,
+                          NULL, NULL, send_typing_cb,
+                          g_object_ref (self));
 }
 
 /**
@@ -1935,8 +2550,15 @@ send_typing_cb (GObject      *obj,
  * @callback: A #GasyncReadyCallback
  * @user_data: The user data for @callback.
  *
- * Set/Unset if the self user is typing or not.
- * The typing set is timeout after 4 seconds.
+ * Set/Unset if the self user is typing or not.  This can
+ * be called on every key press: notices are sent at most
+ * once per second with the latest state.  The server times
+ * out a typing notice after 30 seconds, it's repeated before
+ * that only if typing is set again meanwhile.
+ *
+ * The task completes once the state is queued, failures
+ * to send are retried for as long as the state would be
+ * kept by the server.
  */
 void
 cm_room_set_typing_notice_async (CmRoom              *self,
@@ -1945,39 +2567,24 @@ cm_room_set_typing_notice_async (CmRoom              *self,
                                  GAsyncReadyCallback  callback,
                                  gpointer             user_data)
 {
-  g_autofree char *uri = NULL;
-  JsonObject *object;
-  GTask *task;
+  g_autoptr(GTask) task = NULL;
 
   g_return_if_fail (CM_IS_ROOM (self));
 
   task = g_task_new (self, cancellable, callback, user_data);
-  g_object_set_data (G_OBJECT (task), "was-typing", GINT_TO_POINTER (self->typing));
-  g_object_set_data (G_OBJECT (task), "was-typing-time", GSIZE_TO_POINTER (self->typing_set_time));
+  g_task_set_source_tag (task, cm_room_set_typing_notice_async);
 
-  if (typing == self->typing &&
-      g_get_monotonic_time () - self->typing_set_time < TYPING_TIMEOUT * G_USEC_PER_SEC)
-    {
-      g_task_return_boolean (task, TRUE);
-      return;
-    }
+  typing = !!typing;
 
-  CM_TRACE ("(%p) Set typing to '%s'", self, CM_LOG_BOOL (typing));
-  self->typing_set_time = g_get_monotonic_time ();
-  self->typing = !!typing;
+  /* Don't let a pending refresh hold back the change */
+  if (self->typing_wanted != typing)
+    g_clear_handle_id (&self->typing_timeout_id, g_source_remove);
 
-  /* https://matrix.org/docs/spec/client_server/r0.6.1#put-matrix-client-r0-rooms-roomid-typing-userid */
-  object = json_object_new ();
-  json_object_set_boolean_member (object, "typing", !!typing);
-  if (typing)
-    json_object_set_int_member (object, "timeout", TYPING_TIMEOUT);
-
-  uri = g_strconcat ("/_matrix/client/r0/rooms/", self->room_id,
-                     "/typing/", cm_client_get_user_id (self->client), NULL);
+  self->typing_wanted = typing;
+  self->typing_wanted_time = g_get_monotonic_time ();
+  room_flush_typing (self);
 
-  cm_net_send_json_async (cm_client_get_net (self->client), 0, object,
-                          uri, SOUP_METHOD_PUT,
-                          NULL, cancellable, send_typing_cb, task);
+  g_task_return_boolean (task, TRUE);
 }
 
 /**
@@ -2419,6 +3026,30 @@ room_load_sync_cb (GObject      *object,
   cm_room_load_past_events_async (self, callback, cb_user_data);
 }
 
+static void
+room_get_relations_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  g_autoptr(CmRoom) self = user_data;
+  g_autoptr(CmRoomRelations) relations = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert (CM_IS_ROOM (self));
+
+  relations = cm_db_get_room_relations_finish (CM_DB (object), result, &error);
+  self->relations_loading = FALSE;
+  self->relations_loaded = !error;
+  g_debug ("(%p) Load relations %s", self, CM_LOG_SUCCESS (!error));
+
+  if (error)
+    g_warning ("(%p) Loading relations error: %s", self, error->message);
+
+  if (relations)
+    cm_room_relations_merge (cm_room_event_list_get_relations (self->room_event),
+                             relations);
+}
+
 /**
  * cm_room_load_past_events_async:
  * @self: The room
@@ -2467,6 +3098,15 @@ cm_room_load_past_events_async (CmRoom              *self,
 
   self->loading_past_events = TRUE;
 
+  /* Load the persisted relations once, so that those of past events are known */
+  if (!self->relations_loaded && !self->relations_loading)
+    {
+      self->relations_loading = TRUE;
+      cm_db_get_room_relations_async (cm_client_get_db (self->client), self,
+                                      room_get_relations_cb,
+                                      g_object_ref (self));
+    }
+
   events = cm_room_event_list_get_events (self->room_event);
   from = g_list_model_get_item (events, 0);
   cm_db_get_past_events_async (cm_client_get_db (self->client),
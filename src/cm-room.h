@@ -31,7 +31,20 @@ const char   *cm_room_get_past_name               (CmRoom                *self);
 gboolean      cm_room_is_encrypted                (CmRoom                *self);
 GListModel   *cm_room_get_joined_members          (CmRoom                *self);
 GListModel   *cm_room_get_events_list             (CmRoom                *self);
+const char   *cm_room_get_edit_id                 (CmRoom                *self,
+                                                   CmEvent               *event);
+guint         cm_room_get_reaction_count          (CmRoom                *self,
+                                                   const char            *event_id,
+                                                   const char            *key);
+GStrv         cm_room_get_reaction_keys           (CmRoom                *self,
+                                                   const char            *event_id);
+GStrv         cm_room_get_reply_ids               (CmRoom                *self,
+                                                   const char            *event_id);
 gint64        cm_room_get_unread_notification_counts  (CmRoom                *self);
+GPtrArray    *cm_room_get_typing_user_ids             (CmRoom                *self);
+const char   *cm_room_get_read_receipt                (CmRoom                *self,
+                                                       const char            *user_id,
+                                                       gint64                *time_stamp);
 void          cm_room_get_avatar_async                (CmRoom                *self,
                                                        GCancellable          *cancellable,
                                                        GAsyncReadyCallback    callback,
@@ -39,6 +52,16 @@ void          cm_room_get_avatar_async                (CmRoom                *se
 GInputStream *cm_room_get_avatar_finish               (CmRoom                *self,
                                                        GAsyncResult          *result,
                                                        GError               **error);
+void          cm_room_get_avatar_thumbnail_async      (CmRoom                *self,
+                                                       int                    width,
+                                                       int                    height,
+                                                       CmThumbnailMethod      method,
+                                                       GCancellable          *cancellable,
+                                                       GAsyncReadyCallback    callback,
+                                                       gpointer               user_data);
+GInputStream *cm_room_get_avatar_thumbnail_finish     (CmRoom                *self,
+                                                       GAsyncResult          *result,
+                                                       GError               **error);
 void          cm_room_accept_invite_async         (CmRoom                *self,
                                                    GCancellable          *cancellable,
                                                    GAsyncReadyCallback    callback,
@@ -0,0 +1,45 @@
+/* cm-stats-private.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "cm-stats.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+  CM_STATS_OBJECT_EVENT,
+  CM_STATS_OBJECT_ROOM,
+  CM_STATS_OBJECT_USER,
+  CM_STATS_OBJECT_N,
+} CmStatsObject;
+
+CmStats      *cm_stats_get_default                    (void);
+void          cm_stats_add_count                      (CmStats             *self,
+                                                       const char          *name,
+                                                       guint64              value);
+void          cm_stats_set_gauge                      (CmStats             *self,
+                                                       const char          *name,
+                                                       gint64               value);
+void          cm_stats_add_time                       (CmStats             *self,
+                                                       const char          *name,
+                                                       gint64               usec);
+void          cm_stats_add_request                    (CmStats             *self,
+                                                       const char          *method,
+                                                       const char          *uri_path,
+                                                       gsize                sent,
+                                                       gsize                received,
+                                                       gint64               usec,
+                                                       gboolean             failed);
+char         *cm_stats_get_endpoint                   (const char          *method,
+                                                       const char          *uri_path);
+void          cm_stats_object_new                     (CmStatsObject        type);
+void          cm_stats_object_free                    (CmStatsObject        type);
+
+G_END_DECLS
@@ -0,0 +1,491 @@
+/* cm-stats.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "cm-stats"
+
+#include "cm-config.h"
+
+#include "cm-stats-private.h"
+
+/**
+ * CmStats:
+ *
+ * Runtime counters and timings of libcmatrix, meant to be
+ * exported to monitoring.  The values are collected for the
+ * whole process, so the same #CmStats is shared by every
+ * #CmMatrix and #CmClient.
+ *
+ * There are three kind of values, named with a `/` separated
+ * path:
+ *
+ * - counters, which only increase (eg: `enc/megolm-decrypted`)
+ * - gauges, which are the current value of something (eg:
+ *   `db/queue-depth` or `objects/room`)
+ * - histograms of durations in microseconds (eg: `sync/processing`,
+ *   `db/task/db_add_room_events` or `http/GET client/sync`)
+ *
+ * HTTP requests are accounted per endpoint, where the ids
+ * in the path are replaced with `{id}`, so that
+ * `/_matrix/client/r0/rooms/!abc:example.org/messages`
+ * becomes `GET client/rooms/{id}/messages`.
+ *
+ * Use cm_stats_get_snapshot() to read them.
+ */
+
+/* Upper bounds (in µs) of the histogram buckets, the last bucket is unbounded */
+static const guint64 bucket_bounds[] = {
+  100, 250, 500,
+  1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000,
+};
+
+#define N_BUCKETS (G_N_ELEMENTS (bucket_bounds) + 1)
+
+typedef struct
+{
+  guint64 count;
+  guint64 sum;
+  guint64 min;
+  guint64 max;
+  guint64 buckets[N_BUCKETS];
+} Histogram;
+
+struct _CmStats
+{
+  GObject     parent_instance;
+
+  /* The values are updated from the db and parser threads too */
+  GMutex      lock;
+  /* name -> guint64 */
+  GHashTable *counters;
+  /* name -> gint64 */
+  GHashTable *gauges;
+  /* name -> Histogram */
+  GHashTable *histograms;
+};
+
+G_DEFINE_TYPE (CmStats, cm_stats, G_TYPE_OBJECT)
+
+static const char *object_names[CM_STATS_OBJECT_N] = {
+  "objects/event",
+  "objects/room",
+  "objects/user",
+};
+
+/* Objects may be created before the stats, so keep them aside */
+static gint object_counts[CM_STATS_OBJECT_N];
+
+static void
+histogram_add (Histogram *histogram,
+               guint64    value)
+{
+  guint i;
+
+  if (!histogram->count || value < histogram->min)
+    histogram->min = value;
+  if (value > histogram->max)
+    histogram->max = value;
+
+  histogram->count++;
+  histogram->sum += value;
+
+  for (i = 0; i < G_N_ELEMENTS (bucket_bounds); i++)
+    if (value <= bucket_bounds[i])
+      break;
+
+  histogram->buckets[i]++;
+}
+
+static GVariant *
+histogram_to_variant (Histogram *histogram)
+{
+  GVariantDict dict;
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "count", "t", histogram->count);
+  g_variant_dict_insert (&dict, "sum", "t", histogram->sum);
+  g_variant_dict_insert (&dict, "min", "t", histogram->min);
+  g_variant_dict_insert (&dict, "max", "t", histogram->max);
+  g_variant_dict_insert_value (&dict, "buckets",
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+                                                          histogram->buckets,
+                                                          N_BUCKETS,
+                                                          sizeof (guint64)));
+
+  return g_variant_dict_end (&dict);
+}
+
+/* A segment of the path that doesn't carry data, like "rooms" or "m.room.message" */
+static gboolean
+stats_segment_is_name (const char *segment)
+{
+  if (!g_ascii_isalpha (*segment))
+    return FALSE;
+
+  for (const char *c = segment; *c; c++)
+    if (!g_ascii_isalpha (*c) && *c != '.' && *c != '_' && *c != '-')
+      return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+stats_segment_is_version (const char *segment)
+{
+  if (g_str_equal (segment, "r0") || g_str_equal (segment, "unstable"))
+    return TRUE;
+
+  if (*segment != 'v' || !segment[1])
+    return FALSE;
+
+  for (const char *c = segment + 1; *c; c++)
+    if (!g_ascii_isdigit (*c))
+      return FALSE;
+
+  return TRUE;
+}
+
+static void
+cm_stats_finalize (GObject *object)
+{
+  CmStats *self = (CmStats *)object;
+
+  g_clear_pointer (&self->counters, g_hash_table_unref);
+  g_clear_pointer (&self->gauges, g_hash_table_unref);
+  g_clear_pointer (&self->histograms, g_hash_table_unref);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (cm_stats_parent_class)->finalize (object);
+}
+
+static void
+cm_stats_class_init (CmStatsClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = cm_stats_finalize;
+}
+
+static void
+cm_stats_init (CmStats *self)
+{
+  g_mutex_init (&self->lock);
+  self->counters = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->gauges = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->histograms = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+/**
+ * cm_stats_get_default:
+ *
+ * Get the #CmStats values of the process are collected to.
+ *
+ * Returns: (transfer none): A #CmStats
+ */
+CmStats *
+cm_stats_get_default (void)
+{
+  static CmStats *stats;
+
+  if (g_once_init_enter (&stats))
+    g_once_init_leave (&stats, g_object_new (CM_TYPE_STATS, NULL));
+
+  return stats;
+}
+
+void
+cm_stats_add_count (CmStats    *self,
+                    const char *name,
+                    guint64     value)
+{
+  guint64 *counter;
+
+  g_return_if_fail (CM_IS_STATS (self));
+  g_return_if_fail (name && *name);
+
+  g_mutex_lock (&self->lock);
+  counter = g_hash_table_lookup (self->counters, name);
+
+  if (!counter)
+    {
+      counter = g_new0 (guint64, 1);
+      g_hash_table_insert (self->counters, g_strdup (name), counter);
+    }
+
+  *counter += value;
+  g_mutex_unlock (&self->lock);
+}
+
+void
+cm_stats_set_gauge (CmStats    *self,
+                    const char *name,
+                    gint64      value)
+{
+  gint64 *gauge;
+
+  g_return_if_fail (CM_IS_STATS (self));
+  g_return_if_fail (name && *name);
+
+  g_mutex_lock (&self->lock);
+  gauge = g_hash_table_lookup (self->gauges, name);
+
+  if (!gauge)
+    {
+      gauge = g_new0 (gint64, 1);
+      g_hash_table_insert (self->gauges, g_strdup (name), gauge);
+    }
+
+  *gauge = value;
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * cm_stats_add_time:
+ * @self: A #CmStats
+ * @name: The name of the histogram
+ * @usec: The duration in microseconds
+ *
+ * Add @usec to the histogram @name.
+ */
+void
+cm_stats_add_time (CmStats    *self,
+                   const char *name,
+                   gint64      usec)
+{
+  Histogram *histogram;
+
+  g_return_if_fail (CM_IS_STATS (self));
+  g_return_if_fail (name && *name);
+
+  g_mutex_lock (&self->lock);
+  histogram = g_hash_table_lookup (self->histograms, name);
+
+  if (!histogram)
+    {
+      histogram = g_new0 (Histogram, 1);
+      g_hash_table_insert (self->histograms, g_strdup (name), histogram);
+    }
+
+  histogram_add (histogram, MAX (usec, 0));
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * cm_stats_add_request:
+ * @self: A #CmStats
+ * @method: The request method
+ * @uri_path: The request path
+ * @sent: The size of the request body
+ * @received: The size of the response body
+ * @usec: The time taken for the request in microseconds
+ * @failed: Whether the request failed
+ *
+ * Account the request to its endpoint.
+ */
+void
+cm_stats_add_request (CmStats    *self,
+                      const char *method,
+                      const char *uri_path,
+                      gsize       sent,
+                      gsize       received,
+                      gint64      usec,
+                      gboolean    failed)
+{
+  g_autofree char *endpoint = NULL;
+  g_autoptr(GString) name = NULL;
+  gsize len;
+
+  g_return_if_fail (CM_IS_STATS (self));
+  g_return_if_fail (method && uri_path);
+
+  endpoint = cm_stats_get_endpoint (method, uri_path);
+  name = g_string_new ("http/");
+  g_string_append (name, endpoint);
+  len = name->len;
+
+  cm_stats_add_time (self, name->str, usec);
+
+  g_string_append (name, "/bytes-sent");
+  cm_stats_add_count (self, name->str, sent);
+  g_string_truncate (name, len);
+
+  g_string_append (name, "/bytes-received");
+  cm_stats_add_count (self, name->str, received);
+  g_string_truncate (name, len);
+
+  if (failed)
+    {
+      g_string_append (name, "/errors");
+      cm_stats_add_count (self, name->str, 1);
+    }
+}
+
+/**
+ * cm_stats_get_endpoint:
+ * @method: The request method
+ * @uri_path: The request path
+ *
+ * Get the endpoint @uri_path is a request to, with
+ * the api version removed and ids replaced with `{id}`.
+ *
+ * Returns: (transfer full): The endpoint name
+ */
+char *
+cm_stats_get_endpoint (const char *method,
+                       const char *uri_path)
+{
+  g_auto(GStrv) segments = NULL;
+  GString *str;
+  guint media_segment = 0, txn_segment = 0;
+  gboolean is_matrix;
+
+  g_return_val_if_fail (method && uri_path, NULL);
+
+  segments = g_strsplit (uri_path, "/", -1);
+  str = g_string_new (method);
+  g_string_append_c (str, ' ');
+  is_matrix = segments[0] && segments[1] && g_str_equal (segments[1], "_matrix");
+
+  for (guint i = 0; segments[i]; i++)
+    {
+      const char *segment = segments[i];
+
+      if (!*segment)
+        continue;
+
+      /* /_matrix/{client,media,...}/{version}/ */
+      if (is_matrix && (i == 1 || (i == 3 && stats_segment_is_version (segment))))
+        continue;
+
+      if (str->str[str->len - 1] != ' ')
+        g_string_append_c (str, '/');
+
+      /* .../download/{serverName}/{mediaId} and .../send/{eventType}/{txnId} */
+      if (media_segment)
+        {
+          media_segment--;
+          segment = "{id}";
+        }
+      else if (txn_segment && --txn_segment == 0)
+        {
+          segment = "{id}";
+        }
+      else if (!stats_segment_is_name (segment))
+        {
+          segment = "{id}";
+        }
+
+      g_string_append (str, segment);
+
+      if (g_str_equal (segment, "download") ||
+          g_str_equal (segment, "thumbnail"))
+        media_segment = 2;
+      else if (g_str_equal (segment, "send") ||
+               g_str_equal (segment, "sendToDevice"))
+        txn_segment = 2;
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+void
+cm_stats_object_new (CmStatsObject type)
+{
+  g_return_if_fail (type < CM_STATS_OBJECT_N);
+
+  g_atomic_int_inc (&object_counts[type]);
+}
+
+void
+cm_stats_object_free (CmStatsObject type)
+{
+  g_return_if_fail (type < CM_STATS_OBJECT_N);
+
+  g_atomic_int_add (&object_counts[type], -1);
+}
+
+/**
+ * cm_stats_get_snapshot:
+ * @self: A #CmStats
+ *
+ * Get the current values as a dictionary (`a{sv}`) with
+ * the following keys:
+ *
+ * - `counters` (`a{st}`): The counters
+ * - `gauges` (`a{sx}`): The gauges, including the number of
+ *   live objects (`objects/event`, `objects/room` and `objects/user`)
+ * - `histograms` (`a{sa{sv}}`): The histograms, each with their
+ *   `count`, `sum`, `min`, `max` (all `t`, in µs) and `buckets` (`at`)
+ * - `bucket-bounds` (`at`): The upper bound of each bucket in µs,
+ *   the last bucket (not listed here) has no upper bound
+ *
+ * Returns: (transfer floating): The snapshot of values
+ */
+GVariant *
+cm_stats_get_snapshot (CmStats *self)
+{
+  GVariantBuilder counters, gauges, histograms;
+  GVariantDict dict;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_return_val_if_fail (CM_IS_STATS (self), NULL);
+
+  g_variant_builder_init (&counters, G_VARIANT_TYPE ("a{st}"));
+  g_variant_builder_init (&gauges, G_VARIANT_TYPE ("a{sx}"));
+  g_variant_builder_init (&histograms, G_VARIANT_TYPE ("a{sa{sv}}"));
+
+  for (guint i = 0; i < CM_STATS_OBJECT_N; i++)
+    g_variant_builder_add (&gauges, "{sx}", object_names[i],
+                           (gint64)g_atomic_int_get (&object_counts[i]));
+
+  g_mutex_lock (&self->lock);
+
+  g_hash_table_iter_init (&iter, self->counters);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&counters, "{st}", key, *(guint64 *)value);
+
+  g_hash_table_iter_init (&iter, self->gauges);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&gauges, "{sx}", key, *(gint64 *)value);
+
+  g_hash_table_iter_init (&iter, self->histograms);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&histograms, "{s@a{sv}}", key, histogram_to_variant (value));
+
+  g_mutex_unlock (&self->lock);
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert_value (&dict, "counters", g_variant_builder_end (&counters));
+  g_variant_dict_insert_value (&dict, "gauges", g_variant_builder_end (&gauges));
+  g_variant_dict_insert_value (&dict, "histograms", g_variant_builder_end (&histograms));
+  g_variant_dict_insert_value (&dict, "bucket-bounds",
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+                                                          bucket_bounds,
+                                                          G_N_ELEMENTS (bucket_bounds),
+                                                          sizeof (guint64)));
+
+  return g_variant_dict_end (&dict);
+}
+
+/**
+ * cm_stats_reset:
+ * @self: A #CmStats
+ *
+ * Reset the counters and histograms.  Gauges are
+ * left as is, as they are current values.
+ */
+void
+cm_stats_reset (CmStats *self)
+{
+  g_return_if_fail (CM_IS_STATS (self));
+
+  g_mutex_lock (&self->lock);
+  g_hash_table_remove_all (self->counters);
+  g_hash_table_remove_all (self->histograms);
+  g_mutex_unlock (&self->lock);
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#if !defined(_CMATRIX_TAKEN) && !defined(CMATRIX_COMPILATION)
+# error "Only <cmatrix.h> can be included directly."
+#endif
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define CM_TYPE_STATS (cm_stats_get_type ())
+G_DECLARE_FINAL_TYPE (CmStats, cm_stats, CM, STATS, GObject)
+
+GVariant     *cm_stats_get_snapshot                   (CmStats             *self);
+void          cm_stats_reset                          (CmStats             *self);
+
+G_END_DECLS
@@ -0,0 +1,42 @@
+/* cm-sync-scheduler-private.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define CM_TYPE_SYNC_SCHEDULER (cm_sync_scheduler_get_type ())
+
+G_DECLARE_FINAL_TYPE (CmSyncScheduler, cm_sync_scheduler, CM, SYNC_SCHEDULER, GObject)
+
+typedef void (*CmSyncSchedulerFunc) (gpointer object);
+
+CmSyncScheduler *cm_sync_scheduler_new            (void);
+guint            cm_sync_scheduler_retry          (CmSyncScheduler     *self,
+                                                   gpointer             object,
+                                                   CmSyncSchedulerFunc  func,
+                                                   guint                retry_after_ms);
+guint            cm_sync_scheduler_reconnect      (CmSyncScheduler     *self,
+                                                   gpointer             object,
+                                                   CmSyncSchedulerFunc  func);
+void             cm_sync_scheduler_reset          (CmSyncScheduler     *self,
+                                                   gpointer             object);
+void             cm_sync_scheduler_cancel         (CmSyncScheduler     *self,
+                                                   gpointer             object);
+void             cm_sync_scheduler_remove         (CmSyncScheduler     *self,
+                                                   gpointer             object);
+gboolean         cm_sync_scheduler_acquire_slot   (CmSyncScheduler     *self,
+                                                   gpointer             object,
+                                                   CmSyncSchedulerFunc  func);
+void             cm_sync_scheduler_release_slot   (CmSyncScheduler     *self,
+                                                   gpointer             object);
+gboolean         cm_sync_scheduler_is_pending     (CmSyncScheduler     *self,
+                                                   gpointer             object);
+
+G_END_DECLS
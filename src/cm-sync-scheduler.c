@@ -0,0 +1,410 @@
+/* cm-sync-scheduler.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "cm-sync-scheduler"
+
+#include "cm-config.h"
+
+#include "cm-sync-scheduler-private.h"
+
+/**
+ * CmSyncScheduler:
+ *
+ * Decides when the clients (re)start syncing, so that they
+ * don't all hit the server at the same time after a network
+ * change or an outage.
+ *
+ * Failed attempts are retried with an exponential backoff
+ * and a random jitter, never earlier than the server asked
+ * to when rate limited.  After a network change, clients
+ * reconnect spread over a few seconds, and only a few of
+ * them may run their initial sync (the heaviest request
+ * of all) at a time, the rest wait for a free slot.
+ *
+ * The scheduler doesn't keep a reference to the objects
+ * scheduled, they have to be removed with
+ * cm_sync_scheduler_remove() before they are finalized.
+ */
+
+#define RETRY_MIN          2000        /* milliseconds */
+#define RETRY_MAX          (120 * 1000) /* milliseconds */
+#define RECONNECT_SPREAD   3000        /* milliseconds */
+#define MAX_INITIAL_SYNCS  2
+
+typedef struct {
+  CmSyncScheduler     *self;
+  gpointer             object;
+  CmSyncSchedulerFunc  func;
+  /* Monotonic time before which the server doesn't want to see us */
+  gint64               not_before;
+  guint                n_failures;
+  guint                timeout_id;
+  gboolean             has_slot;
+  gboolean             waiting_slot;
+} SyncEntry;
+
+struct _CmSyncScheduler
+{
+  GObject     parent_instance;
+
+  /* object -> SyncEntry */
+  GHashTable *entries;
+  /* SyncEntry waiting for an initial sync slot */
+  GQueue      waiting;
+  guint       n_slots;
+};
+
+G_DEFINE_TYPE (CmSyncScheduler, cm_sync_scheduler, G_TYPE_OBJECT)
+
+static void
+sync_entry_free (gpointer data)
+{
+  SyncEntry *entry = data;
+
+  g_clear_handle_id (&entry->timeout_id, g_source_remove);
+  g_free (entry);
+}
+
+static SyncEntry *
+sync_scheduler_get_entry (CmSyncScheduler *self,
+                          gpointer         object)
+{
+  SyncEntry *entry;
+
+  entry = g_hash_table_lookup (self->entries, object);
+
+  if (!entry)
+    {
+      entry = g_new0 (SyncEntry, 1);
+      entry->self = self;
+      entry->object = object;
+      g_hash_table_insert (self->entries, object, entry);
+    }
+
+  return entry;
+}
+
+static void
+sync_entry_timeout_cb (gpointer user_data)
+{
+  SyncEntry *entry = user_data;
+
+  entry->timeout_id = 0;
+  entry->func (entry->object);
+}
+
+static void
+sync_entry_schedule (SyncEntry           *entry,
+                     CmSyncSchedulerFunc  func,
+                     guint                delay)
+{
+  g_clear_handle_id (&entry->timeout_id, g_source_remove);
+  entry->func = func;
+  entry->timeout_id = g_timeout_add_once (delay, sync_entry_timeout_cb, entry);
+}
+
+/* Milliseconds until the server accepts requests again */
+static guint
+sync_entry_get_wait (SyncEntry *entry)
+{
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+
+  if (entry->not_before <= now)
+    return 0;
+
+  return (entry->not_before - now) / 1000 + 1;
+}
+
+static void
+sync_scheduler_dispatch (CmSyncScheduler *self)
+{
+  guint n_free;
+
+  g_assert (self->n_slots <= MAX_INITIAL_SYNCS);
+
+  /* The slot is not reserved, the one woken up takes it if
+   * it's still free once it gets there, or waits again */
+  n_free = MAX_INITIAL_SYNCS - self->n_slots;
+
+  for (guint i = 0; i < n_free && !g_queue_is_empty (&self->waiting); i++)
+    {
+      SyncEntry *entry;
+
+      entry = g_queue_pop_head (&self->waiting);
+      entry->waiting_slot = FALSE;
+      sync_entry_schedule (entry, entry->func, sync_entry_get_wait (entry));
+    }
+}
+
+static void
+cm_sync_scheduler_finalize (GObject *object)
+{
+  CmSyncScheduler *self = (CmSyncScheduler *)object;
+
+  g_queue_clear (&self->waiting);
+  g_clear_pointer (&self->entries, g_hash_table_unref);
+
+  G_OBJECT_CLASS (cm_sync_scheduler_parent_class)->finalize (object);
+}
+
+static void
+cm_sync_scheduler_class_init (CmSyncSchedulerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = cm_sync_scheduler_finalize;
+}
+
+static void
+cm_sync_scheduler_init (CmSyncScheduler *self)
+{
+  self->entries = g_hash_table_new_full (NULL, NULL, NULL, sync_entry_free);
+  g_queue_init (&self->waiting);
+}
+
+CmSyncScheduler *
+cm_sync_scheduler_new (void)
+{
+  return g_object_new (CM_TYPE_SYNC_SCHEDULER, NULL);
+}
+
+/**
+ * cm_sync_scheduler_retry:
+ * @self: A #CmSyncScheduler
+ * @object: The object to schedule
+ * @func: The function to run with @object
+ * @retry_after_ms: The delay asked by the server, or 0
+ *
+ * Schedule @func to be run after a failed attempt of
+ * @object.  The delay grows with every failure, until
+ * reset with cm_sync_scheduler_reset().
+ *
+ * Returns: The delay in milliseconds
+ */
+guint
+cm_sync_scheduler_retry (CmSyncScheduler     *self,
+                         gpointer             object,
+                         CmSyncSchedulerFunc  func,
+                         guint                retry_after_ms)
+{
+  SyncEntry *entry;
+  guint base, delay, wait;
+
+  g_return_val_if_fail (CM_IS_SYNC_SCHEDULER (self), 0);
+  g_return_val_if_fail (object, 0);
+  g_return_val_if_fail (func, 0);
+
+  entry = sync_scheduler_get_entry (self, object);
+
+  base = MIN (RETRY_MAX, (guint64)RETRY_MIN << MIN (entry->n_failures, 16));
+  entry->n_failures++;
+
+  /* Half of it is random, so that the clients that failed
+   * together don't retry together, and the delay still grows */
+  delay = base / 2 + g_random_int_range (0, base / 2 + 1);
+
+  if (retry_after_ms)
+    entry->not_before = g_get_monotonic_time () + (gint64)retry_after_ms * 1000;
+
+  wait = sync_entry_get_wait (entry);
+  if (wait)
+    delay = MAX (delay, wait + g_random_int_range (0, RETRY_MIN));
+
+  sync_entry_schedule (entry, func, delay);
+
+  return delay;
+}
+
+/**
+ * cm_sync_scheduler_reconnect:
+ * @self: A #CmSyncScheduler
+ * @object: The object to schedule
+ * @func: The function to run with @object
+ *
+ * Schedule @func to be run soon with a random delay,
+ * eg: on network changes, when every client has to
+ * reconnect at once.  The backoff of @object is reset.
+ *
+ * Returns: The delay in milliseconds
+ */
+guint
+cm_sync_scheduler_reconnect (CmSyncScheduler     *self,
+                             gpointer             object,
+                             CmSyncSchedulerFunc  func)
+{
+  SyncEntry *entry;
+  guint delay;
+
+  g_return_val_if_fail (CM_IS_SYNC_SCHEDULER (self), 0);
+  g_return_val_if_fail (object, 0);
+  g_return_val_if_fail (func, 0);
+
+  entry = sync_scheduler_get_entry (self, object);
+  entry->n_failures = 0;
+
+  delay = g_random_int_range (0, RECONNECT_SPREAD);
+  delay = MAX (delay, sync_entry_get_wait (entry));
+  sync_entry_schedule (entry, func, delay);
+
+  return delay;
+}
+
+/**
+ * cm_sync_scheduler_reset:
+ * @self: A #CmSyncScheduler
+ * @object: The object scheduled
+ *
+ * Forget the failures of @object, to be called once
+ * it succeeded.
+ */
+void
+cm_sync_scheduler_reset (CmSyncScheduler *self,
+                         gpointer         object)
+{
+  SyncEntry *entry;
+
+  g_return_if_fail (CM_IS_SYNC_SCHEDULER (self));
+
+  entry = g_hash_table_lookup (self->entries, object);
+
+  if (entry)
+    {
+      entry->n_failures = 0;
+      entry->not_before = 0;
+    }
+}
+
+/**
+ * cm_sync_scheduler_cancel:
+ * @self: A #CmSyncScheduler
+ * @object: The object scheduled
+ *
+ * Cancel the pending run of @object, if any, and give
+ * back its initial sync slot.  The backoff is kept.
+ */
+void
+cm_sync_scheduler_cancel (CmSyncScheduler *self,
+                          gpointer         object)
+{
+  SyncEntry *entry;
+
+  g_return_if_fail (CM_IS_SYNC_SCHEDULER (self));
+
+  entry = g_hash_table_lookup (self->entries, object);
+
+  if (!entry)
+    return;
+
+  g_clear_handle_id (&entry->timeout_id, g_source_remove);
+
+  if (entry->waiting_slot)
+    g_queue_remove (&self->waiting, entry);
+  entry->waiting_slot = FALSE;
+
+  cm_sync_scheduler_release_slot (self, object);
+}
+
+/**
+ * cm_sync_scheduler_remove:
+ * @self: A #CmSyncScheduler
+ * @object: The object scheduled
+ *
+ * Cancel everything pending for @object and forget
+ * about it.  Shall be called before @object is finalized.
+ */
+void
+cm_sync_scheduler_remove (CmSyncScheduler *self,
+                          gpointer         object)
+{
+  g_return_if_fail (CM_IS_SYNC_SCHEDULER (self));
+
+  cm_sync_scheduler_cancel (self, object);
+  g_hash_table_remove (self->entries, object);
+}
+
+/**
+ * cm_sync_scheduler_acquire_slot:
+ * @self: A #CmSyncScheduler
+ * @object: The object to schedule
+ * @func: The function to run with @object
+ *
+ * Get a slot to run an initial sync of @object.  If
+ * none is free, @object is queued, and @func is run
+ * when one is.  Release the slot with
+ * cm_sync_scheduler_release_slot() once done.
+ *
+ * Returns: %TRUE if @object got the slot
+ */
+gboolean
+cm_sync_scheduler_acquire_slot (CmSyncScheduler     *self,
+                                gpointer             object,
+                                CmSyncSchedulerFunc  func)
+{
+  SyncEntry *entry;
+
+  g_return_val_if_fail (CM_IS_SYNC_SCHEDULER (self), FALSE);
+  g_return_val_if_fail (object, FALSE);
+  g_return_val_if_fail (func, FALSE);
+
+  entry = sync_scheduler_get_entry (self, object);
+
+  if (entry->has_slot)
+    return TRUE;
+
+  if (!entry->waiting_slot && self->n_slots < MAX_INITIAL_SYNCS)
+    {
+      entry->has_slot = TRUE;
+      self->n_slots++;
+
+      return TRUE;
+    }
+
+  if (!entry->waiting_slot)
+    {
+      g_debug ("%u initial syncs running, %p waiting", self->n_slots, object);
+      g_clear_handle_id (&entry->timeout_id, g_source_remove);
+      entry->func = func;
+      entry->waiting_slot = TRUE;
+      g_queue_push_tail (&self->waiting, entry);
+    }
+
+  return FALSE;
+}
+
+void
+cm_sync_scheduler_release_slot (CmSyncScheduler *self,
+                                gpointer         object)
+{
+  SyncEntry *entry;
+
+  g_return_if_fail (CM_IS_SYNC_SCHEDULER (self));
+
+  entry = g_hash_table_lookup (self->entries, object);
+
+  if (!entry || !entry->has_slot)
+    return;
+
+  g_assert (self->n_slots > 0);
+  entry->has_slot = FALSE;
+  self->n_slots--;
+  sync_scheduler_dispatch (self);
+}
+
+gboolean
+cm_sync_scheduler_is_pending (CmSyncScheduler *self,
+                              gpointer         object)
+{
+  SyncEntry *entry;
+
+  g_return_val_if_fail (CM_IS_SYNC_SCHEDULER (self), FALSE);
+
+  entry = g_hash_table_lookup (self->entries, object);
+
+  return entry && (entry->timeout_id || entry->waiting_slot);
+}
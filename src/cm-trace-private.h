@@ -0,0 +1,53 @@
+/* cm-trace-private.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include "cm-config.h"
+
+#include <glib.h>
+
+#if HAVE_SYSPROF
+# include <sysprof-capture.h>
+#endif
+
+G_BEGIN_DECLS
+
+/*
+ * Tracing spans, emitted as sysprof marks when built with
+ * -Dtracing=enabled, so that the time spent in sync, db tasks,
+ * encryption, etc. can be seen in a sysprof timeline.  Without
+ * it, CM_TRACE_BEGIN() is 0 and CM_TRACE_SPAN() evaluates only
+ * @begin, so that the variable holding it isn't unused, and
+ * not the name or the format arguments.  @begin should be
+ * free of side effects.
+ *
+ *   gint64 begin = CM_TRACE_BEGIN ();
+ *   ...
+ *   CM_TRACE_SPAN (begin, "sync", "%u rooms", n_rooms);
+ *
+ * @begin is in g_get_monotonic_time() units, so times already
+ * taken with it can be reused as the beginning of a span.
+ */
+#if HAVE_SYSPROF
+# define CM_TRACE_BEGIN() g_get_monotonic_time ()
+# define CM_TRACE_SPAN(begin, name, fmt, ...) G_STMT_START {            \
+  gint64 _begin = (begin);                                              \
+                                                                        \
+  if (_begin)                                                           \
+    sysprof_collector_mark_printf (_begin * 1000,                       \
+                                   (g_get_monotonic_time () - _begin) * 1000, \
+                                   "libcmatrix", name, fmt, ##__VA_ARGS__); \
+} G_STMT_END
+#else
+# define CM_TRACE_BEGIN() 0
+# define CM_TRACE_SPAN(begin, name, fmt, ...) G_STMT_START {            \
+  (void)(begin);                                                        \
+} G_STMT_END
+#endif
+
+G_END_DECLS
@@ -12,6 +12,7 @@
 
 #include "cm-enums.h"
 #include "cm-types.h"
+#include "cm-net-private.h"
 
 /* Hack to check format specifier arguments match */
 static inline void check_format (const char *fmt, ...) G_GNUC_PRINTF (1, 2);
@@ -39,11 +40,14 @@ gboolean      cm_utils_get_item_position        (GListModel          *list,
                                                  guint               *position);
 gboolean      cm_utils_remove_list_item         (GListStore          *store,
                                                  gpointer             item);
+CmEventType   cm_utils_get_event_type           (const char          *type);
 const char   *cm_utils_get_event_type_str       (CmEventType          type);
 char         *cm_utils_json_object_to_string    (JsonObject          *object,
                                                  gboolean             prettify);
 GString      *cm_utils_json_get_canonical       (JsonObject          *object,
                                                  GString             *out);
+const char   *cm_utils_json_write_canonical     (JsonObject          *object,
+                                                 gsize               *out_len);
 JsonObject   *cm_utils_string_to_json_object    (const char          *json_str);
 gboolean      cm_utils_json_object_has_member   (JsonObject          *object,
                                                  const char          *member);
@@ -55,6 +59,9 @@ const char   *cm_utils_json_object_get_string   (JsonObject          *object,
                                                  const char          *member);
 char         *cm_utils_json_object_dup_string   (JsonObject          *object,
                                                  const char          *member);
+GRefString   *cm_utils_intern_id                (const char          *id);
+GRefString   *cm_utils_json_object_intern_string (JsonObject         *object,
+                                                  const char         *member);
 JsonObject   *cm_utils_json_object_get_object   (JsonObject          *object,
                                                  const char          *member);
 JsonArray    *cm_utils_json_object_get_array    (JsonObject          *object,
@@ -85,14 +92,41 @@ GStrv         cm_utils_verify_homeserver_finish (GAsyncResult        *result,
 void          cm_utils_save_url_to_path_async     (CmClient              *client,
                                                    const char            *uri,
                                                    char                  *file_path,
+                                                   CmTransferPriority     priority,
                                                    GCancellable          *cancellable,
                                                    GFileProgressCallback  progress_callback,
                                                    gpointer               progress_user_data,
                                                    GAsyncReadyCallback    callback,
                                                    gpointer               user_data);
+void          cm_utils_save_thumbnail_to_path_async (CmClient            *client,
+                                                     const char          *uri,
+                                                     int                  width,
+                                                     int                  height,
+                                                     CmThumbnailMethod    method,
+                                                     char                *file_path,
+                                                     CmTransferPriority   priority,
+                                                     GCancellable        *cancellable,
+                                                     GAsyncReadyCallback  callback,
+                                                     gpointer             user_data);
 GFile        *cm_utils_save_url_to_path_finish    (GAsyncResult          *result,
                                                    GError               **error);
+void          cm_utils_read_thumbnail_async       (CmClient              *client,
+                                                   const char            *uri,
+                                                   int                    width,
+                                                   int                    height,
+                                                   CmThumbnailMethod      method,
+                                                   CmEventType            type,
+                                                   CmTransferPriority     priority,
+                                                   GCancellable          *cancellable,
+                                                   GAsyncReadyCallback    callback,
+                                                   gpointer               user_data);
+GInputStream *cm_utils_read_thumbnail_finish      (GAsyncResult          *result,
+                                                   GError               **error);
 char         *cm_utils_get_path_for_m_type      (const char          *base_path,
                                                  CmEventType          type,
                                                  gboolean             thumbnail,
                                                  const char          *file_name);
+char         *cm_utils_get_thumbnail_file_name  (const char          *mxc_uri,
+                                                 int                  width,
+                                                 int                  height,
+                                                 CmThumbnailMethod    method);
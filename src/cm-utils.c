@@ -19,6 +19,8 @@
 #include "cm-common.h"
 #include "cm-enc-private.h"
 #include "cm-enums.h"
+#include "cm-matrix-private.h"
+#include "cm-media-cache-private.h"
 #include "cm-utils-private.h"
 #include "cm-utils.h"
 
@@ -250,201 +252,133 @@ cm_utils_remove_list_item (GListStore *store,
   return FALSE;
 }
 
-const char *
-cm_utils_get_event_type_str (CmEventType type)
-{
-  switch (type)
-    {
-    case CM_M_CALL_ANSWER:
-      return "m.call.answer";
-
-    case CM_M_CALL_ASSERTED_IDENTITY:
-      return "m.call.asserted_identity";
-
-    case CM_M_CALL_ASSERTED_IDENTITY_PREFIX:
-      return "org.matrix.call.asserted_identity";
-
-    case CM_M_CALL_CANDIDATES:
-      return "m.call.candidates";
-
-    case CM_M_CALL_HANGUP:
-      return "m.call.hangup";
-
-    case CM_M_CALL_INVITE:
-      return "m.call.invite";
-
-    case CM_M_CALL_NEGOTIATE:
-      return "m.call.negotiate";
-
-    case CM_M_CALL_REJECT:
-      return "m.call.reject";
-
-    case CM_M_CALL_REPLACES:
-      return "m.call.replaces";
-
-    case CM_M_CALL_SELECT_ANSWER:
-      return "m.call.select_answer";
-
-    case CM_M_DIRECT:
-      return "m.direct";
-
-    case CM_M_DUMMY:
-      return "m.dummy";
-
-    case CM_M_FORWARDED_ROOM_KEY:
-      return "m.forwarded_room_key";
-
-    case CM_M_FULLY_READ:
-      return "m.fully_read";
-
-    case CM_M_IGNORED_USER_LIST:
-      return "m.ignored_user_list";
-
-    case CM_M_KEY_VERIFICATION_ACCEPT:
-      return "m.key.verification_accept";
-
-    case CM_M_KEY_VERIFICATION_CANCEL:
-      return "m.key.verification.cancel";
-
-    case CM_M_KEY_VERIFICATION_DONE:
-      return "m.key.verification.done";
-
-    case CM_M_KEY_VERIFICATION_KEY:
-      return "m.key.verification.key";
-
-    case CM_M_KEY_VERIFICATION_MAC:
-      return "m.key.verification.mac";
-
-    case CM_M_KEY_VERIFICATION_READY:
-      return "m.key.verification.ready";
-
-    case CM_M_KEY_VERIFICATION_REQUEST:
-      return "m.key.verification.request";
-
-    case CM_M_KEY_VERIFICATION_START:
-      return "m.key.verification.start";
-
-    case CM_M_PRESENCE:
-      return "m.presence";
-
-    case CM_M_PUSH_RULES:
-      return "m.push_rules";
-
-    case CM_M_REACTION:
-      return "m.reaction";
-
-    case CM_M_RECEIPT:
-      return "m.receipt";
-
-    case CM_M_ROOM_ALIASES:
-      return "m.room.aliases";
-
-    case CM_M_ROOM_AVATAR:
-      return "m.room.avatar";
-
-    case CM_M_ROOM_BOT_OPTIONS:
-      return "m.room.bot.options";
-
-    case CM_M_ROOM_CANONICAL_ALIAS:
-      return "m.room.canonical_alias";
-
-    case CM_M_ROOM_CREATE:
-      return "m.room.create";
-
-    case CM_M_ROOM_ENCRYPTED:
-      return "m.room.encrypted";
-
-    case CM_M_ROOM_ENCRYPTION:
-      return "m.room.encryption";
-
-    case CM_M_ROOM_GUEST_ACCESS:
-      return "m.room.guest_access";
-
-    case CM_M_ROOM_HISTORY_VISIBILITY:
-      return "m.room.history_visibility";
-
-    case CM_M_ROOM_JOIN_RULES:
-      return "m.room.join_rules";
-
-    case CM_M_ROOM_KEY:
-      return "m.room_key";
-
-    case CM_M_ROOM_KEY_REQUEST:
-      return "m.room_key.request";
-
-    case CM_M_ROOM_MEMBER:
-      return "m.room.member";
-
-    case CM_M_ROOM_MESSAGE:
-      return "m.room.message";
-
-    case CM_M_ROOM_MESSAGE_FEEDBACK:
-      return "m.room.message.feedback";
-
-    case CM_M_ROOM_NAME:
-      return "m.room.name";
-
-    case CM_M_ROOM_PINNED_EVENTS:
-      return "m.room.pinned_events";
-
-    case CM_M_ROOM_PLUMBING:
-      return "m.room.plumbing";
-
-    case CM_M_ROOM_POWER_LEVELS:
-      return "m.room.power_levels";
-
-    case CM_M_ROOM_REDACTION:
-      return "m.room.redaction";
-
-    case CM_M_ROOM_RELATED_GROUPS:
-      return "m.room.related_groups";
-
-    case CM_M_ROOM_SERVER_ACL:
-      return "m.room.server_acl";
-
-    case CM_M_ROOM_THIRD_PARTY_INVITE:
-      return "m.room.third_party_invite";
-
-    case CM_M_ROOM_TOMBSTONE:
-      return "m.room.tombstone";
+static const char *event_type_names[] = {
+  [CM_M_CALL_ANSWER]                   = "m.call.answer",
+  [CM_M_CALL_ASSERTED_IDENTITY]        = "m.call.asserted_identity",
+  [CM_M_CALL_ASSERTED_IDENTITY_PREFIX] = "org.matrix.call.asserted_identity",
+  [CM_M_CALL_CANDIDATES]               = "m.call.candidates",
+  [CM_M_CALL_HANGUP]                   = "m.call.hangup",
+  [CM_M_CALL_INVITE]                   = "m.call.invite",
+  [CM_M_CALL_NEGOTIATE]                = "m.call.negotiate",
+  [CM_M_CALL_REJECT]                   = "m.call.reject",
+  [CM_M_CALL_REPLACES]                 = "m.call.replaces",
+  [CM_M_CALL_SELECT_ANSWER]            = "m.call.select_answer",
+  [CM_M_DIRECT]                        = "m.direct",
+  [CM_M_DUMMY]                         = "m.dummy",
+  [CM_M_FORWARDED_ROOM_KEY]            = "m.forwarded_room_key",
+  [CM_M_FULLY_READ]                    = "m.fully_read",
+  [CM_M_IGNORED_USER_LIST]             = "m.ignored_user_list",
+  [CM_M_KEY_VERIFICATION_ACCEPT]       = "m.key.verification_accept",
+  [CM_M_KEY_VERIFICATION_CANCEL]       = "m.key.verification.cancel",
+  [CM_M_KEY_VERIFICATION_DONE]         = "m.key.verification.done",
+  [CM_M_KEY_VERIFICATION_KEY]          = "m.key.verification.key",
+  [CM_M_KEY_VERIFICATION_MAC]          = "m.key.verification.mac",
+  [CM_M_KEY_VERIFICATION_READY]        = "m.key.verification.ready",
+  [CM_M_KEY_VERIFICATION_REQUEST]      = "m.key.verification.request",
+  [CM_M_KEY_VERIFICATION_START]        = "m.key.verification.start",
+  [CM_M_PRESENCE]                      = "m.presence",
+  [CM_M_PUSH_RULES]                    = "m.push_rules",
+  [CM_M_REACTION]                      = "m.reaction",
+  [CM_M_RECEIPT]                       = "m.receipt",
+  [CM_M_ROOM_ALIASES]                  = "m.room.aliases",
+  [CM_M_ROOM_AVATAR]                   = "m.room.avatar",
+  [CM_M_ROOM_BOT_OPTIONS]              = "m.room.bot.options",
+  [CM_M_ROOM_CANONICAL_ALIAS]          = "m.room.canonical_alias",
+  [CM_M_ROOM_CREATE]                   = "m.room.create",
+  [CM_M_ROOM_ENCRYPTED]                = "m.room.encrypted",
+  [CM_M_ROOM_ENCRYPTION]               = "m.room.encryption",
+  [CM_M_ROOM_GUEST_ACCESS]             = "m.room.guest_access",
+  [CM_M_ROOM_HISTORY_VISIBILITY]       = "m.room.history_visibility",
+  [CM_M_ROOM_JOIN_RULES]               = "m.room.join_rules",
+  [CM_M_ROOM_KEY]                      = "m.room_key",
+  [CM_M_ROOM_KEY_REQUEST]              = "m.room_key.request",
+  [CM_M_ROOM_MEMBER]                   = "m.room.member",
+  [CM_M_ROOM_MESSAGE]                  = "m.room.message",
+  [CM_M_ROOM_MESSAGE_FEEDBACK]         = "m.room.message.feedback",
+  [CM_M_ROOM_NAME]                     = "m.room.name",
+  [CM_M_ROOM_PINNED_EVENTS]            = "m.room.pinned_events",
+  [CM_M_ROOM_PLUMBING]                 = "m.room.plumbing",
+  [CM_M_ROOM_POWER_LEVELS]             = "m.room.power_levels",
+  [CM_M_ROOM_REDACTION]                = "m.room.redaction",
+  [CM_M_ROOM_RELATED_GROUPS]           = "m.room.related_groups",
+  [CM_M_ROOM_SERVER_ACL]               = "m.room.server_acl",
+  [CM_M_ROOM_THIRD_PARTY_INVITE]       = "m.room.third_party_invite",
+  [CM_M_ROOM_TOMBSTONE]                = "m.room.tombstone",
+  [CM_M_ROOM_TOPIC]                    = "m.room.topic",
+  [CM_M_SECRET_REQUEST]                = "m.secret.request",
+  [CM_M_SECRET_SEND]                   = "m.secret.send",
+  [CM_M_SECRET_STORAGE_DEFAULT_KEY]    = "m.secret_storage.default_key",
+  [CM_M_SPACE_CHILD]                   = "m.space.child",
+  [CM_M_SPACE_PARENT]                  = "m.space.parent",
+  [CM_M_STICKER]                       = "m.sticker",
+  [CM_M_TAG]                           = "m.tag",
+  [CM_M_TYPING]                        = "m.typing",
+};
 
-    case CM_M_ROOM_TOPIC:
-      return "m.room.topic";
+/*
+ * Perfect hash of event_type_names, see cm_utils_get_event_type().
+ * Generated with build-aux/gen-event-type-hash.py
+ */
+#define EVENT_TYPE_HASH_SEED 0x5695a
+#define EVENT_TYPE_HASH_BITS 7
+
+static const guint8 event_type_slots[1 << EVENT_TYPE_HASH_BITS] = {
+   5,  0, 54,  0,  0,  8,  0,  0, 35,  0,  0, 31,  0, 23,  0,  0,
+   0,  0, 45,  1,  0,  0,  0,  0,  2,  0,  0,  0,  0, 58,  7,  0,
+   0, 29,  0, 10,  0,  0,  0, 47, 46, 25,  0, 28, 43, 33, 26, 36,
+   0, 34,  0,  0,  3, 11,  0, 49, 22, 44,  0,  0,  0,  0, 27, 16,
+   0,  0,  0, 42,  0, 57,  0,  0, 20, 15, 19,  0, 12,  0, 37,  0,
+  39, 53,  0,  0, 59,  0, 21,  0,  9, 13,  4,  0,  0,  0, 52,  0,
+   0,  0,  0, 55,  0,  0, 50, 30,  0, 18, 56,  0,  0,  0, 48, 60,
+   0,  0, 38, 24,  0,  0, 32, 41,  0,  0, 40, 17,  6, 51,  0, 14,
+};
 
-    case CM_M_SECRET_REQUEST:
-      return "m.secret.request";
+static inline guint32
+utils_event_type_hash (const char *str)
+{
+  guint32 hash = EVENT_TYPE_HASH_SEED;
 
-    case CM_M_SECRET_SEND:
-      return "m.secret.send";
+  /* FNV-1a */
+  for (const guchar *p = (const guchar *)str; *p; p++)
+    hash = (hash ^ *p) * 16777619;
 
-    case CM_M_SECRET_STORAGE_DEFAULT_KEY:
-      return "m.secret_storage.default_key";
+  return hash >> (32 - EVENT_TYPE_HASH_BITS);
+}
 
-    case CM_M_SPACE_CHILD:
-      return "m.space.child";
+/*
+ * cm_utils_get_event_type:
+ * @type: (nullable): An event type string
+ *
+ * Get the #CmEventType for the event type
+ * string @type, eg: "m.room.message"
+ *
+ * Returns: The event type, or %CM_M_UNKNOWN
+ * if the @type is not known.
+ */
+CmEventType
+cm_utils_get_event_type (const char *type)
+{
+  guint slot;
 
-    case CM_M_SPACE_PARENT:
-      return "m.space.parent";
+  if (!type)
+    return CM_M_UNKNOWN;
 
-    case CM_M_STICKER:
-      return "m.sticker";
+  slot = event_type_slots[utils_event_type_hash (type)];
 
-    case CM_M_TAG:
-      return "m.tag";
+  if (slot && strcmp (event_type_names[slot], type) == 0)
+    return slot;
 
-    case CM_M_TYPING:
-      return "m.typing";
+  return CM_M_UNKNOWN;
+}
 
-    case CM_M_UNKNOWN:
-    case CM_M_USER_STATUS:
-    case CM_M_ROOM_INVITE:
-    case CM_M_ROOM_BAN:
-    case CM_M_ROOM_KICK:
-    default:
-      g_return_val_if_reached (NULL);
-    }
+const char *
+cm_utils_get_event_type_str (CmEventType type)
+{
+  if (type > CM_M_UNKNOWN && type < G_N_ELEMENTS (event_type_names) &&
+      event_type_names[type])
+    return event_type_names[type];
 
-  return NULL;
+  g_return_val_if_reached (NULL);
 }
 
 void
@@ -600,110 +534,310 @@ cm_utils_json_object_to_string (JsonObject *object,
   return json_to_string (node, !!prettify);
 }
 
-static void utils_json_canonical_array (JsonArray *array,
-                                        GString   *out);
+/*
+ * Canonical JSON, as required for signing:
+ * https://spec.matrix.org/v1.5/appendices/#canonical-json
+ *
+ * Keys are sorted by Unicode codepoint, which for UTF-8
+ * is the same as sorting by bytes with strcmp().  Only
+ * the required characters are escaped, everything else
+ * is written as UTF-8.
+ */
+#define CANONICAL_STACK_KEYS 32
+
+static void utils_canonical_append_node (GString  *out,
+                                         JsonNode *node);
+
+static int
+utils_canonical_key_cmp (gconstpointer a,
+                         gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
 static void
-utils_handle_node (JsonNode *node,
-                   GString  *out)
+utils_canonical_append_string (GString    *out,
+                               const char *str)
 {
-  GType type;
+  const char *start, *p;
 
-  g_assert (node);
-  g_assert (out);
+  g_string_append_c (out, '"');
+
+  for (start = p = str; *p; p++)
+    {
+      guchar c = *p;
+
+      if (G_LIKELY (c >= 0x20 && c != '"' && c != '\\'))
+        continue;
+
+      g_string_append_len (out, start, p - start);
+      start = p + 1;
+
+      switch (c)
+        {
+        case '"':
+          g_string_append_len (out, "\\\"", 2);
+          break;
+
+        case '\\':
+          g_string_append_len (out, "\\\\", 2);
+          break;
+
+        case '\b':
+          g_string_append_len (out, "\\b", 2);
+          break;
+
+        case '\f':
+          g_string_append_len (out, "\\f", 2);
+          break;
+
+        case '\n':
+          g_string_append_len (out, "\\n", 2);
+          break;
+
+        case '\r':
+          g_string_append_len (out, "\\r", 2);
+          break;
+
+        case '\t':
+          g_string_append_len (out, "\\t", 2);
+          break;
+
+        default:
+          g_string_append_printf (out, "\\u%04x", c);
+        }
+    }
+
+  g_string_append_len (out, start, p - start);
+  g_string_append_c (out, '"');
+}
+
+static void
+utils_canonical_append_int (GString *out,
+                            gint64   value)
+{
+  char buffer[24];
+  char *p = buffer + sizeof buffer;
+  guint64 num;
+
+  /* Avoid overflow on G_MININT64 */
+  num = value < 0 ? -(guint64)value : (guint64)value;
+
+  do
+    {
+      *--p = '0' + num % 10;
+      num /= 10;
+    }
+  while (num);
+
+  if (value < 0)
+    *--p = '-';
+
+  g_string_append_len (out, p, buffer + sizeof buffer - p);
+}
+
+static void
+utils_canonical_append_value (GString  *out,
+                              JsonNode *node)
+{
+  GType type;
 
   type = json_node_get_value_type (node);
 
-  if (type == JSON_TYPE_OBJECT)
-    cm_utils_json_get_canonical (json_node_get_object (node), out);
-  else if (type == JSON_TYPE_ARRAY)
-    utils_json_canonical_array (json_node_get_array (node), out);
-  else if (type == G_TYPE_INVALID)
-    g_string_append (out, "null");
-  else if (type == G_TYPE_STRING)
-    g_string_append_printf (out, "\"%s\"", json_node_get_string (node));
+  if (type == G_TYPE_STRING)
+    {
+      utils_canonical_append_string (out, json_node_get_string (node));
+    }
   else if (type == G_TYPE_INT64)
-    g_string_append_printf (out, "%" G_GINT64_FORMAT, json_node_get_int (node));
-  else if (type == G_TYPE_DOUBLE)
-    g_string_append_printf (out, "%f", json_node_get_double (node));
+    {
+      utils_canonical_append_int (out, json_node_get_int (node));
+    }
   else if (type == G_TYPE_BOOLEAN)
-    g_string_append (out, json_node_get_boolean (node) ? "true" : "false");
+    {
+      if (json_node_get_boolean (node))
+        g_string_append_len (out, "true", 4);
+      else
+        g_string_append_len (out, "false", 5);
+    }
+  else if (type == G_TYPE_DOUBLE)
+    {
+      char buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+      /* Canonical JSON allows only integers, but be lenient.
+       * Integral values are written without a fraction part */
+      g_string_append (out, g_ascii_dtostr (buffer, sizeof buffer,
+                                            json_node_get_double (node)));
+    }
   else
-    g_return_if_reached ();
+    {
+      g_return_if_reached ();
+    }
 }
 
 static void
-utils_json_canonical_array (JsonArray *array,
-                            GString   *out)
+utils_canonical_append_array (GString   *out,
+                              JsonArray *array)
 {
-  g_autoptr(GList) elements = NULL;
-
-  g_assert (array);
-  g_assert (out);
+  guint length;
 
+  length = json_array_get_length (array);
   g_string_append_c (out, '[');
-  elements = json_array_get_elements (array);
 
   /* The order of array members shouldn’t be changed */
-  for (GList *item = elements; item; item = item->next)
+  for (guint i = 0; i < length; i++)
     {
-      utils_handle_node (item->data, out);
-
-      if (item->next)
+      if (i)
         g_string_append_c (out, ',');
+
+      utils_canonical_append_node (out, json_array_get_element (array, i));
     }
 
   g_string_append_c (out, ']');
 }
 
-GString *
-cm_utils_json_get_canonical (JsonObject *object,
-                             GString    *out)
+static void
+utils_canonical_append_object (GString    *out,
+                               JsonObject *object,
+                               gboolean    signed_only)
 {
-  JsonNode *signatures, *non_signed;
+  const char *stack_keys[CANONICAL_STACK_KEYS];
+  g_autofree const char **heap_keys = NULL;
+  const char **keys = stack_keys;
+  JsonObjectIter iter;
+  const char *key;
+  guint size, n_keys = 0;
 
-  g_autoptr(GList) members = NULL;
+  size = json_object_get_size (object);
 
-  g_return_val_if_fail (object, NULL);
+  if (size > CANONICAL_STACK_KEYS)
+    keys = heap_keys = g_new (const char *, size);
 
-  if (!out)
-    out = g_string_sized_new (BUFFER_SIZE);
+  json_object_iter_init (&iter, object);
 
-  signatures = json_object_dup_member (object, "signatures");
-  non_signed = json_object_dup_member (object, "unsigned");
+  while (json_object_iter_next (&iter, &key, NULL))
+    {
+      if (signed_only &&
+          (g_str_equal (key, "signatures") || g_str_equal (key, "unsigned")))
+        continue;
 
-  /* Remove the non signed members before verification */
-  json_object_remove_member (object, "signatures");
-  json_object_remove_member (object, "unsigned");
+      keys[n_keys++] = key;
+    }
+
+  if (n_keys > 1)
+    qsort (keys, n_keys, sizeof *keys, utils_canonical_key_cmp);
 
   g_string_append_c (out, '{');
 
-  members = json_object_get_members (object);
-  members = g_list_sort (members, (GCompareFunc)g_strcmp0);
+  for (guint i = 0; i < n_keys; i++)
+    {
+      if (i)
+        g_string_append_c (out, ',');
+
+      utils_canonical_append_string (out, keys[i]);
+      g_string_append_c (out, ':');
+      utils_canonical_append_node (out, json_object_get_member (object, keys[i]));
+    }
+
+  g_string_append_c (out, '}');
+}
 
-  for (GList *item = members; item; item = item->next)
+static void
+utils_canonical_append_node (GString  *out,
+                             JsonNode *node)
+{
+  g_assert (node);
+
+  switch (json_node_get_node_type (node))
     {
-      JsonNode *node;
+    case JSON_NODE_OBJECT:
+      utils_canonical_append_object (out, json_node_get_object (node), FALSE);
+      break;
 
-      g_string_append_printf (out, "\"%s\":", (char *)item->data);
+    case JSON_NODE_ARRAY:
+      utils_canonical_append_array (out, json_node_get_array (node));
+      break;
 
-      node = json_object_get_member (object, item->data);
-      utils_handle_node (node, out);
+    case JSON_NODE_VALUE:
+      utils_canonical_append_value (out, node);
+      break;
 
-      if (item->next)
-        g_string_append_c (out, ',');
+    case JSON_NODE_NULL:
+    default:
+      g_string_append_len (out, "null", 4);
     }
+}
 
-  g_string_append_c (out, '}');
+/**
+ * cm_utils_json_get_canonical:
+ * @object: A #JsonObject
+ * @out: (nullable): A #GString to append to
+ *
+ * Append the canonical JSON of @object to @out, without
+ * the top level "signatures" and "unsigned" members so
+ * that the result can be used for signing and verifying.
+ * @object is not modified.
+ *
+ * Returns: (transfer full): @out, or a new #GString if
+ * @out is %NULL.
+ */
+GString *
+cm_utils_json_get_canonical (JsonObject *object,
+                             GString    *out)
+{
+  g_return_val_if_fail (object, NULL);
 
-  /* Revert the changes we made to the JSON object */
-  if (signatures)
-    json_object_set_member (object, "signatures", signatures);
-  if (non_signed)
-    json_object_set_member (object, "unsigned", non_signed);
+  if (!out)
+    out = g_string_sized_new (BUFFER_SIZE);
+
+  utils_canonical_append_object (out, object, TRUE);
 
   return out;
 }
 
+static void
+utils_canonical_buffer_free (gpointer data)
+{
+  g_string_free (data, TRUE);
+}
+
+/**
+ * cm_utils_json_write_canonical:
+ * @object: A #JsonObject
+ * @out_len: (out) (optional): Return location for the length
+ *
+ * Same as cm_utils_json_get_canonical(), but the JSON is
+ * written to a buffer owned by the calling thread, which is
+ * reused to avoid allocations on each call.
+ *
+ * Returns: (transfer none): The canonical JSON string, valid
+ * until the next call from the same thread.
+ */
+const char *
+cm_utils_json_write_canonical (JsonObject *object,
+                               gsize      *out_len)
+{
+  static GPrivate buffer_key = G_PRIVATE_INIT (utils_canonical_buffer_free);
+  GString *buffer;
+
+  g_return_val_if_fail (object, NULL);
+
+  buffer = g_private_get (&buffer_key);
+
+  if (!buffer)
+    {
+      buffer = g_string_sized_new (4096);
+      g_private_set (&buffer_key, buffer);
+    }
+
+  g_string_truncate (buffer, 0);
+  utils_canonical_append_object (buffer, object, TRUE);
+
+  if (out_len)
+    *out_len = buffer->len;
+
+  return buffer->str;
+}
+
 JsonObject *
 cm_utils_string_to_json_object (const char *json_str)
 {
@@ -801,6 +935,33 @@ cm_utils_json_object_dup_string (JsonObject *object,
   return g_strdup (str);
 }
 
+/**
+ * cm_utils_intern_id:
+ * @id: (nullable): A Matrix identifier
+ *
+ * Get the interned string for @id, which is shared by
+ * every user of the same identifier.  So two interned
+ * identifiers are equal only if the pointers are equal.
+ *
+ * Returns: (transfer full) (nullable): The interned string.
+ * Free with g_ref_string_release().
+ */
+GRefString *
+cm_utils_intern_id (const char *id)
+{
+  if (!id)
+    return NULL;
+
+  return g_ref_string_new_intern (id);
+}
+
+GRefString *
+cm_utils_json_object_intern_string (JsonObject *object,
+                                    const char *member)
+{
+  return cm_utils_intern_id (cm_utils_json_object_get_string (object, member));
+}
+
 /**
  * cm_utils_json_object_get_object:
  * @object: a JSON object
@@ -1449,24 +1610,47 @@ find_file_enc_cb (GObject      *object,
   cancellable = g_task_get_cancellable (task);
   uri = g_object_get_data (user_data, "uri");
 
-  cm_net_get_file_async (cm_client_get_net (client),
-                         uri, file_info,
-                         cm_client_get_homeserver_versions (client),
-                         cancellable,
-                         get_file_cb,
-                         g_steal_pointer (&task));
+  cm_net_get_file_range_async (cm_client_get_net (client),
+                               uri, file_info,
+                               cm_client_get_homeserver_versions (client),
+                               0,
+                               GPOINTER_TO_INT (g_object_get_data (user_data, "priority")),
+                               cancellable,
+                               get_file_cb,
+                               g_steal_pointer (&task));
+}
+
+static void
+utils_media_cache_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GError *error = NULL;
+  GFile *file;
+
+  g_assert (G_IS_TASK (task));
+
+  file = cm_media_cache_get_file_finish (CM_MEDIA_CACHE (object), result, &error);
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, file, g_object_unref);
 }
 
 void
 cm_utils_save_url_to_path_async (CmClient              *client,
                                  const char            *uri,
                                  char                  *file_path,
+                                 CmTransferPriority     priority,
                                  GCancellable          *cancellable,
                                  GFileProgressCallback  progress_callback,
                                  gpointer               progress_user_data,
                                  GAsyncReadyCallback    callback,
                                  gpointer               user_data)
 {
+  CmMediaCache *cache;
   GTask *task;
 
   g_return_if_fail (CM_IS_CLIENT (client));
@@ -1477,14 +1661,75 @@ cm_utils_save_url_to_path_async (CmClient              *client,
 
   task = g_task_new (client, cancellable, callback, user_data);
   g_object_set_data_full (G_OBJECT (task), "uri", g_strdup (uri), g_free);
-  g_object_set_data_full (G_OBJECT (task), "path", file_path, g_free);
   g_object_set_data (G_OBJECT (task), "progress-cb", progress_callback);
   g_object_set_data (G_OBJECT (task), "progress-cb-data", progress_user_data);
+  g_object_set_data (G_OBJECT (task), "priority", GINT_TO_POINTER (priority));
+
+  /* Go through the shared cache if available (not so in some tests) */
+  cache = cm_matrix_get_media_cache ();
+
+  if (cache)
+    {
+      cm_media_cache_get_file_async (cache, client, uri, file_path, priority,
+                                     cancellable, progress_callback, progress_user_data,
+                                     utils_media_cache_cb, task);
+      return;
+    }
 
+  g_object_set_data_full (G_OBJECT (task), "path", file_path, g_free);
   cm_enc_find_file_enc_async (cm_client_get_enc (client), uri,
                               find_file_enc_cb, task);
 }
 
+/*
+ * cm_utils_save_thumbnail_to_path_async:
+ *
+ * Same as cm_utils_save_url_to_path_async(), but saves a
+ * server generated thumbnail of @uri of the given size.
+ * Finish with cm_utils_save_url_to_path_finish().
+ */
+void
+cm_utils_save_thumbnail_to_path_async (CmClient            *client,
+                                       const char          *uri,
+                                       int                  width,
+                                       int                  height,
+                                       CmThumbnailMethod    method,
+                                       char                *file_path,
+                                       CmTransferPriority   priority,
+                                       GCancellable        *cancellable,
+                                       GAsyncReadyCallback  callback,
+                                       gpointer             user_data)
+{
+  CmMediaCache *cache;
+  GTask *task;
+
+  g_return_if_fail (CM_IS_CLIENT (client));
+  g_return_if_fail (uri && g_str_has_prefix (uri, "mxc://"));
+  g_return_if_fail (width > 0 && height > 0);
+  g_return_if_fail (file_path && *file_path == '/');
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (client, cancellable, callback, user_data);
+  g_task_set_source_tag (task, cm_utils_save_thumbnail_to_path_async);
+  g_object_set_data_full (G_OBJECT (task), "uri", g_strdup (uri), g_free);
+
+  cache = cm_matrix_get_media_cache ();
+
+  if (cache)
+    {
+      cm_media_cache_get_thumbnail_async (cache, client, uri, width, height, method,
+                                          file_path, priority, cancellable,
+                                          utils_media_cache_cb, task);
+      return;
+    }
+
+  g_object_set_data_full (G_OBJECT (task), "path", file_path, g_free);
+  cm_net_get_thumbnail_async (cm_client_get_net (client), uri,
+                              width, height, method,
+                              cm_client_get_homeserver_versions (client),
+                              priority, cancellable, get_file_cb, task);
+}
+
 GFile *
 cm_utils_save_url_to_path_finish (GAsyncResult  *result,
                                   GError       **error)
@@ -1494,6 +1739,116 @@ cm_utils_save_url_to_path_finish (GAsyncResult  *result,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+static void
+utils_thumbnail_read_cb (GObject      *object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GFileInputStream *istream;
+  GError *error = NULL;
+
+  g_assert (G_IS_TASK (task));
+
+  istream = g_file_read_finish (G_FILE (object), result, &error);
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, istream, g_object_unref);
+}
+
+static void
+utils_thumbnail_saved_cb (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GFile) file = NULL;
+  GError *error = NULL;
+
+  g_assert (G_IS_TASK (task));
+
+  file = cm_utils_save_url_to_path_finish (result, &error);
+  g_debug ("(%p) Get thumbnail %s", g_task_get_source_object (task),
+           CM_LOG_SUCCESS (!error));
+
+  if (error)
+    g_task_return_error (task, error);
+  else if (file)
+    g_file_read_async (file, G_PRIORITY_DEFAULT,
+                       g_task_get_cancellable (task),
+                       utils_thumbnail_read_cb,
+                       g_steal_pointer (&task));
+  else
+    g_task_return_pointer (task, NULL, NULL);
+}
+
+/*
+ * cm_utils_read_thumbnail_async:
+ * @client: A #CmClient
+ * @uri: (nullable): The mxc:// uri of the media
+ * @type: The event type the media belongs to, see
+ *   cm_utils_get_path_for_m_type()
+ *
+ * Get a server generated thumbnail of @uri of the given size,
+ * saved in the data directory of @type.  The thumbnail is
+ * %NULL, without an error, if @uri isn't a valid mxc:// uri.
+ * Finish with cm_utils_read_thumbnail_finish().
+ */
+void
+cm_utils_read_thumbnail_async (CmClient            *client,
+                               const char          *uri,
+                               int                  width,
+                               int                  height,
+                               CmThumbnailMethod    method,
+                               CmEventType          type,
+                               CmTransferPriority   priority,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  g_autofree char *file_name = NULL;
+  GTask *task;
+  char *file_path;
+
+  g_return_if_fail (CM_IS_CLIENT (client));
+  g_return_if_fail (width > 0 && height > 0);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (client, cancellable, callback, user_data);
+  g_task_set_source_tag (task, cm_utils_read_thumbnail_async);
+
+  file_name = cm_utils_get_thumbnail_file_name (uri, width, height, method);
+
+  if (!file_name)
+    {
+      g_task_return_pointer (task, NULL, NULL);
+      g_object_unref (task);
+      return;
+    }
+
+  file_path = cm_utils_get_path_for_m_type (cm_matrix_get_data_dir (),
+                                            type, TRUE, file_name);
+  cm_utils_save_thumbnail_to_path_async (client, uri, width, height, method,
+                                         file_path, priority, cancellable,
+                                         utils_thumbnail_saved_cb, task);
+}
+
+/*
+ * cm_utils_read_thumbnail_finish:
+ *
+ * Returns: (transfer full) (nullable): The thumbnail stream
+ */
+GInputStream *
+cm_utils_read_thumbnail_finish (GAsyncResult  *result,
+                                GError       **error)
+{
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 /*
  * The @base_path should contain the base path up to 'cmatrix'
  * directory
@@ -1531,3 +1886,36 @@ cm_utils_get_path_for_m_type (const char  *base_path,
 
   g_return_val_if_reached (NULL);
 }
+
+/*
+ * Get the name of the file to save the thumbnail of
+ * @mxc_uri of the given size to.  Media ids are unique
+ * only within a server, so the name has both.
+ *
+ * Returns: (transfer full) (nullable): The file name, or
+ * %NULL if @mxc_uri isn't a valid mxc:// uri
+ */
+char *
+cm_utils_get_thumbnail_file_name (const char        *mxc_uri,
+                                  int                width,
+                                  int                height,
+                                  CmThumbnailMethod  method)
+{
+  g_autofree char *server_name = NULL;
+  const char *start, *media_id;
+
+  if (!mxc_uri || !g_str_has_prefix (mxc_uri, "mxc://"))
+    return NULL;
+
+  start = mxc_uri + strlen ("mxc://");
+  media_id = strchr (start, '/');
+
+  if (!media_id || media_id == start || !media_id[1] || strchr (media_id + 1, '/'))
+    return NULL;
+
+  server_name = g_strndup (start, media_id - start);
+
+  return g_strdup_printf ("%dx%d-%s-%s-%s", width, height,
+                          method == CM_THUMBNAIL_METHOD_CROP ? "crop" : "scale",
+                          server_name, media_id + 1);
+}
@@ -29,6 +29,7 @@ G_BEGIN_DECLS
 #include "cm-matrix.h"
 #include "cm-pusher.h"
 #include "cm-room.h"
+#include "cm-stats.h"
 #include "cm-utils.h"
 #include "events/cm-event.h"
 #include "events/cm-room-event.h"
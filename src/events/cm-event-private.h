@@ -26,7 +26,9 @@ typedef enum {
   CM_RELATION_ANNOTATION,
   CM_RELATION_REPLACE,
   CM_RELATION_REFERENCE,
-  CM_RELATION_THREAD
+  CM_RELATION_THREAD,
+  /* Not a rel_type, set from m.in_reply_to */
+  CM_RELATION_REPLY
 } CmRelationType;
 
 CmEvent      *cm_event_new                (CmEventType   type);
@@ -44,11 +46,17 @@ void          cm_event_set_id             (CmEvent      *self,
                                            const char   *id);
 const char   *cm_event_get_replaces_id    (CmEvent      *self);
 const char   *cm_event_get_reply_to_id    (CmEvent      *self);
+CmRelationType cm_event_get_relation      (CmEvent      *self,
+                                           const char  **relates_to_id,
+                                           const char  **key);
+gboolean      cm_event_has_relation       (CmEvent      *self);
+gboolean      cm_event_has_state_key      (CmEvent      *self);
 void          cm_event_set_m_type         (CmEvent      *self,
                                            CmEventType   type);
 void          cm_event_set_json           (CmEvent      *self,
                                            JsonObject   *root,
                                            JsonObject   *encrypted);
+void          cm_event_release_json       (CmEvent      *self);
 GRefString   *cm_event_get_sender_id      (CmEvent      *self);
 void          cm_event_set_sender         (CmEvent      *self,
                                            CmUser       *sender);
@@ -59,6 +67,7 @@ gboolean      cm_event_is_decrypted          (CmEvent       *self);
 char         *cm_event_get_json_str       (CmEvent      *self,
                                            gboolean      prettify);
 JsonObject   *cm_event_get_json           (CmEvent      *self);
+JsonObject   *cm_event_peek_json          (CmEvent      *self);
 JsonObject   *cm_event_get_encrypted_json (CmEvent      *self);
 JsonObject   *cm_event_generate_json      (CmEvent      *self,
                                            gpointer      room);
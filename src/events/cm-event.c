@@ -11,6 +11,7 @@
 #include "cm-room-private.h"
 #include "users/cm-account.h"
 #include "cm-utils-private.h"
+#include "cm-stats-private.h"
 #include "cm-event-private.h"
 
 typedef struct
@@ -18,11 +19,15 @@ typedef struct
   CmUser        *sender;
   GRefString    *sender_id;
   char          *sender_device_id;
-  char          *event_id;
-  char          *replaces_event_id;
-  char          *reply_to_event_id;
+  /* Matrix ids are interned, so they can be compared by pointer */
+  GRefString    *event_id;
+  GRefString    *replaces_event_id;
+  GRefString    *reply_to_event_id;
+  /* The event this event relates to, and the annotation key if any */
+  GRefString    *relates_to_id;
+  char          *relation_key;
   /* Transaction id generated/recived for every event */
-  char          *txn_id;
+  GRefString    *txn_id;
 
   /* Transaction id received in events (like key verification) */
   char          *transaction_id;
@@ -32,13 +37,24 @@ typedef struct
   JsonObject    *json;
   /* The JSON source if the event was encrypted */
   JsonObject    *encrypted_json;
+  /* Compact form of the above when released, see cm_event_release_json() */
+  char          *json_str;
+  char          *encrypted_json_str;
   gint64         time_stamp;
   CmEventType    event_type;
   CmEventState   event_state;
+  CmRelationType relation_type;
+
+  /* Set once the fields decoded on demand (relations,
+   * state key and txn id) are parsed from the JSON */
+  int            fields_parsed;
 } CmEventPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (CmEvent, cm_event, G_TYPE_OBJECT)
 
+/* Guards JSON trees and lazy fields, events are also read from the db thread */
+static GMutex json_lock;
+
 enum {
   UPDATED,
   N_SIGNALS
@@ -46,7 +62,6 @@ enum {
 
 static guint signals[N_SIGNALS];
 
-#define event_type_string(_event_type) (cm_utils_get_event_type_str(_event_type))
 
 static char *
 create_txn_id (guint id)
@@ -55,12 +70,33 @@ create_txn_id (guint id)
                           g_get_real_time () / G_TIME_SPAN_MILLISECOND, id);
 }
 
+static CmRelationType
+event_get_relation_type (const char *rel_type)
+{
+  if (!rel_type)
+    return CM_RELATION_NONE;
+
+  if (g_str_equal (rel_type, "m.annotation"))
+    return CM_RELATION_ANNOTATION;
+
+  if (g_str_equal (rel_type, "m.replace"))
+    return CM_RELATION_REPLACE;
+
+  if (g_str_equal (rel_type, "m.reference"))
+    return CM_RELATION_REFERENCE;
+
+  if (g_str_equal (rel_type, "m.thread"))
+    return CM_RELATION_THREAD;
+
+  return CM_RELATION_UNKNOWN;
+}
+
 static void
 event_parse_relations (CmEvent    *self,
                        JsonObject *root)
 {
   CmEventPrivate *priv = cm_event_get_instance_private (self);
-  JsonObject *child;
+  JsonObject *child, *reply;
   const char *type, *value;
 
   g_assert (CM_IS_EVENT (self));
@@ -71,13 +107,39 @@ event_parse_relations (CmEvent    *self,
   type = cm_utils_json_object_get_string (child, "rel_type");
   value = cm_utils_json_object_get_string (child, "event_id");
 
+  reply = cm_utils_json_object_get_object (child, "m.in_reply_to");
+  if (!priv->reply_to_event_id)
+    priv->reply_to_event_id = cm_utils_json_object_intern_string (reply, "event_id");
+
+  /* The unencrypted relation (if any) is parsed first, and wins */
+  if (priv->relation_type == CM_RELATION_NONE && value)
+    {
+      priv->relation_type = event_get_relation_type (type);
+      if (priv->relation_type != CM_RELATION_NONE)
+        {
+          priv->relates_to_id = cm_utils_intern_id (value);
+          if (priv->relation_type == CM_RELATION_ANNOTATION)
+            priv->relation_key = cm_utils_json_object_dup_string (child, "key");
+        }
+    }
+
+  if (priv->relation_type == CM_RELATION_NONE && priv->reply_to_event_id)
+    {
+      priv->relation_type = CM_RELATION_REPLY;
+      priv->relates_to_id = g_ref_string_acquire (priv->reply_to_event_id);
+    }
+
+  /* This is run for both the encrypted and decrypted JSON */
   if (g_strcmp0 (type, "m.replace") == 0)
-    priv->replaces_event_id = g_strdup (value);
+    {
+      g_clear_pointer (&priv->replaces_event_id, g_ref_string_release);
+      priv->replaces_event_id = cm_utils_intern_id (value);
+    }
 
   if (!priv->replaces_event_id)
     {
       child = cm_utils_json_object_get_object (root, "unsigned");
-      priv->replaces_event_id = g_strdup (cm_utils_json_object_get_string (child, "replaces_state"));
+      priv->replaces_event_id = cm_utils_json_object_intern_string (child, "replaces_state");
     }
 
   if (!priv->replaces_event_id)
@@ -85,18 +147,92 @@ event_parse_relations (CmEvent    *self,
       child = cm_utils_json_object_get_object (root, "unsigned");
       child = cm_utils_json_object_get_object (child, "m.relations");
       child = cm_utils_json_object_get_object (child, "m.replace");
-      priv->replaces_event_id = g_strdup (cm_utils_json_object_get_string (child, "event_id"));
+      priv->replaces_event_id = cm_utils_json_object_intern_string (child, "event_id");
     }
 
   if (!priv->replaces_event_id)
     {
       type = cm_utils_json_object_get_string (root, "type");
 
-      if (g_strcmp0 (event_type_string (CM_M_ROOM_REDACTION), type) == 0)
-        priv->replaces_event_id = cm_utils_json_object_dup_string (root, "redacts");
+      if (cm_utils_get_event_type (type) == CM_M_ROOM_REDACTION)
+        priv->replaces_event_id = cm_utils_json_object_intern_string (root, "redacts");
+    }
+}
+
+/* Should be called with json_lock held */
+static void
+event_ensure_json_locked (CmEvent *self)
+{
+  CmEventPrivate *priv = cm_event_get_instance_private (self);
+
+  if (!priv->json && priv->json_str)
+    {
+      priv->json = cm_utils_string_to_json_object (priv->json_str);
+      g_clear_pointer (&priv->json_str, g_free);
+    }
+
+  if (!priv->encrypted_json && priv->encrypted_json_str)
+    {
+      priv->encrypted_json = cm_utils_string_to_json_object (priv->encrypted_json_str);
+      g_clear_pointer (&priv->encrypted_json_str, g_free);
     }
 }
 
+static void
+event_ensure_fields (CmEvent *self)
+{
+  CmEventPrivate *priv = cm_event_get_instance_private (self);
+  JsonObject *child;
+
+  if (g_atomic_int_get (&priv->fields_parsed))
+    return;
+
+  g_mutex_lock (&json_lock);
+
+  if (priv->fields_parsed)
+    {
+      g_mutex_unlock (&json_lock);
+      return;
+    }
+
+  event_ensure_json_locked (self);
+  g_clear_pointer (&priv->replaces_event_id, g_ref_string_release);
+  g_clear_pointer (&priv->reply_to_event_id, g_ref_string_release);
+  g_clear_pointer (&priv->relates_to_id, g_ref_string_release);
+  g_clear_pointer (&priv->relation_key, g_free);
+  g_clear_pointer (&priv->state_key, g_free);
+  priv->relation_type = CM_RELATION_NONE;
+
+  child = cm_utils_json_object_get_object (priv->encrypted_json ?: priv->json, "unsigned");
+  if (cm_utils_json_object_has_member (child, "transaction_id"))
+    {
+      g_clear_pointer (&priv->txn_id, g_ref_string_release);
+      priv->txn_id = cm_utils_json_object_intern_string (child, "transaction_id");
+    }
+
+  if (priv->encrypted_json)
+    event_parse_relations (self, priv->encrypted_json);
+
+  if (priv->json)
+    {
+      event_parse_relations (self, priv->json);
+      priv->state_key = cm_utils_json_object_dup_string (priv->json, "state_key");
+    }
+
+  g_atomic_int_set (&priv->fields_parsed, TRUE);
+  g_mutex_unlock (&json_lock);
+}
+
+static gboolean
+event_json_has_relation (JsonObject *root)
+{
+  JsonObject *child;
+
+  child = cm_utils_json_object_get_object (root, "content");
+
+  return cm_utils_json_object_has_member (child, "m.relates_to");
+}
+
 static gpointer
 cm_event_real_generate_json (CmEvent  *self,
                              gpointer  room)
@@ -126,15 +262,20 @@ cm_event_finalize (GObject *object)
   g_clear_object (&priv->sender);
   g_clear_pointer (&priv->sender_id, g_ref_string_release);
   g_free (priv->sender_device_id);
-  g_free (priv->event_id);
-  g_free (priv->replaces_event_id);
-  g_free (priv->reply_to_event_id);
-  g_free (priv->txn_id);
+  g_clear_pointer (&priv->event_id, g_ref_string_release);
+  g_clear_pointer (&priv->replaces_event_id, g_ref_string_release);
+  g_clear_pointer (&priv->reply_to_event_id, g_ref_string_release);
+  g_clear_pointer (&priv->relates_to_id, g_ref_string_release);
+  g_free (priv->relation_key);
+  g_clear_pointer (&priv->txn_id, g_ref_string_release);
   g_free (priv->transaction_id);
   g_free (priv->verification_key);
   g_free (priv->state_key);
   g_clear_pointer (&priv->encrypted_json, json_object_unref);
   g_clear_pointer (&priv->json, json_object_unref);
+  g_free (priv->encrypted_json_str);
+  g_free (priv->json_str);
+  cm_stats_object_free (CM_STATS_OBJECT_EVENT);
 
   G_OBJECT_CLASS (cm_event_parent_class)->finalize (object);
 }
@@ -168,6 +309,7 @@ cm_event_class_init (CmEventClass *klass)
 static void
 cm_event_init (CmEvent *self)
 {
+  cm_stats_object_new (CM_STATS_OBJECT_EVENT);
 }
 
 CmEvent *
@@ -221,7 +363,7 @@ cm_event_set_id (CmEvent    *self,
   g_return_if_fail (CM_IS_EVENT (self));
   g_return_if_fail (!priv->event_id);
 
-  priv->event_id = g_strdup (id);
+  priv->event_id = cm_utils_intern_id (id);
 }
 
 const char *
@@ -231,6 +373,8 @@ cm_event_get_replaces_id (CmEvent *self)
 
   g_return_val_if_fail (CM_IS_EVENT (self), NULL);
 
+  event_ensure_fields (self);
+
   return priv->replaces_event_id;
 }
 
@@ -241,9 +385,101 @@ cm_event_get_reply_to_id (CmEvent *self)
 
   g_return_val_if_fail (CM_IS_EVENT (self), NULL);
 
+  event_ensure_fields (self);
+
   return priv->reply_to_event_id;
 }
 
+/*
+ * cm_event_get_relation:
+ * @self: The event
+ * @relates_to_id: (out) (optional): The related event id
+ * @key: (out) (optional): The annotation key
+ *
+ * Get how @self relates to some other event.  The
+ * rel_type in m.relates_to is used if present, otherwise
+ * %CM_RELATION_REPLY is returned if the event is a reply.
+ *
+ * Returns: The relation type
+ */
+CmRelationType
+cm_event_get_relation (CmEvent     *self,
+                       const char **relates_to_id,
+                       const char **key)
+{
+  CmEventPrivate *priv = cm_event_get_instance_private (self);
+
+  g_return_val_if_fail (CM_IS_EVENT (self), CM_RELATION_NONE);
+
+  event_ensure_fields (self);
+
+  if (relates_to_id)
+    *relates_to_id = priv->relates_to_id;
+
+  if (key)
+    *key = priv->relation_key;
+
+  return priv->relation_type;
+}
+
+/*
+ * cm_event_has_relation:
+ * @self: The event
+ *
+ * Check if @self may relate to some other event.  Unlike
+ * cm_event_get_relation() this doesn't decode the lazy
+ * fields, and so can be used to skip most events of a sync.
+ *
+ * Returns: %TRUE if @self has m.relates_to
+ */
+gboolean
+cm_event_has_relation (CmEvent *self)
+{
+  CmEventPrivate *priv = cm_event_get_instance_private (self);
+  gboolean has_relation;
+
+  g_return_val_if_fail (CM_IS_EVENT (self), FALSE);
+
+  if (g_atomic_int_get (&priv->fields_parsed))
+    return priv->relation_type != CM_RELATION_NONE;
+
+  g_mutex_lock (&json_lock);
+  event_ensure_json_locked (self);
+  has_relation = event_json_has_relation (priv->json) ||
+    event_json_has_relation (priv->encrypted_json);
+  g_mutex_unlock (&json_lock);
+
+  return has_relation;
+}
+
+/*
+ * cm_event_has_state_key:
+ * @self: The event
+ *
+ * Check if @self is a state event, without decoding
+ * the lazy fields like cm_event_get_state_key() does.
+ *
+ * Returns: %TRUE if @self has a state key
+ */
+gboolean
+cm_event_has_state_key (CmEvent *self)
+{
+  CmEventPrivate *priv = cm_event_get_instance_private (self);
+  gboolean has_state_key;
+
+  g_return_val_if_fail (CM_IS_EVENT (self), FALSE);
+
+  if (g_atomic_int_get (&priv->fields_parsed))
+    return priv->state_key != NULL;
+
+  g_mutex_lock (&json_lock);
+  event_ensure_json_locked (self);
+  has_state_key = cm_utils_json_object_has_member (priv->json, "state_key");
+  g_mutex_unlock (&json_lock);
+
+  return has_state_key;
+}
+
 const char *
 cm_event_get_transaction_id (CmEvent *self)
 {
@@ -271,6 +507,8 @@ cm_event_get_txn_id (CmEvent *self)
 
   g_return_val_if_fail (CM_IS_EVENT (self), NULL);
 
+  event_ensure_fields (self);
+
   return priv->txn_id;
 }
 
@@ -279,11 +517,16 @@ cm_event_create_txn_id (CmEvent *self,
                         guint    id)
 {
   CmEventPrivate *priv = cm_event_get_instance_private (self);
+  g_autofree char *txn_id = NULL;
 
   g_return_if_fail (CM_IS_EVENT (self));
   g_return_if_fail (!priv->event_id);
 
-  priv->txn_id = create_txn_id (id);
+  /* So that the lazy parsing won't override the new id */
+  event_ensure_fields (self);
+  txn_id = create_txn_id (id);
+  g_clear_pointer (&priv->txn_id, g_ref_string_release);
+  priv->txn_id = g_ref_string_new_intern (txn_id);
 }
 
 const char *
@@ -293,6 +536,8 @@ cm_event_get_state_key (CmEvent *self)
 
   g_return_val_if_fail (CM_IS_EVENT (self), NULL);
 
+  event_ensure_fields (self);
+
   if (priv->state_key && *priv->state_key)
     return priv->state_key;
 
@@ -361,6 +606,11 @@ cm_event_set_state (CmEvent      *self,
   g_signal_emit (self, signals[UPDATED], 0);
 }
 
+/*
+ * Only the fields required to sort and show the event in
+ * a list (id, time stamp, sender and type) are decoded here,
+ * others are decoded on first use with event_ensure_fields().
+ */
 void
 cm_event_set_json (CmEvent    *self,
                    JsonObject *root,
@@ -368,6 +618,7 @@ cm_event_set_json (CmEvent    *self,
 {
   CmEventPrivate *priv = cm_event_get_instance_private (self);
   JsonObject *child;
+  CmEventType event_type;
   const char *type;
 
   g_return_if_fail (CM_IS_EVENT (self));
@@ -381,7 +632,7 @@ cm_event_set_json (CmEvent    *self,
     type = cm_utils_json_object_get_string (encrypted, "type");
 
   /* todo: Handle content less encrypted events (eg: redactions) */
-  if (g_strcmp0 (type, event_type_string (CM_M_ROOM_ENCRYPTED)) == 0)
+  if (cm_utils_get_event_type (type) == CM_M_ROOM_ENCRYPTED)
     {
       /* We got something encrypted */
       if (!encrypted)
@@ -389,101 +640,42 @@ cm_event_set_json (CmEvent    *self,
       priv->event_type = CM_M_ROOM_ENCRYPTED;
     }
 
+  g_mutex_lock (&json_lock);
   if (encrypted)
-    priv->encrypted_json = json_object_ref (encrypted);
+    {
+      g_clear_pointer (&priv->encrypted_json, json_object_unref);
+      g_clear_pointer (&priv->encrypted_json_str, g_free);
+      priv->encrypted_json = json_object_ref (encrypted);
+    }
 
-  priv->event_id = g_strdup (cm_utils_json_object_get_string (encrypted ?: root, "event_id"));
+  if (root)
+    {
+      g_clear_pointer (&priv->json, json_object_unref);
+      g_clear_pointer (&priv->json_str, g_free);
+      priv->json = json_object_ref (root);
+    }
+
+  g_atomic_int_set (&priv->fields_parsed, FALSE);
+  g_mutex_unlock (&json_lock);
+
+  g_clear_pointer (&priv->event_id, g_ref_string_release);
+  priv->event_id = cm_utils_json_object_intern_string (encrypted ?: root, "event_id");
   priv->time_stamp = cm_utils_json_object_get_int (encrypted ?: root, "origin_server_ts");
   if (cm_utils_json_object_get_string (encrypted ?: root, "sender"))
-    priv->sender_id = g_ref_string_new_intern (cm_utils_json_object_get_string (encrypted ?: root, "sender"));
-
-  child = cm_utils_json_object_get_object (encrypted ?: root, "unsigned");
-  if (cm_utils_json_object_has_member (child, "transaction_id"))
     {
-      g_free (priv->txn_id);
-      priv->txn_id = cm_utils_json_object_dup_string (child, "transaction_id");
+      g_clear_pointer (&priv->sender_id, g_ref_string_release);
+      priv->sender_id = g_ref_string_new_intern (cm_utils_json_object_get_string (encrypted ?: root, "sender"));
     }
 
-  if (encrypted)
-    event_parse_relations (self, encrypted);
-
   if (!root)
     return;
 
-  event_parse_relations (self, root);
-  priv->state_key = g_strdup (cm_utils_json_object_get_string (root, "state_key"));
-  priv->json = json_object_ref (root);
-
   type = cm_utils_json_object_get_string (root, "type");
 
-  if (g_strcmp0 (type, event_type_string (CM_M_ROOM_MESSAGE)) == 0)
-    priv->event_type = CM_M_ROOM_MESSAGE;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_MEMBER)) == 0)
-    priv->event_type = CM_M_ROOM_MEMBER;
-  else if (g_strcmp0 (type, event_type_string (CM_M_REACTION)) == 0)
-    priv->event_type = CM_M_REACTION;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_REDACTION)) == 0)
-    priv->event_type = CM_M_ROOM_REDACTION;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_TOPIC)) == 0)
-    priv->event_type = CM_M_ROOM_TOPIC;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_AVATAR)) == 0)
-    priv->event_type = CM_M_ROOM_AVATAR;
-  else if (g_strcmp0 (type, event_type_string (CM_M_CALL_INVITE)) == 0)
-    priv->event_type = CM_M_CALL_INVITE;
-  else if (g_strcmp0 (type, event_type_string (CM_M_CALL_CANDIDATES)) == 0)
-    priv->event_type = CM_M_CALL_CANDIDATES;
-  else if (g_strcmp0 (type, event_type_string (CM_M_CALL_ANSWER)) == 0)
-    priv->event_type = CM_M_CALL_ANSWER;
-  else if (g_strcmp0 (type, event_type_string (CM_M_CALL_SELECT_ANSWER)) == 0)
-    priv->event_type = CM_M_CALL_SELECT_ANSWER;
-  else if (g_strcmp0 (type, event_type_string (CM_M_CALL_HANGUP)) == 0)
-    priv->event_type = CM_M_CALL_HANGUP;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_CANONICAL_ALIAS)) == 0)
-    priv->event_type = CM_M_ROOM_CANONICAL_ALIAS;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_NAME)) == 0)
-    priv->event_type = CM_M_ROOM_NAME;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_CREATE)) == 0)
-    priv->event_type = CM_M_ROOM_CREATE;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_POWER_LEVELS)) == 0)
-    priv->event_type = CM_M_ROOM_POWER_LEVELS;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_GUEST_ACCESS)) == 0)
-    priv->event_type = CM_M_ROOM_GUEST_ACCESS;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_HISTORY_VISIBILITY)) == 0)
-    priv->event_type = CM_M_ROOM_HISTORY_VISIBILITY;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_JOIN_RULES)) == 0)
-    priv->event_type = CM_M_ROOM_JOIN_RULES;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_SERVER_ACL)) == 0)
-    priv->event_type = CM_M_ROOM_SERVER_ACL;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_ENCRYPTION)) == 0)
-    priv->event_type = CM_M_ROOM_ENCRYPTION;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_THIRD_PARTY_INVITE)) == 0)
-    priv->event_type = CM_M_ROOM_THIRD_PARTY_INVITE;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_RELATED_GROUPS)) == 0)
-    priv->event_type = CM_M_ROOM_RELATED_GROUPS;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_TOMBSTONE)) == 0)
-    priv->event_type = CM_M_ROOM_TOMBSTONE;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_PINNED_EVENTS)) == 0)
-    priv->event_type = CM_M_ROOM_PINNED_EVENTS;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_PLUMBING)) == 0)
-    priv->event_type = CM_M_ROOM_PLUMBING;
-  else if (g_strcmp0 (type, event_type_string (CM_M_ROOM_BOT_OPTIONS)) == 0)
-    priv->event_type = CM_M_ROOM_BOT_OPTIONS;
-  else if (g_strcmp0 (type, event_type_string (CM_M_KEY_VERIFICATION_ACCEPT)) == 0)
-    priv->event_type = CM_M_KEY_VERIFICATION_ACCEPT;
-  else if (g_strcmp0 (type, event_type_string (CM_M_KEY_VERIFICATION_CANCEL)) == 0)
-    priv->event_type = CM_M_KEY_VERIFICATION_CANCEL;
-  else if (g_strcmp0 (type, event_type_string (CM_M_KEY_VERIFICATION_DONE)) == 0)
-    priv->event_type = CM_M_KEY_VERIFICATION_DONE;
-  else if (g_strcmp0 (type, event_type_string (CM_M_KEY_VERIFICATION_KEY)) == 0)
-    priv->event_type = CM_M_KEY_VERIFICATION_KEY;
-  else if (g_strcmp0 (type, event_type_string (CM_M_KEY_VERIFICATION_MAC)) == 0)
-    priv->event_type = CM_M_KEY_VERIFICATION_MAC;
-  else if (g_strcmp0 (type, event_type_string (CM_M_KEY_VERIFICATION_READY)) == 0)
-    priv->event_type = CM_M_KEY_VERIFICATION_READY;
-  else if (g_strcmp0 (type, event_type_string (CM_M_KEY_VERIFICATION_REQUEST)) == 0)
-    priv->event_type = CM_M_KEY_VERIFICATION_REQUEST;
-  else if (g_strcmp0 (type, event_type_string (CM_M_KEY_VERIFICATION_START)) == 0)
-    priv->event_type = CM_M_KEY_VERIFICATION_START;
+  event_type = cm_utils_get_event_type (type);
+
+  if (event_type != CM_M_UNKNOWN)
+    priv->event_type = event_type;
   else
     CM_TRACE ("unhandled event type: %s", type);
 
@@ -491,12 +683,47 @@ cm_event_set_json (CmEvent    *self,
       priv->event_type == CM_M_KEY_VERIFICATION_START)
     {
       child = cm_utils_json_object_get_object (root, "content");
+      g_free (priv->sender_device_id);
       priv->sender_device_id = cm_utils_json_object_dup_string (child, "from_device");
       if (!priv->time_stamp)
         priv->time_stamp = cm_utils_json_object_get_int (child, "timestamp");
     }
 }
 
+/**
+ * cm_event_release_json:
+ * @self: The event
+ *
+ * Drop the parsed JSON of @self and keep it as a compact
+ * string instead.  This can be used for events that are
+ * not likely to be shown soon, like old events in a long
+ * timeline.  The JSON is parsed again when required.
+ */
+void
+cm_event_release_json (CmEvent *self)
+{
+  CmEventPrivate *priv = cm_event_get_instance_private (self);
+
+  g_return_if_fail (CM_IS_EVENT (self));
+
+  /* The lazy fields can't be parsed once the trees are gone */
+  event_ensure_fields (self);
+
+  g_mutex_lock (&json_lock);
+  if (priv->json)
+    {
+      priv->json_str = cm_utils_json_object_to_string (priv->json, FALSE);
+      g_clear_pointer (&priv->json, json_object_unref);
+    }
+
+  if (priv->encrypted_json)
+    {
+      priv->encrypted_json_str = cm_utils_json_object_to_string (priv->encrypted_json, FALSE);
+      g_clear_pointer (&priv->encrypted_json, json_object_unref);
+    }
+  g_mutex_unlock (&json_lock);
+}
+
 GRefString *
 cm_event_get_sender_id (CmEvent *self)
 {
@@ -562,7 +789,7 @@ cm_event_is_encrypted (CmEvent *self)
 
   g_return_val_if_fail (CM_IS_EVENT (self), FALSE);
 
-  return !!priv->encrypted_json;
+  return priv->encrypted_json || priv->encrypted_json_str;
 }
 
 gboolean
@@ -570,15 +797,20 @@ cm_event_has_encrypted_content (CmEvent *self)
 {
   CmEventPrivate *priv = cm_event_get_instance_private (self);
   JsonObject *child;
+  gboolean has_content;
 
   g_return_val_if_fail (CM_IS_EVENT (self), FALSE);
 
-  if (!priv->encrypted_json)
+  if (!cm_event_is_encrypted (self))
     return FALSE;
 
+  g_mutex_lock (&json_lock);
+  event_ensure_json_locked (self);
   child = cm_utils_json_object_get_object (priv->encrypted_json, "content");
+  has_content = cm_utils_json_object_has_member (child, "ciphertext");
+  g_mutex_unlock (&json_lock);
 
-  return cm_utils_json_object_has_member (child, "ciphertext");
+  return has_content;
 }
 
 gboolean
@@ -588,7 +820,7 @@ cm_event_is_decrypted (CmEvent *self)
 
   g_return_val_if_fail (CM_IS_EVENT (self), FALSE);
 
-  return !!priv->json;
+  return priv->json || priv->json_str;
 }
 
 /**
@@ -617,13 +849,22 @@ cm_event_get_json_str (CmEvent  *self,
                        gboolean  prettify)
 {
   CmEventPrivate *priv = cm_event_get_instance_private (self);
+  char *str = NULL;
 
   g_return_val_if_fail (CM_IS_EVENT (self), NULL);
 
-  if (priv->json)
-    return cm_utils_json_object_to_string (priv->json, prettify);
+  g_mutex_lock (&json_lock);
+  if (priv->json_str && !prettify)
+    str = g_strdup (priv->json_str);
+  else
+    {
+      event_ensure_json_locked (self);
+      if (priv->json)
+        str = cm_utils_json_object_to_string (priv->json, prettify);
+    }
+  g_mutex_unlock (&json_lock);
 
-  return NULL;
+  return str;
 }
 
 /**
@@ -639,26 +880,58 @@ JsonObject *
 cm_event_get_json (CmEvent *self)
 {
   CmEventPrivate *priv = cm_event_get_instance_private (self);
+  JsonObject *json = NULL;
 
   g_return_val_if_fail (CM_IS_EVENT (self), NULL);
 
+  g_mutex_lock (&json_lock);
+  event_ensure_json_locked (self);
   if (priv->json)
-    return json_object_ref (priv->json);
+    json = json_object_ref (priv->json);
+  g_mutex_unlock (&json_lock);
 
-  return NULL;
+  return json;
+}
+
+/**
+ * cm_event_peek_json:
+ * @self: The event
+ *
+ * Same as cm_event_get_json(), but without a reference.
+ * Should be used only in the main thread, and the returned
+ * object is valid until cm_event_release_json() is called.
+ *
+ * Returns: (transfer none) (nullable)
+ */
+JsonObject *
+cm_event_peek_json (CmEvent *self)
+{
+  CmEventPrivate *priv = cm_event_get_instance_private (self);
+
+  g_return_val_if_fail (CM_IS_EVENT (self), NULL);
+
+  g_mutex_lock (&json_lock);
+  event_ensure_json_locked (self);
+  g_mutex_unlock (&json_lock);
+
+  return priv->json;
 }
 
 JsonObject *
 cm_event_get_encrypted_json (CmEvent *self)
 {
   CmEventPrivate *priv = cm_event_get_instance_private (self);
+  JsonObject *json = NULL;
 
   g_return_val_if_fail (CM_IS_EVENT (self), NULL);
 
+  g_mutex_lock (&json_lock);
+  event_ensure_json_locked (self);
   if (priv->encrypted_json)
-    return json_object_ref (priv->encrypted_json);
+    json = json_object_ref (priv->encrypted_json);
+  g_mutex_unlock (&json_lock);
 
-  return NULL;
+  return json;
 }
 
 JsonObject *
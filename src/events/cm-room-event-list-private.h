@@ -14,6 +14,7 @@
 #include <gio/gio.h>
 
 #include "cm-types.h"
+#include "cm-room-relations-private.h"
 
 G_BEGIN_DECLS
 
@@ -27,6 +28,7 @@ void             cm_room_event_list_set_client       (CmRoomEventList *self,
 CmEvent         *cm_room_event_list_get_event        (CmRoomEventList *self,
                                                       CmEventType      type);
 GListModel      *cm_room_event_list_get_events       (CmRoomEventList *self);
+CmRoomRelations *cm_room_event_list_get_relations    (CmRoomEventList *self);
 void             cm_room_event_list_set_save_pending (CmRoomEventList *self,
                                                       gboolean         save_pending);
 gboolean         cm_room_event_list_save_pending     (CmRoomEventList *self);
@@ -22,6 +22,7 @@
 #include "cm-room-event-private.h"
 #include "cm-room-message-event-private.h"
 #include "cm-room-private.h"
+#include "cm-room-relations-private.h"
 #include "cm-room-event-list-private.h"
 
 struct _CmRoomEventList
@@ -32,6 +33,7 @@ struct _CmRoomEventList
   CmClient     *client;
 
   GListStore   *events_list;
+  CmRoomRelations *relations;
   CmEvent      *canonical_alias_event;
   CmEvent      *encryption_event;
   CmEvent      *guest_access_event;
@@ -51,6 +53,10 @@ struct _CmRoomEventList
 
 G_DEFINE_TYPE (CmRoomEventList, cm_room_event_list, G_TYPE_OBJECT)
 
+/* Number of events from the end of the timeline that keep their
+ * parsed JSON, older events keep only a compact copy */
+#define LIVE_EVENTS_COUNT 60
+
 #define event_m_type_str(_type) (cm_utils_get_event_type_str (_type))
 #define set_json_from_event(_event, _json) do {                 \
   CmEventType _type;                                            \
@@ -118,8 +124,8 @@ remove_event_with_txn_id (CmRoomEventList *self,
       if (!cm_event_get_txn_id (item))
         continue;
 
-      if (g_strcmp0 (cm_event_get_txn_id (event),
-                     cm_event_get_txn_id (item)) == 0)
+      /* txn ids are interned */
+      if (cm_event_get_txn_id (event) == cm_event_get_txn_id (item))
         {
           cm_utils_remove_list_item (self->events_list, item);
           break;
@@ -127,6 +133,58 @@ remove_event_with_txn_id (CmRoomEventList *self,
     }
 }
 
+static gboolean
+event_list_is_state_event (CmRoomEventList *self,
+                           CmEvent         *event)
+{
+  return event == self->canonical_alias_event ||
+    event == self->encryption_event ||
+    event == self->guest_access_event ||
+    event == self->history_visibility_event ||
+    event == self->join_rules_event ||
+    event == self->power_level_event ||
+    event == self->room_avatar_event ||
+    event == self->room_create_event ||
+    event == self->room_name_event ||
+    event == self->room_topic_event ||
+    event == self->tombstone_event;
+}
+
+/*
+ * Release the JSON of the events from @start to @end that
+ * are not within the last LIVE_EVENTS_COUNT events of the
+ * timeline, as they are not likely to be shown soon.
+ */
+static void
+event_list_release_old_events (CmRoomEventList *self,
+                               guint            start,
+                               guint            end)
+{
+  GListModel *events;
+  guint n_items;
+
+  g_assert (CM_IS_ROOM_EVENT_LIST (self));
+
+  events = G_LIST_MODEL (self->events_list);
+  n_items = g_list_model_get_n_items (events);
+
+  if (n_items <= LIVE_EVENTS_COUNT)
+    return;
+
+  end = MIN (end, n_items - LIVE_EVENTS_COUNT);
+
+  for (guint i = start; i < end; i++)
+    {
+      g_autoptr(CmEvent) event = NULL;
+
+      event = g_list_model_get_item (events, i);
+
+      /* The JSON of state events are shared with local_json */
+      if (!event_list_is_state_event (self, event))
+        cm_event_release_json (event);
+    }
+}
+
 static void
 room_event_list_generate_json (CmRoomEventList *self)
 {
@@ -172,6 +230,7 @@ cm_room_event_list_finalize (GObject *object)
   CmRoomEventList *self = (CmRoomEventList *)object;
 
   g_clear_object (&self->events_list);
+  g_clear_object (&self->relations);
 
   g_clear_object (&self->canonical_alias_event);
   g_clear_object (&self->encryption_event);
@@ -205,6 +264,7 @@ static void
 cm_room_event_list_init (CmRoomEventList *self)
 {
   self->events_list = g_list_store_new (CM_TYPE_EVENT);
+  self->relations = cm_room_relations_new ();
 }
 
 CmRoomEventList *
@@ -295,6 +355,14 @@ cm_room_event_list_get_event (CmRoomEventList *self,
   return NULL;
 }
 
+CmRoomRelations *
+cm_room_event_list_get_relations (CmRoomEventList *self)
+{
+  g_return_val_if_fail (CM_IS_ROOM_EVENT_LIST (self), NULL);
+
+  return self->relations;
+}
+
 GListModel *
 cm_room_event_list_get_events (CmRoomEventList *self)
 {
@@ -386,7 +454,8 @@ cm_room_event_list_add_events (CmRoomEventList *self,
 
       event = events->pdata[i];
 
-      if (g_strcmp0 (cm_event_get_id (event), cm_event_get_id (last_event)) == 0)
+      /* event ids are interned */
+      if (cm_event_get_id (event) == cm_event_get_id (last_event))
         g_ptr_array_remove_index (events, i);
       else
         i++;
@@ -397,6 +466,10 @@ cm_room_event_list_add_events (CmRoomEventList *self,
       position = g_list_model_get_n_items (G_LIST_MODEL (self->events_list));
       g_list_store_splice (self->events_list,
                            position, 0, events->pdata, events->len);
+      /* The events pushed out of the live ones */
+      event_list_release_old_events (self,
+                                     position - MIN (position, LIVE_EVENTS_COUNT),
+                                     position + events->len);
     }
   else
     {
@@ -408,6 +481,8 @@ cm_room_event_list_add_events (CmRoomEventList *self,
         g_ptr_array_insert (reversed, 0, events->pdata[i]);
       g_list_store_splice (self->events_list,
                            0, 0, reversed->pdata, reversed->len);
+      /* Past events loaded when the timeline is long already */
+      event_list_release_old_events (self, 0, reversed->len);
     }
 }
 
@@ -479,6 +554,7 @@ cm_room_event_list_parse_events (CmRoomEventList *self,
                                  GPtrArray       *events,
                                  gboolean         past)
 {
+  g_autoptr(GPtrArray) changed = NULL;
   JsonObject *child;
   JsonArray *array;
   guint length = 0;
@@ -510,6 +586,7 @@ cm_room_event_list_parse_events (CmRoomEventList *self,
     {
       g_autoptr(CmEvent) event = NULL;
       JsonObject *decrypted = NULL;
+      GRefString *target_id;
       CmUser *user;
       const char *value;
       CmEventType type;
@@ -543,6 +620,19 @@ cm_room_event_list_parse_events (CmRoomEventList *self,
             remove_event_with_txn_id (self, event);
 
           g_ptr_array_add (events, g_object_ref (event));
+
+          target_id = cm_room_relations_add_event (self->relations, event);
+          if (target_id)
+            {
+              if (!changed)
+                changed = g_ptr_array_new_with_free_func ((GDestroyNotify)g_ref_string_release);
+
+              /* ids are interned, and so pointers can be compared */
+              if (!g_ptr_array_find (changed, target_id, NULL))
+                g_ptr_array_add (changed, target_id);
+              else
+                g_ref_string_release (target_id);
+            }
         }
 
       /* past events shouldn't alter room state, as they may be obsolete */
@@ -602,4 +692,7 @@ cm_room_event_list_parse_events (CmRoomEventList *self,
 
   if (events && events->len)
     cm_room_event_list_add_events (self, events, !past);
+
+  for (guint i = 0; changed && i < changed->len; i++)
+    cm_room_emit_relations_changed (self->room, changed->pdata[i]);
 }
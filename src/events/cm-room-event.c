@@ -34,7 +34,6 @@ typedef struct
   char          *encryption;
   GRefString    *member_id;
   GPtrArray     *users;
-  JsonObject    *json;
   CmStatus       member_status;
 
   /* Content fetched for different events */
@@ -75,7 +74,6 @@ cm_room_event_finalize (GObject *object)
   g_free (priv->encryption);
   g_clear_pointer (&priv->member_id, g_ref_string_release);
   g_clear_pointer (&priv->users, g_ptr_array_unref);
-  g_clear_pointer (&priv->json, json_object_unref);
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wswitch-enum"
@@ -116,13 +114,13 @@ cm_room_event_new_from_json (gpointer    room,
   CmRoomEventPrivate *priv;
   CmRoomEvent *self = NULL;
   JsonObject *child;
-  const char *value, *event_type;
+  const char *value;
   CmEventType type;
 
   g_return_val_if_fail (CM_IS_ROOM (room), NULL);
   g_return_val_if_fail (root || encrypted, NULL);
 
-  event_type = cm_utils_json_object_get_string (root, "type");
+  type = cm_utils_get_event_type (cm_utils_json_object_get_string (root, "type"));
 
   /* currently, only room messages are encrypted */
   if (encrypted && root)
@@ -130,7 +128,7 @@ cm_room_event_new_from_json (gpointer    room,
 
   if (!self)
     {
-      if (g_strcmp0 (event_type, "m.room.message") == 0)
+      if (type == CM_M_ROOM_MESSAGE)
         self = cm_room_message_event_new_from_json (root);
       else
         self = g_object_new (CM_TYPE_ROOM_EVENT, NULL);
@@ -143,8 +141,6 @@ cm_room_event_new_from_json (gpointer    room,
   if (!root)
     return self;
 
-  priv->json = json_object_ref (root);
-
   if (CM_IS_ROOM_MESSAGE_EVENT (self))
     return self;
 
@@ -248,27 +244,40 @@ cm_room_event_get_encryption (CmRoomEvent *self)
   return priv->encryption;
 }
 
+/**
+ * cm_room_event_get_room_member_json:
+ * @self: A #CmRoomEvent
+ * @user_id: (out) (optional): The user id of the member
+ *
+ * Get the content of the m.room.member event.  Both the
+ * returned object and @user_id are borrowed from the JSON
+ * of @self, see cm_event_peek_json(), and so are valid
+ * only until cm_event_release_json() is called on @self.
+ * Copy them if they have to be kept.
+ *
+ * Returns: (transfer none) (nullable): The event content
+ */
 JsonObject *
 cm_room_event_get_room_member_json (CmRoomEvent  *self,
                                     const char  **user_id)
 {
-  CmRoomEventPrivate *priv = cm_room_event_get_instance_private (self);
-  JsonObject *child;
+  JsonObject *root, *child;
 
   g_return_val_if_fail (CM_IS_ROOM_EVENT (self), NULL);
   ret_val_if_fail (self, CM_M_ROOM_MEMBER, 0, NULL);
 
-  child = cm_utils_json_object_get_object (priv->json, "content");
+  root = cm_event_peek_json (CM_EVENT (self));
+  child = cm_utils_json_object_get_object (root, "content");
 
   if (user_id)
     {
       if (g_strcmp0 (cm_utils_json_object_get_string (child, "membership"), "join") == 0)
-        *user_id = cm_utils_json_object_get_string (priv->json, "sender");
+        *user_id = cm_utils_json_object_get_string (root, "sender");
       else
-        *user_id = cm_utils_json_object_get_string (priv->json, "state_key");
+        *user_id = cm_utils_json_object_get_string (root, "state_key");
 
       if (G_UNLIKELY (!*user_id || !**user_id))
-        *user_id = cm_utils_json_object_get_string (priv->json, "sender");
+        *user_id = cm_utils_json_object_get_string (root, "sender");
     }
 
   return child;
@@ -329,19 +338,17 @@ cm_room_event_user_has_power (CmRoomEvent *self,
                               const char  *user_id,
                               CmEventType  event)
 {
-  CmRoomEventPrivate *priv = cm_room_event_get_instance_private (self);
-  JsonObject *child, *content;
+  JsonObject *root, *child, *content;
   int user_power = 0;
 
   g_return_val_if_fail (CM_IS_ROOM_EVENT (self), FALSE);
   g_return_val_if_fail (user_id && *user_id == '@', FALSE);
-  g_return_val_if_fail (priv->json, FALSE);
   ret_val_if_fail (self, CM_M_ROOM_POWER_LEVELS, 0, FALSE);
 
-  if (!priv->json)
-    return FALSE;
+  root = cm_event_peek_json (CM_EVENT (self));
+  g_return_val_if_fail (root, FALSE);
 
-  content = cm_utils_json_object_get_object (priv->json, "content");
+  content = cm_utils_json_object_get_object (root, "content");
   child = cm_utils_json_object_get_object (content, "users");
   user_power = cm_utils_json_object_get_int (child, user_id);
 
@@ -414,16 +421,17 @@ cm_room_event_user_has_power (CmRoomEvent *self,
 GPtrArray *
 cm_room_event_get_admin_ids (CmRoomEvent *self)
 {
-  CmRoomEventPrivate *priv = cm_room_event_get_instance_private (self);
   g_autoptr(GList) users = NULL;
   GPtrArray *admin_ids;
-  JsonObject *child;
+  JsonObject *root, *child;
 
   g_return_val_if_fail (CM_IS_ROOM_EVENT (self), NULL);
-  g_return_val_if_fail (priv->json, NULL);
   ret_val_if_fail (self, CM_M_ROOM_POWER_LEVELS, 0, NULL);
 
-  child = cm_utils_json_object_get_object (priv->json, "content");
+  root = cm_event_peek_json (CM_EVENT (self));
+  g_return_val_if_fail (root, NULL);
+
+  child = cm_utils_json_object_get_object (root, "content");
   child = cm_utils_json_object_get_object (child, "users");
   if (child)
     users = json_object_get_members (child);
@@ -451,15 +459,17 @@ cm_room_event_set_admin_users (CmRoomEvent *self,
                                GPtrArray   *users)
 {
   CmRoomEventPrivate *priv = cm_room_event_get_instance_private (self);
-  JsonObject *child;
+  JsonObject *root, *child;
 
   g_return_if_fail (CM_IS_ROOM_EVENT (self));
   g_return_if_fail (users);
-  g_return_if_fail (priv->json);
   g_return_if_fail (!priv->users);
   ret_if_fail (self, CM_M_ROOM_POWER_LEVELS);
 
-  child = cm_utils_json_object_get_object (priv->json, "content");
+  root = cm_event_peek_json (CM_EVENT (self));
+  g_return_if_fail (root);
+
+  child = cm_utils_json_object_get_object (root, "content");
   child = cm_utils_json_object_get_object (child, "users");
   g_return_if_fail (child);
   g_return_if_fail (json_object_get_size (child) == users->len);
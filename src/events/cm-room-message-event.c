@@ -25,7 +25,6 @@ struct _CmRoomMessageEvent
 {
   CmRoomEvent     parent_instance;
 
-  JsonObject     *json;
   CmContentType   type;
 
   char           *body;
@@ -35,6 +34,8 @@ struct _CmRoomMessageEvent
   char           *mxc_uri;
 
   gboolean       downloading_file;
+  /* The file is encrypted, server can't create thumbnails */
+  gboolean       file_encrypted;
 };
 
 G_DEFINE_TYPE (CmRoomMessageEvent, cm_room_message_event, CM_TYPE_ROOM_EVENT)
@@ -154,7 +155,6 @@ cm_room_message_event_finalize (GObject *object)
 {
   CmRoomMessageEvent *self = (CmRoomMessageEvent *)object;
 
-  g_clear_pointer (&self->json, json_object_unref);
   g_free (self->body);
   g_free (self->mxc_uri);
   g_free (self->file_path);
@@ -205,8 +205,6 @@ cm_room_message_event_new_from_json (JsonObject *root)
     g_return_val_if_reached (NULL);
 
   self = g_object_new (CM_TYPE_ROOM_MESSAGE_EVENT, NULL);
-  self->json = json_object_ref (root);
-
   child = cm_utils_json_object_get_object (root, "content");
   type = cm_utils_json_object_get_string (child, "msgtype");
   body = cm_utils_json_object_get_string (child, "body");
@@ -237,6 +235,7 @@ cm_room_message_event_new_from_json (JsonObject *root)
 
       if (file)
 	self->mxc_uri = cm_utils_json_object_dup_string (file, "url");
+      self->file_encrypted = !!self->mxc_uri;
     }
 
   return CM_ROOM_EVENT (self);
@@ -405,12 +404,115 @@ cm_room_message_event_get_file_async (CmRoomMessageEvent    *self,
   cm_utils_save_url_to_path_async (cm_room_get_client (room),
                                    self->mxc_uri,
                                    g_strdup (self->file_path),
+                                   CM_TRANSFER_PRIORITY_DOWNLOAD,
                                    cancellable,
-                                   NULL, NULL,
+                                   progress_callback, progress_user_data,
                                    message_file_stream_cb,
                                    g_steal_pointer (&task));
 }
 
+static void
+message_thumbnail_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GInputStream *istream;
+  GError *error = NULL;
+
+  g_assert (G_IS_TASK (task));
+
+  istream = cm_utils_read_thumbnail_finish (result, &error);
+
+  if (error)
+    g_task_return_error (task, error);
+  else if (istream)
+    g_task_return_pointer (task, istream, g_object_unref);
+  else
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                             "Thumbnail not available for the file");
+}
+
+/**
+ * cm_room_message_event_get_thumbnail_async:
+ * @self: The room message event
+ * @width: The desired width in pixels
+ * @height: The desired height in pixels
+ * @method: A #CmThumbnailMethod
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: A #GAsyncReadyCallback
+ * @user_data: The user data for @callback.
+ *
+ * Get a server generated thumbnail of the image in @self
+ * to be used as preview.  Fails with %G_IO_ERROR_NOT_SUPPORTED
+ * if the file is encrypted.
+ *
+ * Since: 0.0.4
+ */
+void
+cm_room_message_event_get_thumbnail_async (CmRoomMessageEvent  *self,
+                                           int                  width,
+                                           int                  height,
+                                           CmThumbnailMethod    method,
+                                           GCancellable        *cancellable,
+                                           GAsyncReadyCallback  callback,
+                                           gpointer             user_data)
+{
+  CmRoom *room;
+  GTask *task;
+
+  g_return_if_fail (CM_IS_ROOM_MESSAGE_EVENT (self));
+  g_return_if_fail (width > 0 && height > 0);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+  g_return_if_fail (self->type == CM_CONTENT_TYPE_IMAGE);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, cm_room_message_event_get_thumbnail_async);
+
+  if (self->file_encrypted)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                               "Thumbnail not available for the file");
+      g_object_unref (task);
+      return;
+    }
+
+  g_debug ("(%p) Get thumbnail %dx%d", self, width, height);
+
+  /* Not available unless the file has a valid mxc:// uri */
+  room = cm_room_event_get_room (CM_ROOM_EVENT (self));
+  cm_utils_read_thumbnail_async (cm_room_get_client (room), self->mxc_uri,
+                                 width, height, method,
+                                 CM_M_ROOM_MESSAGE, CM_TRANSFER_PRIORITY_THUMBNAIL,
+                                 cancellable,
+                                 message_thumbnail_cb, task);
+}
+
+/**
+ * cm_room_message_event_get_thumbnail_finish:
+ * @self: The room message event
+ * @result: `GAsyncResult`
+ * @error: The return location for a recoverable error.
+ *
+ * Finishes an asynchronous operation started with
+ * [method@RoomMessageEvent.get_thumbnail_async].
+ *
+ * Returns: (transfer full): The input stream for the thumbnail.
+ *
+ * Since: 0.0.4
+ */
+GInputStream *
+cm_room_message_event_get_thumbnail_finish (CmRoomMessageEvent  *self,
+                                            GAsyncResult        *result,
+                                            GError             **error)
+{
+  g_return_val_if_fail (CM_IS_ROOM_MESSAGE_EVENT (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 /**
  * cm_room_message_event_get_file_finish:
  * @self: The room message event
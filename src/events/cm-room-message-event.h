@@ -38,6 +38,16 @@ void                cm_room_message_event_get_file_async  (CmRoomMessageEvent
 GInputStream       *cm_room_message_event_get_file_finish (CmRoomMessageEvent    *self,
                                                            GAsyncResult          *result,
                                                            GError               **error);
+void                cm_room_message_event_get_thumbnail_async  (CmRoomMessageEvent  *self,
+                                                                int                  width,
+                                                                int                  height,
+                                                                CmThumbnailMethod    method,
+                                                                GCancellable        *cancellable,
+                                                                GAsyncReadyCallback  callback,
+                                                                gpointer             user_data);
+GInputStream       *cm_room_message_event_get_thumbnail_finish (CmRoomMessageEvent  *self,
+                                                                GAsyncResult        *result,
+                                                                GError             **error);
 
 
 G_END_DECLS
@@ -0,0 +1,46 @@
+/* cm-room-relations-private.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "cm-types.h"
+#include "cm-event-private.h"
+
+G_BEGIN_DECLS
+
+#define CM_TYPE_ROOM_RELATIONS (cm_room_relations_get_type ())
+
+G_DECLARE_FINAL_TYPE (CmRoomRelations, cm_room_relations, CM, ROOM_RELATIONS, GObject)
+
+CmRoomRelations *cm_room_relations_new                 (void);
+gboolean         cm_room_relations_add                 (CmRoomRelations *self,
+                                                        const char      *event_id,
+                                                        const char      *relates_to_id,
+                                                        const char      *sender_id,
+                                                        CmRelationType   type,
+                                                        const char      *key,
+                                                        gint64           time_stamp);
+GRefString      *cm_room_relations_add_event           (CmRoomRelations *self,
+                                                        CmEvent         *event);
+GRefString      *cm_room_relations_remove              (CmRoomRelations *self,
+                                                        const char      *event_id);
+void             cm_room_relations_merge               (CmRoomRelations *self,
+                                                        CmRoomRelations *other);
+const char      *cm_room_relations_get_edit_id         (CmRoomRelations *self,
+                                                        const char      *event_id,
+                                                        const char      *sender_id);
+guint            cm_room_relations_get_annotation_count (CmRoomRelations *self,
+                                                         const char      *event_id,
+                                                         const char      *key);
+GStrv            cm_room_relations_get_annotation_keys (CmRoomRelations *self,
+                                                        const char      *event_id);
+GStrv            cm_room_relations_get_reply_ids       (CmRoomRelations *self,
+                                                        const char      *event_id);
+
+G_END_DECLS
@@ -0,0 +1,527 @@
+/* cm-room-relations.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "cm-room-relations"
+
+#include "cm-config.h"
+
+#include "cm-utils-private.h"
+#include "cm-event-private.h"
+#include "cm-room-relations-private.h"
+
+/*
+ * CmRoomRelations:
+ *
+ * Aggregates the relations of the events in a room, so that
+ * the latest edit, annotation (reaction) counts and replies
+ * of an event can be found without scanning the timeline.
+ *
+ * Only m.replace, m.annotation and replies are aggregated.
+ * An edit is only honoured if it's sent by the sender of the
+ * original event, and annotations are counted once per sender
+ * and key.
+ */
+
+typedef struct
+{
+  GRefString     *event_id;
+  GRefString     *relates_to_id;
+  GRefString     *sender;
+  char           *key;
+  gint64          time_stamp;
+  CmRelationType  type;
+} Relation;
+
+typedef struct
+{
+  /* Relation items, owned by relations table */
+  GPtrArray      *edits;
+  GPtrArray      *replies;
+  /* key → (sender → number of relations) */
+  GHashTable     *annotations;
+} RelationTarget;
+
+struct _CmRoomRelations
+{
+  GObject     parent_instance;
+
+  /* event id → Relation */
+  GHashTable *relations;
+  /* related event id → RelationTarget */
+  GHashTable *targets;
+};
+
+G_DEFINE_TYPE (CmRoomRelations, cm_room_relations, G_TYPE_OBJECT)
+
+static void
+relation_free (gpointer data)
+{
+  Relation *relation = data;
+
+  g_clear_pointer (&relation->event_id, g_ref_string_release);
+  g_clear_pointer (&relation->relates_to_id, g_ref_string_release);
+  g_clear_pointer (&relation->sender, g_ref_string_release);
+  g_free (relation->key);
+  g_free (relation);
+}
+
+static void
+relation_target_free (gpointer data)
+{
+  RelationTarget *target = data;
+
+  g_clear_pointer (&target->edits, g_ptr_array_unref);
+  g_clear_pointer (&target->replies, g_ptr_array_unref);
+  g_clear_pointer (&target->annotations, g_hash_table_unref);
+  g_free (target);
+}
+
+static gboolean
+relation_target_is_empty (RelationTarget *target)
+{
+  return (!target->edits || !target->edits->len) &&
+    (!target->replies || !target->replies->len) &&
+    (!target->annotations || !g_hash_table_size (target->annotations));
+}
+
+static Relation *
+relation_target_get_edit (RelationTarget *target,
+                          GRefString     *sender)
+{
+  Relation *latest_edit = NULL;
+
+  for (guint i = 0; target->edits && i < target->edits->len; i++)
+    {
+      Relation *edit = target->edits->pdata[i];
+
+      /* Senders are interned, and so pointers can be compared */
+      if (edit->sender != sender)
+        continue;
+
+      /* Latest wins, and the last added one if equal */
+      if (!latest_edit || edit->time_stamp >= latest_edit->time_stamp)
+        latest_edit = edit;
+    }
+
+  return latest_edit;
+}
+
+static int
+relation_compare_keys (gconstpointer a,
+                       gconstpointer b)
+{
+  return g_strcmp0 (*(const char **)a, *(const char **)b);
+}
+
+static void
+cm_room_relations_finalize (GObject *object)
+{
+  CmRoomRelations *self = (CmRoomRelations *)object;
+
+  /* targets refer to items in relations */
+  g_clear_pointer (&self->targets, g_hash_table_unref);
+  g_clear_pointer (&self->relations, g_hash_table_unref);
+
+  G_OBJECT_CLASS (cm_room_relations_parent_class)->finalize (object);
+}
+
+static void
+cm_room_relations_class_init (CmRoomRelationsClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = cm_room_relations_finalize;
+}
+
+static void
+cm_room_relations_init (CmRoomRelations *self)
+{
+  self->relations = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, relation_free);
+  self->targets = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         (GDestroyNotify)g_ref_string_release,
+                                         relation_target_free);
+}
+
+CmRoomRelations *
+cm_room_relations_new (void)
+{
+  return g_object_new (CM_TYPE_ROOM_RELATIONS, NULL);
+}
+
+/**
+ * cm_room_relations_add:
+ * @self: A #CmRoomRelations
+ * @event_id: The event that has the relation
+ * @relates_to_id: The event @event_id relates to
+ * @sender_id: The sender of @event_id
+ * @type: The relation type
+ * @key: (nullable): The annotation key, if @type is annotation
+ * @time_stamp: The origin server time stamp of @event_id
+ *
+ * Add a relation to the index.  Relations that are already
+ * added and those that are not aggregated are ignored.
+ *
+ * Returns: %TRUE if the relation was added
+ */
+gboolean
+cm_room_relations_add (CmRoomRelations *self,
+                       const char      *event_id,
+                       const char      *relates_to_id,
+                       const char      *sender_id,
+                       CmRelationType   type,
+                       const char      *key,
+                       gint64           time_stamp)
+{
+  RelationTarget *target;
+  Relation *relation;
+
+  g_return_val_if_fail (CM_IS_ROOM_RELATIONS (self), FALSE);
+
+  if (!event_id || !*event_id || !relates_to_id || !*relates_to_id ||
+      !sender_id || !*sender_id)
+    return FALSE;
+
+  if (type != CM_RELATION_REPLACE &&
+      type != CM_RELATION_ANNOTATION &&
+      type != CM_RELATION_REPLY)
+    return FALSE;
+
+  if (type == CM_RELATION_ANNOTATION && (!key || !*key))
+    return FALSE;
+
+  if (g_hash_table_contains (self->relations, event_id))
+    return FALSE;
+
+  relation = g_new0 (Relation, 1);
+  relation->event_id = cm_utils_intern_id (event_id);
+  relation->relates_to_id = cm_utils_intern_id (relates_to_id);
+  relation->sender = cm_utils_intern_id (sender_id);
+  relation->key = g_strdup (key);
+  relation->time_stamp = time_stamp;
+  relation->type = type;
+  g_hash_table_insert (self->relations, relation->event_id, relation);
+
+  target = g_hash_table_lookup (self->targets, relates_to_id);
+  if (!target)
+    {
+      target = g_new0 (RelationTarget, 1);
+      g_hash_table_insert (self->targets,
+                           g_ref_string_acquire (relation->relates_to_id),
+                           target);
+    }
+
+  if (type == CM_RELATION_REPLACE)
+    {
+      if (!target->edits)
+        target->edits = g_ptr_array_new ();
+      g_ptr_array_add (target->edits, relation);
+    }
+  else if (type == CM_RELATION_REPLY)
+    {
+      if (!target->replies)
+        target->replies = g_ptr_array_new ();
+      g_ptr_array_add (target->replies, relation);
+    }
+  else
+    {
+      GHashTable *senders;
+      guint count;
+
+      if (!target->annotations)
+        target->annotations = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, (GDestroyNotify)g_hash_table_unref);
+      senders = g_hash_table_lookup (target->annotations, key);
+      if (!senders)
+        {
+          senders = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                           (GDestroyNotify)g_ref_string_release, NULL);
+          g_hash_table_insert (target->annotations, g_strdup (key), senders);
+        }
+
+      /* A sender may react with the same key more than once, eg: when
+       * a reaction was sent again before the first was synced.  Count
+       * the sender once, but keep track of every relation so that
+       * redacting one of them doesn't drop the reaction. */
+      count = GPOINTER_TO_UINT (g_hash_table_lookup (senders, relation->sender));
+      g_hash_table_insert (senders, g_ref_string_acquire (relation->sender),
+                           GUINT_TO_POINTER (count + 1));
+    }
+
+  return TRUE;
+}
+
+/**
+ * cm_room_relations_add_event:
+ * @self: A #CmRoomRelations
+ * @event: A #CmEvent
+ *
+ * Update the index with @event.  If @event is a redaction
+ * the redacted relation, if any, is removed.
+ *
+ * Returns: (transfer full) (nullable): The id of the event
+ * whose relations changed.  Free with g_ref_string_release().
+ */
+GRefString *
+cm_room_relations_add_event (CmRoomRelations *self,
+                             CmEvent         *event)
+{
+  const char *relates_to_id, *key;
+  CmRelationType type;
+
+  g_return_val_if_fail (CM_IS_ROOM_RELATIONS (self), NULL);
+  g_return_val_if_fail (CM_IS_EVENT (event), NULL);
+
+  if (cm_event_get_m_type (event) == CM_M_ROOM_REDACTION)
+    return cm_room_relations_remove (self, cm_event_get_replaces_id (event));
+
+  if (!cm_event_has_relation (event))
+    return NULL;
+
+  type = cm_event_get_relation (event, &relates_to_id, &key);
+
+  if (cm_room_relations_add (self, cm_event_get_id (event), relates_to_id,
+                             cm_event_get_sender_id (event), type, key,
+                             cm_event_get_time_stamp (event)))
+    return cm_utils_intern_id (relates_to_id);
+
+  return NULL;
+}
+
+/**
+ * cm_room_relations_remove:
+ * @self: A #CmRoomRelations
+ * @event_id: (nullable): The id of the event with the relation
+ *
+ * Remove the relation of @event_id, eg: when it's redacted.
+ *
+ * Returns: (transfer full) (nullable): The id of the event
+ * whose relations changed.  Free with g_ref_string_release().
+ */
+GRefString *
+cm_room_relations_remove (CmRoomRelations *self,
+                          const char      *event_id)
+{
+  RelationTarget *target;
+  Relation *relation;
+  GRefString *target_id;
+
+  g_return_val_if_fail (CM_IS_ROOM_RELATIONS (self), NULL);
+
+  if (!event_id)
+    return NULL;
+
+  relation = g_hash_table_lookup (self->relations, event_id);
+
+  if (!relation)
+    return NULL;
+
+  target_id = g_ref_string_acquire (relation->relates_to_id);
+  target = g_hash_table_lookup (self->targets, target_id);
+  g_assert (target);
+
+  if (relation->type == CM_RELATION_REPLACE)
+    {
+      g_ptr_array_remove (target->edits, relation);
+    }
+  else if (relation->type == CM_RELATION_REPLY)
+    {
+      g_ptr_array_remove (target->replies, relation);
+    }
+  else
+    {
+      GHashTable *senders;
+      guint count;
+
+      senders = g_hash_table_lookup (target->annotations, relation->key);
+      g_assert (senders);
+      count = GPOINTER_TO_UINT (g_hash_table_lookup (senders, relation->sender));
+      if (count > 1)
+        g_hash_table_insert (senders, g_ref_string_acquire (relation->sender),
+                             GUINT_TO_POINTER (count - 1));
+      else
+        g_hash_table_remove (senders, relation->sender);
+
+      if (!g_hash_table_size (senders))
+        g_hash_table_remove (target->annotations, relation->key);
+    }
+
+  g_hash_table_remove (self->relations, event_id);
+
+  if (relation_target_is_empty (target))
+    g_hash_table_remove (self->targets, target_id);
+
+  return target_id;
+}
+
+/**
+ * cm_room_relations_merge:
+ * @self: A #CmRoomRelations
+ * @other: A #CmRoomRelations
+ *
+ * Add every relation in @other to @self, eg: to add
+ * the relations loaded from db.
+ */
+void
+cm_room_relations_merge (CmRoomRelations *self,
+                         CmRoomRelations *other)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_return_if_fail (CM_IS_ROOM_RELATIONS (self));
+  g_return_if_fail (CM_IS_ROOM_RELATIONS (other));
+
+  g_hash_table_iter_init (&iter, other->relations);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Relation *relation = value;
+
+      cm_room_relations_add (self, relation->event_id, relation->relates_to_id,
+                             relation->sender, relation->type, relation->key,
+                             relation->time_stamp);
+    }
+}
+
+/**
+ * cm_room_relations_get_edit_id:
+ * @self: A #CmRoomRelations
+ * @event_id: An event id
+ * @sender_id: The sender of @event_id
+ *
+ * Edits sent by anyone other than @sender_id are ignored.
+ *
+ * Returns: (nullable): The id of the latest event
+ * that replaces @event_id, if any.
+ */
+const char *
+cm_room_relations_get_edit_id (CmRoomRelations *self,
+                               const char      *event_id,
+                               const char      *sender_id)
+{
+  g_autoptr(GRefString) sender = NULL;
+  RelationTarget *target;
+  Relation *edit = NULL;
+
+  g_return_val_if_fail (CM_IS_ROOM_RELATIONS (self), NULL);
+
+  if (!event_id || !sender_id)
+    return NULL;
+
+  target = g_hash_table_lookup (self->targets, event_id);
+
+  if (target)
+    {
+      sender = cm_utils_intern_id (sender_id);
+      edit = relation_target_get_edit (target, sender);
+    }
+
+  if (edit)
+    return edit->event_id;
+
+  return NULL;
+}
+
+guint
+cm_room_relations_get_annotation_count (CmRoomRelations *self,
+                                        const char      *event_id,
+                                        const char      *key)
+{
+  RelationTarget *target;
+  GHashTable *senders;
+
+  g_return_val_if_fail (CM_IS_ROOM_RELATIONS (self), 0);
+
+  if (!event_id || !key)
+    return 0;
+
+  target = g_hash_table_lookup (self->targets, event_id);
+
+  if (!target || !target->annotations)
+    return 0;
+
+  senders = g_hash_table_lookup (target->annotations, key);
+
+  return senders ? g_hash_table_size (senders) : 0;
+}
+
+/**
+ * cm_room_relations_get_annotation_keys:
+ * @self: A #CmRoomRelations
+ * @event_id: An event id
+ *
+ * Returns: (transfer full) (nullable): The sorted
+ * annotation keys of @event_id
+ */
+GStrv
+cm_room_relations_get_annotation_keys (CmRoomRelations *self,
+                                       const char      *event_id)
+{
+  RelationTarget *target;
+  GPtrArray *keys;
+  GHashTableIter iter;
+  gpointer key;
+
+  g_return_val_if_fail (CM_IS_ROOM_RELATIONS (self), NULL);
+
+  if (!event_id)
+    return NULL;
+
+  target = g_hash_table_lookup (self->targets, event_id);
+
+  if (!target || !target->annotations || !g_hash_table_size (target->annotations))
+    return NULL;
+
+  keys = g_ptr_array_sized_new (g_hash_table_size (target->annotations) + 1);
+  g_hash_table_iter_init (&iter, target->annotations);
+
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (keys, g_strdup (key));
+
+  g_ptr_array_sort (keys, relation_compare_keys);
+  g_ptr_array_add (keys, NULL);
+
+  return (GStrv)g_ptr_array_free (keys, FALSE);
+}
+
+/**
+ * cm_room_relations_get_reply_ids:
+ * @self: A #CmRoomRelations
+ * @event_id: An event id
+ *
+ * Returns: (transfer full) (nullable): The ids of
+ * events that are replies to @event_id
+ */
+GStrv
+cm_room_relations_get_reply_ids (CmRoomRelations *self,
+                                 const char      *event_id)
+{
+  RelationTarget *target;
+  GStrv replies;
+
+  g_return_val_if_fail (CM_IS_ROOM_RELATIONS (self), NULL);
+
+  if (!event_id)
+    return NULL;
+
+  target = g_hash_table_lookup (self->targets, event_id);
+
+  if (!target || !target->replies || !target->replies->len)
+    return NULL;
+
+  replies = g_new0 (char *, target->replies->len + 1);
+
+  for (guint i = 0; i < target->replies->len; i++)
+    {
+      Relation *relation = target->replies->pdata[i];
+
+      replies[i] = g_strdup (relation->event_id);
+    }
+
+  return replies;
+}
@@ -17,6 +17,7 @@
 #include "cm-device.h"
 #include "cm-device-private.h"
 #include "cm-matrix-private.h"
+#include "cm-stats-private.h"
 #include "cm-user-list-private.h"
 #include "cm-user-private.h"
 #include "cm-user.h"
@@ -75,6 +76,7 @@ cm_user_finalize (GObject *object)
   g_clear_pointer (&priv->generated_json, json_object_unref);
 
   g_clear_weak_pointer (&priv->cm_client);
+  cm_stats_object_free (CM_STATS_OBJECT_USER);
 
   G_OBJECT_CLASS (cm_user_parent_class)->finalize (object);
 }
@@ -109,6 +111,7 @@ cm_user_init (CmUser *self)
   priv->devices = g_list_store_new (CM_TYPE_DEVICE);
   priv->devices_table = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                g_free, g_object_unref);
+  cm_stats_object_new (CM_STATS_OBJECT_USER);
 }
 
 JsonObject *
@@ -369,7 +372,8 @@ avatar_get_user_info_cb (GObject      *object,
 
       priv->avatar_loading = TRUE;
       cm_utils_save_url_to_path_async (priv->cm_client, priv->avatar_url,
-                                       file_path, cancellable,
+                                       file_path, CM_TRANSFER_PRIORITY_AVATAR,
+                                       cancellable,
                                        NULL, NULL,
                                        user_get_avatar_cb, g_steal_pointer (&task));
     }
@@ -439,7 +443,8 @@ cm_user_get_avatar_async (CmUser              *self,
 
       priv->avatar_loading = TRUE;
       cm_utils_save_url_to_path_async (priv->cm_client, priv->avatar_url,
-                                       file_path, cancellable,
+                                       file_path, CM_TRANSFER_PRIORITY_AVATAR,
+                                       cancellable,
                                        NULL, NULL,
                                        user_get_avatar_cb, g_steal_pointer (&task));
     }
@@ -469,6 +474,137 @@ cm_user_get_avatar_finish (CmUser        *self,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+static void
+user_get_avatar_thumbnail_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GInputStream *istream;
+  GError *error = NULL;
+
+  g_assert (G_IS_TASK (task));
+
+  istream = cm_utils_read_thumbnail_finish (result, &error);
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, istream, g_object_unref);
+}
+
+/* Takes ownership of @task */
+static void
+user_get_avatar_thumbnail (CmUser *self,
+                           GTask  *task)
+{
+  CmUserPrivate *priv = cm_user_get_instance_private (self);
+  CmThumbnailMethod method;
+  int width, height;
+
+  g_assert (CM_IS_USER (self));
+  g_assert (G_IS_TASK (task));
+
+  width = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "width"));
+  height = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "height"));
+  method = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "method"));
+
+  g_debug ("(%p) Get avatar thumbnail %dx%d", self, width, height);
+
+  cm_utils_read_thumbnail_async (priv->cm_client, priv->avatar_url,
+                                 width, height, method,
+                                 CM_M_ROOM_MEMBER, CM_TRANSFER_PRIORITY_AVATAR,
+                                 g_task_get_cancellable (task),
+                                 user_get_avatar_thumbnail_cb, task);
+}
+
+static void
+thumbnail_get_user_info_cb (GObject      *object,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+  GTask *task = user_data;
+
+  g_assert (G_IS_TASK (task));
+
+  /* Try with whatever we have, even if loading info failed */
+  cm_user_load_info_finish (CM_USER (object), result, NULL);
+  user_get_avatar_thumbnail (CM_USER (object), task);
+}
+
+/**
+ * cm_user_get_avatar_thumbnail_async:
+ * @self: The user
+ * @width: The desired width in pixels
+ * @height: The desired height in pixels
+ * @method: A #CmThumbnailMethod
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: A #GAsyncReadyCallback
+ * @user_data: The user data for @callback.
+ *
+ * Get a thumbnail of the user avatar generated by the server.
+ * This is much cheaper than [method@User.get_avatar_async]
+ * when the avatar is shown small, eg: in a member list.
+ *
+ * The returned image may be larger than requested.
+ *
+ * Since: 0.0.4
+ */
+void
+cm_user_get_avatar_thumbnail_async (CmUser              *self,
+                                    int                  width,
+                                    int                  height,
+                                    CmThumbnailMethod    method,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  CmUserPrivate *priv = cm_user_get_instance_private (self);
+  GTask *task;
+
+  g_return_if_fail (CM_IS_USER (self));
+  g_return_if_fail (width > 0 && height > 0);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, cm_user_get_avatar_thumbnail_async);
+  g_object_set_data (G_OBJECT (task), "width", GINT_TO_POINTER (width));
+  g_object_set_data (G_OBJECT (task), "height", GINT_TO_POINTER (height));
+  g_object_set_data (G_OBJECT (task), "method", GINT_TO_POINTER (method));
+
+  if (!priv->avatar_url && !priv->info_loaded)
+    cm_user_load_info_async (self, cancellable,
+                             thumbnail_get_user_info_cb, task);
+  else
+    user_get_avatar_thumbnail (self, task);
+}
+
+/**
+ * cm_user_get_avatar_thumbnail_finish:
+ * @self: The user
+ * @result: `GAsyncResult`
+ * @error: The return location for a recoverable error.
+ *
+ * Finishes an asynchronous operation started with
+ * [method@User.get_avatar_thumbnail_async].
+ *
+ * Returns: (transfer full) (nullable): The input stream, or
+ * %NULL if the user has no avatar
+ *
+ * Since: 0.0.4
+ */
+GInputStream *
+cm_user_get_avatar_thumbnail_finish (CmUser        *self,
+                                     GAsyncResult  *result,
+                                     GError       **error)
+{
+  g_return_val_if_fail (CM_IS_USER (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 static void
 user_get_user_info_cb (GObject      *obj,
                        GAsyncResult *result,
@@ -492,6 +628,8 @@ user_get_user_info_cb (GObject      *obj,
 
   if (error)
     {
+      /* Can be dropped when rate limited, let it be retried */
+      priv->info_loading = FALSE;
       g_task_return_error (task, error);
       return;
     }
@@ -545,7 +683,7 @@ cm_user_load_info_async (CmUser              *self,
   priv->info_loading = TRUE;
   uri = g_strdup_printf ("/_matrix/client/r0/profile/%s", priv->user_id);
   cm_net_send_json_async (cm_client_get_net (priv->cm_client),
-                          1, NULL, uri, SOUP_METHOD_GET,
+                          -1, NULL, uri, SOUP_METHOD_GET,
                           NULL, cancellable, user_get_user_info_cb,
                           g_steal_pointer (&task));
 }
@@ -624,9 +762,10 @@ cm_user_set_devices (CmUser     *self,
 {
   CmUserPrivate *priv = cm_user_get_instance_private (self);
   g_autoptr(GHashTable) devices_table = NULL;
-  g_autoptr(GList) members = NULL;
   GHashTable *old_devices;
-  JsonObject *child;
+  JsonObjectIter iter;
+  JsonNode *node;
+  const char *member;
 
   g_return_if_fail (CM_IS_USER (self));
   g_return_if_fail (root);
@@ -634,33 +773,38 @@ cm_user_set_devices (CmUser     *self,
   /* Create a table of devices and add the items here */
   devices_table = g_hash_table_new_full (g_str_hash, g_str_equal,
                                          g_free, g_object_unref);
-  members = json_object_get_members (root);
+  json_object_iter_init (&iter, root);
 
-  for (GList *member = members; member; member = member->next)
+  while (json_object_iter_next (&iter, &member, &node))
     {
       g_autoptr(CmDevice) device = NULL;
       const char *device_id, *user;
+      JsonObject *child;
+      gpointer key;
+
+      /* If the device is already in the old table, move it
+       * with its key to the new table, so that it's present
+       * only in the new devices_table.  Such devices are
+       * already verified, so nothing else needs to be done.
+       */
+      if (priv->devices_table &&
+          g_hash_table_steal_extended (priv->devices_table, member,
+                                       &key, (gpointer *)&device))
+        {
+          g_hash_table_insert (devices_table, key, g_steal_pointer (&device));
+          continue;
+        }
 
-      child = cm_utils_json_object_get_object (root, member->data);
+      if (!JSON_NODE_HOLDS_OBJECT (node))
+        continue;
+
+      child = json_node_get_object (node);
       device_id = cm_utils_json_object_get_string (child, "device_id");
       user = cm_utils_json_object_get_string (child, "user_id");
 
       if (!device_id || !*device_id)
         continue;
 
-      if (priv->devices_table &&
-          (device = g_hash_table_lookup (priv->devices_table, device_id)))
-        {
-          /* If the device is already in the old table, remove it there
-           * so that it's present only in the new devices_table.
-           */
-          /* device variable is autofree, so the ref is unref later automatically */
-          g_object_ref (device);
-          g_hash_table_remove (priv->devices_table, device_id);
-          g_hash_table_insert (devices_table, g_strdup (device_id), g_object_ref (device));
-          continue;
-        }
-
       if (g_strcmp0 (user, cm_user_get_id (self)) != 0)
         {
           g_warning ("‘%s’ and ‘%s’ are not the same users",
@@ -668,9 +812,9 @@ cm_user_set_devices (CmUser     *self,
           continue;
         }
 
-      if (g_strcmp0 (member->data, device_id) != 0)
+      if (g_strcmp0 (member, device_id) != 0)
         {
-          g_warning ("‘%s’ and ‘%s’ are not the same device", (char *)member->data, device_id);
+          g_warning ("‘%s’ and ‘%s’ are not the same device", member, device_id);
           continue;
         }
 
@@ -17,6 +17,8 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include "cm-enums.h"
+
 G_BEGIN_DECLS
 
 #define CM_TYPE_USER (cm_user_get_type ())
@@ -41,6 +43,16 @@ void          cm_user_get_avatar_async        (CmUser              *self,
 GInputStream *cm_user_get_avatar_finish       (CmUser              *self,
                                                GAsyncResult        *result,
                                                GError             **error);
+void          cm_user_get_avatar_thumbnail_async  (CmUser              *self,
+                                                   int                  width,
+                                                   int                  height,
+                                                   CmThumbnailMethod    method,
+                                                   GCancellable        *cancellable,
+                                                   GAsyncReadyCallback  callback,
+                                                   gpointer             user_data);
+GInputStream *cm_user_get_avatar_thumbnail_finish (CmUser              *self,
+                                                   GAsyncResult        *result,
+                                                   GError             **error);
 void          cm_user_load_info_async         (CmUser              *self,
                                                GCancellable        *cancellable,
                                                GAsyncReadyCallback  callback,
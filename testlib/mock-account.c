@@ -0,0 +1,390 @@
+/* mock-account.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <string.h>
+
+#include "mock-account.h"
+
+/*
+ * A synthetic account, for the tests and the benchmarks.
+ *
+ * The account is a /sync response with n_rooms joined rooms,
+ * each with n_members members and n_events timeline events.
+ * The same seed generates the same account.
+ */
+
+#define OWN_USER_ID     "@bench:example.org"
+#define START_TIME      G_GINT64_CONSTANT (1650000000000)
+
+static const char *words[] = {
+  "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+  "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+  "et", "dolore", "magna", "aliqua", "matrix", "room", "hello", "world",
+};
+
+char *
+mock_account_get_user_id (const MockAccount *account,
+                          guint              index)
+{
+  /* The first member of every room is the account owner */
+  if (index == 0)
+    return g_strdup (OWN_USER_ID);
+
+  return g_strdup_printf ("@user%05u:example.org", index);
+}
+
+char *
+mock_account_get_room_id (const MockAccount *account,
+                          guint              index)
+{
+  return g_strdup_printf ("!room%05u:example.org", index);
+}
+
+static JsonObject *
+account_new_event (const char *type,
+                   const char *event_id,
+                   const char *sender,
+                   const char *state_key,
+                   gint64      time_stamp,
+                   JsonObject *content)
+{
+  JsonObject *event;
+
+  event = json_object_new ();
+  json_object_set_string_member (event, "type", type);
+  json_object_set_string_member (event, "event_id", event_id);
+  json_object_set_string_member (event, "sender", sender);
+  json_object_set_int_member (event, "origin_server_ts", time_stamp);
+  if (state_key)
+    json_object_set_string_member (event, "state_key", state_key);
+  json_object_set_object_member (event, "content", content);
+
+  return event;
+}
+
+static char *
+account_new_text (GRand *rng)
+{
+  GString *str;
+  guint count;
+
+  str = g_string_new (NULL);
+  count = g_rand_int_range (rng, 1, 40);
+
+  for (guint i = 0; i < count; i++)
+    {
+      if (i)
+        g_string_append_c (str, ' ');
+      g_string_append (str, words[g_rand_int_range (rng, 0, G_N_ELEMENTS (words))]);
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+static JsonObject *
+account_new_message_content (GRand      *rng,
+                             const char *last_event_id)
+{
+  g_autofree char *text = NULL;
+  JsonObject *content, *child;
+  int kind;
+
+  content = json_object_new ();
+  kind = g_rand_int_range (rng, 0, 100);
+  text = account_new_text (rng);
+  json_object_set_string_member (content, "msgtype", "m.text");
+  json_object_set_string_member (content, "body", text);
+
+  /* A few edits and replies, so that relations get some work too */
+  if (last_event_id && kind < 5)
+    {
+      child = json_object_new ();
+      json_object_set_string_member (child, "rel_type", "m.replace");
+      json_object_set_string_member (child, "event_id", last_event_id);
+      json_object_set_object_member (content, "m.relates_to", child);
+    }
+  else if (last_event_id && kind < 10)
+    {
+      JsonObject *reply;
+
+      reply = json_object_new ();
+      json_object_set_string_member (reply, "event_id", last_event_id);
+      child = json_object_new ();
+      json_object_set_object_member (child, "m.in_reply_to", reply);
+      json_object_set_object_member (content, "m.relates_to", child);
+    }
+
+  return content;
+}
+
+static JsonObject *
+account_new_encrypted_content (GRand      *rng,
+                               const char *room_id)
+{
+  g_autofree char *ciphertext = NULL;
+  g_autofree char *session_id = NULL;
+  JsonObject *content;
+  guchar data[192];
+
+  for (guint i = 0; i < sizeof data; i++)
+    data[i] = g_rand_int_range (rng, 0, 256);
+
+  /* Not decryptable, but of the right shape and size */
+  ciphertext = g_base64_encode (data, g_rand_int_range (rng, 64, sizeof data));
+  session_id = g_compute_checksum_for_string (G_CHECKSUM_SHA256, room_id, -1);
+
+  content = json_object_new ();
+  json_object_set_string_member (content, "algorithm", "m.megolm.v1.aes-sha2");
+  json_object_set_string_member (content, "ciphertext", ciphertext);
+  json_object_set_string_member (content, "device_id", "BENCHDEVICE");
+  json_object_set_string_member (content, "sender_key", "3C5BFWi2Y8MaVvjM8M22DBmh24PmgR0nPvJOIArzgyI");
+  json_object_set_string_member (content, "session_id", session_id);
+
+  return content;
+}
+
+/**
+ * mock_account_generate_room:
+ * @account: A #MockAccount
+ * @index: The room index, less than n_rooms
+ *
+ * Generate the /sync data of a single joined room
+ *
+ * Returns: (transfer full): The room json
+ */
+JsonObject *
+mock_account_generate_room (const MockAccount *account,
+                            guint              index)
+{
+  g_autofree char *room_id = NULL;
+  g_autofree char *last_event_id = NULL;
+  g_autoptr(GRand) rng = NULL;
+  JsonObject *room, *child, *content;
+  JsonArray *state, *timeline;
+  gint64 time_stamp = START_TIME;
+  gboolean encrypted;
+
+  g_assert (account);
+  g_assert (account->n_members > 0);
+
+  /* Each room has its own sequence, so that rooms can be generated alone */
+  rng = g_rand_new_with_seed (account->seed + index);
+  room_id = mock_account_get_room_id (account, index);
+  encrypted = g_rand_int_range (rng, 0, 100) < (int)account->encrypted_percent;
+
+  state = json_array_new ();
+  content = json_object_new ();
+  json_object_set_string_member (content, "creator", OWN_USER_ID);
+  json_object_set_string_member (content, "room_version", "9");
+  json_array_add_object_element (state, account_new_event ("m.room.create", "$create:example.org",
+                                                           OWN_USER_ID, "", time_stamp++, content));
+
+  content = json_object_new ();
+  json_object_set_string_member (content, "name", room_id);
+  json_array_add_object_element (state, account_new_event ("m.room.name", "$name:example.org",
+                                                           OWN_USER_ID, "", time_stamp++, content));
+
+  if (encrypted)
+    {
+      content = json_object_new ();
+      json_object_set_string_member (content, "algorithm", "m.megolm.v1.aes-sha2");
+      json_array_add_object_element (state, account_new_event ("m.room.encryption", "$encryption:example.org",
+                                                               OWN_USER_ID, "", time_stamp++, content));
+    }
+
+  for (guint i = 0; i < account->n_members; i++)
+    {
+      g_autofree char *user_id = NULL;
+      g_autofree char *event_id = NULL;
+      guint user;
+
+      /* Members overlap between rooms, as they do in real accounts */
+      user = i ? g_rand_int_range (rng, 1, account->n_members * 4) : 0;
+      user_id = mock_account_get_user_id (account, user);
+      event_id = g_strdup_printf ("$r%05u-m%05u:example.org", index, i);
+      content = json_object_new ();
+      json_object_set_string_member (content, "membership", "join");
+      json_object_set_string_member (content, "displayname", user_id + 1);
+      json_array_add_object_element (state, account_new_event ("m.room.member", event_id, user_id,
+                                                               user_id, time_stamp++, content));
+    }
+
+  timeline = json_array_new ();
+
+  for (guint i = 0; i < account->n_events; i++)
+    {
+      g_autofree char *sender = NULL;
+      g_autofree char *event_id = NULL;
+      const char *type;
+
+      sender = mock_account_get_user_id (account, g_rand_int_range (rng, 0, account->n_members));
+      event_id = g_strdup_printf ("$r%05u-e%06u:example.org", index, i);
+
+      if (encrypted)
+        {
+          type = "m.room.encrypted";
+          content = account_new_encrypted_content (rng, room_id);
+        }
+      else if (last_event_id && g_rand_int_range (rng, 0, 100) < 10)
+        {
+          type = "m.reaction";
+          content = json_object_new ();
+          child = json_object_new ();
+          json_object_set_string_member (child, "rel_type", "m.annotation");
+          json_object_set_string_member (child, "event_id", last_event_id);
+          json_object_set_string_member (child, "key", g_rand_boolean (rng) ? "👍" : "🎉");
+          json_object_set_object_member (content, "m.relates_to", child);
+        }
+      else
+        {
+          type = "m.room.message";
+          content = account_new_message_content (rng, last_event_id);
+        }
+
+      time_stamp += g_rand_int_range (rng, 1000, 600000);
+      json_array_add_object_element (timeline, account_new_event (type, event_id, sender,
+                                                                  NULL, time_stamp, content));
+      g_free (last_event_id);
+      last_event_id = g_steal_pointer (&event_id);
+    }
+
+  room = json_object_new ();
+
+  child = json_object_new ();
+  json_object_set_array_member (child, "events", state);
+  json_object_set_object_member (room, "state", child);
+
+  child = json_object_new ();
+  json_object_set_array_member (child, "events", timeline);
+  json_object_set_boolean_member (child, "limited", TRUE);
+  json_object_set_string_member (child, "prev_batch", "t1-bench");
+  json_object_set_object_member (room, "timeline", child);
+
+  child = json_object_new ();
+  json_object_set_int_member (child, "notification_count", g_rand_int_range (rng, 0, 10));
+  json_object_set_int_member (child, "highlight_count", 0);
+  json_object_set_object_member (room, "unread_notifications", child);
+
+  return room;
+}
+
+/**
+ * mock_account_generate_sync:
+ * @account: A #MockAccount
+ *
+ * Generate the initial /sync response of @account
+ *
+ * Returns: (transfer full): The sync response json
+ */
+JsonObject *
+mock_account_generate_sync (const MockAccount *account)
+{
+  JsonObject *root, *rooms, *join;
+
+  g_assert (account);
+
+  join = json_object_new ();
+
+  for (guint i = 0; i < account->n_rooms; i++)
+    {
+      g_autofree char *room_id = NULL;
+
+      room_id = mock_account_get_room_id (account, i);
+      json_object_set_object_member (join, room_id, mock_account_generate_room (account, i));
+    }
+
+  rooms = json_object_new ();
+  json_object_set_object_member (rooms, "join", join);
+
+  root = json_object_new ();
+  json_object_set_string_member (root, "next_batch", "s1-bench");
+  json_object_set_object_member (root, "rooms", rooms);
+
+  return root;
+}
+
+/**
+ * mock_account_generate_update:
+ * @account: A #MockAccount
+ * @batch: The sync batch number, starting from 1
+ * @n_rooms: The number of rooms that changed
+ * @n_events: The number of new events in each room
+ *
+ * Generate an incremental /sync response following the
+ * initial sync (or the update with @batch - 1).  Only
+ * plain text messages are added.
+ *
+ * Returns: (transfer full): The sync response json
+ */
+JsonObject *
+mock_account_generate_update (const MockAccount *account,
+                              guint              batch,
+                              guint              n_rooms,
+                              guint              n_events)
+{
+  g_autoptr(GRand) rng = NULL;
+  g_autofree char *next_batch = NULL;
+  JsonObject *root, *rooms, *join;
+  gint64 time_stamp;
+
+  g_assert (account);
+  g_assert (batch > 0);
+
+  rng = g_rand_new_with_seed (account->seed ^ batch);
+  join = json_object_new ();
+  n_rooms = MIN (n_rooms, account->n_rooms);
+  /* After the initial timeline and the earlier batches */
+  time_stamp = START_TIME + ((gint64)account->n_members + account->n_events) * 600000;
+  time_stamp += (gint64)(batch - 1) * n_rooms * n_events * 60000;
+
+  for (guint i = 0; i < n_rooms; i++)
+    {
+      g_autofree char *room_id = NULL;
+      JsonObject *room, *timeline;
+      JsonArray *events;
+      guint index;
+
+      index = g_rand_int_range (rng, 0, account->n_rooms);
+      room_id = mock_account_get_room_id (account, index);
+
+      if (json_object_has_member (join, room_id))
+        continue;
+
+      events = json_array_new ();
+
+      for (guint j = 0; j < n_events; j++)
+        {
+          g_autofree char *sender = NULL;
+          g_autofree char *event_id = NULL;
+
+          sender = mock_account_get_user_id (account, g_rand_int_range (rng, 0, account->n_members));
+          event_id = g_strdup_printf ("$r%05u-b%05u-e%06u:example.org", index, batch, j);
+          time_stamp += g_rand_int_range (rng, 1000, 60000);
+          json_array_add_object_element (events, account_new_event ("m.room.message", event_id, sender, NULL,
+                                                                    time_stamp,
+                                                                    account_new_message_content (rng, NULL)));
+        }
+
+      timeline = json_object_new ();
+      json_object_set_array_member (timeline, "events", events);
+      json_object_set_boolean_member (timeline, "limited", FALSE);
+
+      room = json_object_new ();
+      json_object_set_object_member (room, "timeline", timeline);
+      json_object_set_object_member (join, room_id, room);
+    }
+
+  rooms = json_object_new ();
+  json_object_set_object_member (rooms, "join", join);
+
+  next_batch = g_strdup_printf ("s%u-bench", batch + 1);
+  root = json_object_new ();
+  json_object_set_string_member (root, "next_batch", next_batch);
+  json_object_set_object_member (root, "rooms", rooms);
+
+  return root;
+}
@@ -0,0 +1,39 @@
+/* mock-account.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+  guint   n_rooms;
+  /* Members in each room */
+  guint   n_members;
+  /* Timeline events in each room */
+  guint   n_events;
+  /* Percentage of rooms that are encrypted */
+  guint   encrypted_percent;
+  guint32 seed;
+} MockAccount;
+
+char       *mock_account_get_user_id     (const MockAccount *account,
+                                          guint              index);
+char       *mock_account_get_room_id     (const MockAccount *account,
+                                          guint              index);
+JsonObject *mock_account_generate_room   (const MockAccount *account,
+                                          guint              index);
+JsonObject *mock_account_generate_sync   (const MockAccount *account);
+JsonObject *mock_account_generate_update (const MockAccount *account,
+                                          guint              batch,
+                                          guint              n_rooms,
+                                          guint              n_events);
+
+G_END_DECLS
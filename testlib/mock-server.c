@@ -0,0 +1,807 @@
+/* mock-server.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <string.h>
+#include <libsoup/soup.h>
+
+#include "cm-utils-private.h"
+#include "mock-server.h"
+
+/*
+ * A stand-in for a homeserver, good enough to log in and
+ * sync a #CmClient.  /sync responses are served from a
+ * script (generated or recorded, in order), and once the
+ * script is over /sync long polls as a server would.
+ * Other endpoints are generated from the #MockAccount, and
+ * any of them can be replaced with mock_server_set_response().
+ *
+ * Every response is delayed by the configured latency and by
+ * the time it would take to transfer with the configured
+ * bandwidth.  The server runs in the thread default main
+ * context, and so the client and server can share a thread.
+ */
+
+#define USER_ID         "@bench:example.org"
+#define DEVICE_ID       "BENCHDEVICE"
+#define MAX_SYNC_WAIT   30000
+#define MEDIA_SIZE      (64 * 1024)
+
+struct _MockServer
+{
+  SoupServer   *server;
+  char         *uri;
+  MockAccount   account;
+  gboolean      has_account;
+
+  /* path -> JsonObject */
+  GHashTable   *responses;
+  /* path -> extra delay of the response in ms */
+  GHashTable   *response_delays;
+  /* path -> RateLimit */
+  GHashTable   *rate_limits;
+  /* path -> GPtrArray of request bodies */
+  GHashTable   *requests;
+  GQueue       *syncs;
+  GPtrArray    *delays;
+  GBytes       *media;
+
+  guint         latency_ms;
+  /* in bytes per second, 0 for no limit */
+  guint         bandwidth;
+  guint         sync_count;
+  gsize         bytes_sent;
+  gboolean      drained;
+};
+
+typedef struct
+{
+  MockServer        *self;
+  SoupServerMessage *msg;
+  GSource           *source;
+} Delay;
+
+typedef struct
+{
+  guint    n_requests;
+  guint    retry_after_ms;
+  gboolean use_header;
+} RateLimit;
+
+static void
+delay_free (gpointer data)
+{
+  Delay *delay = data;
+
+  g_source_destroy (delay->source);
+  g_source_unref (delay->source);
+  g_object_unref (delay->msg);
+  g_free (delay);
+}
+
+static gboolean
+delay_done_cb (gpointer user_data)
+{
+  Delay *delay = user_data;
+
+  soup_server_message_unpause (delay->msg);
+  /* frees @delay */
+  g_ptr_array_remove_fast (delay->self->delays, delay);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+server_respond (MockServer        *self,
+                SoupServerMessage *msg,
+                guint              status,
+                const char        *content_type,
+                gpointer           body,
+                gsize              length,
+                guint              extra_delay)
+{
+  guint delay_ms;
+
+  self->bytes_sent += length;
+  soup_server_message_set_status (msg, status, NULL);
+  soup_server_message_set_response (msg, content_type, SOUP_MEMORY_TAKE, body, length);
+
+  delay_ms = self->latency_ms + extra_delay;
+  if (self->bandwidth)
+    delay_ms += length * 1000 / self->bandwidth;
+
+  if (delay_ms)
+    {
+      Delay *delay;
+
+      delay = g_new0 (Delay, 1);
+      delay->self = self;
+      delay->msg = g_object_ref (msg);
+      delay->source = g_timeout_source_new (delay_ms);
+      g_source_set_callback (delay->source, delay_done_cb, delay, NULL);
+      g_source_attach (delay->source, g_main_context_get_thread_default ());
+      g_ptr_array_add (self->delays, delay);
+
+      soup_server_message_pause (msg);
+    }
+}
+
+static void
+server_respond_json (MockServer        *self,
+                     SoupServerMessage *msg,
+                     guint              status,
+                     JsonObject        *object,
+                     guint              extra_delay)
+{
+  char *body;
+
+  body = cm_utils_json_object_to_string (object, FALSE);
+  server_respond (self, msg, status, "application/json",
+                  body, strlen (body), extra_delay);
+}
+
+static void
+server_respond_error (MockServer        *self,
+                      SoupServerMessage *msg,
+                      guint              status,
+                      const char        *errcode)
+{
+  g_autoptr(JsonObject) object = NULL;
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "errcode", errcode);
+  json_object_set_string_member (object, "error", soup_status_get_phrase (status));
+  server_respond_json (self, msg, status, object, 0);
+}
+
+static gboolean
+server_respond_rate_limited (MockServer        *self,
+                             SoupServerMessage *msg,
+                             const char        *path)
+{
+  g_autoptr(JsonObject) object = NULL;
+  RateLimit *limit;
+
+  limit = g_hash_table_lookup (self->rate_limits, path);
+
+  if (!limit || !limit->n_requests)
+    return FALSE;
+
+  limit->n_requests--;
+  object = json_object_new ();
+  json_object_set_string_member (object, "errcode", "M_LIMIT_EXCEEDED");
+  json_object_set_string_member (object, "error", "Too many requests");
+
+  /* The header has a precision of seconds only */
+  if (limit->use_header)
+    {
+      g_autofree char *value = NULL;
+
+      value = g_strdup_printf ("%u", (limit->retry_after_ms + 999) / 1000);
+      soup_message_headers_replace (soup_server_message_get_response_headers (msg),
+                                    "Retry-After", value);
+    }
+  else
+    {
+      json_object_set_int_member (object, "retry_after_ms", limit->retry_after_ms);
+    }
+
+  server_respond_json (self, msg, SOUP_STATUS_TOO_MANY_REQUESTS, object, 0);
+
+  return TRUE;
+}
+
+static void
+server_log_request (MockServer        *self,
+                    SoupServerMessage *msg,
+                    const char        *path)
+{
+  SoupMessageBody *body;
+  GPtrArray *requests;
+
+  requests = g_hash_table_lookup (self->requests, path);
+
+  if (!requests)
+    {
+      requests = g_ptr_array_new_with_free_func (g_free);
+      g_hash_table_insert (self->requests, g_strdup (path), requests);
+    }
+
+  body = soup_server_message_get_request_body (msg);
+
+  if (body && body->length)
+    g_ptr_array_add (requests, g_strndup (body->data, body->length));
+  else
+    g_ptr_array_add (requests, g_strdup (""));
+}
+
+static JsonObject *
+server_get_request_json (SoupServerMessage *msg)
+{
+  SoupMessageBody *body;
+  g_autofree char *data = NULL;
+
+  body = soup_server_message_get_request_body (msg);
+
+  if (!body || !body->length)
+    return NULL;
+
+  data = g_strndup (body->data, body->length);
+
+  return cm_utils_string_to_json_object (data);
+}
+
+static void
+server_handle_sync (MockServer        *self,
+                    SoupServerMessage *msg,
+                    GHashTable        *query)
+{
+  g_autoptr(JsonObject) response = NULL;
+  const char *since = NULL, *timeout = NULL;
+  guint wait_ms = 0;
+
+  self->sync_count++;
+
+  if (query)
+    {
+      since = g_hash_table_lookup (query, "since");
+      timeout = g_hash_table_lookup (query, "timeout");
+    }
+
+  response = g_queue_pop_head (self->syncs);
+
+  /* Nothing new, hold the request as long as the client asked to */
+  if (!response)
+    {
+      JsonObject *child;
+
+      self->drained = TRUE;
+
+      if (timeout)
+        wait_ms = MIN (g_ascii_strtoull (timeout, NULL, 10), MAX_SYNC_WAIT);
+
+      response = json_object_new ();
+      json_object_set_string_member (response, "next_batch", since ?: "s1-bench");
+      child = json_object_new ();
+      json_object_set_object_member (child, "join", json_object_new ());
+      json_object_set_object_member (response, "rooms", child);
+    }
+
+  server_respond_json (self, msg, SOUP_STATUS_OK, response, wait_ms);
+}
+
+static void
+server_handle_login (MockServer        *self,
+                     SoupServerMessage *msg)
+{
+  g_autoptr(JsonObject) object = NULL;
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "user_id", USER_ID);
+  json_object_set_string_member (object, "access_token", "bench-access-token");
+  json_object_set_string_member (object, "device_id", DEVICE_ID);
+  server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+}
+
+static void
+server_handle_keys_query (MockServer        *self,
+                          SoupServerMessage *msg)
+{
+  g_autoptr(JsonObject) request = NULL;
+  g_autoptr(JsonObject) object = NULL;
+  g_autoptr(GList) users = NULL;
+  JsonObject *keys, *child;
+
+  request = server_get_request_json (msg);
+  child = cm_utils_json_object_get_object (request, "device_keys");
+  keys = json_object_new ();
+
+  if (child)
+    users = json_object_get_members (child);
+
+  /* Users without any device */
+  for (GList *node = users; node; node = node->next)
+    json_object_set_object_member (keys, node->data, json_object_new ());
+
+  object = json_object_new ();
+  json_object_set_object_member (object, "device_keys", keys);
+  json_object_set_object_member (object, "failures", json_object_new ());
+  server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+}
+
+static void
+server_handle_messages (MockServer        *self,
+                        SoupServerMessage *msg,
+                        const char        *room_id,
+                        GHashTable        *query)
+{
+  g_autoptr(JsonObject) object = NULL;
+  const char *from = NULL;
+  JsonArray *chunk;
+
+  if (query)
+    from = g_hash_table_lookup (query, "from");
+
+  chunk = json_array_new ();
+  object = json_object_new ();
+  json_object_set_array_member (object, "chunk", chunk);
+  json_object_set_string_member (object, "start", from ?: "t1-bench");
+
+  /* Only one page of history, as old as the initial sync */
+  if (self->has_account && g_str_has_prefix (room_id, "!room") &&
+      g_strcmp0 (from, "t0-bench") != 0)
+    {
+      g_autoptr(JsonObject) room = NULL;
+      JsonObject *child;
+      JsonArray *events;
+      guint index, length;
+
+      index = g_ascii_strtoull (room_id + strlen ("!room"), NULL, 10);
+      room = mock_account_generate_room (&self->account, index % self->account.n_rooms);
+      child = cm_utils_json_object_get_object (room, "timeline");
+      events = cm_utils_json_object_get_array (child, "events");
+      length = json_array_get_length (events);
+
+      for (guint i = length; i > 0; i--)
+        {
+          g_autofree char *event_id = NULL;
+          JsonObject *event;
+
+          event = json_array_get_object_element (events, i - 1);
+          /* So that they don't clash with the ones in the timeline */
+          event_id = g_strconcat ("$p", cm_utils_json_object_get_string (event, "event_id") + 1, NULL);
+          json_object_set_string_member (event, "event_id", event_id);
+          json_array_add_object_element (chunk, json_object_ref (event));
+        }
+
+      json_object_set_string_member (object, "end", "t0-bench");
+    }
+
+  server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+}
+
+static void
+server_handle_request (SoupServer        *server,
+                       SoupServerMessage *msg,
+                       const char        *path,
+                       GHashTable        *query,
+                       gpointer           user_data)
+{
+  MockServer *self = user_data;
+  g_autoptr(JsonObject) object = NULL;
+  JsonObject *response;
+  const char *method;
+
+  method = soup_server_message_get_method (msg);
+  server_log_request (self, msg, path);
+
+  if (server_respond_rate_limited (self, msg, path))
+    return;
+
+  response = g_hash_table_lookup (self->responses, path);
+
+  if (response)
+    {
+      guint delay_ms;
+
+      delay_ms = GPOINTER_TO_UINT (g_hash_table_lookup (self->response_delays, path));
+      server_respond_json (self, msg, SOUP_STATUS_OK, response, delay_ms);
+      return;
+    }
+
+  if (g_str_equal (path, "/_matrix/client/versions"))
+    {
+      JsonArray *versions;
+
+      versions = json_array_new ();
+      json_array_add_string_element (versions, "r0.6.1");
+      json_array_add_string_element (versions, "v1.1");
+      json_array_add_string_element (versions, "v1.11");
+      object = json_object_new ();
+      json_object_set_array_member (object, "versions", versions);
+      server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+    }
+  else if (g_str_has_suffix (path, "/sync"))
+    {
+      server_handle_sync (self, msg, query);
+    }
+  else if (g_str_has_suffix (path, "/login"))
+    {
+      server_handle_login (self, msg);
+    }
+  else if (g_str_has_suffix (path, "/keys/upload"))
+    {
+      JsonObject *child;
+
+      child = json_object_new ();
+      json_object_set_int_member (child, "signed_curve25519", 50);
+      object = json_object_new ();
+      json_object_set_object_member (object, "one_time_key_counts", child);
+      server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+    }
+  else if (g_str_has_suffix (path, "/keys/query"))
+    {
+      server_handle_keys_query (self, msg);
+    }
+  else if (g_str_has_suffix (path, "/keys/claim"))
+    {
+      object = json_object_new ();
+      json_object_set_object_member (object, "one_time_keys", json_object_new ());
+      json_object_set_object_member (object, "failures", json_object_new ());
+      server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+    }
+  else if (g_str_has_suffix (path, "/filter") &&
+           g_strcmp0 (method, SOUP_METHOD_POST) == 0)
+    {
+      object = json_object_new ();
+      json_object_set_string_member (object, "filter_id", "1");
+      server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+    }
+  else if (g_str_has_suffix (path, "/joined_rooms"))
+    {
+      JsonArray *rooms;
+
+      rooms = json_array_new ();
+      for (guint i = 0; self->has_account && i < self->account.n_rooms; i++)
+        {
+          g_autofree char *room_id = NULL;
+
+          room_id = mock_account_get_room_id (&self->account, i);
+          json_array_add_string_element (rooms, room_id);
+        }
+      object = json_object_new ();
+      json_object_set_array_member (object, "joined_rooms", rooms);
+      server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+    }
+  else if (g_str_has_suffix (path, "/messages") &&
+           g_str_has_prefix (path, "/_matrix/client/r0/rooms/"))
+    {
+      g_autofree char *room_id = NULL;
+      const char *start;
+
+      start = path + strlen ("/_matrix/client/r0/rooms/");
+      room_id = g_uri_unescape_segment (start, strrchr (path, '/'), NULL);
+      server_handle_messages (self, msg, room_id ?: "", query);
+    }
+  else if (g_str_has_suffix (path, "/media/r0/upload") ||
+           g_str_has_suffix (path, "/media/v3/upload"))
+    {
+      object = json_object_new ();
+      json_object_set_string_member (object, "content_uri", "mxc://example.org/bench-upload");
+      server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+    }
+  else if (strstr (path, "/download/") || strstr (path, "/thumbnail/"))
+    {
+      server_respond (self, msg, SOUP_STATUS_OK, "image/png",
+                      g_memdup2 (g_bytes_get_data (self->media, NULL), MEDIA_SIZE),
+                      MEDIA_SIZE, 0);
+    }
+  else if (g_strcmp0 (method, SOUP_METHOD_PUT) == 0 ||
+           g_strcmp0 (method, SOUP_METHOD_POST) == 0)
+    {
+      /* Messages, typing notices, read markers and the like */
+      object = json_object_new ();
+      json_object_set_string_member (object, "event_id", "$bench-sent:example.org");
+      server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+    }
+  else if (strstr (path, "/account_data/"))
+    {
+      object = json_object_new ();
+      server_respond_json (self, msg, SOUP_STATUS_OK, object, 0);
+    }
+  else
+    {
+      server_respond_error (self, msg, SOUP_STATUS_NOT_FOUND, "M_UNRECOGNIZED");
+    }
+}
+
+/**
+ * mock_server_new:
+ * @account: (nullable): A #MockAccount
+ *
+ * Create a new server listening on localhost.  If @account
+ * is set, it's used to answer /joined_rooms, /messages and
+ * the like.  The /sync responses should be added with
+ * mock_server_add_sync().
+ *
+ * Returns: (transfer full): A new #MockServer
+ */
+MockServer *
+mock_server_new (const MockAccount *account)
+{
+  g_autoptr(GError) error = NULL;
+  MockServer *self;
+  GSList *uris;
+  guchar *data;
+
+  self = g_new0 (MockServer, 1);
+
+  if (account)
+    {
+      self->account = *account;
+      self->has_account = TRUE;
+    }
+
+  self->responses = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify)json_object_unref);
+  self->response_delays = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->rate_limits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->requests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)g_ptr_array_unref);
+  self->syncs = g_queue_new ();
+  self->delays = g_ptr_array_new_with_free_func (delay_free);
+
+  data = g_malloc (MEDIA_SIZE);
+  for (guint i = 0; i < MEDIA_SIZE; i++)
+    data[i] = i * 31;
+  self->media = g_bytes_new_take (data, MEDIA_SIZE);
+
+  self->server = soup_server_new (NULL, NULL);
+  soup_server_add_handler (self->server, NULL, server_handle_request, self, NULL);
+  soup_server_listen_local (self->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (self->server);
+  g_assert_nonnull (uris);
+  self->uri = g_uri_to_string_partial (uris->data, G_URI_HIDE_PASSWORD);
+  g_slist_free_full (uris, (GDestroyNotify)g_uri_unref);
+
+  /* The client doesn't like trailing slashes */
+  if (g_str_has_suffix (self->uri, "/"))
+    self->uri[strlen (self->uri) - 1] = '\0';
+
+  return self;
+}
+
+void
+mock_server_free (MockServer *self)
+{
+  if (!self)
+    return;
+
+  soup_server_disconnect (self->server);
+  g_ptr_array_unref (self->delays);
+  g_clear_object (&self->server);
+  g_queue_free_full (self->syncs, (GDestroyNotify)json_object_unref);
+  g_hash_table_unref (self->responses);
+  g_hash_table_unref (self->response_delays);
+  g_hash_table_unref (self->rate_limits);
+  g_hash_table_unref (self->requests);
+  g_bytes_unref (self->media);
+  g_free (self->uri);
+  g_free (self);
+}
+
+/**
+ * mock_server_get_uri:
+ * @self: A #MockServer
+ *
+ * Returns: The homeserver uri, like http://127.0.0.1:1234
+ */
+const char *
+mock_server_get_uri (MockServer *self)
+{
+  g_assert (self);
+
+  return self->uri;
+}
+
+void
+mock_server_set_latency (MockServer *self,
+                         guint       latency_ms)
+{
+  g_assert (self);
+
+  self->latency_ms = latency_ms;
+}
+
+/**
+ * mock_server_set_bandwidth:
+ * @self: A #MockServer
+ * @kbytes_per_second: The bandwidth in KiB/s, 0 for no limit
+ *
+ * Delay each response by the time it would take to transfer
+ * its body with the given bandwidth.
+ */
+void
+mock_server_set_bandwidth (MockServer *self,
+                           guint       kbytes_per_second)
+{
+  g_assert (self);
+
+  self->bandwidth = kbytes_per_second * 1024;
+}
+
+/**
+ * mock_server_add_sync:
+ * @self: A #MockServer
+ * @response: (transfer full): The /sync response
+ *
+ * Queue @response to be served for the next /sync
+ * request that isn't answered yet.
+ */
+void
+mock_server_add_sync (MockServer *self,
+                      JsonObject *response)
+{
+  g_assert (self);
+  g_assert (response);
+
+  self->drained = FALSE;
+  g_queue_push_tail (self->syncs, response);
+}
+
+/**
+ * mock_server_add_sync_file:
+ * @self: A #MockServer
+ * @file_name: A json file with a recorded /sync response
+ * @error: A #GError
+ *
+ * Same as mock_server_add_sync(), with the response
+ * loaded from @file_name.
+ *
+ * Returns: %TRUE if the file could be loaded
+ */
+gboolean
+mock_server_add_sync_file (MockServer  *self,
+                           const char  *file_name,
+                           GError     **error)
+{
+  g_autoptr(JsonParser) parser = NULL;
+  JsonNode *root;
+
+  g_assert (self);
+  g_assert (file_name);
+
+  parser = json_parser_new ();
+
+  if (!json_parser_load_from_file (parser, file_name, error))
+    return FALSE;
+
+  root = json_parser_get_root (parser);
+
+  if (!root || !JSON_NODE_HOLDS_OBJECT (root))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "'%s' isn't a json object", file_name);
+      return FALSE;
+    }
+
+  mock_server_add_sync (self, json_node_dup_object (root));
+
+  return TRUE;
+}
+
+/**
+ * mock_server_set_response:
+ * @self: A #MockServer
+ * @path: The request path
+ * @response: (transfer full) (nullable): The response
+ *
+ * Always reply with @response for requests with @path,
+ * instead of the generated response.  Set %NULL to
+ * remove the response.
+ */
+void
+mock_server_set_response (MockServer *self,
+                          const char *path,
+                          JsonObject *response)
+{
+  g_assert (self);
+  g_assert (path && *path == '/');
+
+  if (response)
+    g_hash_table_insert (self->responses, g_strdup (path), response);
+  else
+    g_hash_table_remove (self->responses, path);
+}
+
+/**
+ * mock_server_delay_response:
+ * @self: A #MockServer
+ * @path: The request path
+ * @delay_ms: The extra delay in milliseconds
+ *
+ * Delay the response set with mock_server_set_response()
+ * for @path by @delay_ms more than the others, eg: to
+ * have concurrent requests finish in a given order.
+ */
+void
+mock_server_delay_response (MockServer *self,
+                            const char *path,
+                            guint       delay_ms)
+{
+  g_assert (self);
+  g_assert (path && *path == '/');
+
+  g_hash_table_insert (self->response_delays, g_strdup (path),
+                       GUINT_TO_POINTER (delay_ms));
+}
+
+/**
+ * mock_server_set_rate_limited:
+ * @self: A #MockServer
+ * @path: The request path
+ * @n_requests: The number of requests to reject
+ * @retry_after_ms: The time the client should wait
+ * @use_header: Whether to send the time in the Retry-After
+ *   header instead of the response body
+ *
+ * Reply to the next @n_requests requests with @path
+ * with 429 Too Many Requests.
+ */
+void
+mock_server_set_rate_limited (MockServer *self,
+                              const char *path,
+                              guint       n_requests,
+                              guint       retry_after_ms,
+                              gboolean    use_header)
+{
+  RateLimit *limit;
+
+  g_assert (self);
+  g_assert (path && *path == '/');
+
+  limit = g_new0 (RateLimit, 1);
+  limit->n_requests = n_requests;
+  limit->retry_after_ms = retry_after_ms;
+  limit->use_header = !!use_header;
+  g_hash_table_insert (self->rate_limits, g_strdup (path), limit);
+}
+
+/**
+ * mock_server_get_requests:
+ * @self: A #MockServer
+ * @path: The request path
+ *
+ * Get the bodies of the requests received with @path,
+ * in the order they were received.  Requests without
+ * a body are logged as empty strings.
+ *
+ * Returns: (transfer none) (nullable): The request bodies
+ */
+GPtrArray *
+mock_server_get_requests (MockServer *self,
+                          const char *path)
+{
+  g_assert (self);
+  g_assert (path && *path == '/');
+
+  return g_hash_table_lookup (self->requests, path);
+}
+
+guint
+mock_server_get_sync_count (MockServer *self)
+{
+  g_assert (self);
+
+  return self->sync_count;
+}
+
+/**
+ * mock_server_is_drained:
+ * @self: A #MockServer
+ *
+ * Get if all queued /sync responses have been served,
+ * and the client has asked for more.
+ *
+ * Returns: %TRUE if the client has caught up
+ */
+gboolean
+mock_server_is_drained (MockServer *self)
+{
+  g_assert (self);
+
+  return self->drained;
+}
+
+gsize
+mock_server_get_bytes_sent (MockServer *self)
+{
+  g_assert (self);
+
+  return self->bytes_sent;
+}
@@ -0,0 +1,50 @@
+/* mock-server.h
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+#include "mock-account.h"
+
+G_BEGIN_DECLS
+
+typedef struct _MockServer MockServer;
+
+MockServer *mock_server_new               (const MockAccount  *account);
+void        mock_server_free              (MockServer         *self);
+const char *mock_server_get_uri           (MockServer         *self);
+void        mock_server_set_latency       (MockServer         *self,
+                                           guint               latency_ms);
+void        mock_server_set_bandwidth     (MockServer         *self,
+                                           guint               kbytes_per_second);
+void        mock_server_add_sync          (MockServer         *self,
+                                           JsonObject         *response);
+gboolean    mock_server_add_sync_file     (MockServer         *self,
+                                           const char         *file_name,
+                                           GError            **error);
+void        mock_server_set_response      (MockServer         *self,
+                                           const char         *path,
+                                           JsonObject         *response);
+void        mock_server_delay_response    (MockServer         *self,
+                                           const char         *path,
+                                           guint               delay_ms);
+void        mock_server_set_rate_limited  (MockServer         *self,
+                                           const char         *path,
+                                           guint               n_requests,
+                                           guint               retry_after_ms,
+                                           gboolean            use_header);
+GPtrArray  *mock_server_get_requests      (MockServer         *self,
+                                           const char         *path);
+guint       mock_server_get_sync_count    (MockServer         *self);
+gboolean    mock_server_is_drained        (MockServer         *self);
+gsize       mock_server_get_bytes_sent    (MockServer         *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MockServer, mock_server_free)
+
+G_END_DECLS
@@ -15,7 +15,20 @@
 #undef G_DISABLE_CAST_CHECKS
 #undef G_LOG_DOMAIN
 
-#include "cm-client.h"
+#include "cm-client.c"
+
+#include <glib/gstdio.h>
+#include <sqlite3.h>
+
+#include "cm-matrix.h"
+#include "cm-device-private.h"
+#include "cm-media-cache-private.h"
+#include "mock-server.h"
+
+#define MOCK_MEDIA_SIZE (64 * 1024) /* MEDIA_SIZE in mock-server.c */
+#define MAX_INITIAL_SYNCS 2 /* MAX_INITIAL_SYNCS in cm-sync-scheduler.c */
+#define JOINED_ROOMS_PATH "/_matrix/client/r0/joined_rooms"
+#define DIRECT_ROOMS_PATH "/_matrix/client/r0/user/@alice:example.org/account_data/m.direct"
 
 static void
 test_cm_client_new (void)
@@ -77,13 +90,796 @@ test_cm_client_new (void)
   g_assert_finalize_object (client);
 }
 
+static void
+finish_bool_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  gboolean status;
+
+  g_assert_true (G_IS_TASK (task));
+
+  status = g_task_propagate_boolean (G_TASK (result), &error);
+  g_assert_no_error (error);
+  g_task_return_boolean (task, status);
+}
+
+static void
+wait_for_task (GTask *task)
+{
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static void
+sync_cb (CmClient  *client,
+         CmRoom    *room,
+         GPtrArray *events,
+         GError    *error,
+         gpointer   user_data)
+{
+  guint *n_calls = user_data;
+
+  /* Only errors are reported here if the batched callback is set */
+  g_assert_null (room);
+  (*n_calls)++;
+}
+
+static void
+batch_sync_cb (CmClient  *client,
+               GPtrArray *changes,
+               gpointer   user_data)
+{
+  GHashTable *flags = user_data;
+
+  g_assert_true (CM_IS_CLIENT (client));
+  g_hash_table_remove_all (flags);
+
+  for (guint i = 0; i < changes->len; i++)
+    {
+      CmRoomChange *change = changes->pdata[i];
+
+      g_assert_true (CM_IS_ROOM (change->room));
+      g_assert_true (!change->events == !(change->flags & CM_ROOM_CHANGE_EVENTS));
+      g_hash_table_insert (flags, g_strdup (cm_room_get_id (change->room)),
+                           GUINT_TO_POINTER (change->flags));
+    }
+}
+
+static guint64
+stats_get_db_task_count (const char *name)
+{
+  g_autoptr(GVariant) histograms = NULL;
+  g_autoptr(GVariant) histogram = NULL;
+  g_autoptr(GVariant) snapshot = NULL;
+  g_autofree char *key = NULL;
+  guint64 count = 0;
+
+  snapshot = g_variant_ref_sink (cm_stats_get_snapshot (cm_stats_get_default ()));
+  histograms = g_variant_lookup_value (snapshot, "histograms", G_VARIANT_TYPE ("a{sa{sv}}"));
+  key = g_strconcat ("db/task/", name, NULL);
+  histogram = g_variant_lookup_value (histograms, key, G_VARIANT_TYPE_VARDICT);
+
+  if (histogram)
+    g_variant_lookup (histogram, "count", "t", &count);
+
+  return count;
+}
+
+static guint64
+stats_get_time_sum (const char *name)
+{
+  g_autoptr(GVariant) histograms = NULL;
+  g_autoptr(GVariant) histogram = NULL;
+  g_autoptr(GVariant) snapshot = NULL;
+  guint64 sum = 0;
+
+  snapshot = g_variant_ref_sink (cm_stats_get_snapshot (cm_stats_get_default ()));
+  histograms = g_variant_lookup_value (snapshot, "histograms", G_VARIANT_TYPE ("a{sa{sv}}"));
+  histogram = g_variant_lookup_value (histograms, name, G_VARIANT_TYPE_VARDICT);
+
+  if (histogram)
+    g_variant_lookup (histogram, "sum", "t", &sum);
+
+  return sum;
+}
+
+static void
+test_cm_client_batch_sync (void)
+{
+  g_autoptr(GHashTable) flags = NULL;
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(CmDb) db = NULL;
+  GTask *task;
+  guint n_calls = 0;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                    "test-client.db", finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  client = cm_client_new ();
+  /* Mark client to not save changes to db */
+  g_object_set_data (G_OBJECT (client), "no-save", GINT_TO_POINTER (TRUE));
+  cm_client_set_user_id (client, "@alice:example.org");
+  cm_client_set_device_id (client, "DEADBEAF");
+  cm_client_set_db (client, db);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_client_async (db, client, g_strdup ("pickle"), finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  flags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  cm_client_set_sync_callback (client, sync_cb, &n_calls, NULL);
+  cm_client_set_batch_sync_callback (client, batch_sync_cb,
+                                     g_hash_table_ref (flags),
+                                     (GDestroyNotify)g_hash_table_unref);
+
+  /* The first sync creates the rooms */
+  root = cm_utils_string_to_json_object ("{\"rooms\": {"
+                                         "\"join\": {"
+                                         "\"!a:example.org\": {\"timeline\": {\"events\": []}},"
+                                         "\"!b:example.org\": {\"timeline\": {\"events\": []}}}}}");
+  g_assert_nonnull (root);
+  handle_red_pill (client, root);
+  g_clear_pointer (&root, json_object_unref);
+
+  g_assert_cmpint (g_hash_table_size (flags), ==, 2);
+  g_assert_cmpint (GPOINTER_TO_UINT (g_hash_table_lookup (flags, "!a:example.org")), ==, CM_ROOM_CHANGE_STATUS);
+  g_assert_cmpint (GPOINTER_TO_UINT (g_hash_table_lookup (flags, "!b:example.org")), ==, CM_ROOM_CHANGE_STATUS);
+
+  cm_stats_reset (cm_stats_get_default ());
+  root = cm_utils_string_to_json_object ("{\"rooms\": {"
+                                         "\"join\": {"
+                                         "\"!a:example.org\": {\"timeline\": {\"events\": ["
+                                         "{\"type\": \"m.room.message\", \"event_id\": \"$a1:example.org\","
+                                         "\"sender\": \"@bob:example.org\", \"origin_server_ts\": 1650000000000,"
+                                         "\"content\": {\"msgtype\": \"m.text\", \"body\": \"hi\"}},"
+                                         "{\"type\": \"m.room.topic\", \"event_id\": \"$a2:example.org\","
+                                         "\"sender\": \"@bob:example.org\", \"origin_server_ts\": 1650000001000,"
+                                         "\"state_key\": \"\", \"content\": {\"topic\": \"Topic\"}}]}},"
+                                         "\"!b:example.org\": {\"unread_notifications\": {\"notification_count\": 2},"
+                                         "\"timeline\": {\"events\": ["
+                                         "{\"type\": \"m.room.message\", \"event_id\": \"$b1:example.org\","
+                                         "\"sender\": \"@bob:example.org\", \"origin_server_ts\": 1650000002000,"
+                                         "\"content\": {\"msgtype\": \"m.text\", \"body\": \"hello\"}}]}}},"
+                                         "\"invite\": {"
+                                         "\"!c:example.org\": {\"invite_state\": {\"events\": ["
+                                         "{\"type\": \"m.room.name\", \"sender\": \"@bob:example.org\","
+                                         "\"state_key\": \"\", \"content\": {\"name\": \"Room C\"}}]}}}}}");
+  g_assert_nonnull (root);
+  handle_red_pill (client, root);
+
+  g_assert_cmpint (g_hash_table_size (flags), ==, 3);
+  g_assert_cmpint (GPOINTER_TO_UINT (g_hash_table_lookup (flags, "!a:example.org")), ==,
+                   CM_ROOM_CHANGE_EVENTS | CM_ROOM_CHANGE_STATE);
+  g_assert_cmpint (GPOINTER_TO_UINT (g_hash_table_lookup (flags, "!b:example.org")), ==,
+                   CM_ROOM_CHANGE_EVENTS | CM_ROOM_CHANGE_UNREAD);
+  g_assert_cmpint (GPOINTER_TO_UINT (g_hash_table_lookup (flags, "!c:example.org")), ==,
+                   CM_ROOM_CHANGE_STATUS | CM_ROOM_CHANGE_STATE);
+  g_assert_cmpint (n_calls, ==, 0);
+
+  /* Closing waits for every pending task, and so their stats */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (db, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  /* The events of both rooms are saved in a single transaction */
+  g_assert_cmpuint (stats_get_db_task_count ("db_add_rooms_events"), ==, 1);
+  g_assert_cmpuint (stats_get_db_task_count ("db_add_room_events"), ==, 0);
+
+  cm_client_set_batch_sync_callback (client, NULL, NULL, NULL);
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+}
+
+static void
+load_client_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  JsonObject *cache;
+  GPtrArray *hashes;
+  gboolean status;
+
+  g_assert_true (G_IS_TASK (task));
+
+  status = g_task_propagate_boolean (G_TASK (result), &error);
+  g_assert_no_error (error);
+
+  cache = g_object_get_data (G_OBJECT (result), "homeserver-cache");
+  if (cache)
+    g_object_set_data_full (G_OBJECT (task), "homeserver-cache", json_object_ref (cache),
+                            (GDestroyNotify)json_object_unref);
+  hashes = g_object_get_data (G_OBJECT (result), "device-key-hashes");
+  if (hashes)
+    g_object_set_data_full (G_OBJECT (task), "device-key-hashes", g_ptr_array_ref (hashes),
+                            (GDestroyNotify)g_ptr_array_unref);
+  g_task_return_boolean (task, status);
+}
+
+static JsonObject *
+homeserver_cache_new (const char *url,
+                      gint64      checked)
+{
+  JsonObject *cache;
+  JsonArray *versions;
+
+  versions = json_array_new ();
+  json_array_add_string_element (versions, "v1.1");
+  cache = json_object_new ();
+  json_object_set_string_member (cache, "url", url);
+  json_object_set_array_member (cache, "versions", versions);
+  json_object_set_int_member (cache, "checked", checked);
+
+  return cache;
+}
+
+static CmClient *
+homeserver_client_new (void)
+{
+  CmClient *client;
+
+  client = cm_client_new ();
+  /* Mark client to not save changes to db */
+  g_object_set_data (G_OBJECT (client), "no-save", GINT_TO_POINTER (TRUE));
+  cm_client_set_user_id (client, "@alice:example.org");
+  cm_client_set_device_id (client, "DEADBEAF");
+
+  return client;
+}
+
+static void
+test_cm_client_homeserver_cache_db (void)
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(JsonObject) cache = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(CmDb) db = NULL;
+  JsonObject *loaded;
+  JsonArray *versions;
+  GTask *task;
+  gint64 now, checked;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+  server = mock_server_new (NULL);
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  checked = now - 60 * 60;
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                    "test-client.db", finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  /* Nothing is cached until the server is verified */
+  client = homeserver_client_new ();
+  g_assert_true (cm_client_set_homeserver (client, mock_server_get_uri (server)));
+  g_assert_null (cm_client_get_homeserver_cache (client));
+
+  client->homeserver_verified = TRUE;
+  client->homeserver_versions = g_strsplit ("r0.6.1 v1.1", " ", -1);
+  client->homeserver_checked = checked;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_client_async (db, client, g_strdup ("pickle"), finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+  g_clear_object (&client);
+
+  client = homeserver_client_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_load_client_async (db, client, "DEADBEAF", load_client_cb, task);
+  wait_for_task (task);
+
+  loaded = g_object_get_data (G_OBJECT (task), "homeserver-cache");
+  g_assert_nonnull (loaded);
+  g_assert_cmpstr (cm_utils_json_object_get_string (loaded, "url"), ==, mock_server_get_uri (server));
+  g_assert_cmpint (cm_utils_json_object_get_int (loaded, "checked"), ==, checked);
+  versions = cm_utils_json_object_get_array (loaded, "versions");
+  g_assert_nonnull (versions);
+  g_assert_cmpint (json_array_get_length (versions), ==, 2);
+  g_assert_cmpstr (json_array_get_string_element (versions, 1), ==, "v1.1");
+
+  /* The homeserver is used without discovering it again */
+  g_assert_null (cm_client_get_homeserver (client));
+  client_restore_homeserver_cache (client, loaded);
+  g_clear_object (&task);
+  g_assert_cmpstr (cm_client_get_homeserver (client), ==, mock_server_get_uri (server));
+  g_assert_true (client->homeserver_verified);
+  g_assert_cmpstr (client->homeserver_versions[0], ==, "r0.6.1");
+
+  cache = cm_client_get_homeserver_cache (client);
+  g_assert_nonnull (cache);
+  g_assert_cmpint (cm_utils_json_object_get_int (cache, "checked"), ==, checked);
+
+  /* And is verified again in the background */
+  while (client->homeserver_checked == checked)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (client->homeserver_verified);
+  g_assert_cmpint (client->homeserver_checked, >=, now);
+  g_assert_cmpstr (client->homeserver_versions[0], ==, "r0.6.1");
+  g_assert_cmpstr (client->homeserver_versions[2], ==, "v1.11");
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (db, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+}
+
+static char *
+db_get_user_device_json (const char *device_id)
+{
+  g_autofree char *db_path = NULL;
+  sqlite3_stmt *stmt;
+  char *json = NULL;
+  sqlite3 *db;
+
+  db_path = g_test_build_filename (G_TEST_BUILT, "test-client.db", NULL);
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  sqlite3_prepare_v2 (db, "SELECT json_data FROM user_devices WHERE device=?1",
+                      -1, &stmt, NULL);
+  sqlite3_bind_text (stmt, 1, device_id, -1, SQLITE_TRANSIENT);
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    json = g_strdup ((char *)sqlite3_column_text (stmt, 0));
+
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+
+  return json;
+}
+
+static void
+test_cm_client_device_key_hash_db (void)
+{
+  g_autoptr(GRefString) bob_id = NULL;
+  g_autoptr(GPtrArray) members = NULL;
+  g_autoptr(GPtrArray) added = NULL;
+  g_autoptr(JsonObject) devices = NULL;
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(CmRoomMember) member = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(CmRoom) room = NULL;
+  g_autoptr(CmEnc) bob_enc = NULL;
+  g_autoptr(CmDb) db = NULL;
+  g_autofree char *json_str = NULL;
+  GPtrArray *hashes;
+  JsonObject *keys;
+  const char *hash;
+  GTask *task;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                    "test-client.db", finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  client = homeserver_client_new ();
+  client->cm_enc = cm_enc_new (NULL, NULL, NULL);
+  cm_enc_set_details (client->cm_enc, cm_client_get_user_id (client),
+                      cm_client_get_device_id (client));
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_client_async (db, client, g_strdup ("pickle"), finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  room = cm_room_new ("!some-room-id:example.org");
+  cm_room_set_client (room, client);
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_room_async (db, client, room, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  /* Device keys of an other user, signed by the device */
+  bob_id = g_ref_string_new_intern ("@bob:example.org");
+  bob_enc = cm_enc_new (NULL, NULL, NULL);
+  cm_enc_set_details (bob_enc, bob_id, "BOBDEVICE");
+  json_str = cm_enc_get_device_keys_json (bob_enc);
+  root = cm_utils_string_to_json_object (json_str);
+  keys = cm_utils_json_object_get_object (root, "device_keys");
+  g_assert_nonnull (keys);
+  devices = json_object_new ();
+  json_object_set_object_member (devices, "BOBDEVICE", json_object_ref (keys));
+
+  member = cm_room_member_new (bob_id);
+  cm_user_set_client (CM_USER (member), client);
+  added = g_ptr_array_new_with_free_func (g_object_unref);
+  cm_user_set_devices (CM_USER (member), devices, FALSE, added, NULL);
+  g_assert_cmpuint (added->len, ==, 1);
+  hash = cm_device_get_key_hash (added->pdata[0]);
+  g_assert_nonnull (hash);
+
+  /* The hash saved after a key query is kept when saving members */
+  cm_db_update_user_devices (db, client, CM_USER (member), added, NULL, TRUE);
+  members = g_ptr_array_new ();
+  g_ptr_array_add (members, member);
+  cm_db_add_room_members (db, room, members);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_load_client_async (db, client, "DEADBEAF", load_client_cb, task);
+  wait_for_task (task);
+  hashes = g_object_get_data (G_OBJECT (task), "device-key-hashes");
+  g_assert_nonnull (hashes);
+  g_assert_cmpuint (hashes->len, ==, 3);
+  g_assert_cmpstr (hashes->pdata[0], ==, "@bob:example.org");
+  g_assert_cmpstr (hashes->pdata[1], ==, "BOBDEVICE");
+  g_assert_cmpstr (hashes->pdata[2], ==, hash);
+  g_clear_object (&task);
+
+  /* And the device keys are kept when saving the hash */
+  cm_db_update_user_devices (db, client, CM_USER (member), added, NULL, TRUE);
+  g_clear_pointer (&json_str, g_free);
+  g_clear_pointer (&root, json_object_unref);
+  json_str = db_get_user_device_json ("BOBDEVICE");
+  root = cm_utils_string_to_json_object (json_str);
+  g_assert_cmpstr (cm_utils_json_object_get_string (root, "device_id"), ==, "BOBDEVICE");
+  keys = cm_utils_json_object_get_object (root, "local");
+  g_assert_cmpstr (cm_utils_json_object_get_string (keys, "key_hash"), ==, hash);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (db, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+}
+
+static void
+test_cm_client_homeserver_cache_validity (void)
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(JsonObject) cache = NULL;
+  g_autoptr(CmClient) client = NULL;
+  JsonObject *response;
+  JsonArray *versions;
+  const char *uri;
+  gint64 now;
+
+  server = mock_server_new (NULL);
+  uri = mock_server_get_uri (server);
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  client = homeserver_client_new ();
+
+  /* Expired */
+  cache = homeserver_cache_new (uri, now - HOMESERVER_CACHE_TTL - 60);
+  client_restore_homeserver_cache (client, cache);
+  g_assert_null (cm_client_get_homeserver (client));
+  g_assert_false (client->homeserver_verified);
+  g_clear_pointer (&cache, json_object_unref);
+
+  /* Checked in the future, the clock has gone backwards */
+  cache = homeserver_cache_new (uri, now + 60 * 60);
+  client_restore_homeserver_cache (client, cache);
+  g_assert_null (cm_client_get_homeserver (client));
+  g_assert_false (client->homeserver_verified);
+  g_clear_pointer (&cache, json_object_unref);
+
+  /* A different homeserver is known from the secrets */
+  g_assert_true (cm_client_set_homeserver (client, "http://example.org"));
+  cache = homeserver_cache_new (uri, now - 60);
+  client_restore_homeserver_cache (client, cache);
+  g_assert_cmpstr (cm_client_get_homeserver (client), ==, "http://example.org");
+  g_assert_false (client->homeserver_verified);
+  g_assert_null (cm_client_get_homeserver_cache (client));
+  g_clear_object (&client);
+
+  /* The server no longer supports any version we do */
+  versions = json_array_new ();
+  json_array_add_string_element (versions, "r0.4.0");
+  response = json_object_new ();
+  json_object_set_array_member (response, "versions", versions);
+  mock_server_set_response (server, "/_matrix/client/versions", response);
+
+  client = homeserver_client_new ();
+  client_restore_homeserver_cache (client, cache);
+  g_assert_cmpstr (cm_client_get_homeserver (client), ==, uri);
+  g_assert_true (client->homeserver_verified);
+  g_assert_cmpint (client->homeserver_checked, ==, now - 60);
+
+  g_test_expect_message ("cm-client", G_LOG_LEVEL_WARNING, "*is no longer supported*");
+
+  while (client->homeserver_verified)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_test_assert_expected_messages ();
+  g_assert_cmpint (client->homeserver_checked, ==, 0);
+  g_assert_null (cm_client_get_homeserver_cache (client));
+}
+
+typedef struct {
+  guint   n_calls;
+  goffset current;
+  goffset total;
+} MediaProgress;
+
+static void
+media_progress_cb (goffset  current,
+                   goffset  total,
+                   gpointer user_data)
+{
+  MediaProgress *progress = user_data;
+
+  g_assert_cmpint (current, >=, progress->current);
+  progress->n_calls++;
+  progress->current = current;
+  progress->total = total;
+}
+
+static void
+media_cache_file_cb (GObject      *object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  GTask *task = user_data;
+
+  g_assert_true (G_IS_TASK (task));
+
+  file = cm_media_cache_get_file_finish (CM_MEDIA_CACHE (object), result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (file);
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+test_cm_client_media_progress (void)
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(CmMediaCache) cache = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(CmDb) db = NULL;
+  g_autoptr(GTask) task_a = NULL;
+  g_autoptr(GTask) task_b = NULL;
+  g_autofree char *file_path = NULL;
+  MediaProgress progress_a = { 0 }, progress_b = { 0 };
+  GPtrArray *requests;
+  GStatBuf st;
+  GTask *task;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+  file_path = g_test_build_filename (G_TEST_BUILT, "media-progress", NULL);
+  g_remove (file_path);
+  server = mock_server_new (NULL);
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                    "test-client.db", finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  client = homeserver_client_new ();
+  client->cm_enc = cm_enc_new (db, NULL, NULL);
+  g_assert_true (cm_client_set_homeserver (client, mock_server_get_uri (server)));
+  cache = cm_media_cache_new (db);
+
+  /* Both the request that started the download and the one
+   * that joined it get the progress */
+  task_a = g_task_new (NULL, NULL, NULL, NULL);
+  cm_media_cache_get_file_async (cache, client, "mxc://example.org/progress",
+                                 g_strdup (file_path), CM_TRANSFER_PRIORITY_DOWNLOAD,
+                                 NULL, media_progress_cb, &progress_a,
+                                 media_cache_file_cb, task_a);
+  task_b = g_task_new (NULL, NULL, NULL, NULL);
+  cm_media_cache_get_file_async (cache, client, "mxc://example.org/progress",
+                                 g_strdup (file_path), CM_TRANSFER_PRIORITY_DOWNLOAD,
+                                 NULL, media_progress_cb, &progress_b,
+                                 media_cache_file_cb, task_b);
+  wait_for_task (task_a);
+  wait_for_task (task_b);
+
+  g_assert_cmpint (g_stat (file_path, &st), ==, 0);
+  g_assert_cmpint (st.st_size, ==, MOCK_MEDIA_SIZE);
+  requests = mock_server_get_requests (server, "/_matrix/media/r0/download/example.org/progress");
+  g_assert_nonnull (requests);
+  g_assert_cmpuint (requests->len, ==, 1);
+
+  g_assert_cmpuint (progress_a.n_calls, >, 0);
+  g_assert_cmpint (progress_a.current, ==, MOCK_MEDIA_SIZE);
+  g_assert_cmpint (progress_a.total, ==, MOCK_MEDIA_SIZE);
+  g_assert_cmpuint (progress_b.n_calls, ==, progress_a.n_calls);
+  g_assert_cmpint (progress_b.current, ==, MOCK_MEDIA_SIZE);
+  g_assert_cmpint (progress_b.total, ==, MOCK_MEDIA_SIZE);
+
+  /* Files in cache are returned without downloading */
+  progress_a.n_calls = 0;
+  g_clear_object (&task_a);
+  task_a = g_task_new (NULL, NULL, NULL, NULL);
+  cm_media_cache_get_file_async (cache, client, "mxc://example.org/progress",
+                                 g_strdup (file_path), CM_TRANSFER_PRIORITY_DOWNLOAD,
+                                 NULL, media_progress_cb, &progress_a,
+                                 media_cache_file_cb, task_a);
+  wait_for_task (task_a);
+  g_assert_cmpuint (progress_a.n_calls, ==, 0);
+
+  g_remove (file_path);
+}
+
+static void
+test_cm_client_startup_stats (void)
+{
+  g_autoptr(CmClient) client = NULL;
+  guint64 total;
+
+  client = homeserver_client_new ();
+  cm_stats_reset (cm_stats_get_default ());
+
+  client_set_startup_phase (client, "startup/db-load");
+  g_usleep (1000);
+
+  /* The time stopped isn't accounted, but what was done before is */
+  cm_client_stop_sync (client);
+  g_assert_null (client->startup_phase);
+  g_assert_cmpuint (stats_get_time_sum ("startup/db-load"), >=, 1000);
+  g_usleep (50000);
+
+  client_set_startup_phase (client, "startup/login");
+  g_usleep (1000);
+  client_set_startup_phase (client, NULL);
+  g_assert_true (client->startup_done);
+
+  total = stats_get_time_sum ("startup/total");
+  g_assert_cmpuint (total, ==, stats_get_time_sum ("startup/db-load") +
+                    stats_get_time_sum ("startup/login"));
+  g_assert_cmpuint (total, <, 50000);
+}
+
+static void
+room_lists_slot_cb (gpointer object)
+{
+  g_assert_not_reached ();
+}
+
+static void
+client_room_lists (gboolean direct_first)
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(CmDb) db = NULL;
+  const char *first_path, *last_path;
+  gboolean *first_loaded, *last_loaded;
+  JsonObject *response;
+  GPtrArray *requests;
+  CmRoom *room;
+  GTask *task;
+  guint n_calls = 0;
+  int slot_holders[MAX_INITIAL_SYNCS];
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+  server = mock_server_new (NULL);
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                    "test-client.db", finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+
+  response = cm_utils_string_to_json_object ("{\"joined_rooms\": [\"!dm:example.org\"]}");
+  mock_server_set_response (server, JOINED_ROOMS_PATH, response);
+  response = cm_utils_string_to_json_object ("{\"@bob:example.org\": [\"!dm:example.org\"]}");
+  mock_server_set_response (server, DIRECT_ROOMS_PATH, response);
+
+  /* Both are requested at once, have the last one finish well after */
+  first_path = direct_first ? DIRECT_ROOMS_PATH : JOINED_ROOMS_PATH;
+  last_path = direct_first ? JOINED_ROOMS_PATH : DIRECT_ROOMS_PATH;
+  mock_server_delay_response (server, last_path, 200);
+
+  /* A logged in client with everything but the room lists */
+  client = homeserver_client_new ();
+  cm_client_set_db (client, db);
+  g_assert_true (cm_client_set_homeserver (client, mock_server_get_uri (server)));
+  client->homeserver_verified = TRUE;
+  cm_net_set_access_token (client->cm_net, "token");
+  client->cm_enc = cm_enc_new (db, NULL, NULL);
+  client->db_loaded = TRUE;
+  client->db_migrated = TRUE;
+  client->filter_id = g_strdup ("1");
+  cm_client_set_sync_callback (client, sync_cb, &n_calls, NULL);
+
+  first_loaded = direct_first ? &client->direct_room_list_loaded : &client->room_list_loaded;
+  last_loaded = direct_first ? &client->room_list_loaded : &client->direct_room_list_loaded;
+
+  /* Keep the initial sync from starting once the lists are done */
+  for (guint i = 0; i < MAX_INITIAL_SYNCS; i++)
+    g_assert_true (cm_sync_scheduler_acquire_slot (client->sync_scheduler, &slot_holders[i],
+                                                   room_lists_slot_cb));
+
+  matrix_start_sync (client, NULL);
+  g_assert_true (client->room_list_loading);
+  g_assert_true (client->direct_room_list_loading);
+  g_assert_cmpstr (client->startup_phase, ==, "startup/room-lists");
+
+  while (!*first_loaded)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The sync continues only once both are done */
+  g_assert_false (*last_loaded);
+  g_assert_cmpstr (client->startup_phase, ==, "startup/room-lists");
+
+  while (!*last_loaded)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (client->startup_phase, ==, "startup/sync-wait");
+  g_assert_cmpuint (n_calls, ==, 0);
+
+  /* The room is joined and direct, whichever list came first */
+  g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (client->joined_rooms)), ==, 1);
+  room = g_list_model_get_item (G_LIST_MODEL (client->joined_rooms), 0);
+  g_assert_cmpstr (cm_room_get_id (room), ==, "!dm:example.org");
+  g_assert_true (cm_room_is_direct (room));
+  g_object_unref (room);
+  g_assert_cmpuint (g_hash_table_size (client->direct_rooms), ==, 0);
+
+  requests = mock_server_get_requests (server, first_path);
+  g_assert_nonnull (requests);
+  g_assert_cmpuint (requests->len, ==, 1);
+  requests = mock_server_get_requests (server, last_path);
+  g_assert_nonnull (requests);
+  g_assert_cmpuint (requests->len, ==, 1);
+
+  cm_client_stop_sync (client);
+  for (guint i = 0; i < MAX_INITIAL_SYNCS; i++)
+    cm_sync_scheduler_remove (client->sync_scheduler, &slot_holders[i]);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (db, finish_bool_cb, task);
+  wait_for_task (task);
+  g_clear_object (&task);
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-client.db", NULL));
+}
+
+static void
+test_cm_client_room_lists_joined_first (void)
+{
+  client_room_lists (FALSE);
+}
+
+static void
+test_cm_client_room_lists_direct_first (void)
+{
+  client_room_lists (TRUE);
+}
+
 int
 main (int   argc,
       char *argv[])
 {
   g_test_init (&argc, &argv, NULL);
 
+  cm_init (TRUE);
+
   g_test_add_func ("/cm-client/new", test_cm_client_new);
+  g_test_add_func ("/cm-client/batch-sync", test_cm_client_batch_sync);
+  g_test_add_func ("/cm-client/homeserver-cache/db", test_cm_client_homeserver_cache_db);
+  g_test_add_func ("/cm-client/homeserver-cache/validity", test_cm_client_homeserver_cache_validity);
+  g_test_add_func ("/cm-client/device-key-hash/db", test_cm_client_device_key_hash_db);
+  g_test_add_func ("/cm-client/media-cache/progress", test_cm_client_media_progress);
+  g_test_add_func ("/cm-client/startup-stats", test_cm_client_startup_stats);
+  g_test_add_func ("/cm-client/room-lists/joined-first", test_cm_client_room_lists_joined_first);
+  g_test_add_func ("/cm-client/room-lists/direct-first", test_cm_client_room_lists_direct_first);
 
   return g_test_run ();
 }
@@ -20,6 +20,7 @@
 
 #include "cm-matrix.h"
 #include "cm-db-private.h"
+#include "events/cm-event-private.h"
 #include "cm-client.h"
 
 typedef struct _Data
@@ -144,6 +145,7 @@ add_matrix_account (CmDb       *db,
 static void
 test_cm_db_account (void)
 {
+  CmClient *client;
   GTask *task;
   CmDb *db;
   gboolean status;
@@ -178,9 +180,296 @@ test_cm_db_account (void)
   add_matrix_account (db, account_array, "@bob:example.org",
                       NULL, "XXAABBDD", FALSE);
 
+  /* Saving without pickle should keep the one in db */
+  client = account_array->pdata[2];
+  g_assert_cmpstr (cm_client_get_user_id (client), ==, "@alice:example.com");
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_client_async (db, client, NULL, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_clear_object (&task);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_load_client_async (db, client, "XXAABBDD", finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_assert_cmpstr (g_object_get_data (G_OBJECT (task), "pickle"), ==, "Some Pickle");
+  g_clear_object (&task);
+
+  /* Only the next batch can be saved for existing accounts */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_next_batch_async (db, client, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_clear_object (&task);
+
+  client = cm_client_new ();
+  g_object_set_data (G_OBJECT (client), "no-save", GINT_TO_POINTER (TRUE));
+  cm_client_set_user_id (client, "@carol:example.org");
+  cm_client_set_device_id (client, "XXAABBDD");
+  g_ptr_array_add (account_array, client);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_save_next_batch_async (db, client, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (g_task_propagate_boolean (task, NULL));
+  g_clear_object (&task);
+
   g_ptr_array_unref (account_array);
 }
 
+static void
+finish_pointer_cb (GObject      *object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  gpointer data;
+
+  g_assert_true (G_IS_TASK (task));
+
+  data = g_task_propagate_pointer (G_TASK (result), &error);
+  g_assert_no_error (error);
+
+  g_task_return_pointer (task, data, g_free);
+}
+
+static char *
+db_lookup_media (CmDb       *db,
+                 const char *uri)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_lookup_media_async (db, uri, finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_task_propagate_pointer (task, NULL);
+}
+
+static char *
+db_add_media (CmDb       *db,
+              const char *uri,
+              const char *name,
+              gsize       size,
+              goffset     max_size)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autofree char *content = NULL;
+  char *file_path;
+
+  file_path = g_test_build_filename (G_TEST_BUILT, name, NULL);
+  content = g_malloc0 (size);
+  g_assert_true (g_file_set_contents (file_path, content, size, NULL));
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_add_media_async (db, uri, file_path, size, NULL, FALSE,
+                         max_size, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+
+  return file_path;
+}
+
+static char *
+db_add_media_part (CmDb       *db,
+                   const char *uri,
+                   const char *name,
+                   gsize       size,
+                   goffset     max_size)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autofree char *content = NULL;
+  char *part_path;
+
+  part_path = g_test_build_filename (G_TEST_BUILT, name, NULL);
+  content = g_malloc0 (size);
+  g_assert_true (g_file_set_contents (part_path, content, size, NULL));
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_add_media_part_async (db, uri, part_path, size, max_size, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+
+  return part_path;
+}
+
+static void
+db_open_close (CmDb     *db,
+               gboolean  open)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+
+  if (open)
+    cm_db_open_async (db, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                      "test-matrix.db", finish_bool_cb, task);
+  else
+    cm_db_close_async (db, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+}
+
+static void
+test_cm_db_media_cache (void)
+{
+  g_autofree char *path_a = NULL;
+  g_autofree char *path_b = NULL;
+  g_autofree char *path_c = NULL;
+  g_autofree char *path = NULL;
+  GTask *task;
+  CmDb *db;
+  gboolean status;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-matrix.db", NULL));
+
+  db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (db, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                    "test-matrix.db", finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  status = g_task_propagate_boolean (task, NULL);
+  g_assert_finalize_object (task);
+  g_assert_true (status);
+
+  g_assert_null (db_lookup_media (db, "mxc://example.org/a"));
+
+  path_a = db_add_media (db, "mxc://example.org/a", "media-a", 100, 250);
+  path = db_lookup_media (db, "mxc://example.org/a");
+  g_assert_cmpstr (path, ==, path_a);
+  g_clear_pointer (&path, g_free);
+
+  path_b = db_add_media (db, "mxc://example.org/b", "media-b", 100, 250);
+
+  /* 'a' is the least recently used, so it should be evicted */
+  path_c = db_add_media (db, "mxc://example.org/c", "media-c", 100, 250);
+  g_assert_null (db_lookup_media (db, "mxc://example.org/a"));
+  g_assert_false (g_file_test (path_a, G_FILE_TEST_EXISTS));
+
+  path = db_lookup_media (db, "mxc://example.org/b");
+  g_assert_cmpstr (path, ==, path_b);
+  g_clear_pointer (&path, g_free);
+
+  /* Files changed outside should be dropped from cache */
+  g_assert_true (g_file_set_contents (path_c, "changed", -1, NULL));
+  g_assert_null (db_lookup_media (db, "mxc://example.org/c"));
+  g_assert_false (g_file_test (path_c, G_FILE_TEST_EXISTS));
+
+  g_remove (path_b);
+  g_assert_null (db_lookup_media (db, "mxc://example.org/b"));
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (db, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  status = g_task_propagate_boolean (task, NULL);
+  g_assert_true (status);
+  g_assert_finalize_object (task);
+  g_object_unref (db);
+}
+
+static void
+test_cm_db_media_cache_parts (void)
+{
+  g_autofree char *part_p = NULL;
+  g_autofree char *part_q = NULL;
+  g_autofree char *path_a = NULL;
+  g_autofree char *path_b = NULL;
+  g_autofree char *path_q = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *db_path = NULL;
+  sqlite3 *sqlite_db;
+  CmDb *db;
+  int status;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-matrix.db", NULL));
+
+  db = cm_db_new ();
+  db_open_close (db, TRUE);
+
+  /* Partial files are never returned */
+  part_p = db_add_media_part (db, "mxc://example.org/p", "media-p.part", 100, 250);
+  g_assert_null (db_lookup_media (db, "mxc://example.org/p"));
+  g_assert_true (g_file_test (part_p, G_FILE_TEST_EXISTS));
+
+  /* but count towards the budget, and are evicted like other files */
+  path_a = db_add_media (db, "mxc://example.org/a", "media-a", 100, 250);
+  g_assert_true (g_file_test (part_p, G_FILE_TEST_EXISTS));
+  path_b = db_add_media (db, "mxc://example.org/b", "media-b", 100, 250);
+  g_assert_false (g_file_test (part_p, G_FILE_TEST_EXISTS));
+
+  path = db_lookup_media (db, "mxc://example.org/a");
+  g_assert_cmpstr (path, ==, path_a);
+  g_clear_pointer (&path, g_free);
+
+  /* The complete file replaces the partial one */
+  part_q = db_add_media_part (db, "mxc://example.org/q", "media-q.part", 50, 0);
+  g_assert_null (db_lookup_media (db, "mxc://example.org/q"));
+  path_q = db_add_media (db, "mxc://example.org/q", "media-q", 100, 0);
+  path = db_lookup_media (db, "mxc://example.org/q");
+  g_assert_cmpstr (path, ==, path_q);
+  g_clear_pointer (&path, g_free);
+  g_remove (part_q);
+
+  /* Partial files not resumed for long are removed on open */
+  g_clear_pointer (&part_p, g_free);
+  part_p = db_add_media_part (db, "mxc://example.org/p", "media-p.part", 100, 0);
+  db_open_close (db, FALSE);
+
+  db_path = g_test_build_filename (G_TEST_BUILT, "test-matrix.db", NULL);
+  status = sqlite3_open (db_path, &sqlite_db);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  status = sqlite3_exec (sqlite_db, "UPDATE media_cache SET last_access=0;",
+                         NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  sqlite3_close (sqlite_db);
+
+  db_open_close (db, TRUE);
+  g_assert_false (g_file_test (part_p, G_FILE_TEST_EXISTS));
+  g_assert_true (g_file_test (path_q, G_FILE_TEST_EXISTS));
+
+  path = db_lookup_media (db, "mxc://example.org/q");
+  g_assert_cmpstr (path, ==, path_q);
+  g_clear_pointer (&path, g_free);
+
+  db_open_close (db, FALSE);
+  g_object_unref (db);
+
+  g_remove (path_a);
+  g_remove (path_b);
+  g_remove (path_q);
+}
+
 static void
 test_cm_db_new (void)
 {
@@ -419,7 +708,7 @@ test_cm_db_migration (void)
     GTask *task;
     int status;
 
-    if (g_str_has_suffix (name, "v2.sql"))
+    if (g_str_has_suffix (name, "v4.sql"))
       continue;
 
     g_assert_true (g_str_has_suffix (name, "sql"));
@@ -430,7 +719,7 @@ test_cm_db_migration (void)
     sqlite3_close (db);
 
     /* Export migrated version sql file */
-    expected_file = g_strdelimit (g_strdup (name), "01", '2');
+    expected_file = g_strdelimit (g_strdup (name), "0123", '4');
     matrix_export_sql_file (path, expected_file, &db);
 
     /* Open history with old db, which will result in db migration */
@@ -478,6 +767,112 @@ test_cm_db_migration (void)
   }
 }
 
+static void
+db_add_room_event (sqlite3    *db,
+                   int         id,
+                   CmEventType type,
+                   const char *event_id,
+                   const char *json_str)
+{
+  g_autofree char *json_data = NULL;
+  sqlite3_stmt *stmt;
+  int status;
+
+  json_data = g_strconcat ("{\"json\": ", json_str, "}", NULL);
+  status = sqlite3_prepare_v2 (db,
+                               "INSERT INTO room_events(id,sorted_id,room_id,sender_id,"
+                               "event_type,event_uid,origin_server_ts,json_data) "
+                               "VALUES(?1,?1,8,1,?2,?3,1650000000000,?4)",
+                               -1, &stmt, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  sqlite3_bind_int (stmt, 1, id);
+  sqlite3_bind_int (stmt, 2, type);
+  sqlite3_bind_text (stmt, 3, event_id, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text (stmt, 4, json_data, -1, SQLITE_TRANSIENT);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_DONE);
+  sqlite3_finalize (stmt);
+}
+
+static void
+test_cm_db_migration_relations (void)
+{
+  g_autofree char *path = NULL;
+  CmDb *cm_db;
+  sqlite3 *db = NULL;
+  GTask *task;
+  int status;
+
+  path = g_test_build_filename (G_TEST_DIST, "cm-db", NULL);
+  matrix_export_sql_file (path, "content-v3.sql", &db);
+
+  status = sqlite3_exec (db, "INSERT INTO room_members VALUES(1, 8, 2, 0, NULL);",
+                         NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  db_add_room_event (db, 1, CM_M_ROOM_MESSAGE, "$orig:example.net",
+                     "{\"type\": \"m.room.message\", \"event_id\": \"$orig:example.net\","
+                     "\"sender\": \"@alice:example.net\", \"origin_server_ts\": 1650000000000,"
+                     "\"content\": {\"msgtype\": \"m.text\", \"body\": \"hi\"}}");
+  db_add_room_event (db, 2, CM_M_ROOM_MESSAGE, "$edit:example.net",
+                     "{\"type\": \"m.room.message\", \"event_id\": \"$edit:example.net\","
+                     "\"sender\": \"@alice:example.net\", \"origin_server_ts\": 1650000001000,"
+                     "\"content\": {\"msgtype\": \"m.text\", \"body\": \"* hello\","
+                     "\"m.relates_to\": {\"rel_type\": \"m.replace\", \"event_id\": \"$orig:example.net\"}}}");
+  db_add_room_event (db, 3, CM_M_REACTION, "$react1:example.net",
+                     "{\"type\": \"m.reaction\", \"event_id\": \"$react1:example.net\","
+                     "\"sender\": \"@alice:example.net\", \"origin_server_ts\": 1650000002000,"
+                     "\"content\": {\"m.relates_to\": {\"rel_type\": \"m.annotation\","
+                     "\"event_id\": \"$orig:example.net\", \"key\": \"👍\"}}}");
+  db_add_room_event (db, 4, CM_M_REACTION, "$react2:example.net",
+                     "{\"type\": \"m.reaction\", \"event_id\": \"$react2:example.net\","
+                     "\"sender\": \"@alice:example.net\", \"origin_server_ts\": 1650000003000,"
+                     "\"content\": {\"m.relates_to\": {\"rel_type\": \"m.annotation\","
+                     "\"event_id\": \"$orig:example.net\", \"key\": \"🎉\"}}}");
+  db_add_room_event (db, 5, CM_M_ROOM_REDACTION, "$redact:example.net",
+                     "{\"type\": \"m.room.redaction\", \"event_id\": \"$redact:example.net\","
+                     "\"sender\": \"@alice:example.net\", \"origin_server_ts\": 1650000004000,"
+                     "\"redacts\": \"$react2:example.net\", \"content\": {}}");
+  sqlite3_close (db);
+
+  /* Opening the db migrates it to v4, which adds the existing relations */
+  cm_db = cm_db_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_open_async (cm_db, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                    "content-v3.db", finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_assert_finalize_object (task);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_db_close_async (cm_db, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_assert_finalize_object (task);
+  g_object_unref (cm_db);
+
+  g_free (path);
+  path = g_test_build_filename (G_TEST_BUILT, "content-v3.db", NULL);
+  status = sqlite3_open (path, &db);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  g_assert_cmpint (db_get_int (db, "PRAGMA user_version;"), ==, 4);
+  g_assert_cmpint (db_get_int (db, "SELECT COUNT(*) FROM room_relations;"), ==, 2);
+  g_assert_cmpint (db_get_int (db, "SELECT relation_type FROM room_relations "
+                                   "WHERE event_uid='$edit:example.net' "
+                                   "AND relates_to_uid='$orig:example.net' AND room_id=8;"),
+                   ==, CM_RELATION_REPLACE);
+  g_assert_cmpint (db_get_int (db, "SELECT relation_type FROM room_relations "
+                                   "WHERE event_uid='$react1:example.net' AND key='👍';"),
+                   ==, CM_RELATION_ANNOTATION);
+  sqlite3_close (db);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -495,6 +890,9 @@ main (int   argc,
   g_test_add_func ("/cm-db/new", test_cm_db_new);
   g_test_add_func ("/cm-db/account", test_cm_db_account);
   g_test_add_func ("/cm-db/migration", test_cm_db_migration);
+  g_test_add_func ("/cm-db/migration/relations", test_cm_db_migration_relations);
+  g_test_add_func ("/cm-db/media-cache", test_cm_db_media_cache);
+  g_test_add_func ("/cm-db/media-cache/parts", test_cm_db_media_cache_parts);
 
   return g_test_run ();
 }
@@ -18,11 +18,13 @@
 #include "cm-config.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <olm/olm.h>
 #include <sys/random.h>
 
 #include "cm-utils-private.h"
 #include "cm-enc-private.h"
+#include "cm-input-stream-private.h"
 
 typedef struct EncData {
   char *user_id;
@@ -157,6 +159,311 @@ test_cm_enc_new (void)
   }
 }
 
+static void
+test_cm_enc_verify_device_keys (void)
+{
+  g_autoptr(GRefString) user_id = NULL;
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(CmEnc) cm_enc = NULL;
+  g_autoptr(CmEnc) cm_enc2 = NULL;
+  g_autofree char *json_str = NULL;
+  g_autofree char *hash = NULL;
+  g_autofree char *hash2 = NULL;
+  JsonObject *object, *child;
+  const char *ed_key;
+
+  cm_enc = cm_enc_new (NULL, enc[0].olm2_pickle, enc[0].pickle_key);
+  user_id = g_ref_string_new_intern (enc[0].user_id);
+  cm_enc_set_details (cm_enc, user_id, enc[0].device_id);
+  ed_key = cm_enc_get_ed25519_key (cm_enc);
+
+  json_str = cm_enc_get_device_keys_json (cm_enc);
+  root = cm_utils_string_to_json_object (json_str);
+  object = cm_utils_json_object_get_object (root, "device_keys");
+  g_assert_nonnull (object);
+
+  g_assert_true (cm_enc_verify_device_keys (cm_enc, object, enc[0].user_id,
+                                            enc[0].device_id, ed_key, &hash));
+  g_assert_nonnull (hash);
+  /* Cached, and the hash doesn't change */
+  g_assert_true (cm_enc_verify_device_keys (cm_enc, object, enc[0].user_id,
+                                            enc[0].device_id, ed_key, &hash2));
+  g_assert_cmpstr (hash, ==, hash2);
+  g_clear_pointer (&hash2, g_free);
+
+  /* Unsigned content doesn't change the hash */
+  child = json_object_new ();
+  json_object_set_string_member (child, "device_display_name", "Neo's phone");
+  json_object_set_object_member (object, "unsigned", child);
+  g_assert_true (cm_enc_verify_device_keys (cm_enc, object, enc[0].user_id,
+                                            enc[0].device_id, ed_key, &hash2));
+  g_assert_cmpstr (hash, ==, hash2);
+  g_clear_pointer (&hash2, g_free);
+
+  /* A hash from an earlier session, the ed25519 key is part of the hash */
+  cm_enc2 = cm_enc_new (NULL, enc[1].olm2_pickle, enc[1].pickle_key);
+  g_assert_false (cm_enc_verify_device_keys (cm_enc2, object, enc[0].user_id,
+                                             enc[0].device_id, enc[1].ed_key, NULL));
+  cm_enc_add_verified_device_keys (cm_enc2, enc[0].user_id, enc[0].device_id, hash);
+  g_assert_false (cm_enc_verify_device_keys (cm_enc2, object, enc[0].user_id,
+                                             enc[0].device_id, enc[1].ed_key, NULL));
+  g_assert_true (cm_enc_verify_device_keys (cm_enc2, object, enc[0].user_id,
+                                            enc[0].device_id, ed_key, &hash2));
+  g_assert_cmpstr (hash, ==, hash2);
+
+  /* Changed keys are verified again */
+  child = cm_utils_json_object_get_object (object, "keys");
+  json_object_set_string_member (child, "curve25519:JOJOAREBZY", enc[1].curve_key);
+  g_assert_false (cm_enc_verify_device_keys (cm_enc, object, enc[0].user_id,
+                                             enc[0].device_id, ed_key, NULL));
+  g_assert_false (cm_enc_verify_device_keys (cm_enc2, object, enc[0].user_id,
+                                             enc[0].device_id, ed_key, NULL));
+}
+
+static void
+create_one_time_keys_cb (GObject      *obj,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  char **keys = user_data;
+
+  *keys = cm_enc_create_one_time_keys_finish (CM_ENC (obj), result, &error);
+  g_assert_no_error (error);
+}
+
+static char *
+create_one_time_keys (CmEnc  *cm_enc,
+                      size_t  count)
+{
+  char *keys = (char *)"";
+
+  cm_enc_create_one_time_keys_async (cm_enc, count, NULL,
+                                     create_one_time_keys_cb, &keys);
+
+  while (keys && !*keys)
+    g_main_context_iteration (NULL, TRUE);
+
+  return keys;
+}
+
+static void
+test_cm_enc_one_time_keys_async (void)
+{
+  g_autoptr(GRefString) user_id = NULL;
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(CmEnc) cm_enc = NULL;
+  g_autoptr(GList) members = NULL;
+  g_autofree char *keys = NULL;
+  JsonObject *object;
+  guint generation;
+
+  cm_enc = cm_enc_new (NULL, enc[0].olm2_pickle, enc[0].pickle_key);
+  g_assert (CM_IS_ENC (cm_enc));
+  user_id = g_ref_string_new_intern (enc[0].user_id);
+  cm_enc_set_details (cm_enc, user_id, enc[0].device_id);
+  generation = cm_enc_get_account_generation (cm_enc);
+
+  /* The 3 unpublished keys in the pickle are included */
+  keys = create_one_time_keys (cm_enc, 5);
+  g_assert_nonnull (keys);
+  g_assert_cmpuint (cm_enc_get_account_generation (cm_enc), >, generation);
+
+  root = cm_utils_string_to_json_object (keys);
+  object = cm_utils_json_object_get_object (root, "one_time_keys");
+  g_assert_nonnull (object);
+  g_assert_cmpint (json_object_get_size (object), ==, 8);
+
+  members = json_object_get_members (object);
+  g_assert_true (g_str_has_prefix (members->data, "signed_curve25519:"));
+  object = cm_utils_json_object_get_object (object, members->data);
+  g_assert_nonnull (object);
+  g_assert_true (cm_enc_verify (cm_enc, object, enc[0].user_id,
+                                enc[0].device_id, enc[0].ed_key));
+  g_clear_pointer (&keys, g_free);
+
+  /* Only sign the existing keys, there are none after publishing */
+  cm_enc_publish_one_time_keys (cm_enc);
+  generation = cm_enc_get_account_generation (cm_enc);
+  keys = create_one_time_keys (cm_enc, 0);
+  g_assert_null (keys);
+  g_assert_cmpuint (cm_enc_get_account_generation (cm_enc), ==, generation);
+}
+
+static GBytes *
+read_stream_to_bytes (GInputStream *stream)
+{
+  g_autoptr(GOutputStream) out = NULL;
+  g_autoptr(GError) error = NULL;
+
+  out = g_memory_output_stream_new_resizable ();
+  g_output_stream_splice (out, stream, G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                          NULL, &error);
+  g_assert_no_error (error);
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
+}
+
+static void
+test_cm_enc_input_stream_offset (void)
+{
+  g_autoptr(CmInputStream) stream = NULL;
+  g_autoptr(JsonObject) json = NULL;
+  g_autoptr(GBytes) encrypted = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree char *path = NULL;
+  CmEncFileInfo file_info = { 0 };
+  const guchar *enc_data;
+  guchar plain[1000];
+  gsize enc_len;
+  const goffset offsets[] = { 0, 1, 5, 15, 16, 17, 33, 512, 999, 1000 };
+
+  for (guint i = 0; i < G_N_ELEMENTS (plain); i++)
+    plain[i] = g_random_int_range (0, 256);
+
+  path = g_test_build_filename (G_TEST_BUILT, "enc-offset.bin", NULL);
+  g_assert_true (g_file_set_contents (path, (char *)plain, sizeof (plain), NULL));
+  file = g_file_new_for_path (path);
+
+  stream = cm_input_stream_new_from_file (file, TRUE, NULL, &error);
+  g_assert_no_error (error);
+  g_object_set_data_full (G_OBJECT (stream), "uri", g_strdup ("mxc://example.org/abc"), g_free);
+  encrypted = read_stream_to_bytes (G_INPUT_STREAM (stream));
+  json = cm_input_stream_get_file_json (stream);
+  g_assert_nonnull (json);
+  g_clear_object (&stream);
+  g_remove (path);
+
+  enc_data = g_bytes_get_data (encrypted, &enc_len);
+  g_assert_cmpint (enc_len, ==, sizeof (plain));
+
+  file_info.mxc_uri = (char *)"mxc://example.org/abc";
+  file_info.aes_iv_base64 = (char *)cm_utils_json_object_get_string (json, "iv");
+  file_info.aes_key_base64 = (char *)cm_utils_json_object_get_string (cm_utils_json_object_get_object (json, "key"), "k");
+  file_info.sha256_base64 = (char *)cm_utils_json_object_get_string (cm_utils_json_object_get_object (json, "hashes"), "sha256");
+
+  for (guint i = 0; i < G_N_ELEMENTS (offsets); i++)
+    {
+      g_autoptr(GInputStream) base = NULL;
+      g_autoptr(GInputStream) prefix = NULL;
+      g_autoptr(GBytes) decrypted = NULL;
+      g_autofree char *sha256 = NULL;
+      goffset offset = offsets[i];
+
+      /* Seek to the offset, no checksum available */
+      base = g_memory_input_stream_new_from_data (enc_data + offset, enc_len - offset, NULL);
+      stream = cm_input_stream_new (base);
+      cm_input_stream_set_file_enc (stream, &file_info);
+      cm_input_stream_set_offset (stream, offset);
+      decrypted = read_stream_to_bytes (G_INPUT_STREAM (stream));
+      g_assert_cmpmem (g_bytes_get_data (decrypted, NULL), g_bytes_get_size (decrypted),
+                       plain + offset, sizeof (plain) - offset);
+      sha256 = cm_input_stream_get_sha256 (stream);
+      if (offset)
+        g_assert_null (sha256);
+      g_clear_pointer (&sha256, g_free);
+      g_clear_pointer (&decrypted, g_bytes_unref);
+      g_clear_object (&stream);
+      g_clear_object (&base);
+
+      /* Resume with the already decrypted content, checksum should match */
+      base = g_memory_input_stream_new_from_data (enc_data + offset, enc_len - offset, NULL);
+      prefix = g_memory_input_stream_new_from_data (plain, offset, NULL);
+      stream = cm_input_stream_new (base);
+      cm_input_stream_set_file_enc (stream, &file_info);
+      g_assert_cmpint (cm_input_stream_resume_with_prefix (stream, prefix, NULL, &error), ==, offset);
+      g_assert_no_error (error);
+      decrypted = read_stream_to_bytes (G_INPUT_STREAM (stream));
+      g_assert_cmpmem (g_bytes_get_data (decrypted, NULL), g_bytes_get_size (decrypted),
+                       plain + offset, sizeof (plain) - offset);
+      sha256 = cm_input_stream_get_sha256 (stream);
+      g_assert_cmpstr (sha256, ==, file_info.sha256_base64);
+      g_clear_object (&stream);
+    }
+}
+
+static GBytes *
+read_stream_in_blocks (GInputStream *stream,
+                       gsize         block_size)
+{
+  g_autoptr(GByteArray) content = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *buffer = NULL;
+  gssize n_read;
+
+  content = g_byte_array_new ();
+  buffer = g_malloc (block_size);
+
+  while ((n_read = g_input_stream_read (stream, buffer, block_size, NULL, &error)) > 0)
+    g_byte_array_append (content, buffer, n_read);
+
+  g_assert_no_error (error);
+
+  return g_byte_array_free_to_bytes (g_steal_pointer (&content));
+}
+
+static void
+test_cm_enc_input_stream_large (void)
+{
+  g_autoptr(CmInputStream) stream = NULL;
+  g_autoptr(GInputStream) base = NULL;
+  g_autoptr(JsonObject) json = NULL;
+  g_autoptr(GBytes) encrypted = NULL;
+  g_autoptr(GBytes) decrypted = NULL;
+  g_autoptr(GChecksum) checksum = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree guchar *plain = NULL;
+  g_autofree guchar *digest = NULL;
+  g_autofree char *expected = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *sha256 = NULL;
+  CmEncFileInfo file_info = { 0 };
+  gsize size = 3 * 1024 * 1024 + 7, digest_len = 32;
+
+  /* Large enough to be hashed in the thread */
+  plain = g_malloc (size);
+  for (gsize i = 0; i < size; i++)
+    plain[i] = g_random_int_range (0, 256);
+
+  path = g_test_build_filename (G_TEST_BUILT, "enc-large.bin", NULL);
+  g_assert_true (g_file_set_contents (path, (char *)plain, size, NULL));
+  file = g_file_new_for_path (path);
+
+  stream = cm_input_stream_new_from_file (file, TRUE, NULL, &error);
+  g_assert_no_error (error);
+  g_object_set_data_full (G_OBJECT (stream), "uri", g_strdup ("mxc://example.org/abc"), g_free);
+  encrypted = read_stream_in_blocks (G_INPUT_STREAM (stream), 64 * 1024);
+  json = cm_input_stream_get_file_json (stream);
+  g_assert_nonnull (json);
+  g_clear_object (&stream);
+  g_remove (path);
+  g_assert_cmpint (g_bytes_get_size (encrypted), ==, size);
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, g_bytes_get_data (encrypted, NULL), size);
+  digest = g_malloc (digest_len);
+  g_checksum_get_digest (checksum, digest, &digest_len);
+  expected = g_base64_encode (digest, digest_len);
+  g_strdelimit (expected, "=", '\0');
+
+  file_info.mxc_uri = (char *)"mxc://example.org/abc";
+  file_info.aes_iv_base64 = (char *)cm_utils_json_object_get_string (json, "iv");
+  file_info.aes_key_base64 = (char *)cm_utils_json_object_get_string (cm_utils_json_object_get_object (json, "key"), "k");
+  file_info.sha256_base64 = (char *)cm_utils_json_object_get_string (cm_utils_json_object_get_object (json, "hashes"), "sha256");
+  g_assert_cmpstr (file_info.sha256_base64, ==, expected);
+
+  base = g_memory_input_stream_new_from_bytes (encrypted);
+  stream = cm_input_stream_new (base);
+  cm_input_stream_set_file_enc (stream, &file_info);
+  decrypted = read_stream_in_blocks (G_INPUT_STREAM (stream), 100 * 1024);
+  g_assert_cmpmem (g_bytes_get_data (decrypted, NULL), g_bytes_get_size (decrypted),
+                   plain, size);
+  sha256 = cm_input_stream_get_sha256 (stream);
+  g_assert_cmpstr (sha256, ==, expected);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -165,6 +472,10 @@ main (int   argc,
 
   g_test_add_func ("/matrix/enc/new", test_cm_enc_new);
   g_test_add_func ("/matrix/enc/verify", test_cm_enc_verify);
+  g_test_add_func ("/matrix/enc/verify-device-keys", test_cm_enc_verify_device_keys);
+  g_test_add_func ("/matrix/enc/one-time-keys-async", test_cm_enc_one_time_keys_async);
+  g_test_add_func ("/matrix/enc/input-stream-offset", test_cm_enc_input_stream_offset);
+  g_test_add_func ("/matrix/enc/input-stream-large", test_cm_enc_input_stream_large);
 
   return g_test_run ();
 }
@@ -51,6 +51,8 @@ test_utils_canonical (void)
     g_autofree char *expected_json = NULL;
     g_autoptr(JsonObject) object = NULL;
     g_autoptr(GString) json_str = NULL;
+    guint size;
+    gsize len;
 
     if (!g_str_has_suffix (name, ".json"))
       continue;
@@ -61,11 +63,61 @@ test_utils_canonical (void)
     g_assert_no_error (error);
 
     object = get_json_object_for_file (path, name);
+    size = json_object_get_size (object);
     json_str = cm_utils_json_get_canonical (object, NULL);
     g_assert_cmpstr (json_str->str, ==, expected_json);
+    /* The object shouldn't be modified */
+    g_assert_cmpint (json_object_get_size (object), ==, size);
+
+    /* Same as above, but written to the reused buffer */
+    g_assert_cmpstr (cm_utils_json_write_canonical (object, &len), ==, expected_json);
+    g_assert_cmpint (len, ==, json_str->len);
   }
 }
 
+static void
+test_utils_event_type (void)
+{
+  const char *unknown[] = {
+    "", "m", "m.room", "m.room.message ", "m.room.messages",
+    "M.ROOM.MESSAGE", "org.example.custom", "m.key.verification",
+  };
+
+  for (CmEventType type = CM_M_UNKNOWN + 1; type <= CM_M_TYPING; type++)
+    {
+      const char *str;
+
+      str = cm_utils_get_event_type_str (type);
+      g_assert_nonnull (str);
+      g_assert_cmpint (cm_utils_get_event_type (str), ==, type);
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (unknown); i++)
+    g_assert_cmpint (cm_utils_get_event_type (unknown[i]), ==, CM_M_UNKNOWN);
+
+  g_assert_cmpint (cm_utils_get_event_type (NULL), ==, CM_M_UNKNOWN);
+}
+
+static void
+test_utils_intern_id (void)
+{
+  g_autoptr(GRefString) id1 = NULL;
+  g_autoptr(GRefString) id2 = NULL;
+  g_autoptr(GRefString) id3 = NULL;
+  g_autofree char *str = NULL;
+
+  g_assert_null (cm_utils_intern_id (NULL));
+
+  str = g_strdup ("$some-event:example.org");
+  id1 = cm_utils_intern_id ("$some-event:example.org");
+  id2 = cm_utils_intern_id (str);
+  id3 = cm_utils_intern_id ("!some-room:example.org");
+
+  g_assert_true (id1 == id2);
+  g_assert_true (id1 != id3);
+  g_assert_cmpstr (id2, ==, str);
+}
+
 static void
 test_utils_valid_user_name (void)
 {
@@ -193,6 +245,40 @@ test_utils_valid_home_server (void)
     }
 }
 
+static void
+test_utils_thumbnail_file_name (void)
+{
+  struct Data
+  {
+    const char *uri;
+    const char *file_name;
+  } data[] = {
+    {"", NULL},
+    {"https://example.org/abc", NULL},
+    {"mxc://", NULL},
+    {"mxc://example.org", NULL},
+    {"mxc://example.org/", NULL},
+    {"mxc:///abc", NULL},
+    {"mxc://example.org/abc/def", NULL},
+    {"mxc://example.org/abc", "96x64-crop-example.org-abc"},
+    {"mxc://example.com/abc", "96x64-crop-example.com-abc"},
+    {"mxc://localhost:8008/abc", "96x64-crop-localhost:8008-abc"},
+  };
+  g_autofree char *file_name = NULL;
+
+  for (guint i = 0; i < G_N_ELEMENTS (data); i++)
+    {
+      g_autofree char *name = NULL;
+
+      name = cm_utils_get_thumbnail_file_name (data[i].uri, 96, 64, CM_THUMBNAIL_METHOD_CROP);
+      g_assert_cmpstr (name, ==, data[i].file_name);
+    }
+
+  file_name = cm_utils_get_thumbnail_file_name ("mxc://example.org/abc", 32, 32,
+                                                CM_THUMBNAIL_METHOD_SCALE);
+  g_assert_cmpstr (file_name, ==, "32x32-scale-example.org-abc");
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -200,10 +286,13 @@ main (int   argc,
   g_test_init (&argc, &argv, NULL);
 
   g_test_add_func ("/cm-utils/canonical", test_utils_canonical);
+  g_test_add_func ("/cm-utils/event-type", test_utils_event_type);
+  g_test_add_func ("/cm-utils/intern-id", test_utils_intern_id);
   g_test_add_func ("/cm-utils/valid-user-name", test_utils_valid_user_name);
   g_test_add_func ("/cm-utils/valid-email", test_utils_valid_email);
   g_test_add_func ("/cm-utils/valid-phone", test_utils_valid_phone);
   g_test_add_func ("/cm-utils/valid-home-server", test_utils_valid_home_server);
+  g_test_add_func ("/cm-utils/thumbnail-file-name", test_utils_thumbnail_file_name);
 
   return g_test_run ();
 }
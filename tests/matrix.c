@@ -0,0 +1,291 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* matrix.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include "cm-matrix.c"
+
+#define OPEN_DB_NAME "test-matrix-open.db"
+
+typedef struct {
+  GError   *error;
+  gboolean  status;
+  gboolean  done;
+  guint     n_ready;
+} OpenResult;
+
+static void
+open_cb (GObject      *object,
+         GAsyncResult *result,
+         gpointer      user_data)
+{
+  OpenResult *open_result = user_data;
+
+  g_assert_true (CM_IS_MATRIX (object));
+
+  open_result->status = cm_matrix_open_finish (CM_MATRIX (object), result,
+                                               &open_result->error);
+  open_result->done = TRUE;
+}
+
+static void
+ready_cb (CmMatrix   *matrix,
+          GParamSpec *pspec,
+          OpenResult *open_result)
+{
+  g_assert_true (CM_IS_MATRIX (matrix));
+
+  open_result->n_ready++;
+}
+
+static CmMatrix *
+matrix_new (OpenResult *open_result)
+{
+  CmMatrix *matrix;
+
+  /* Opening doesn't use the data dirs, which cm_matrix_new() sets globally */
+  matrix = g_object_new (CM_TYPE_MATRIX, NULL);
+  g_signal_connect (matrix, "notify::ready", G_CALLBACK (ready_cb), open_result);
+
+  return matrix;
+}
+
+/*
+ * Start opening @matrix with both the secrets and the db
+ * pending, as cm_matrix_open_async() does outside tests,
+ * so that each half can be completed in the order wanted.
+ */
+static GTask *
+matrix_open_task_new (CmMatrix   *matrix,
+                      OpenResult *open_result)
+{
+  MatrixOpenData *open_data;
+  GTask *task;
+
+  task = g_task_new (matrix, NULL, open_cb, open_result);
+  open_data = g_new0 (MatrixOpenData, 1);
+  open_data->start_time = g_get_monotonic_time ();
+  open_data->n_pending = 2;
+  g_task_set_task_data (task, open_data, matrix_open_data_free);
+  matrix->is_opening = TRUE;
+
+  return task;
+}
+
+static void
+matrix_open_db (CmMatrix   *matrix,
+                GTask      *task,
+                const char *dir)
+{
+  matrix->cm_db = cm_db_new ();
+  cm_db_open_async (matrix->cm_db, g_strdup (dir), OPEN_DB_NAME,
+                    db_open_cb, g_object_ref (task));
+}
+
+/* Complete loading secrets with @error, or with no accounts */
+static void
+matrix_load_secrets (CmMatrix *matrix,
+                     GTask    *task,
+                     GError   *error)
+{
+  g_autoptr(GTask) secret_task = NULL;
+
+  secret_task = g_task_new (matrix->secret_store, NULL,
+                            matrix_store_load_cb, g_object_ref (task));
+  if (error)
+    g_task_return_error (secret_task, error);
+  else
+    g_task_return_pointer (secret_task, g_ptr_array_new (),
+                           (GDestroyNotify)g_ptr_array_unref);
+}
+
+static void
+wait_for_pending (GTask *task,
+                  guint  n_pending)
+{
+  MatrixOpenData *open_data;
+
+  open_data = g_task_get_task_data (task);
+
+  while (open_data->n_pending > n_pending)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+wait_for_open (OpenResult *open_result)
+{
+  while (!open_result->done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_matrix_open_secrets_error (void)
+{
+  g_autoptr(CmMatrix) matrix = NULL;
+  g_autoptr(GTask) task = NULL;
+  OpenResult open_result = { 0 };
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, OPEN_DB_NAME, NULL));
+  matrix = matrix_new (&open_result);
+  task = matrix_open_task_new (matrix, &open_result);
+
+  /* Secrets fail first, the db is still to be opened */
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*Load secrets error*");
+  matrix_load_secrets (matrix, task,
+                       g_error_new (G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED, "Locked"));
+  wait_for_pending (task, 1);
+  g_test_assert_expected_messages ();
+  g_assert_false (open_result.done);
+  g_assert_true (matrix->is_opening);
+  g_assert_false (matrix->secrets_loaded);
+
+  matrix_open_db (matrix, task, g_test_get_dir (G_TEST_BUILT));
+  wait_for_open (&open_result);
+
+  g_assert_error (open_result.error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED);
+  g_assert_false (open_result.status);
+  g_assert_cmpint (open_result.n_ready, ==, 0);
+  g_assert_false (matrix->is_opening);
+  g_assert_false (matrix->secrets_loaded);
+  g_assert_true (matrix->db_loaded);
+  g_assert_nonnull (matrix->media_cache);
+
+  g_clear_error (&open_result.error);
+  g_clear_object (&matrix->cm_db);
+}
+
+static void
+test_matrix_open_db_error (void)
+{
+  g_autoptr(CmMatrix) matrix = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autofree char *file = NULL;
+  g_autofree char *dir = NULL;
+  OpenResult open_result = { 0 };
+
+  /* A regular file in place of the db directory can't be opened */
+  file = g_test_build_filename (G_TEST_BUILT, "test-matrix-not-a-dir", NULL);
+  g_assert_true (g_file_set_contents (file, "", 0, NULL));
+  dir = g_build_filename (file, "db", NULL);
+
+  matrix = matrix_new (&open_result);
+  task = matrix_open_task_new (matrix, &open_result);
+
+  /* The db fails first, the secrets are still to be loaded */
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*Open DB error*");
+  matrix_open_db (matrix, task, dir);
+  wait_for_pending (task, 1);
+  g_test_assert_expected_messages ();
+  g_assert_false (open_result.done);
+  g_assert_true (matrix->is_opening);
+  g_assert_false (matrix->db_loaded);
+  g_assert_null (matrix->cm_db);
+
+  matrix_load_secrets (matrix, task, NULL);
+  wait_for_open (&open_result);
+
+  g_assert_error (open_result.error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_assert_false (open_result.status);
+  g_assert_cmpint (open_result.n_ready, ==, 0);
+  g_assert_false (matrix->is_opening);
+  g_assert_true (matrix->secrets_loaded);
+  g_assert_false (matrix->db_loaded);
+  g_assert_null (matrix->media_cache);
+
+  g_clear_error (&open_result.error);
+  g_unlink (file);
+}
+
+static void
+test_matrix_open_both_error (void)
+{
+  g_autoptr(CmMatrix) matrix = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autofree char *file = NULL;
+  g_autofree char *dir = NULL;
+  OpenResult open_result = { 0 };
+
+  file = g_test_build_filename (G_TEST_BUILT, "test-matrix-not-a-dir", NULL);
+  g_assert_true (g_file_set_contents (file, "", 0, NULL));
+  dir = g_build_filename (file, "db", NULL);
+
+  matrix = matrix_new (&open_result);
+  task = matrix_open_task_new (matrix, &open_result);
+
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*Open DB error*");
+  matrix_open_db (matrix, task, dir);
+  wait_for_pending (task, 1);
+  g_test_assert_expected_messages ();
+
+  /* Only the first error is returned */
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*Load secrets error*");
+  matrix_load_secrets (matrix, task,
+                       g_error_new (G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED, "Locked"));
+  wait_for_open (&open_result);
+  g_test_assert_expected_messages ();
+
+  g_assert_error (open_result.error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_assert_false (open_result.status);
+  g_assert_false (matrix->is_opening);
+  g_assert_false (cm_matrix_is_ready (matrix));
+
+  g_clear_error (&open_result.error);
+  g_unlink (file);
+}
+
+static void
+test_matrix_open (void)
+{
+  g_autoptr(CmMatrix) matrix = NULL;
+  g_autoptr(GTask) task = NULL;
+  OpenResult open_result = { 0 };
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, OPEN_DB_NAME, NULL));
+  matrix = matrix_new (&open_result);
+  task = matrix_open_task_new (matrix, &open_result);
+
+  matrix_open_db (matrix, task, g_test_get_dir (G_TEST_BUILT));
+  wait_for_pending (task, 1);
+  g_assert_false (open_result.done);
+  g_assert_true (matrix->db_loaded);
+  g_assert_cmpint (open_result.n_ready, ==, 0);
+
+  matrix_load_secrets (matrix, task, NULL);
+  wait_for_open (&open_result);
+
+  g_assert_no_error (open_result.error);
+  g_assert_true (open_result.status);
+  g_assert_cmpint (open_result.n_ready, ==, 1);
+  g_assert_false (matrix->is_opening);
+  g_assert_true (matrix->secrets_loaded);
+  g_assert_true (matrix->db_loaded);
+  g_assert_true (cm_matrix_is_ready (matrix));
+  g_assert_cmpint (g_list_model_get_n_items (cm_matrix_get_clients_list (matrix)), ==, 0);
+
+  g_clear_object (&matrix->cm_db);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  cm_init (TRUE);
+
+  g_test_add_func ("/cm-matrix/open", test_matrix_open);
+  g_test_add_func ("/cm-matrix/open/secrets-error", test_matrix_open_secrets_error);
+  g_test_add_func ("/cm-matrix/open/db-error", test_matrix_open_db_error);
+  g_test_add_func ("/cm-matrix/open/both-error", test_matrix_open_both_error);
+
+  return g_test_run ();
+}
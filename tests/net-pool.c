@@ -0,0 +1,172 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* net-pool.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include "cm-matrix.h"
+#include "cm-net-pool-private.h"
+
+static void
+test_net_pool_session (void)
+{
+  g_autoptr(CmNetPool) pool = NULL;
+  g_autoptr(GPtrArray) sessions = NULL;
+  SoupSession *a, *b, *c, *d;
+
+  pool = cm_net_pool_new ();
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), ==, 0);
+
+  /* Same origin, same session */
+  a = cm_net_pool_acquire_session (pool, "https://matrix.example.org");
+  b = cm_net_pool_acquire_session (pool, "https://matrix.example.org:443/");
+  g_assert_true (SOUP_IS_SESSION (a));
+  g_assert_true (a == b);
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), ==, 1);
+
+  /* Different port or host, different session */
+  c = cm_net_pool_acquire_session (pool, "https://matrix.example.org:8448");
+  d = cm_net_pool_acquire_session (pool, "https://example.com");
+  g_assert_true (a != c);
+  g_assert_true (a != d);
+  g_assert_true (c != d);
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), ==, 3);
+
+  /* Kept as long as anyone uses it */
+  cm_net_pool_release_session (pool, b);
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), ==, 3);
+  cm_net_pool_release_session (pool, a);
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), ==, 2);
+  cm_net_pool_release_session (pool, c);
+  cm_net_pool_release_session (pool, d);
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), ==, 0);
+
+  /* A session is shared by a limited number of users */
+  sessions = g_ptr_array_new ();
+  for (guint i = 0; i < 32; i++)
+    g_ptr_array_add (sessions, cm_net_pool_acquire_session (pool, "https://example.com"));
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), >, 1);
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), <, 32);
+
+  for (guint i = 0; i < sessions->len; i++)
+    cm_net_pool_release_session (pool, sessions->pdata[i]);
+  g_assert_cmpuint (cm_net_pool_get_n_sessions (pool), ==, 0);
+}
+
+static void
+transfer_released_cb (guint *count)
+{
+  (*count)++;
+}
+
+static void
+test_net_pool_transfer (void)
+{
+  g_autoptr(CmNetPool) pool = NULL;
+  guint n_per_host = 0, n_total = 0, n_released = 0;
+  char host[32];
+
+  pool = cm_net_pool_new ();
+  g_signal_connect_swapped (pool, "transfer-released",
+                            G_CALLBACK (transfer_released_cb), &n_released);
+  g_assert_true (SOUP_IS_SESSION (cm_net_pool_get_file_session (pool)));
+
+  while (cm_net_pool_can_transfer (pool, "example.com"))
+    {
+      cm_net_pool_add_transfer (pool, "example.com");
+      n_per_host++;
+      g_assert_cmpuint (n_per_host, <, 100);
+    }
+  g_assert_cmpuint (n_per_host, >, 0);
+
+  /* Other hosts are not blocked by a busy one */
+  g_assert_true (cm_net_pool_can_transfer (pool, "example.org"));
+
+  cm_net_pool_remove_transfer (pool, "example.com");
+  g_assert_cmpuint (n_released, ==, 1);
+  g_assert_true (cm_net_pool_can_transfer (pool, "example.com"));
+  cm_net_pool_add_transfer (pool, "example.com");
+
+  /* But the total is limited too */
+  n_total = n_per_host;
+  for (guint i = 0; i < 100; i++)
+    {
+      g_snprintf (host, sizeof host, "%u.example.org", i);
+      if (!cm_net_pool_can_transfer (pool, host))
+        break;
+
+      cm_net_pool_add_transfer (pool, host);
+      n_total++;
+    }
+  g_assert_cmpuint (n_total, >, n_per_host);
+  g_assert_cmpuint (n_total, <, 100 + n_per_host);
+  g_assert_false (cm_net_pool_can_transfer (pool, "example.net"));
+
+  cm_net_pool_remove_transfer (pool, "0.example.org");
+  g_assert_cmpuint (n_released, ==, 2);
+  g_assert_true (cm_net_pool_can_transfer (pool, "example.net"));
+}
+
+static void
+test_net_pool_rate_limit (void)
+{
+  g_autoptr(CmNetPool) pool = NULL;
+  g_autofree char *origin = NULL;
+  g_autofree char *other = NULL;
+  guint n_tokens = 0, wait_ms = 0;
+
+  pool = cm_net_pool_new ();
+  origin = cm_net_pool_get_origin ("https://matrix.example.org/");
+  other = cm_net_pool_get_origin ("http://matrix.example.org");
+  g_assert_cmpstr (origin, ==, "https://matrix.example.org:443");
+  g_assert_cmpstr (other, ==, "http://matrix.example.org:80");
+
+  /* A burst is allowed, then requests are spaced */
+  while (cm_net_pool_take_token (pool, origin, &wait_ms))
+    {
+      n_tokens++;
+      g_assert_cmpuint (wait_ms, ==, 0);
+      g_assert_cmpuint (n_tokens, <, 1000);
+    }
+  g_assert_cmpuint (n_tokens, >, 1);
+  g_assert_cmpuint (wait_ms, >, 0);
+  g_assert_cmpuint (wait_ms, <=, 1000);
+
+  /* Per origin */
+  g_assert_true (cm_net_pool_take_token (pool, other, &wait_ms));
+  g_assert_cmpuint (cm_net_pool_get_retry_after (pool, origin), ==, 0);
+
+  /* All held back when the server asks so */
+  cm_net_pool_set_retry_after (pool, other, 5000);
+  g_assert_cmpuint (cm_net_pool_get_retry_after (pool, other), >, 4000);
+  g_assert_cmpuint (cm_net_pool_get_retry_after (pool, other), <=, 5001);
+  g_assert_false (cm_net_pool_take_token (pool, other, &wait_ms));
+  g_assert_cmpuint (wait_ms, >, 4000);
+
+  /* A shorter one doesn't cut it short */
+  cm_net_pool_set_retry_after (pool, other, 10);
+  g_assert_cmpuint (cm_net_pool_get_retry_after (pool, other), >, 4000);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  cm_init (TRUE);
+
+  g_test_add_func ("/net-pool/session", test_net_pool_session);
+  g_test_add_func ("/net-pool/transfer", test_net_pool_transfer);
+  g_test_add_func ("/net-pool/rate-limit", test_net_pool_rate_limit);
+
+  return g_test_run ();
+}
@@ -0,0 +1,147 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* net-recorder.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "cm-matrix.h"
+#include "cm-net-recorder-private.h"
+#include "cm-utils-private.h"
+
+static const char *sync_response =
+  "{\"next_batch\":\"s72595_4483_1934\","
+  " \"rooms\":{\"join\":{\"!cURbafjkfsMDVwdRDQ:matrix.org\":{"
+  "  \"timeline\":{\"events\":[{\"type\":\"m.room.message\","
+  "   \"event_id\":\"$143273582443PhrSn:example.org\",\"sender\":\"@alice:example.org\","
+  "   \"origin_server_ts\":1432735824653,"
+  "   \"content\":{\"msgtype\":\"m.text\",\"body\":\"my secret plans\","
+  "    \"url\":\"mxc://example.org/SEsfnsuifSDFSSEF\"}}]}}}}}";
+
+static void
+test_net_recorder_record (void)
+{
+  g_autoptr(CmNetRecorder) recorder = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *file_name = NULL;
+  g_autofree char *room_path = NULL;
+  g_autofree char *media_path = NULL;
+  g_autoptr(GList) members = NULL;
+  JsonObject *entry, *object, *event, *content;
+  const char *login = "{\"type\":\"m.login.password\",\"password\":\"hunter2\","
+    "\"identifier\":{\"type\":\"m.id.user\",\"user\":\"alice\"}}";
+  const char *login_response = "{\"user_id\":\"@alice:example.org\","
+    "\"access_token\":\"syt_YWxpY2U_secret\",\"device_id\":\"GHTYAJCE\"}";
+  const char *room_id, *event_id, *url;
+
+  file_name = g_test_build_filename (G_TEST_BUILT, "net-trace.gz", NULL);
+  g_remove (file_name);
+
+  recorder = cm_net_recorder_new (file_name, &error);
+  g_assert_no_error (error);
+  g_assert_true (CM_IS_NET_RECORDER (recorder));
+
+  cm_net_recorder_add (recorder, "POST", "/_matrix/client/r0/login", NULL,
+                       login, strlen (login), 200,
+                       login_response, strlen (login_response),
+                       g_get_monotonic_time (), NULL);
+  cm_net_recorder_add (recorder, "GET", "/_matrix/client/r0/sync",
+                       "since=s72594_4483_1934&timeout=30000",
+                       NULL, 0, 200,
+                       sync_response, strlen (sync_response),
+                       g_get_monotonic_time (), NULL);
+  cm_net_recorder_add (recorder, "GET", "/_matrix/client/r0/rooms/!cURbafjkfsMDVwdRDQ:matrix.org/messages",
+                       NULL, NULL, 0, 0, NULL, 0,
+                       g_get_monotonic_time (), "Connection to alice.example.org refused");
+
+  room_path = cm_net_recorder_anonymize_path (recorder, "/_matrix/client/r0/rooms/!cURbafjkfsMDVwdRDQ:matrix.org/messages");
+  media_path = cm_net_recorder_anonymize_path (recorder, "/_matrix/media/r0/download/example.org/SEsfnsuifSDFSSEF");
+  /* Finishes the trace */
+  g_clear_object (&recorder);
+
+  entries = cm_net_recorder_load (file_name, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (entries);
+  g_assert_cmpint (entries->len, ==, 3);
+
+  /* Secrets are removed, ids are replaced but still valid */
+  entry = entries->pdata[0];
+  g_assert_cmpstr (cm_utils_json_object_get_string (entry, "method"), ==, "POST");
+  g_assert_cmpstr (cm_utils_json_object_get_string (entry, "path"), ==, "/_matrix/client/r0/login");
+  object = cm_utils_json_object_get_object (entry, "request");
+  g_assert_cmpstr (cm_utils_json_object_get_string (object, "type"), ==, "m.login.password");
+  g_assert_cmpstr (cm_utils_json_object_get_string (object, "password"), ==, "******");
+  object = cm_utils_json_object_get_object (entry, "response");
+  g_assert_cmpstr (cm_utils_json_object_get_string (object, "access_token"), ==, "******");
+  g_assert_true (cm_utils_user_name_valid (cm_utils_json_object_get_string (object, "user_id")));
+  g_assert_cmpstr (cm_utils_json_object_get_string (object, "user_id"), !=, "@alice:example.org");
+
+  /* Sync tokens and event types are kept, content is not */
+  entry = entries->pdata[1];
+  object = cm_utils_json_object_get_object (entry, "query");
+  g_assert_cmpstr (cm_utils_json_object_get_string (object, "since"), ==, "s72594_4483_1934");
+  g_assert_cmpstr (cm_utils_json_object_get_string (object, "timeout"), ==, "30000");
+  object = cm_utils_json_object_get_object (entry, "response");
+  g_assert_cmpstr (cm_utils_json_object_get_string (object, "next_batch"), ==, "s72595_4483_1934");
+  object = cm_utils_json_object_get_object (object, "rooms");
+  object = cm_utils_json_object_get_object (object, "join");
+  g_assert_cmpint (json_object_get_size (object), ==, 1);
+  members = json_object_get_members (object);
+  room_id = members->data;
+  g_assert_cmpstr (room_id, !=, "!cURbafjkfsMDVwdRDQ:matrix.org");
+  g_assert_true (g_str_has_prefix (room_id, "!"));
+
+  /* The same id is replaced the same way in paths */
+  path = g_strconcat ("/_matrix/client/r0/rooms/", room_id, "/messages", NULL);
+  g_assert_cmpstr (path, ==, room_path);
+  entry = entries->pdata[2];
+  g_assert_cmpstr (cm_utils_json_object_get_string (entry, "path"), ==, room_path);
+  g_assert_nonnull (cm_utils_json_object_get_string (entry, "error"));
+  g_assert_null (strstr (cm_utils_json_object_get_string (entry, "error"), "alice"));
+
+  object = cm_utils_json_object_get_object (object, room_id);
+  object = cm_utils_json_object_get_object (object, "timeline");
+  event = json_array_get_object_element (cm_utils_json_object_get_array (object, "events"), 0);
+  g_assert_nonnull (event);
+  event_id = cm_utils_json_object_get_string (event, "event_id");
+  g_assert_true (g_str_has_prefix (event_id, "$"));
+  g_assert_cmpstr (event_id, !=, "$143273582443PhrSn:example.org");
+  g_assert_cmpstr (cm_utils_json_object_get_string (event, "type"), ==, "m.room.message");
+  g_assert_cmpint (cm_utils_json_object_get_int (event, "origin_server_ts"), ==, 1432735824653);
+  content = cm_utils_json_object_get_object (event, "content");
+  g_assert_cmpstr (cm_utils_json_object_get_string (content, "msgtype"), ==, "m.text");
+  g_assert_cmpstr (cm_utils_json_object_get_string (content, "body"), !=, "my secret plans");
+  g_assert_null (strstr (cm_utils_json_object_get_string (content, "body"), "secret"));
+
+  /* Media urls match the download paths */
+  url = cm_utils_json_object_get_string (content, "url");
+  g_assert_true (g_str_has_prefix (url, "mxc://"));
+  g_assert_true (g_str_has_suffix (media_path, url + strlen ("mxc://")));
+
+  g_remove (file_name);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  cm_init (TRUE);
+
+  g_test_add_func ("/net-recorder/record", test_net_recorder_record);
+
+  return g_test_run ();
+}
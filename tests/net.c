@@ -0,0 +1,392 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* net.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include "cm-net.c"
+
+#include "cm-matrix.h"
+#include "mock-server.h"
+
+#define SEND_PATH    "/_matrix/client/r0/rooms/!a:example.org/send/m.room.message/"
+#define TYPING_PATH  "/_matrix/client/r0/rooms/!a:example.org/typing/@alice:example.org"
+#define MEDIA_PATH   "/_matrix/media/r0/download/example.org/"
+/* MAX_TRANSFERS_PER_HOST in cm-net-pool.c */
+#define POOL_MAX_TRANSFERS_PER_HOST 4
+
+static void
+send_json_cb (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GError *error = NULL;
+  JsonObject *response;
+
+  g_assert_true (G_IS_TASK (task));
+
+  response = g_task_propagate_pointer (G_TASK (result), &error);
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, response, (GDestroyNotify)json_object_unref);
+}
+
+static GTask *
+net_send_json (CmNet      *net,
+               int         priority,
+               const char *path,
+               const char *body)
+{
+  JsonObject *object = NULL;
+  GTask *task;
+
+  if (body)
+    {
+      object = json_object_new ();
+      json_object_set_string_member (object, "body", body);
+    }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_net_send_json_async (net, priority, object, path, SOUP_METHOD_PUT,
+                          NULL, NULL, send_json_cb, g_object_ref (task));
+
+  return task;
+}
+
+static JsonObject *
+wait_for_json (GTask   *task,
+               GError **error)
+{
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_task_propagate_pointer (task, error);
+}
+
+static void
+request_queued_cb (SoupSession *session,
+                   SoupMessage *msg,
+                   GArray      *priorities)
+{
+  SoupMessagePriority priority;
+
+  priority = soup_message_get_priority (msg);
+  g_array_append_val (priorities, priority);
+}
+
+static void
+test_net_requeue (void)
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(GArray) priorities = NULL;
+  g_autoptr(JsonObject) response = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(CmNet) net = NULL;
+  g_autoptr(GTask) task = NULL;
+  GPtrArray *requests;
+
+  server = mock_server_new (NULL);
+  net = cm_net_new ();
+  cm_net_set_homeserver (net, mock_server_get_uri (server));
+
+  priorities = g_array_new (FALSE, FALSE, sizeof (SoupMessagePriority));
+  g_signal_connect (net->soup_session, "request-queued",
+                    G_CALLBACK (request_queued_cb), priorities);
+
+  /* Sent again, as it was, until it gets through */
+  mock_server_set_rate_limited (server, SEND_PATH "1", MAX_REQUEUES, 20, FALSE);
+  task = net_send_json (net, 1, SEND_PATH "1", "hello");
+  response = wait_for_json (task, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (response);
+  g_assert_cmpstr (cm_utils_json_object_get_string (response, "event_id"), ==,
+                   "$bench-sent:example.org");
+
+  requests = mock_server_get_requests (server, SEND_PATH "1");
+  g_assert_nonnull (requests);
+  g_assert_cmpuint (requests->len, ==, MAX_REQUEUES + 1);
+  g_assert_cmpuint (priorities->len, ==, MAX_REQUEUES + 1);
+
+  for (guint i = 0; i < requests->len; i++)
+    {
+      g_autoptr(JsonObject) request = NULL;
+
+      request = cm_utils_string_to_json_object (requests->pdata[i]);
+      g_assert_nonnull (request);
+      g_assert_cmpstr (cm_utils_json_object_get_string (request, "body"), ==, "hello");
+      g_assert_cmpint (g_array_index (priorities, SoupMessagePriority, i), ==,
+                       SOUP_MESSAGE_PRIORITY_HIGH);
+    }
+
+  g_clear_object (&task);
+  g_clear_pointer (&response, json_object_unref);
+  g_array_set_size (priorities, 0);
+
+  /* And given up after that */
+  mock_server_set_rate_limited (server, SEND_PATH "2", MAX_REQUEUES + 1, 20, FALSE);
+  task = net_send_json (net, 0, SEND_PATH "2", "hello");
+  response = wait_for_json (task, &error);
+  g_assert_error (error, CM_ERROR, CM_ERROR_LIMIT_EXCEEDED);
+  g_assert_null (response);
+
+  requests = mock_server_get_requests (server, SEND_PATH "2");
+  g_assert_nonnull (requests);
+  g_assert_cmpuint (requests->len, ==, MAX_REQUEUES + 1);
+  g_assert_cmpuint (priorities->len, ==, MAX_REQUEUES + 1);
+
+  for (guint i = 0; i < priorities->len; i++)
+    g_assert_cmpint (g_array_index (priorities, SoupMessagePriority, i), ==,
+                     SOUP_MESSAGE_PRIORITY_NORMAL);
+}
+
+static void
+test_net_retry_after (void)
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(JsonObject) response = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(CmNet) net = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GTask) low_task = NULL;
+  g_autoptr(GTask) lowest_task = NULL;
+  GPtrArray *requests;
+  guint retry_after;
+
+  server = mock_server_new (NULL);
+  net = cm_net_new ();
+  cm_net_set_homeserver (net, mock_server_get_uri (server));
+
+  /* Without retry_after_ms in the response, the header is used */
+  mock_server_set_rate_limited (server, SEND_PATH "1", 1, 1000, TRUE);
+  task = net_send_json (net, -1, SEND_PATH "1", "hello");
+  response = wait_for_json (task, &error);
+  g_assert_error (error, CM_ERROR, CM_ERROR_LIMIT_EXCEEDED);
+  g_assert_null (response);
+  g_clear_error (&error);
+  g_clear_object (&task);
+
+  /* Low priority requests are not sent again */
+  requests = mock_server_get_requests (server, SEND_PATH "1");
+  g_assert_nonnull (requests);
+  g_assert_cmpuint (requests->len, ==, 1);
+
+  retry_after = cm_net_get_retry_after (net);
+  g_assert_cmpuint (retry_after, >, 0);
+  g_assert_cmpuint (retry_after, <=, 1001);
+
+  /* While rate limited, low priority requests are shed, others wait */
+  task = net_send_json (net, 0, SEND_PATH "2", "hello");
+  low_task = net_send_json (net, -1, TYPING_PATH, NULL);
+  lowest_task = net_send_json (net, -2, TYPING_PATH, NULL);
+
+  response = wait_for_json (lowest_task, &error);
+  g_assert_error (error, CM_ERROR, CM_ERROR_LIMIT_EXCEEDED);
+  g_assert_null (response);
+  g_clear_error (&error);
+
+  response = wait_for_json (low_task, &error);
+  g_assert_error (error, CM_ERROR, CM_ERROR_LIMIT_EXCEEDED);
+  g_assert_null (response);
+  g_clear_error (&error);
+
+  g_assert_null (mock_server_get_requests (server, TYPING_PATH));
+  g_assert_false (g_task_get_completed (task));
+
+  response = wait_for_json (task, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (response);
+  g_assert_cmpuint (cm_net_get_retry_after (net), ==, 0);
+
+  requests = mock_server_get_requests (server, SEND_PATH "2");
+  g_assert_nonnull (requests);
+  g_assert_cmpuint (requests->len, ==, 1);
+  g_assert_null (mock_server_get_requests (server, TYPING_PATH));
+}
+
+static void
+get_file_cb (GObject      *object,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GInputStream *stream;
+  GError *error = NULL;
+
+  g_assert_true (G_IS_TASK (task));
+
+  stream = cm_net_get_file_finish (CM_NET (object), result, &error);
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, stream, g_object_unref);
+}
+
+static GTask *
+net_get_file (CmNet              *net,
+              const char         *name,
+              CmTransferPriority  priority,
+              GCancellable       *cancellable)
+{
+  g_autofree char *uri = NULL;
+  GTask *task;
+
+  uri = g_strconcat ("mxc://example.org/", name, NULL);
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  cm_net_get_file_range_async (net, uri, NULL, NULL, 0, priority, cancellable,
+                               get_file_cb, g_object_ref (task));
+
+  return task;
+}
+
+static void
+wait_for_task (GTask *task)
+{
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+file_queued_cb (SoupSession *session,
+                SoupMessage *msg,
+                GPtrArray   *paths)
+{
+  g_ptr_array_add (paths, g_strdup (g_uri_get_path (soup_message_get_uri (msg))));
+}
+
+static guint
+net_get_n_queued_transfers (CmNet *net)
+{
+  guint count = 0;
+
+  for (guint i = 0; i < CM_TRANSFER_PRIORITY_N; i++)
+    count += net->transfer_queue[i].length;
+
+  return count;
+}
+
+static void
+test_net_transfer (void)
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(GCancellable) cancellable = NULL;
+  g_autoptr(GPtrArray) paths = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(CmNet) net = NULL;
+  GTask *avatar, *thumbnails[2], *download, *prefetches[4];
+  GInputStream *stream;
+  gulong handler;
+
+  server = mock_server_new (NULL);
+  net = cm_net_new ();
+  cm_net_set_homeserver (net, mock_server_get_uri (server));
+
+  paths = g_ptr_array_new_with_free_func (g_free);
+  handler = g_signal_connect (net->file_session, "request-queued",
+                              G_CALLBACK (file_queued_cb), paths);
+
+  /* More than allowed to run at once, the lowest priority first */
+  cancellable = g_cancellable_new ();
+  prefetches[0] = net_get_file (net, "prefetch-0", CM_TRANSFER_PRIORITY_PREFETCH, NULL);
+  prefetches[1] = net_get_file (net, "prefetch-1", CM_TRANSFER_PRIORITY_PREFETCH, NULL);
+  prefetches[2] = net_get_file (net, "prefetch-2", CM_TRANSFER_PRIORITY_PREFETCH, NULL);
+  prefetches[3] = net_get_file (net, "prefetch-3", CM_TRANSFER_PRIORITY_PREFETCH, cancellable);
+  download = net_get_file (net, "download", CM_TRANSFER_PRIORITY_DOWNLOAD, NULL);
+  thumbnails[0] = net_get_file (net, "thumbnail-0", CM_TRANSFER_PRIORITY_THUMBNAIL, NULL);
+  thumbnails[1] = net_get_file (net, "thumbnail-1", CM_TRANSFER_PRIORITY_THUMBNAIL, NULL);
+  avatar = net_get_file (net, "avatar", CM_TRANSFER_PRIORITY_AVATAR, NULL);
+  g_assert_cmpuint (net_get_n_queued_transfers (net), ==, 8);
+
+  /* Started in the order of priority, as many as the host allows */
+  wait_for_task (avatar);
+  wait_for_task (thumbnails[0]);
+  wait_for_task (thumbnails[1]);
+  wait_for_task (download);
+
+  g_assert_cmpuint (paths->len, ==, POOL_MAX_TRANSFERS_PER_HOST);
+  g_assert_cmpstr (paths->pdata[0], ==, MEDIA_PATH "avatar");
+  g_assert_cmpstr (paths->pdata[1], ==, MEDIA_PATH "thumbnail-0");
+  g_assert_cmpstr (paths->pdata[2], ==, MEDIA_PATH "thumbnail-1");
+  g_assert_cmpstr (paths->pdata[3], ==, MEDIA_PATH "download");
+
+  /* The streams not yet finalized keep their slots */
+  g_assert_cmpuint (net->n_active_transfers, ==, POOL_MAX_TRANSFERS_PER_HOST);
+  g_assert_cmpuint (net->transfer_queue[CM_TRANSFER_PRIORITY_PREFETCH].length, ==, 4);
+  g_assert_false (cm_net_pool_can_transfer (net->pool, "127.0.0.1"));
+
+  for (guint i = 0; i < G_N_ELEMENTS (prefetches); i++)
+    g_assert_false (g_task_get_completed (prefetches[i]));
+
+  /* Cancelled transfers are dropped from the queue without being sent */
+  g_cancellable_cancel (cancellable);
+  wait_for_task (prefetches[3]);
+  stream = g_task_propagate_pointer (prefetches[3], &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (stream);
+  g_clear_error (&error);
+  g_clear_object (&prefetches[3]);
+
+  g_assert_cmpuint (net->transfer_queue[CM_TRANSFER_PRIORITY_PREFETCH].length, ==, 3);
+  g_assert_cmpuint (net->n_active_transfers, ==, POOL_MAX_TRANSFERS_PER_HOST);
+
+  /* Finalizing a stream releases its slot for the next one */
+  stream = g_task_propagate_pointer (avatar, &error);
+  g_assert_no_error (error);
+  g_assert_true (G_IS_INPUT_STREAM (stream));
+  g_clear_object (&avatar);
+  g_object_unref (stream);
+
+  wait_for_task (prefetches[0]);
+  g_assert_cmpuint (paths->len, ==, POOL_MAX_TRANSFERS_PER_HOST + 1);
+  g_assert_cmpstr (paths->pdata[4], ==, MEDIA_PATH "prefetch-0");
+  g_assert_cmpuint (net->n_active_transfers, ==, POOL_MAX_TRANSFERS_PER_HOST);
+  g_assert_cmpuint (net->transfer_queue[CM_TRANSFER_PRIORITY_PREFETCH].length, ==, 2);
+  g_assert_false (g_task_get_completed (prefetches[1]));
+
+  /* The rest are run once the slots are free */
+  g_clear_object (&thumbnails[0]);
+  g_clear_object (&thumbnails[1]);
+  g_clear_object (&download);
+  g_clear_object (&prefetches[0]);
+
+  wait_for_task (prefetches[1]);
+  wait_for_task (prefetches[2]);
+  g_clear_object (&prefetches[1]);
+  g_clear_object (&prefetches[2]);
+
+  while (net->n_active_transfers)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (net_get_n_queued_transfers (net), ==, 0);
+  g_assert_cmpuint (paths->len, ==, POOL_MAX_TRANSFERS_PER_HOST + 3);
+  g_assert_null (mock_server_get_requests (server, MEDIA_PATH "prefetch-3"));
+  g_assert_true (cm_net_pool_can_transfer (net->pool, "127.0.0.1"));
+
+  g_signal_handler_disconnect (net->file_session, handler);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  cm_init (TRUE);
+
+  g_test_add_func ("/cm-net/requeue", test_net_requeue);
+  g_test_add_func ("/cm-net/retry-after", test_net_retry_after);
+  g_test_add_func ("/cm-net/transfer", test_net_transfer);
+
+  return g_test_run ();
+}
@@ -17,6 +17,13 @@
 
 #include "cm-room.c"
 
+#include "cm-matrix.h"
+#include "mock-server.h"
+
+#define TYPING_PATH "/_matrix/client/r0/rooms/!some-room-id:example.org/typing/@alice:example.org"
+/* MAX_REQUEUES in cm-net.c */
+#define NET_MAX_REQUEUES 3
+
 static void
 test_room_new (void)
 {
@@ -32,13 +39,420 @@ test_room_new (void)
   g_assert_finalize_object (room);
 }
 
+static void
+test_room_event_json (void)
+{
+  g_autoptr(JsonObject) member_root = NULL;
+  g_autoptr(JsonObject) root = NULL;
+  g_autoptr(JsonObject) json = NULL;
+  g_autoptr(CmEvent) member = NULL;
+  g_autoptr(CmEvent) event = NULL;
+  g_autoptr(CmRoom) room = NULL;
+  g_autofree char *expected = NULL;
+  g_autofree char *json_str = NULL;
+  JsonObject *content;
+  const char *user_id;
+
+  room = cm_room_new ("!some-room-id:example.org");
+  root = cm_utils_string_to_json_object ("{\"type\": \"m.room.message\", \"event_id\": \"$edit:example.org\","
+                                         "\"sender\": \"@alice:example.org\", \"origin_server_ts\": 1650000000000,"
+                                         "\"content\": {\"msgtype\": \"m.text\", \"body\": \"* hello\","
+                                         "\"m.relates_to\": {\"rel_type\": \"m.replace\", \"event_id\": \"$orig:example.org\"}},"
+                                         "\"unsigned\": {\"transaction_id\": \"cm1650000000000.1\"}}");
+  g_assert_nonnull (root);
+  expected = cm_utils_json_object_to_string (root, FALSE);
+
+  event = (gpointer)cm_room_event_new_from_json (room, root, NULL);
+  g_assert_true (CM_IS_ROOM_MESSAGE_EVENT (event));
+  g_assert_cmpstr (cm_event_get_id (event), ==, "$edit:example.org");
+  g_assert_cmpstr (cm_event_get_sender_id (event), ==, "@alice:example.org");
+  g_assert_cmpint (cm_event_get_time_stamp (event), ==, 1650000000000);
+
+  /* Fields decoded on demand should survive releasing the JSON */
+  cm_event_release_json (event);
+  g_assert_cmpstr (cm_event_get_replaces_id (event), ==, "$orig:example.org");
+  g_assert_cmpstr (cm_event_get_txn_id (event), ==, "cm1650000000000.1");
+  g_assert_null (cm_event_get_state_key (event));
+  g_assert_true (cm_event_is_decrypted (event));
+  g_assert_false (cm_event_is_encrypted (event));
+
+  json_str = cm_event_get_json_str (event, FALSE);
+  g_assert_cmpstr (json_str, ==, expected);
+  json = cm_event_get_json (event);
+  g_assert_nonnull (json);
+  g_assert_true (json != root);
+  g_assert_cmpstr (cm_utils_json_object_get_string (json, "event_id"), ==, "$edit:example.org");
+
+  member_root = cm_utils_string_to_json_object ("{\"type\": \"m.room.member\", \"event_id\": \"$member:example.org\","
+                                                "\"sender\": \"@alice:example.org\", \"state_key\": \"@bob:example.org\","
+                                                "\"content\": {\"membership\": \"invite\"}}");
+  member = (gpointer)cm_room_event_new_from_json (room, member_root, NULL);
+  g_assert_cmpint (cm_event_get_m_type (member), ==, CM_M_ROOM_MEMBER);
+
+  cm_event_release_json (member);
+  g_assert_cmpstr (cm_event_get_state_key (member), ==, "@bob:example.org");
+  content = cm_room_event_get_room_member_json (CM_ROOM_EVENT (member), &user_id);
+  g_assert_cmpstr (cm_utils_json_object_get_string (content, "membership"), ==, "invite");
+  g_assert_cmpstr (user_id, ==, "@bob:example.org");
+}
+
+static CmEvent *
+room_event_new (CmRoom     *room,
+                const char *json_str)
+{
+  g_autoptr(JsonObject) root = NULL;
+
+  root = cm_utils_string_to_json_object (json_str);
+  g_assert_nonnull (root);
+
+  return (gpointer)cm_room_event_new_from_json (room, root, NULL);
+}
+
+static void
+test_room_relations (void)
+{
+  g_autoptr(CmRoomRelations) loaded = NULL;
+  g_autoptr(GPtrArray) events = NULL;
+  g_auto(GStrv) keys = NULL;
+  g_auto(GStrv) replies = NULL;
+  g_autoptr(CmEvent) orig = NULL;
+  g_autoptr(CmRoom) room = NULL;
+  CmRoomRelations *relations;
+  GRefString *changed;
+
+  room = cm_room_new ("!some-room-id:example.org");
+  relations = cm_room_event_list_get_relations (room->room_event);
+  events = g_ptr_array_new_with_free_func (g_object_unref);
+
+  orig = room_event_new (room, "{\"type\": \"m.room.message\", \"event_id\": \"$orig:example.org\","
+                         "\"sender\": \"@alice:example.org\", \"origin_server_ts\": 1650000000000,"
+                         "\"content\": {\"msgtype\": \"m.text\", \"body\": \"hi\"}}");
+  /* Events without relations are ignored */
+  g_assert_null (cm_room_relations_add_event (relations, orig));
+
+  /* The newer edit comes first, the latest by time stamp should win */
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.room.message\", \"event_id\": \"$edit2:example.org\","
+                                           "\"sender\": \"@alice:example.org\", \"origin_server_ts\": 1650000002000,"
+                                           "\"content\": {\"msgtype\": \"m.text\", \"body\": \"* hi!\","
+                                           "\"m.relates_to\": {\"rel_type\": \"m.replace\", \"event_id\": \"$orig:example.org\"}}}"));
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.room.message\", \"event_id\": \"$edit1:example.org\","
+                                           "\"sender\": \"@alice:example.org\", \"origin_server_ts\": 1650000001000,"
+                                           "\"content\": {\"msgtype\": \"m.text\", \"body\": \"* hi\","
+                                           "\"m.relates_to\": {\"rel_type\": \"m.replace\", \"event_id\": \"$orig:example.org\"}}}"));
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.reaction\", \"event_id\": \"$react1:example.org\","
+                                           "\"sender\": \"@alice:example.org\", \"origin_server_ts\": 1650000003000,"
+                                           "\"content\": {\"m.relates_to\": {\"rel_type\": \"m.annotation\","
+                                           "\"event_id\": \"$orig:example.org\", \"key\": \"👍\"}}}"));
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.reaction\", \"event_id\": \"$react2:example.org\","
+                                           "\"sender\": \"@bob:example.org\", \"origin_server_ts\": 1650000004000,"
+                                           "\"content\": {\"m.relates_to\": {\"rel_type\": \"m.annotation\","
+                                           "\"event_id\": \"$orig:example.org\", \"key\": \"👍\"}}}"));
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.reaction\", \"event_id\": \"$react3:example.org\","
+                                           "\"sender\": \"@bob:example.org\", \"origin_server_ts\": 1650000005000,"
+                                           "\"content\": {\"m.relates_to\": {\"rel_type\": \"m.annotation\","
+                                           "\"event_id\": \"$orig:example.org\", \"key\": \"🎉\"}}}"));
+  /* The same reaction again by the same user should be counted once */
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.reaction\", \"event_id\": \"$react4:example.org\","
+                                           "\"sender\": \"@alice:example.org\", \"origin_server_ts\": 1650000005500,"
+                                           "\"content\": {\"m.relates_to\": {\"rel_type\": \"m.annotation\","
+                                           "\"event_id\": \"$orig:example.org\", \"key\": \"👍\"}}}"));
+  /* Newer, but edits by others than the original sender are ignored */
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.room.message\", \"event_id\": \"$spoof:example.org\","
+                                           "\"sender\": \"@mallory:example.org\", \"origin_server_ts\": 1650000009000,"
+                                           "\"content\": {\"msgtype\": \"m.text\", \"body\": \"* spoofed\","
+                                           "\"m.relates_to\": {\"rel_type\": \"m.replace\", \"event_id\": \"$orig:example.org\"}}}"));
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.room.message\", \"event_id\": \"$reply:example.org\","
+                                           "\"sender\": \"@bob:example.org\", \"origin_server_ts\": 1650000006000,"
+                                           "\"content\": {\"msgtype\": \"m.text\", \"body\": \"hello\","
+                                           "\"m.relates_to\": {\"m.in_reply_to\": {\"event_id\": \"$orig:example.org\"}}}}"));
+
+  for (guint i = 0; i < events->len; i++)
+    {
+      changed = cm_room_relations_add_event (relations, events->pdata[i]);
+      g_assert_cmpstr (changed, ==, "$orig:example.org");
+      g_ref_string_release (changed);
+
+      /* Adding the same event again shouldn't change anything */
+      changed = cm_room_relations_add_event (relations, events->pdata[i]);
+      g_assert_null (changed);
+    }
+
+  g_assert_cmpstr (cm_room_get_edit_id (room, orig), ==, "$edit2:example.org");
+  g_assert_null (cm_room_get_edit_id (room, events->pdata[0]));
+  g_assert_cmpstr (cm_room_relations_get_edit_id (relations, "$orig:example.org", "@mallory:example.org"),
+                   ==, "$spoof:example.org");
+  g_assert_cmpint (cm_room_get_reaction_count (room, "$orig:example.org", "👍"), ==, 2);
+  g_assert_cmpint (cm_room_get_reaction_count (room, "$orig:example.org", "🎉"), ==, 1);
+  g_assert_cmpint (cm_room_get_reaction_count (room, "$orig:example.org", "🚀"), ==, 0);
+
+  keys = cm_room_get_reaction_keys (room, "$orig:example.org");
+  g_assert_nonnull (keys);
+  g_assert_cmpint (g_strv_length (keys), ==, 2);
+  g_assert_cmpstr (keys[0], <, keys[1]);
+
+  replies = cm_room_get_reply_ids (room, "$orig:example.org");
+  g_assert_nonnull (replies);
+  g_assert_cmpint (g_strv_length (replies), ==, 1);
+  g_assert_cmpstr (replies[0], ==, "$reply:example.org");
+  g_clear_pointer (&replies, g_strfreev);
+
+  /* Redacting a reaction and an edit */
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.room.redaction\", \"event_id\": \"$redact1:example.org\","
+                                           "\"sender\": \"@bob:example.org\", \"origin_server_ts\": 1650000007000,"
+                                           "\"redacts\": \"$react2:example.org\", \"content\": {}}"));
+  changed = cm_room_relations_add_event (relations, g_ptr_array_index (events, events->len - 1));
+  g_assert_cmpstr (changed, ==, "$orig:example.org");
+  g_ref_string_release (changed);
+  g_assert_cmpint (cm_room_get_reaction_count (room, "$orig:example.org", "👍"), ==, 1);
+
+  /* alice still has another 👍 reaction */
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.room.redaction\", \"event_id\": \"$redact3:example.org\","
+                                           "\"sender\": \"@alice:example.org\", \"origin_server_ts\": 1650000007500,"
+                                           "\"redacts\": \"$react1:example.org\", \"content\": {}}"));
+  changed = cm_room_relations_add_event (relations, g_ptr_array_index (events, events->len - 1));
+  g_ref_string_release (changed);
+  g_assert_cmpint (cm_room_get_reaction_count (room, "$orig:example.org", "👍"), ==, 1);
+
+  g_ptr_array_add (events, room_event_new (room, "{\"type\": \"m.room.redaction\", \"event_id\": \"$redact2:example.org\","
+                                           "\"sender\": \"@alice:example.org\", \"origin_server_ts\": 1650000008000,"
+                                           "\"redacts\": \"$edit2:example.org\", \"content\": {}}"));
+  changed = cm_room_relations_add_event (relations, g_ptr_array_index (events, events->len - 1));
+  g_ref_string_release (changed);
+  g_assert_cmpstr (cm_room_get_edit_id (room, orig), ==, "$edit1:example.org");
+
+  /* Relations loaded from db are merged, duplicates are ignored */
+  loaded = cm_room_relations_new ();
+  g_assert_true (cm_room_relations_add (loaded, "$react3:example.org", "$orig:example.org",
+                                        "@bob:example.org", CM_RELATION_ANNOTATION, "🎉", 1650000005000));
+  g_assert_true (cm_room_relations_add (loaded, "$react5:example.org", "$orig:example.org",
+                                        "@bob:example.org", CM_RELATION_ANNOTATION, "🎉", 1650000005500));
+  g_assert_true (cm_room_relations_add (loaded, "$old-reply:example.org", "$orig:example.org",
+                                        "@bob:example.org", CM_RELATION_REPLY, NULL, 1640000000000));
+  g_assert_false (cm_room_relations_add (loaded, "$thread:example.org", "$orig:example.org",
+                                         "@bob:example.org", CM_RELATION_THREAD, NULL, 1640000000000));
+  g_assert_false (cm_room_relations_add (loaded, "$no-sender:example.org", "$orig:example.org",
+                                         NULL, CM_RELATION_REPLY, NULL, 1640000000000));
+  cm_room_relations_merge (relations, loaded);
+
+  g_assert_cmpint (cm_room_get_reaction_count (room, "$orig:example.org", "🎉"), ==, 1);
+  replies = cm_room_get_reply_ids (room, "$orig:example.org");
+  g_assert_cmpint (g_strv_length (replies), ==, 2);
+}
+
+static void
+test_room_ephemeral (void)
+{
+  g_autoptr(JsonObject) object = NULL;
+  g_autoptr(CmRoom) room = NULL;
+  GPtrArray *typing;
+  gint64 time_stamp;
+
+  room = cm_room_new ("!some-room-id:example.org");
+  typing = cm_room_get_typing_user_ids (room);
+  g_assert_cmpint (typing->len, ==, 0);
+  g_assert_null (cm_room_get_read_receipt (room, "@alice:example.org", NULL));
+
+  object = cm_utils_string_to_json_object ("{\"events\": [{\"type\": \"m.typing\", \"content\": "
+                                           "{\"user_ids\": [\"@alice:example.org\", \"@bob:example.org\"]}},"
+                                           "{\"type\": \"m.receipt\", \"content\": {"
+                                           "\"$second:example.org\": {\"m.read\": {\"@alice:example.org\": {\"ts\": 1650000002000}}},"
+                                           "\"$first:example.org\": {\"m.read\": {\"@alice:example.org\": {\"ts\": 1650000001000},"
+                                           "\"@bob:example.org\": {\"ts\": 1650000001000}}}}}]}");
+  g_assert_true (room_parse_ephemeral (room, object));
+
+  typing = cm_room_get_typing_user_ids (room);
+  g_assert_cmpint (typing->len, ==, 2);
+  g_assert_cmpstr (typing->pdata[0], ==, "@alice:example.org");
+  g_assert_cmpstr (typing->pdata[1], ==, "@bob:example.org");
+
+  /* The older receipt shouldn't replace the newer one */
+  g_assert_cmpstr (cm_room_get_read_receipt (room, "@alice:example.org", &time_stamp), ==, "$second:example.org");
+  g_assert_cmpint (time_stamp, ==, 1650000002000);
+  g_assert_cmpstr (cm_room_get_read_receipt (room, "@bob:example.org", NULL), ==, "$first:example.org");
+
+  /* Nothing changed */
+  g_assert_false (room_parse_ephemeral (room, object));
+  g_clear_pointer (&object, json_object_unref);
+
+  object = cm_utils_string_to_json_object ("{\"events\": [{\"type\": \"m.typing\", \"content\": "
+                                           "{\"user_ids\": [\"@bob:example.org\"]}}]}");
+  g_assert_true (room_parse_ephemeral (room, object));
+  typing = cm_room_get_typing_user_ids (room);
+  g_assert_cmpint (typing->len, ==, 1);
+  g_assert_cmpstr (typing->pdata[0], ==, "@bob:example.org");
+}
+
+static JsonObject *
+wait_for_typing_notice (MockServer *server,
+                        guint       n_notices)
+{
+  GPtrArray *requests;
+
+  while (!(requests = mock_server_get_requests (server, TYPING_PATH)) ||
+         requests->len < n_notices)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (requests->len, ==, n_notices);
+
+  return cm_utils_string_to_json_object (requests->pdata[n_notices - 1]);
+}
+
+static void
+test_room_typing (void)
+{
+  g_autoptr(MockServer) server = NULL;
+  g_autoptr(JsonObject) object = NULL;
+  g_autoptr(CmClient) client = NULL;
+  g_autoptr(CmRoom) room = NULL;
+  GPtrArray *requests;
+  gint64 sent_time;
+
+  server = mock_server_new (NULL);
+  client = cm_client_new ();
+  /* Mark client to not save changes to db */
+  g_object_set_data (G_OBJECT (client), "no-save", GINT_TO_POINTER (TRUE));
+  cm_client_set_user_id (client, "@alice:example.org");
+  cm_client_set_homeserver (client, mock_server_get_uri (server));
+
+  room = cm_room_new ("!some-room-id:example.org");
+  cm_room_set_client (room, client);
+
+  /* The first notice is sent right away */
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  object = wait_for_typing_notice (server, 1);
+  sent_time = g_get_monotonic_time ();
+  g_assert_true (cm_utils_json_object_get_bool (object, "typing"));
+  g_assert_cmpint (cm_utils_json_object_get_int (object, "timeout"), ==, TYPING_TIMEOUT);
+  g_assert_cmpint (TYPING_TIMEOUT, ==, 30000);
+  g_clear_pointer (&object, json_object_unref);
+
+  /* Changes within a second are coalesced into the latest one */
+  cm_room_set_typing_notice_async (room, FALSE, NULL, NULL, NULL);
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  cm_room_set_typing_notice_async (room, FALSE, NULL, NULL, NULL);
+  object = wait_for_typing_notice (server, 2);
+  g_assert_cmpint (g_get_monotonic_time () - sent_time, >=, (TYPING_DEBOUNCE - 100) * 1000);
+  g_assert_false (cm_utils_json_object_get_bool (object, "typing"));
+  g_assert_false (json_object_has_member (object, "timeout"));
+  g_clear_pointer (&object, json_object_unref);
+
+  /* Nothing to send if the state is the same in the end */
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  cm_room_set_typing_notice_async (room, FALSE, NULL, NULL, NULL);
+  while (room->typing_sending || room->typing_timeout_id)
+    g_main_context_iteration (NULL, TRUE);
+  requests = mock_server_get_requests (server, TYPING_PATH);
+  g_assert_cmpuint (requests->len, ==, 2);
+
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  object = wait_for_typing_notice (server, 3);
+  g_assert_true (cm_utils_json_object_get_bool (object, "typing"));
+  g_clear_pointer (&object, json_object_unref);
+
+  /* Not refreshed unless typing is set again */
+  while (room->typing_sending)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (room->typing_timeout_id, ==, 0);
+
+  /* Still typing, refreshed before the server times it out */
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  g_assert_cmpuint (room->typing_timeout_id, !=, 0);
+
+  /* Fast forward to the refresh */
+  room->typing_set_time -= TYPING_REFRESH * 1000;
+  g_source_remove (room->typing_timeout_id);
+  room_typing_timeout_cb (room);
+  object = wait_for_typing_notice (server, 4);
+  g_assert_true (cm_utils_json_object_get_bool (object, "typing"));
+  g_assert_cmpint (cm_utils_json_object_get_int (object, "timeout"), ==, TYPING_TIMEOUT);
+  g_clear_pointer (&object, json_object_unref);
+
+  while (room->typing_sending)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (room->typing_timeout_id, ==, 0);
+
+  /* The refresh doesn't hold back unsetting it */
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  g_assert_cmpuint (room->typing_timeout_id, !=, 0);
+  cm_room_set_typing_notice_async (room, FALSE, NULL, NULL, NULL);
+  object = wait_for_typing_notice (server, 5);
+  g_assert_false (cm_utils_json_object_get_bool (object, "typing"));
+  g_clear_pointer (&object, json_object_unref);
+
+  while (room->typing_sending)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (room->typing_timeout_id, ==, 0);
+
+  /* Once the server times it out, unsetting it needs no notice */
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  object = wait_for_typing_notice (server, 6);
+  g_clear_pointer (&object, json_object_unref);
+  while (room->typing_sending)
+    g_main_context_iteration (NULL, TRUE);
+  room->typing_set_time -= TYPING_TIMEOUT * 1000;
+  cm_room_set_typing_notice_async (room, FALSE, NULL, NULL, NULL);
+  g_assert_false (room->typing);
+  g_assert_cmpuint (room->typing_timeout_id, ==, 0);
+  requests = mock_server_get_requests (server, TYPING_PATH);
+  g_assert_cmpuint (requests->len, ==, 6);
+
+  /* A failed notice is resent later */
+  mock_server_set_rate_limited (server, TYPING_PATH, NET_MAX_REQUEUES + 1, 20, FALSE);
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  object = wait_for_typing_notice (server, 6 + NET_MAX_REQUEUES + 1);
+  g_clear_pointer (&object, json_object_unref);
+  while (room->typing_sending)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_true (room->typing_unknown);
+  g_assert_cmpuint (room->typing_timeout_id, !=, 0);
+
+  room->typing_set_time -= TYPING_RETRY * 1000;
+  g_source_remove (room->typing_timeout_id);
+  room_typing_timeout_cb (room);
+  object = wait_for_typing_notice (server, 6 + NET_MAX_REQUEUES + 2);
+  g_assert_true (cm_utils_json_object_get_bool (object, "typing"));
+  g_clear_pointer (&object, json_object_unref);
+  while (room->typing_sending)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_false (room->typing_unknown);
+  g_assert_cmpuint (room->typing_timeout_id, ==, 0);
+
+  /* But not if typing hasn't been set for as long as the server keeps it */
+  mock_server_set_rate_limited (server, TYPING_PATH, NET_MAX_REQUEUES + 1, 20, FALSE);
+  cm_room_set_typing_notice_async (room, TRUE, NULL, NULL, NULL);
+  room->typing_set_time -= TYPING_REFRESH * 1000;
+  g_source_remove (room->typing_timeout_id);
+  room_typing_timeout_cb (room);
+  object = wait_for_typing_notice (server, 6 + 2 * NET_MAX_REQUEUES + 3);
+  g_clear_pointer (&object, json_object_unref);
+  while (room->typing_sending)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_true (room->typing_unknown);
+  g_assert_cmpuint (room->typing_timeout_id, !=, 0);
+
+  room->typing_set_time -= TYPING_RETRY * 1000;
+  room->typing_wanted_time -= TYPING_TIMEOUT * 1000;
+  g_source_remove (room->typing_timeout_id);
+  room_typing_timeout_cb (room);
+  g_assert_false (room->typing_sending);
+  g_assert_cmpuint (room->typing_timeout_id, ==, 0);
+  requests = mock_server_get_requests (server, TYPING_PATH);
+  g_assert_cmpuint (requests->len, ==, 6 + 2 * NET_MAX_REQUEUES + 3);
+}
+
 int
 main (int   argc,
       char *argv[])
 {
   g_test_init (&argc, &argv, NULL);
 
+  cm_init (TRUE);
+
   g_test_add_func ("/room/new", test_room_new);
+  g_test_add_func ("/room/event-json", test_room_event_json);
+  g_test_add_func ("/room/relations", test_room_relations);
+  g_test_add_func ("/room/ephemeral", test_room_ephemeral);
+  g_test_add_func ("/room/typing", test_room_typing);
 
   return g_test_run ();
 }
@@ -0,0 +1,205 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* stats.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include "cm-matrix.h"
+#include "cm-stats-private.h"
+#include "events/cm-event-private.h"
+
+static gint64
+snapshot_get_gauge (GVariant   *snapshot,
+                    const char *name)
+{
+  g_autoptr(GVariant) gauges = NULL;
+  gint64 value = -1;
+
+  gauges = g_variant_lookup_value (snapshot, "gauges", G_VARIANT_TYPE ("a{sx}"));
+  g_assert_nonnull (gauges);
+  g_variant_lookup (gauges, name, "x", &value);
+
+  return value;
+}
+
+static guint64
+snapshot_get_counter (GVariant   *snapshot,
+                      const char *name)
+{
+  g_autoptr(GVariant) counters = NULL;
+  guint64 value = 0;
+
+  counters = g_variant_lookup_value (snapshot, "counters", G_VARIANT_TYPE ("a{st}"));
+  g_assert_nonnull (counters);
+  g_variant_lookup (counters, name, "t", &value);
+
+  return value;
+}
+
+static void
+test_stats_endpoint (void)
+{
+  struct {
+    const char *method;
+    const char *uri_path;
+    const char *endpoint;
+  } endpoints[] = {
+    { "GET", "/_matrix/client/r0/sync", "GET client/sync" },
+    { "GET", "/_matrix/client/versions", "GET client/versions" },
+    { "POST", "/_matrix/client/v3/keys/upload", "POST client/keys/upload" },
+    { "GET", "/_matrix/client/r0/rooms/!cURbafjkfsMDVwdRDQ:matrix.org/messages",
+      "GET client/rooms/{id}/messages" },
+    { "GET", "/_matrix/client/r0/rooms/%21cURbafjkfsMDVwdRDQ%3Amatrix.org/event/$1435:example.org",
+      "GET client/rooms/{id}/event/{id}" },
+    { "PUT", "/_matrix/client/r0/rooms/!abc:example.org/send/m.room.message/m1650000000.1",
+      "PUT client/rooms/{id}/send/m.room.message/{id}" },
+    { "PUT", "/_matrix/client/r0/sendToDevice/m.room.encrypted/abcdef",
+      "PUT client/sendToDevice/m.room.encrypted/{id}" },
+    { "PUT", "/_matrix/client/r0/rooms/!abc:example.org/state/m.room.encryption",
+      "PUT client/rooms/{id}/state/m.room.encryption" },
+    { "GET", "/_matrix/client/r0/user/@alice:example.org/filter/42",
+      "GET client/user/{id}/filter/{id}" },
+    { "GET", "/_matrix/media/r0/download/example.org/SEsfnsuifSDFSSEF",
+      "GET media/download/{id}/{id}" },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (endpoints); i++)
+    {
+      g_autofree char *endpoint = NULL;
+
+      endpoint = cm_stats_get_endpoint (endpoints[i].method, endpoints[i].uri_path);
+      g_assert_cmpstr (endpoint, ==, endpoints[i].endpoint);
+    }
+}
+
+static void
+test_stats_snapshot (void)
+{
+  g_autoptr(GVariant) snapshot = NULL;
+  g_autoptr(GVariant) histograms = NULL;
+  g_autoptr(GVariant) histogram = NULL;
+  g_autoptr(GVariant) buckets = NULL;
+  g_autoptr(GVariant) bounds = NULL;
+  const guint64 *values, *bucket_bounds;
+  CmStats *stats;
+  guint64 value, count = 0;
+  gsize n_buckets, n_bounds;
+
+  stats = cm_stats_get_default ();
+  g_assert_true (CM_IS_STATS (stats));
+  g_assert_true (stats == cm_stats_get_default ());
+  cm_stats_reset (stats);
+
+  cm_stats_add_count (stats, "test/count", 2);
+  cm_stats_add_count (stats, "test/count", 3);
+  cm_stats_set_gauge (stats, "test/gauge", 7);
+  cm_stats_set_gauge (stats, "test/gauge", -4);
+  cm_stats_add_time (stats, "test/time", 50);
+  cm_stats_add_time (stats, "test/time", 2000);
+  cm_stats_add_time (stats, "test/time", 60 * G_USEC_PER_SEC);
+  cm_stats_add_request (stats, "GET", "/_matrix/client/r0/rooms/!a:example.org/messages",
+                        0, 1024, 30000, FALSE);
+  cm_stats_add_request (stats, "GET", "/_matrix/client/r0/rooms/!b:example.org/messages",
+                        0, 512, 40000, TRUE);
+
+  snapshot = g_variant_ref_sink (cm_stats_get_snapshot (stats));
+  g_assert_true (g_variant_is_of_type (snapshot, G_VARIANT_TYPE_VARDICT));
+
+  g_assert_cmpuint (snapshot_get_counter (snapshot, "test/count"), ==, 5);
+  g_assert_cmpint (snapshot_get_gauge (snapshot, "test/gauge"), ==, -4);
+  g_assert_cmpuint (snapshot_get_counter (snapshot, "http/GET client/rooms/{id}/messages/bytes-received"), ==, 1536);
+  g_assert_cmpuint (snapshot_get_counter (snapshot, "http/GET client/rooms/{id}/messages/errors"), ==, 1);
+
+  histograms = g_variant_lookup_value (snapshot, "histograms", G_VARIANT_TYPE ("a{sa{sv}}"));
+  g_assert_nonnull (histograms);
+  histogram = g_variant_lookup_value (histograms, "test/time", G_VARIANT_TYPE_VARDICT);
+  g_assert_nonnull (histogram);
+
+  g_assert_true (g_variant_lookup (histogram, "count", "t", &value));
+  g_assert_cmpuint (value, ==, 3);
+  g_assert_true (g_variant_lookup (histogram, "min", "t", &value));
+  g_assert_cmpuint (value, ==, 50);
+  g_assert_true (g_variant_lookup (histogram, "max", "t", &value));
+  g_assert_cmpuint (value, ==, 60 * G_USEC_PER_SEC);
+  g_assert_true (g_variant_lookup (histogram, "sum", "t", &value));
+  g_assert_cmpuint (value, ==, 60 * G_USEC_PER_SEC + 2050);
+
+  bounds = g_variant_lookup_value (snapshot, "bucket-bounds", G_VARIANT_TYPE ("at"));
+  buckets = g_variant_lookup_value (histogram, "buckets", G_VARIANT_TYPE ("at"));
+  g_assert_nonnull (bounds);
+  g_assert_nonnull (buckets);
+  bucket_bounds = g_variant_get_fixed_array (bounds, &n_bounds, sizeof (guint64));
+  values = g_variant_get_fixed_array (buckets, &n_buckets, sizeof (guint64));
+  g_assert_cmpuint (n_buckets, ==, n_bounds + 1);
+
+  /* The smallest in the first bucket, the largest in the unbounded one */
+  g_assert_cmpuint (values[0], ==, 1);
+  g_assert_cmpuint (values[n_buckets - 1], ==, 1);
+  g_assert_cmpuint (bucket_bounds[0], >=, 50);
+
+  for (guint i = 0; i < n_buckets; i++)
+    count += values[i];
+  g_assert_cmpuint (count, ==, 3);
+
+  g_clear_pointer (&histogram, g_variant_unref);
+  histogram = g_variant_lookup_value (histograms, "http/GET client/rooms/{id}/messages",
+                                      G_VARIANT_TYPE_VARDICT);
+  g_assert_nonnull (histogram);
+  g_assert_true (g_variant_lookup (histogram, "count", "t", &value));
+  g_assert_cmpuint (value, ==, 2);
+
+  /* Gauges are kept on reset */
+  cm_stats_reset (stats);
+  g_clear_pointer (&snapshot, g_variant_unref);
+  snapshot = g_variant_ref_sink (cm_stats_get_snapshot (stats));
+  g_assert_cmpuint (snapshot_get_counter (snapshot, "test/count"), ==, 0);
+  g_assert_cmpint (snapshot_get_gauge (snapshot, "test/gauge"), ==, -4);
+}
+
+static void
+test_stats_objects (void)
+{
+  g_autoptr(GVariant) snapshot = NULL;
+  CmStats *stats;
+  CmEvent *event;
+  gint64 n_events;
+
+  stats = cm_stats_get_default ();
+
+  snapshot = g_variant_ref_sink (cm_stats_get_snapshot (stats));
+  n_events = snapshot_get_gauge (snapshot, "objects/event");
+  g_assert_cmpint (n_events, >=, 0);
+  g_clear_pointer (&snapshot, g_variant_unref);
+
+  event = cm_event_new (CM_M_UNKNOWN);
+  snapshot = g_variant_ref_sink (cm_stats_get_snapshot (stats));
+  g_assert_cmpint (snapshot_get_gauge (snapshot, "objects/event"), ==, n_events + 1);
+  g_clear_pointer (&snapshot, g_variant_unref);
+
+  g_assert_finalize_object (event);
+  snapshot = g_variant_ref_sink (cm_stats_get_snapshot (stats));
+  g_assert_cmpint (snapshot_get_gauge (snapshot, "objects/event"), ==, n_events);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  cm_init (TRUE);
+
+  g_test_add_func ("/stats/endpoint", test_stats_endpoint);
+  g_test_add_func ("/stats/snapshot", test_stats_snapshot);
+  g_test_add_func ("/stats/objects", test_stats_objects);
+
+  return g_test_run ();
+}
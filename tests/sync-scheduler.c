@@ -0,0 +1,138 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* sync-scheduler.c
+ *
+ * Copyright 2022 Purism SPC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include "cm-matrix.h"
+#include "cm-sync-scheduler-private.h"
+
+/* The objects scheduled are counters of the times run */
+static void
+scheduled_cb (gpointer object)
+{
+  guint *count = object;
+
+  (*count)++;
+}
+
+static void
+test_sync_scheduler_retry (void)
+{
+  g_autoptr(CmSyncScheduler) scheduler = NULL;
+  guint count = 0, delay, last_delay = 0;
+
+  scheduler = cm_sync_scheduler_new ();
+  g_assert_false (cm_sync_scheduler_is_pending (scheduler, &count));
+
+  /* Grows, but not forever */
+  for (guint i = 0; i < 20; i++)
+    {
+      delay = cm_sync_scheduler_retry (scheduler, &count, scheduled_cb, 0);
+      g_assert_cmpuint (delay, >, 0);
+      g_assert_cmpuint (delay, <=, 120 * 1000);
+
+      if (i < 4)
+        g_assert_cmpuint (delay, >=, last_delay);
+
+      last_delay = delay;
+    }
+  g_assert_cmpuint (last_delay, >=, 60 * 1000);
+  g_assert_true (cm_sync_scheduler_is_pending (scheduler, &count));
+
+  cm_sync_scheduler_reset (scheduler, &count);
+  delay = cm_sync_scheduler_retry (scheduler, &count, scheduled_cb, 0);
+  g_assert_cmpuint (delay, <=, 2000);
+
+  /* The server knows better */
+  delay = cm_sync_scheduler_retry (scheduler, &count, scheduled_cb, 30 * 1000);
+  g_assert_cmpuint (delay, >=, 30 * 1000);
+
+  /* Even when reconnecting */
+  delay = cm_sync_scheduler_reconnect (scheduler, &count, scheduled_cb);
+  g_assert_cmpuint (delay, >=, 29 * 1000);
+
+  cm_sync_scheduler_reset (scheduler, &count);
+  delay = cm_sync_scheduler_reconnect (scheduler, &count, scheduled_cb);
+  g_assert_cmpuint (delay, <, 3000);
+
+  cm_sync_scheduler_cancel (scheduler, &count);
+  g_assert_false (cm_sync_scheduler_is_pending (scheduler, &count));
+
+  /* Run when due */
+  cm_sync_scheduler_reconnect (scheduler, &count, scheduled_cb);
+  while (cm_sync_scheduler_is_pending (scheduler, &count))
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (count, ==, 1);
+
+  cm_sync_scheduler_remove (scheduler, &count);
+}
+
+static void
+test_sync_scheduler_slot (void)
+{
+  g_autoptr(CmSyncScheduler) scheduler = NULL;
+  guint a = 0, b = 0, c = 0, d = 0;
+
+  scheduler = cm_sync_scheduler_new ();
+
+  g_assert_true (cm_sync_scheduler_acquire_slot (scheduler, &a, scheduled_cb));
+  g_assert_true (cm_sync_scheduler_acquire_slot (scheduler, &a, scheduled_cb));
+  g_assert_true (cm_sync_scheduler_acquire_slot (scheduler, &b, scheduled_cb));
+
+  /* No more slots, wait in order */
+  g_assert_false (cm_sync_scheduler_acquire_slot (scheduler, &c, scheduled_cb));
+  g_assert_false (cm_sync_scheduler_acquire_slot (scheduler, &d, scheduled_cb));
+  g_assert_false (cm_sync_scheduler_acquire_slot (scheduler, &c, scheduled_cb));
+  g_assert_true (cm_sync_scheduler_is_pending (scheduler, &c));
+  g_assert_true (cm_sync_scheduler_is_pending (scheduler, &d));
+
+  /* Releasing twice doesn't free more slots */
+  cm_sync_scheduler_release_slot (scheduler, &a);
+  cm_sync_scheduler_release_slot (scheduler, &a);
+  while (cm_sync_scheduler_is_pending (scheduler, &c))
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (c, ==, 1);
+  g_assert_cmpuint (d, ==, 0);
+  g_assert_true (cm_sync_scheduler_is_pending (scheduler, &d));
+
+  g_assert_true (cm_sync_scheduler_acquire_slot (scheduler, &c, scheduled_cb));
+  g_assert_false (cm_sync_scheduler_acquire_slot (scheduler, &a, scheduled_cb));
+
+  /* A cancelled one gives its slot back, and doesn't wait anymore */
+  cm_sync_scheduler_cancel (scheduler, &d);
+  g_assert_false (cm_sync_scheduler_is_pending (scheduler, &d));
+  cm_sync_scheduler_cancel (scheduler, &b);
+  while (cm_sync_scheduler_is_pending (scheduler, &a))
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (a, ==, 1);
+  g_assert_cmpuint (d, ==, 0);
+  g_assert_true (cm_sync_scheduler_acquire_slot (scheduler, &a, scheduled_cb));
+
+  cm_sync_scheduler_remove (scheduler, &a);
+  cm_sync_scheduler_remove (scheduler, &b);
+  cm_sync_scheduler_remove (scheduler, &c);
+  cm_sync_scheduler_remove (scheduler, &d);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  cm_init (TRUE);
+
+  g_test_add_func ("/sync-scheduler/retry", test_sync_scheduler_retry);
+  g_test_add_func ("/sync-scheduler/slot", test_sync_scheduler_slot);
+
+  return g_test_run ();
+}